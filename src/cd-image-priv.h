@@ -0,0 +1,92 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   CD device emulation - image formats
+
+   Copyright (C) 2019 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <string.h>
+
+#include "cd-image.h"
+
+G_BEGIN_DECLS
+
+/* An image format maps the data of the image (what the guest sees)
+ * to the content of the file. Raw images need no format. */
+typedef struct CdImageFormat {
+    const char *name;
+
+    /* returns TRUE if the first bytes of the file belong to the format */
+    gboolean (*probe)(const uint8_t *header, uint32_t header_len);
+
+    /* parse the metadata, returns the private data of the format
+     * and the size of the image data in size */
+    gpointer (*open)(CdImage *image, uint64_t *size, GError **error);
+
+    /* read image data, called from worker threads */
+    gboolean (*read)(CdImage *image, gpointer data,
+                     uint8_t *buf, uint64_t offset, uint32_t len,
+                     GError **error);
+
+    void (*close)(gpointer data);
+} CdImageFormat;
+
+extern const CdImageFormat cd_image_format_qcow2;
+#ifdef USE_ZSTD
+extern const CdImageFormat cd_image_format_zstd;
+#endif
+
+/* positional read of the file, thread safe */
+gboolean cd_image_pread(CdImage *image, uint8_t *buf,
+                        uint64_t offset, uint32_t len,
+                        GError **error);
+uint64_t cd_image_get_file_size(CdImage *image);
+const char *cd_image_get_filename(CdImage *image);
+
+/* A small thread safe LRU of decompressed blocks, so that chunks
+ * sharing a compressed block do not decompress it again */
+typedef struct CdImageBlockCache CdImageBlockCache;
+
+CdImageBlockCache *cd_image_block_cache_new(guint max_blocks);
+void cd_image_block_cache_free(CdImageBlockCache *cache);
+/* returns: a reference to the block, or NULL */
+GBytes *cd_image_block_cache_lookup(CdImageBlockCache *cache, uint64_t key);
+void cd_image_block_cache_insert(CdImageBlockCache *cache, uint64_t key, GBytes *block);
+
+static inline uint32_t cd_image_ld_le32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return GUINT32_FROM_LE(v);
+}
+
+static inline uint32_t cd_image_ld_be32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return GUINT32_FROM_BE(v);
+}
+
+static inline uint64_t cd_image_ld_be64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return GUINT64_FROM_BE(v);
+}
+
+G_END_DECLS
@@ -0,0 +1,380 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   CD device emulation - qcow2 images
+
+   Copyright (C) 2019 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#ifdef USE_USBREDIR
+
+#include <zlib.h>
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+#include <glib/gi18n-lib.h>
+
+#include "spice-common.h"
+#include "cd-image-priv.h"
+
+/*
+ * Read-only access to qcow2 (version 2 and 3) images, as written by
+ * "qemu-img convert -c". Images with a backing file, encryption or
+ * external data files are not supported. Unallocated clusters read
+ * as zeros.
+ */
+
+#define QCOW2_MAGIC                     0x514649fb /* 'Q', 'F', 'I', 0xfb */
+#define QCOW2_HEADER_V2_SIZE            72
+#define QCOW2_HEADER_V3_SIZE            104
+#define QCOW2_MIN_CLUSTER_BITS          9
+#define QCOW2_MAX_CLUSTER_BITS          21
+#define QCOW2_MAX_L1_SIZE               (32 * 1024 * 1024 / sizeof(uint64_t))
+
+#define QCOW2_INCOMPAT_DIRTY            (1 << 0)
+#define QCOW2_INCOMPAT_CORRUPT          (1 << 1)
+#define QCOW2_INCOMPAT_COMPRESSION      (1 << 3)
+
+#define QCOW2_COMPRESSION_ZLIB          0
+#define QCOW2_COMPRESSION_ZSTD          1
+
+#define QCOW2_OFLAG_COMPRESSED          (1ULL << 62)
+#define QCOW2_OFLAG_ZERO                (1ULL << 0)
+#define QCOW2_OFFSET_MASK               0x00fffffffffffe00ULL
+
+/* cached L2 tables and decompressed clusters */
+#define QCOW2_L2_CACHE_SIZE             16
+#define QCOW2_CLUSTER_CACHE_SIZE        16
+
+typedef struct CdImageQcow2 {
+    uint32_t version;
+    uint32_t cluster_bits;
+    uint32_t cluster_size;
+    uint32_t l2_bits;
+    uint32_t compression;
+
+    /* compressed cluster descriptor */
+    uint32_t csize_shift;
+    uint64_t csize_mask;
+    uint64_t coffset_mask;
+
+    uint32_t l1_size;
+    uint64_t *l1_table;
+
+    CdImageBlockCache *l2_cache; /* L2 offset -> table */
+    CdImageBlockCache *cluster_cache; /* compressed offset -> data */
+} CdImageQcow2;
+
+static gboolean qcow2_probe(const uint8_t *header, uint32_t header_len)
+{
+    return header_len >= 4 && cd_image_ld_be32(header) == QCOW2_MAGIC;
+}
+
+static void qcow2_close(gpointer data)
+{
+    CdImageQcow2 *q = data;
+
+    g_clear_pointer(&q->l2_cache, cd_image_block_cache_free);
+    g_clear_pointer(&q->cluster_cache, cd_image_block_cache_free);
+    g_free(q->l1_table);
+    g_free(q);
+}
+
+static gpointer qcow2_open(CdImage *image, uint64_t *size, GError **error)
+{
+    const char *filename = cd_image_get_filename(image);
+    uint64_t file_size = cd_image_get_file_size(image);
+    uint8_t header[QCOW2_HEADER_V3_SIZE + 1];
+    uint64_t incompat = 0, l1_offset, l1_needed;
+    uint32_t header_len, i;
+    CdImageQcow2 *q;
+
+    header_len = MIN(sizeof(header), file_size);
+    if (header_len < QCOW2_HEADER_V2_SIZE ||
+        !cd_image_pread(image, header, 0, header_len, NULL)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    _("truncated qcow2 header in %s"), filename);
+        return NULL;
+    }
+
+    q = g_new0(CdImageQcow2, 1);
+    q->version = cd_image_ld_be32(header + 4);
+    q->cluster_bits = cd_image_ld_be32(header + 20);
+    *size = cd_image_ld_be64(header + 24);
+    q->l1_size = cd_image_ld_be32(header + 36);
+    l1_offset = cd_image_ld_be64(header + 40);
+
+    if (q->version != 2 && q->version != 3) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                    _("unsupported qcow2 version %u in %s"), q->version, filename);
+        goto fail;
+    }
+    if (cd_image_ld_be64(header + 8) != 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                    _("qcow2 images with a backing file are not supported (%s)"),
+                    filename);
+        goto fail;
+    }
+    if (cd_image_ld_be32(header + 32) != 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                    _("encrypted qcow2 images are not supported (%s)"), filename);
+        goto fail;
+    }
+    if (q->cluster_bits < QCOW2_MIN_CLUSTER_BITS ||
+        q->cluster_bits > QCOW2_MAX_CLUSTER_BITS) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    _("invalid qcow2 cluster size in %s"), filename);
+        goto fail;
+    }
+
+    if (q->version == 3) {
+        uint32_t v3_header_len;
+
+        if (header_len < QCOW2_HEADER_V3_SIZE) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                        _("truncated qcow2 header in %s"), filename);
+            goto fail;
+        }
+        incompat = cd_image_ld_be64(header + 72);
+        v3_header_len = cd_image_ld_be32(header + 100);
+        if ((incompat & QCOW2_INCOMPAT_COMPRESSION) &&
+            v3_header_len > QCOW2_HEADER_V3_SIZE && header_len > QCOW2_HEADER_V3_SIZE) {
+            q->compression = header[QCOW2_HEADER_V3_SIZE];
+        }
+    }
+    /* a dirty image only has stale refcounts, the data is fine */
+    if (incompat & ~(uint64_t)(QCOW2_INCOMPAT_DIRTY | QCOW2_INCOMPAT_COMPRESSION)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                    _("unsupported qcow2 features %#" G_GINT64_MODIFIER "x in %s"),
+                    incompat, filename);
+        goto fail;
+    }
+    if (q->compression != QCOW2_COMPRESSION_ZLIB
+#ifdef USE_ZSTD
+        && q->compression != QCOW2_COMPRESSION_ZSTD
+#endif
+        ) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                    _("unsupported qcow2 compression type %u in %s"),
+                    q->compression, filename);
+        goto fail;
+    }
+
+    q->cluster_size = 1 << q->cluster_bits;
+    q->l2_bits = q->cluster_bits - 3;
+    q->csize_shift = 62 - (q->cluster_bits - 8);
+    q->csize_mask = (1ULL << (q->cluster_bits - 8)) - 1;
+    q->coffset_mask = (1ULL << q->csize_shift) - 1;
+
+    l1_needed = (*size + ((uint64_t)q->cluster_size << q->l2_bits) - 1) >>
+                (q->cluster_bits + q->l2_bits);
+    if (q->l1_size < l1_needed || q->l1_size > QCOW2_MAX_L1_SIZE ||
+        l1_offset > file_size || file_size - l1_offset < q->l1_size * sizeof(uint64_t)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    _("invalid qcow2 L1 table in %s"), filename);
+        goto fail;
+    }
+
+    q->l1_table = g_new(uint64_t, q->l1_size);
+    if (!cd_image_pread(image, (uint8_t *)q->l1_table, l1_offset,
+                        q->l1_size * sizeof(uint64_t), error)) {
+        goto fail;
+    }
+    for (i = 0; i < q->l1_size; i++) {
+        q->l1_table[i] = GUINT64_FROM_BE(q->l1_table[i]);
+    }
+
+    q->l2_cache = cd_image_block_cache_new(QCOW2_L2_CACHE_SIZE);
+    q->cluster_cache = cd_image_block_cache_new(QCOW2_CLUSTER_CACHE_SIZE);
+
+    SPICE_DEBUG("%s: %s, version %u cluster size %u, compression %u", __FUNCTION__,
+                filename, q->version, q->cluster_size, q->compression);
+    return q;
+
+fail:
+    qcow2_close(q);
+    return NULL;
+}
+
+static gboolean qcow2_get_l2_entry(CdImage *image, CdImageQcow2 *q,
+                                   uint64_t cluster, uint64_t *entry,
+                                   GError **error)
+{
+    uint64_t l1_index = cluster >> q->l2_bits;
+    uint64_t l2_offset;
+    GBytes *l2;
+
+    *entry = 0;
+    if (l1_index >= q->l1_size) {
+        return TRUE;
+    }
+    l2_offset = q->l1_table[l1_index] & QCOW2_OFFSET_MASK;
+    if (l2_offset == 0) {
+        return TRUE;
+    }
+
+    l2 = cd_image_block_cache_lookup(q->l2_cache, l2_offset);
+    if (l2 == NULL) {
+        uint8_t *table = g_malloc(q->cluster_size);
+
+        if (!cd_image_pread(image, table, l2_offset, q->cluster_size, error)) {
+            g_free(table);
+            return FALSE;
+        }
+        l2 = g_bytes_new_take(table, q->cluster_size);
+        cd_image_block_cache_insert(q->l2_cache, l2_offset, l2);
+    }
+
+    *entry = cd_image_ld_be64((const uint8_t *)g_bytes_get_data(l2, NULL) +
+                              (cluster & ((1 << q->l2_bits) - 1)) * sizeof(uint64_t));
+    g_bytes_unref(l2);
+    return TRUE;
+}
+
+static gboolean qcow2_inflate(CdImageQcow2 *q, uint8_t *out,
+                              const uint8_t *in, uint32_t in_len)
+{
+    gboolean ok = FALSE;
+
+#ifdef USE_ZSTD
+    if (q->compression == QCOW2_COMPRESSION_ZSTD) {
+        ZSTD_DCtx *dctx = ZSTD_createDCtx();
+        ZSTD_inBuffer input = { in, in_len, 0 };
+        ZSTD_outBuffer output = { out, q->cluster_size, 0 };
+        size_t ret;
+
+        /* the compressed data may be followed by garbage up to
+         * the sector boundary */
+        do {
+            ret = ZSTD_decompressStream(dctx, &output, &input);
+        } while (!ZSTD_isError(ret) && ret != 0 &&
+                 output.pos < output.size && input.pos < input.size);
+        ok = !ZSTD_isError(ret) && output.pos == output.size;
+        ZSTD_freeDCtx(dctx);
+        return ok;
+    }
+#endif
+
+    z_stream strm = { 0 };
+    int ret;
+
+    /* raw deflate, no zlib header */
+    if (inflateInit2(&strm, -12) != Z_OK) {
+        return FALSE;
+    }
+    strm.next_in = (Bytef *)in;
+    strm.avail_in = in_len;
+    strm.next_out = out;
+    strm.avail_out = q->cluster_size;
+    ret = inflate(&strm, Z_FINISH);
+    ok = ret == Z_STREAM_END || (ret == Z_BUF_ERROR && strm.avail_out == 0);
+    inflateEnd(&strm);
+    return ok;
+}
+
+static GBytes *qcow2_get_compressed(CdImage *image, CdImageQcow2 *q,
+                                    uint64_t entry, GError **error)
+{
+    uint64_t file_size = cd_image_get_file_size(image);
+    uint64_t coffset = entry & q->coffset_mask;
+    uint64_t nb_sectors = ((entry >> q->csize_shift) & q->csize_mask) + 1;
+    uint32_t csize = nb_sectors * 512 - (coffset & 511);
+    uint8_t *cdata, *data;
+    GBytes *cluster;
+
+    cluster = cd_image_block_cache_lookup(q->cluster_cache, coffset);
+    if (cluster != NULL) {
+        return cluster;
+    }
+
+    if (coffset >= file_size) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "compressed cluster of %s beyond the end of file",
+                    cd_image_get_filename(image));
+        return NULL;
+    }
+    /* the last cluster may end before the sector boundary */
+    csize = MIN(csize, file_size - coffset);
+
+    cdata = g_malloc(csize);
+    if (!cd_image_pread(image, cdata, coffset, csize, error)) {
+        g_free(cdata);
+        return NULL;
+    }
+    data = g_malloc(q->cluster_size);
+    if (!qcow2_inflate(q, data, cdata, csize)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "corrupted compressed cluster at %" G_GUINT64_FORMAT " in %s",
+                    coffset, cd_image_get_filename(image));
+        g_free(cdata);
+        g_free(data);
+        return NULL;
+    }
+    g_free(cdata);
+
+    cluster = g_bytes_new_take(data, q->cluster_size);
+    cd_image_block_cache_insert(q->cluster_cache, coffset, cluster);
+    return cluster;
+}
+
+static gboolean qcow2_read(CdImage *image, gpointer data,
+                           uint8_t *buf, uint64_t offset, uint32_t len,
+                           GError **error)
+{
+    CdImageQcow2 *q = data;
+
+    while (len > 0) {
+        uint32_t start = offset & (q->cluster_size - 1);
+        uint32_t n = MIN(len, q->cluster_size - start);
+        uint64_t entry, host_offset;
+
+        if (!qcow2_get_l2_entry(image, q, offset >> q->cluster_bits, &entry, error)) {
+            return FALSE;
+        }
+
+        if (entry & QCOW2_OFLAG_COMPRESSED) {
+            GBytes *cluster = qcow2_get_compressed(image, q, entry, error);
+
+            if (cluster == NULL) {
+                return FALSE;
+            }
+            memcpy(buf, (const uint8_t *)g_bytes_get_data(cluster, NULL) + start, n);
+            g_bytes_unref(cluster);
+        } else {
+            host_offset = entry & QCOW2_OFFSET_MASK;
+            if (host_offset == 0 || (q->version >= 3 && (entry & QCOW2_OFLAG_ZERO))) {
+                memset(buf, 0, n);
+            } else if (!cd_image_pread(image, buf, host_offset + start, n, error)) {
+                return FALSE;
+            }
+        }
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+    return TRUE;
+}
+
+const CdImageFormat cd_image_format_qcow2 = {
+    .name = "qcow2",
+    .probe = qcow2_probe,
+    .open = qcow2_open,
+    .read = qcow2_read,
+    .close = qcow2_close,
+};
+
+#endif /* USE_USBREDIR */
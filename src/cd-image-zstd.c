@@ -0,0 +1,260 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   CD device emulation - zstd seekable images
+
+   Copyright (C) 2019 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#if defined(USE_USBREDIR) && defined(USE_ZSTD)
+
+#include <zstd.h>
+#include <glib/gi18n-lib.h>
+
+#include "spice-common.h"
+#include "cd-image-priv.h"
+
+/*
+ * Images in the zstd seekable format: independent zstd frames followed
+ * by a seek table in a skippable frame, which gives the compressed and
+ * decompressed size of each frame. Only the frames covering a read
+ * are decompressed.
+ */
+
+#define ZSTD_SKIPPABLE_MAGIC            0x184D2A5E
+#define ZSTD_SKIPPABLE_MAGIC_MASK       0xFFFFFFF0
+#define ZSTD_SKIPPABLE_HEADER_SIZE      8
+#define ZSTD_SEEKABLE_MAGIC             0x8F92EAB1
+#define ZSTD_SEEKABLE_FOOTER_SIZE       9
+#define ZSTD_SEEKABLE_CHECKSUM_FLAG     0x80
+#define ZSTD_SEEKABLE_RESERVED_FLAGS    0x7c
+#define ZSTD_SEEKABLE_MAX_FRAMES        0x8000000
+#define ZSTD_SEEKABLE_MAX_FRAME_SIZE    (64 * 1024 * 1024)
+
+/* cached decompressed frames */
+#define ZSTD_FRAME_CACHE_SIZE           8
+
+typedef struct ZstdFrame {
+    uint64_t c_offset;
+    uint64_t d_offset;
+    uint32_t c_size;
+    uint32_t d_size;
+} ZstdFrame;
+
+typedef struct CdImageZstd {
+    uint32_t num_frames;
+    ZstdFrame *frames;
+
+    CdImageBlockCache *frame_cache; /* frame index -> data */
+} CdImageZstd;
+
+static gboolean zstd_probe(const uint8_t *header, uint32_t header_len)
+{
+    uint32_t magic;
+
+    if (header_len < 4) {
+        return FALSE;
+    }
+    magic = cd_image_ld_le32(header);
+    return magic == ZSTD_MAGICNUMBER ||
+           (magic & ZSTD_SKIPPABLE_MAGIC_MASK) ==
+           (ZSTD_SKIPPABLE_MAGIC & ZSTD_SKIPPABLE_MAGIC_MASK);
+}
+
+static void zstd_close(gpointer data)
+{
+    CdImageZstd *z = data;
+
+    g_clear_pointer(&z->frame_cache, cd_image_block_cache_free);
+    g_free(z->frames);
+    g_free(z);
+}
+
+static gpointer zstd_open(CdImage *image, uint64_t *size, GError **error)
+{
+    const char *filename = cd_image_get_filename(image);
+    uint64_t file_size = cd_image_get_file_size(image);
+    uint8_t footer[ZSTD_SEEKABLE_FOOTER_SIZE];
+    uint64_t table_size, table_offset, c_offset = 0, d_offset = 0;
+    uint32_t entry_size, i;
+    uint8_t *table = NULL, *entry;
+    CdImageZstd *z;
+
+    if (file_size < ZSTD_SKIPPABLE_HEADER_SIZE + ZSTD_SEEKABLE_FOOTER_SIZE ||
+        !cd_image_pread(image, footer, file_size - sizeof(footer), sizeof(footer), NULL) ||
+        cd_image_ld_le32(footer + 5) != ZSTD_SEEKABLE_MAGIC) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                    _("%s is compressed, but not in the zstd seekable format"), filename);
+        return NULL;
+    }
+
+    z = g_new0(CdImageZstd, 1);
+    z->num_frames = cd_image_ld_le32(footer);
+    entry_size = (footer[4] & ZSTD_SEEKABLE_CHECKSUM_FLAG) ? 12 : 8;
+    table_size = (uint64_t)z->num_frames * entry_size;
+
+    if ((footer[4] & ZSTD_SEEKABLE_RESERVED_FLAGS) ||
+        z->num_frames == 0 || z->num_frames > ZSTD_SEEKABLE_MAX_FRAMES ||
+        file_size < ZSTD_SKIPPABLE_HEADER_SIZE + table_size + ZSTD_SEEKABLE_FOOTER_SIZE) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    _("invalid zstd seek table in %s"), filename);
+        zstd_close(z);
+        return NULL;
+    }
+
+    /* skippable frame header, entries, footer */
+    table_offset = file_size - ZSTD_SEEKABLE_FOOTER_SIZE - table_size - ZSTD_SKIPPABLE_HEADER_SIZE;
+    table = g_malloc(ZSTD_SKIPPABLE_HEADER_SIZE + table_size);
+    if (!cd_image_pread(image, table, table_offset,
+                        ZSTD_SKIPPABLE_HEADER_SIZE + table_size, error)) {
+        goto fail;
+    }
+    if (cd_image_ld_le32(table) != ZSTD_SKIPPABLE_MAGIC ||
+        cd_image_ld_le32(table + 4) != table_size + ZSTD_SEEKABLE_FOOTER_SIZE) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    _("invalid zstd seek table in %s"), filename);
+        goto fail;
+    }
+
+    z->frames = g_new(ZstdFrame, z->num_frames);
+    entry = table + ZSTD_SKIPPABLE_HEADER_SIZE;
+    for (i = 0; i < z->num_frames; i++, entry += entry_size) {
+        ZstdFrame *frame = &z->frames[i];
+
+        frame->c_offset = c_offset;
+        frame->d_offset = d_offset;
+        frame->c_size = cd_image_ld_le32(entry);
+        frame->d_size = cd_image_ld_le32(entry + 4);
+        if (frame->d_size > ZSTD_SEEKABLE_MAX_FRAME_SIZE ||
+            frame->c_size > ZSTD_COMPRESSBOUND(ZSTD_SEEKABLE_MAX_FRAME_SIZE)) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                        _("zstd frames of %s are too large"), filename);
+            goto fail;
+        }
+        c_offset += frame->c_size;
+        d_offset += frame->d_size;
+    }
+    if (c_offset != table_offset) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    _("invalid zstd seek table in %s"), filename);
+        goto fail;
+    }
+    g_free(table);
+
+    z->frame_cache = cd_image_block_cache_new(ZSTD_FRAME_CACHE_SIZE);
+    *size = d_offset;
+
+    SPICE_DEBUG("%s: %s, %u frames", __FUNCTION__, filename, z->num_frames);
+    return z;
+
+fail:
+    g_free(table);
+    zstd_close(z);
+    return NULL;
+}
+
+/* returns the last frame starting at or before offset */
+static uint32_t zstd_find_frame(CdImageZstd *z, uint64_t offset)
+{
+    uint32_t lo = 0, hi = z->num_frames;
+
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (z->frames[mid].d_offset <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static GBytes *zstd_get_frame(CdImage *image, CdImageZstd *z,
+                              uint32_t index, GError **error)
+{
+    ZstdFrame *frame = &z->frames[index];
+    uint8_t *cdata, *data;
+    GBytes *block;
+    size_t ret;
+
+    block = cd_image_block_cache_lookup(z->frame_cache, index);
+    if (block != NULL) {
+        return block;
+    }
+
+    cdata = g_malloc(frame->c_size);
+    if (!cd_image_pread(image, cdata, frame->c_offset, frame->c_size, error)) {
+        g_free(cdata);
+        return NULL;
+    }
+    data = g_malloc(frame->d_size);
+    ret = ZSTD_decompress(data, frame->d_size, cdata, frame->c_size);
+    g_free(cdata);
+    if (ZSTD_isError(ret) || ret != frame->d_size) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "corrupted zstd frame %u in %s: %s", index,
+                    cd_image_get_filename(image),
+                    ZSTD_isError(ret) ? ZSTD_getErrorName(ret) : "size mismatch");
+        g_free(data);
+        return NULL;
+    }
+
+    block = g_bytes_new_take(data, frame->d_size);
+    cd_image_block_cache_insert(z->frame_cache, index, block);
+    return block;
+}
+
+static gboolean zstd_read(CdImage *image, gpointer data,
+                          uint8_t *buf, uint64_t offset, uint32_t len,
+                          GError **error)
+{
+    CdImageZstd *z = data;
+    uint32_t index = zstd_find_frame(z, offset);
+
+    for (; len > 0 && index < z->num_frames; index++) {
+        ZstdFrame *frame = &z->frames[index];
+        uint32_t start = offset - frame->d_offset;
+        uint32_t n = MIN(len, frame->d_size - start);
+        GBytes *block;
+
+        if (n == 0) {
+            continue;
+        }
+        block = zstd_get_frame(image, z, index, error);
+        if (block == NULL) {
+            return FALSE;
+        }
+        memcpy(buf, (const uint8_t *)g_bytes_get_data(block, NULL) + start, n);
+        g_bytes_unref(block);
+
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+    return TRUE;
+}
+
+const CdImageFormat cd_image_format_zstd = {
+    .name = "zstd",
+    .probe = zstd_probe,
+    .open = zstd_open,
+    .read = zstd_read,
+    .close = zstd_close,
+};
+
+#endif /* USE_USBREDIR && USE_ZSTD */
@@ -0,0 +1,1203 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   CD device emulation - image I/O backend
+
+   Copyright (C) 2019 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#ifdef USE_USBREDIR
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <glib/gi18n-lib.h>
+
+#ifdef G_OS_WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "spice-common.h"
+#include "spice-util.h"
+#include "cd-image-priv.h"
+
+/*
+ * The image is read with positional reads in worker threads, so there is
+ * no shared file offset and several reads may be in flight at once.
+ * Data is kept in a cache of fixed size chunks, in LRU order. Chunks that
+ * are being read are in the table too (not ready), so a request for data
+ * that is already on its way waits for it instead of reading it again.
+ * All the cache state is only touched from the main context.
+ * For compressed formats the chunks hold decompressed data, the format
+ * maps the chunk reads to the file.
+ *
+ * Writable (raw) images have a write-back cache: written sectors are kept
+ * per chunk until a worker thread writes them to the file, and are copied
+ * over the data of the chunks as they are read, so reads always see the
+ * last written data. Only one write-back runs at a time.
+ */
+
+/* number of back-to-back reads before starting read-ahead */
+#define CD_IMAGE_SEQUENTIAL_THRESHOLD   2
+/* maximal read-ahead window, in chunks */
+#define CD_IMAGE_MAX_READAHEAD          16
+/* delay of the write-back of written data, in milliseconds */
+#define CD_IMAGE_FLUSH_INTERVAL         1000
+/* written data waiting for the write-back, writes wait beyond that */
+#define CD_IMAGE_MAX_DIRTY              (32 * 1024 * 1024)
+
+#define CD_IMAGE_CHUNK_SECTORS          (CD_IMAGE_CHUNK_SIZE / CD_IMAGE_SECTOR_SIZE)
+
+typedef struct CdImageChunk {
+    gint refs;
+    uint64_t index;
+    uint32_t len;
+    gboolean ready;
+    GList *lru_link;
+    GSList *waiters; /* read tasks waiting for the chunk */
+    uint8_t data[];
+} CdImageChunk;
+
+/* written sectors of a chunk */
+typedef struct CdImageDirty {
+    uint64_t index;
+    uint64_t sectors[CD_IMAGE_CHUNK_SECTORS / 64];
+    uint8_t data[CD_IMAGE_CHUNK_SIZE];
+} CdImageDirty;
+
+struct CdImage {
+    gint refs;
+    char *filename;
+#ifdef G_OS_WIN32
+    HANDLE handle;
+#else
+    int fd;
+#endif
+    uint64_t file_size;
+    uint64_t size; /* size of the image data */
+    uint64_t num_chunks;
+
+    const CdImageFormat *format; /* NULL for raw images */
+    gpointer format_data;
+
+    uint32_t cache_chunks;
+    uint32_t readahead;
+    GHashTable *chunks; /* index -> CdImageChunk */
+    GQueue lru; /* ready chunks, most recently used first */
+
+    /* sequential access detection */
+    uint64_t next_offset;
+    uint32_t sequential;
+
+    gboolean writable;
+    GHashTable *dirty; /* index -> CdImageDirty */
+    GHashTable *flushing; /* dirty chunks being written back, or NULL */
+    GSList *flush_waiters; /* tasks waiting for the next write-back */
+    gboolean flush_sync; /* the next write-back syncs the file */
+    guint flush_timer;
+    GError *flush_error; /* failed write-back, reported by the next flush */
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t readahead_chunks;
+    uint64_t bytes_written;
+    uint64_t write_backs;
+};
+
+typedef struct CdImageRead {
+    CdImage *image;
+    uint64_t offset;
+    uint32_t len;
+    uint32_t missing;
+    GError *error;
+    GPtrArray *chunks;
+} CdImageRead;
+
+typedef struct CdImageFetch {
+    CdImage *image;
+    GPtrArray *chunks; /* contiguous, in ascending order */
+} CdImageFetch;
+
+typedef struct CdImageFlush {
+    CdImage *image;
+    GHashTable *chunks; /* index -> CdImageDirty */
+    GSList *tasks;
+    gboolean sync;
+} CdImageFlush;
+
+static CdImageChunk *cd_image_chunk_ref(CdImageChunk *chunk)
+{
+    g_atomic_int_inc(&chunk->refs);
+    return chunk;
+}
+
+static void cd_image_chunk_unref(CdImageChunk *chunk)
+{
+    if (g_atomic_int_dec_and_test(&chunk->refs)) {
+        g_warn_if_fail(chunk->waiters == NULL);
+        g_free(chunk);
+    }
+}
+
+static const CdImageFormat *const cd_image_formats[] = {
+    &cd_image_format_qcow2,
+#ifdef USE_ZSTD
+    &cd_image_format_zstd,
+#endif
+};
+
+/* a whole CD sector, devices may not allow smaller reads */
+#define CD_IMAGE_HEADER_SIZE 2048
+
+static gboolean cd_image_write_back(CdImage *image, GHashTable *chunks,
+                                    gboolean sync, GError **error);
+
+static gboolean cd_image_probe(CdImage *image, GError **error)
+{
+    uint8_t header[CD_IMAGE_HEADER_SIZE];
+    uint32_t header_len = MIN(sizeof(header), image->file_size);
+    guint i;
+
+    if (!cd_image_pread(image, header, 0, header_len, NULL)) {
+        header_len = 0;
+    }
+
+    for (i = 0; header_len > 0 && i < G_N_ELEMENTS(cd_image_formats); i++) {
+        const CdImageFormat *format = cd_image_formats[i];
+
+        if (format->probe(header, header_len)) {
+            image->format_data = format->open(image, &image->size, error);
+            if (image->format_data == NULL) {
+                return FALSE;
+            }
+            image->format = format;
+            return TRUE;
+        }
+    }
+    image->size = image->file_size;
+    return TRUE;
+}
+
+/* only CD media are probed: the content of a disk belongs to the
+ * guest, which must not be able to turn it into another format */
+static CdImage *cd_image_open_file(const char *filename, uint64_t size,
+                                   gboolean writable, gboolean probe,
+                                   GError **error)
+{
+    CdImage *image;
+
+    g_return_val_if_fail(filename != NULL, NULL);
+
+    if (size == 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                    _("empty image %s"), filename);
+        return NULL;
+    }
+
+    image = g_new0(CdImage, 1);
+    image->refs = 1;
+    image->filename = g_strdup(filename);
+    image->file_size = size;
+    image->chunks = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL,
+                                          (GDestroyNotify) cd_image_chunk_unref);
+    g_queue_init(&image->lru);
+    image->writable = writable;
+    image->dirty = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, g_free);
+
+#ifdef G_OS_WIN32
+    image->handle = CreateFileA(filename,
+                                writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+                                writable ? FILE_SHARE_READ | FILE_SHARE_WRITE : FILE_SHARE_READ,
+                                NULL, OPEN_EXISTING, 0, NULL);
+    if (image->handle == INVALID_HANDLE_VALUE) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                    _("can't open %s (error %lu)"), filename, GetLastError());
+        image->handle = NULL;
+        cd_image_unref(image);
+        return NULL;
+    }
+#else
+    image->fd = open(filename, writable ? O_RDWR : O_RDONLY);
+    if (image->fd < 0) {
+        int errsv = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+                    _("can't open %s: %s"), filename, g_strerror(errsv));
+        cd_image_unref(image);
+        return NULL;
+    }
+#endif
+
+    if (!probe) {
+        image->size = image->file_size;
+    } else if (!cd_image_probe(image, error)) {
+        cd_image_unref(image);
+        return NULL;
+    }
+    if (image->size == 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    _("empty image %s"), filename);
+        cd_image_unref(image);
+        return NULL;
+    }
+    image->num_chunks = (image->size + CD_IMAGE_CHUNK_SIZE - 1) / CD_IMAGE_CHUNK_SIZE;
+
+    SPICE_DEBUG("%s: %s, format %s, size %" G_GUINT64_FORMAT "%s", __FUNCTION__,
+                filename, image->format ? image->format->name : "raw", image->size,
+                writable ? ", writable" : "");
+
+    cd_image_set_cache_size(image, CD_IMAGE_DEFAULT_CACHE_SIZE);
+    return image;
+}
+
+CdImage *cd_image_open(const char *filename, uint64_t size, GError **error)
+{
+    return cd_image_open_file(filename, size, FALSE, TRUE, error);
+}
+
+CdImage *cd_image_open_raw(const char *filename, uint64_t size, GError **error)
+{
+    return cd_image_open_file(filename, size, FALSE, FALSE, error);
+}
+
+CdImage *cd_image_open_writable(const char *filename, uint64_t size, GError **error)
+{
+    return cd_image_open_file(filename, size, TRUE, FALSE, error);
+}
+
+gboolean cd_image_is_writable(CdImage *image)
+{
+    return image->writable;
+}
+
+CdImage *cd_image_ref(CdImage *image)
+{
+    g_atomic_int_inc(&image->refs);
+    return image;
+}
+
+void cd_image_unref(CdImage *image)
+{
+    if (!g_atomic_int_dec_and_test(&image->refs)) {
+        return;
+    }
+
+    if (image->flush_timer != 0) {
+        g_source_remove(image->flush_timer);
+    }
+    /* write-backs hold a reference, none is running. The owner flushes
+     * the image before releasing it, not to write on the main loop */
+    if (g_hash_table_size(image->dirty) > 0) {
+        g_warning("%s: %s released with data not written back",
+                  __FUNCTION__, image->filename);
+    }
+
+    SPICE_DEBUG("%s: %s, hits %" G_GUINT64_FORMAT " misses %" G_GUINT64_FORMAT
+                " read-ahead chunks %" G_GUINT64_FORMAT " written %" G_GUINT64_FORMAT
+                " write-backs %" G_GUINT64_FORMAT, __FUNCTION__,
+                image->filename, image->hits, image->misses, image->readahead_chunks,
+                image->bytes_written, image->write_backs);
+
+    g_queue_clear(&image->lru);
+    g_hash_table_destroy(image->chunks);
+    g_hash_table_destroy(image->dirty);
+    g_clear_error(&image->flush_error);
+    if (image->format != NULL) {
+        image->format->close(image->format_data);
+    }
+#ifdef G_OS_WIN32
+    if (image->handle) {
+        CloseHandle(image->handle);
+    }
+#else
+    if (image->fd >= 0) {
+        close(image->fd);
+    }
+#endif
+    g_free(image->filename);
+    g_free(image);
+}
+
+uint64_t cd_image_get_size(CdImage *image)
+{
+    return image->size;
+}
+
+uint64_t cd_image_get_file_size(CdImage *image)
+{
+    return image->file_size;
+}
+
+const char *cd_image_get_filename(CdImage *image)
+{
+    return image->filename;
+}
+
+static void cd_image_chunk_drop(CdImage *image, CdImageChunk *chunk)
+{
+    g_queue_delete_link(&image->lru, chunk->lru_link);
+    chunk->lru_link = NULL;
+    g_hash_table_remove(image->chunks, &chunk->index);
+}
+
+static void cd_image_evict(CdImage *image)
+{
+    while (image->lru.length > image->cache_chunks) {
+        CdImageChunk *chunk = g_queue_pop_tail(&image->lru);
+        chunk->lru_link = NULL;
+        g_hash_table_remove(image->chunks, &chunk->index);
+    }
+}
+
+void cd_image_set_cache_size(CdImage *image, uint32_t cache_size)
+{
+    image->cache_chunks = cache_size / CD_IMAGE_CHUNK_SIZE;
+    /* keep the window small enough not to evict what the guest is
+     * going to read before it has a chance to */
+    image->readahead = MIN(image->cache_chunks / 2, CD_IMAGE_MAX_READAHEAD);
+    cd_image_evict(image);
+
+    SPICE_DEBUG("%s: %s, cache %u chunks, read-ahead %u chunks", __FUNCTION__,
+                image->filename, image->cache_chunks, image->readahead);
+}
+
+gboolean cd_image_pread(CdImage *image, uint8_t *buf,
+                        uint64_t offset, uint32_t len,
+                        GError **error)
+{
+    while (len > 0) {
+#ifdef G_OS_WIN32
+        OVERLAPPED ov = { 0 };
+        DWORD n = 0;
+
+        ov.Offset = (DWORD) offset;
+        ov.OffsetHigh = (DWORD) (offset >> 32);
+        if (!ReadFile(image->handle, buf, len, &n, &ov) || n == 0) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                        "read of %s at %" G_GUINT64_FORMAT " failed (error %lu)",
+                        image->filename, offset, GetLastError());
+            return FALSE;
+        }
+#else
+        ssize_t n = pread(image->fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            int errsv = n < 0 ? errno : EIO;
+            g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+                        "read of %s at %" G_GUINT64_FORMAT " failed: %s",
+                        image->filename, offset, g_strerror(errsv));
+            return FALSE;
+        }
+#endif
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+    return TRUE;
+}
+
+static gboolean cd_image_pwrite(CdImage *image, const uint8_t *buf,
+                                uint64_t offset, uint32_t len,
+                                GError **error)
+{
+    while (len > 0) {
+#ifdef G_OS_WIN32
+        OVERLAPPED ov = { 0 };
+        DWORD n = 0;
+
+        ov.Offset = (DWORD) offset;
+        ov.OffsetHigh = (DWORD) (offset >> 32);
+        if (!WriteFile(image->handle, buf, len, &n, &ov) || n == 0) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                        "write of %s at %" G_GUINT64_FORMAT " failed (error %lu)",
+                        image->filename, offset, GetLastError());
+            return FALSE;
+        }
+#else
+        ssize_t n = pwrite(image->fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            int errsv = n < 0 ? errno : EIO;
+            g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+                        "write of %s at %" G_GUINT64_FORMAT " failed: %s",
+                        image->filename, offset, g_strerror(errsv));
+            return FALSE;
+        }
+#endif
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+    return TRUE;
+}
+
+static gboolean cd_image_sync(CdImage *image, GError **error)
+{
+#ifdef G_OS_WIN32
+    if (!FlushFileBuffers(image->handle)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                    "sync of %s failed (error %lu)", image->filename, GetLastError());
+        return FALSE;
+    }
+#else
+    if (fsync(image->fd) < 0) {
+        int errsv = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+                    "sync of %s failed: %s", image->filename, g_strerror(errsv));
+        return FALSE;
+    }
+#endif
+    return TRUE;
+}
+
+static gboolean cd_image_read_data(CdImage *image, uint8_t *buf,
+                                   uint64_t offset, uint32_t len,
+                                   GError **error)
+{
+    if (image->format != NULL) {
+        return image->format->read(image, image->format_data, buf, offset, len, error);
+    }
+    return cd_image_pread(image, buf, offset, len, error);
+}
+
+/* limit the range to the size of the image,
+ * returns: FALSE if nothing is left to read
+ */
+static gboolean cd_image_clip(CdImage *image, uint64_t offset, uint32_t *len)
+{
+    if (offset >= image->size) {
+        *len = 0;
+    } else if (*len > image->size - offset) {
+        *len = image->size - offset;
+    }
+    return *len != 0;
+}
+
+static void cd_image_copy(CdImageChunk **chunks, uint64_t offset,
+                          uint8_t *buf, uint32_t len)
+{
+    while (len > 0) {
+        CdImageChunk *chunk = *chunks++;
+        uint32_t start = offset - chunk->index * CD_IMAGE_CHUNK_SIZE;
+        uint32_t n = MIN(len, chunk->len - start);
+
+        memcpy(buf, chunk->data + start, n);
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+static void cd_image_touch(CdImage *image, CdImageChunk *chunk)
+{
+    if (chunk->lru_link != image->lru.head) {
+        g_queue_unlink(&image->lru, chunk->lru_link);
+        g_queue_push_head_link(&image->lru, chunk->lru_link);
+    }
+}
+
+static void cd_image_read_return(GTask *task)
+{
+    CdImageRead *read = g_task_get_task_data(task);
+
+    if (read->error != NULL) {
+        g_task_return_error(task, g_steal_pointer(&read->error));
+    } else {
+        g_task_return_boolean(task, TRUE);
+    }
+    g_object_unref(task);
+}
+
+static gboolean cd_image_dirty_test(const CdImageDirty *dirty, uint32_t sector)
+{
+    return (dirty->sectors[sector / 64] >> (sector % 64)) & 1;
+}
+
+/* copy the written sectors over the data read from the file */
+static void cd_image_dirty_apply(const CdImageDirty *dirty, CdImageChunk *chunk)
+{
+    uint32_t sector;
+
+    if (dirty == NULL) {
+        return;
+    }
+    for (sector = 0; sector * CD_IMAGE_SECTOR_SIZE < chunk->len; sector++) {
+        uint32_t start = sector * CD_IMAGE_SECTOR_SIZE;
+
+        if (cd_image_dirty_test(dirty, sector)) {
+            memcpy(chunk->data + start, dirty->data + start,
+                   MIN(CD_IMAGE_SECTOR_SIZE, chunk->len - start));
+        }
+    }
+}
+
+static void cd_image_chunk_done(CdImage *image, CdImageChunk *chunk,
+                                const GError *error)
+{
+    GSList *waiters, *l;
+
+    if (error == NULL) {
+        /* the file might not have the data written meanwhile */
+        if (image->flushing != NULL) {
+            cd_image_dirty_apply(g_hash_table_lookup(image->flushing, &chunk->index), chunk);
+        }
+        cd_image_dirty_apply(g_hash_table_lookup(image->dirty, &chunk->index), chunk);
+        chunk->ready = TRUE;
+        g_queue_push_head(&image->lru, chunk);
+        chunk->lru_link = image->lru.head;
+    } else if (g_hash_table_lookup(image->chunks, &chunk->index) == chunk) {
+        g_hash_table_remove(image->chunks, &chunk->index);
+    }
+
+    waiters = g_steal_pointer(&chunk->waiters);
+    for (l = waiters; l != NULL; l = l->next) {
+        GTask *task = l->data;
+        CdImageRead *read = g_task_get_task_data(task);
+
+        if (error != NULL && read->error == NULL) {
+            read->error = g_error_copy(error);
+        }
+        if (--read->missing == 0) {
+            cd_image_read_return(task);
+        }
+    }
+    g_slist_free(waiters);
+}
+
+static void cd_image_fetch_thread(GTask *task,
+                                  gpointer source_object,
+                                  gpointer task_data,
+                                  GCancellable *cancellable)
+{
+    CdImageFetch *fetch = task_data;
+    GError *error = NULL;
+    guint i;
+
+    for (i = 0; i < fetch->chunks->len; i++) {
+        CdImageChunk *chunk = g_ptr_array_index(fetch->chunks, i);
+
+        if (!cd_image_read_data(fetch->image, chunk->data,
+                                chunk->index * CD_IMAGE_CHUNK_SIZE, chunk->len,
+                                &error)) {
+            g_task_return_error(task, error);
+            return;
+        }
+    }
+    g_task_return_boolean(task, TRUE);
+}
+
+static void cd_image_fetch_done(GObject *source_object,
+                                GAsyncResult *result,
+                                gpointer user_data)
+{
+    CdImageFetch *fetch = user_data;
+    CdImage *image = fetch->image;
+    GError *error = NULL;
+    guint i;
+
+    if (!g_task_propagate_boolean(G_TASK(result), &error)) {
+        SPICE_DEBUG("%s: %s", __FUNCTION__, error->message);
+    }
+    for (i = 0; i < fetch->chunks->len; i++) {
+        cd_image_chunk_done(image, g_ptr_array_index(fetch->chunks, i), error);
+    }
+    cd_image_evict(image);
+
+    g_clear_error(&error);
+    g_ptr_array_unref(fetch->chunks);
+    cd_image_unref(fetch->image);
+    g_free(fetch);
+}
+
+/* read a run of chunks that are not in the cache yet */
+static void cd_image_fetch_start(CdImage *image, GPtrArray *chunks)
+{
+    CdImageFetch *fetch;
+    GTask *task;
+
+    if (chunks == NULL) {
+        return;
+    }
+
+    fetch = g_new0(CdImageFetch, 1);
+    fetch->image = cd_image_ref(image);
+    fetch->chunks = chunks;
+
+    task = g_task_new(NULL, NULL, cd_image_fetch_done, fetch);
+    g_task_set_task_data(task, fetch, NULL);
+    g_task_run_in_thread(task, cd_image_fetch_thread);
+    g_object_unref(task);
+}
+
+/* returns the chunk, adding it to the run to be fetched if it is new */
+static CdImageChunk *cd_image_get_chunk(CdImage *image, uint64_t index,
+                                        GPtrArray **fetch)
+{
+    CdImageChunk *chunk = g_hash_table_lookup(image->chunks, &index);
+    uint64_t start;
+
+    if (chunk != NULL) {
+        /* keep the runs contiguous */
+        cd_image_fetch_start(image, g_steal_pointer(fetch));
+        return chunk;
+    }
+
+    start = index * CD_IMAGE_CHUNK_SIZE;
+    chunk = g_malloc(sizeof(*chunk) + MIN(CD_IMAGE_CHUNK_SIZE, image->size - start));
+    chunk->refs = 1;
+    chunk->index = index;
+    chunk->len = MIN(CD_IMAGE_CHUNK_SIZE, image->size - start);
+    chunk->ready = FALSE;
+    chunk->lru_link = NULL;
+    chunk->waiters = NULL;
+    g_hash_table_insert(image->chunks, &chunk->index, chunk);
+
+    if (*fetch == NULL) {
+        *fetch = g_ptr_array_new_with_free_func((GDestroyNotify) cd_image_chunk_unref);
+    }
+    g_ptr_array_add(*fetch, cd_image_chunk_ref(chunk));
+    return chunk;
+}
+
+static void cd_image_access(CdImage *image, uint64_t offset, uint32_t len)
+{
+    uint64_t first, last, index;
+    GPtrArray *fetch = NULL;
+
+    if (offset == image->next_offset) {
+        image->sequential++;
+    } else {
+        image->sequential = 0;
+    }
+    image->next_offset = offset + len;
+
+    if (image->sequential < CD_IMAGE_SEQUENTIAL_THRESHOLD || image->readahead == 0) {
+        return;
+    }
+
+    first = (offset + len + CD_IMAGE_CHUNK_SIZE - 1) / CD_IMAGE_CHUNK_SIZE;
+    last = MIN(first + image->readahead, image->num_chunks);
+    for (index = first; index < last; index++) {
+        if (g_hash_table_lookup(image->chunks, &index) == NULL) {
+            image->readahead_chunks++;
+        }
+        cd_image_get_chunk(image, index, &fetch);
+    }
+    cd_image_fetch_start(image, fetch);
+}
+
+gboolean cd_image_read_cached(CdImage *image, uint64_t offset,
+                              uint8_t *buf, uint32_t len,
+                              uint32_t *bytes_read)
+{
+    uint64_t index, first, last;
+
+    *bytes_read = 0;
+    if (!cd_image_clip(image, offset, &len)) {
+        return TRUE;
+    }
+
+    first = offset / CD_IMAGE_CHUNK_SIZE;
+    last = (offset + len - 1) / CD_IMAGE_CHUNK_SIZE;
+    for (index = first; index <= last; index++) {
+        CdImageChunk *chunk = g_hash_table_lookup(image->chunks, &index);
+        if (chunk == NULL || !chunk->ready) {
+            image->misses++;
+            return FALSE;
+        }
+    }
+
+    for (index = first; index <= last; index++) {
+        CdImageChunk *chunk = g_hash_table_lookup(image->chunks, &index);
+        uint32_t start = offset + *bytes_read - index * CD_IMAGE_CHUNK_SIZE;
+        uint32_t n = MIN(len - *bytes_read, chunk->len - start);
+
+        memcpy(buf + *bytes_read, chunk->data + start, n);
+        *bytes_read += n;
+        cd_image_touch(image, chunk);
+    }
+    image->hits++;
+
+    cd_image_access(image, offset, len);
+    return TRUE;
+}
+
+static void cd_image_read_free(CdImageRead *read)
+{
+    g_clear_error(&read->error);
+    g_ptr_array_unref(read->chunks);
+    cd_image_unref(read->image);
+    g_free(read);
+}
+
+void cd_image_read_async(CdImage *image, uint64_t offset, uint32_t len,
+                         GCancellable *cancellable,
+                         GAsyncReadyCallback callback,
+                         gpointer user_data)
+{
+    GTask *task = g_task_new(NULL, cancellable, callback, user_data);
+    CdImageRead *read = g_new0(CdImageRead, 1);
+    GPtrArray *fetch = NULL;
+    uint64_t index;
+
+    read->image = cd_image_ref(image);
+    read->chunks = g_ptr_array_new_with_free_func((GDestroyNotify) cd_image_chunk_unref);
+    g_task_set_task_data(task, read, (GDestroyNotify) cd_image_read_free);
+
+    if (cd_image_clip(image, offset, &len)) {
+        read->offset = offset;
+        read->len = len;
+        for (index = offset / CD_IMAGE_CHUNK_SIZE;
+             index <= (offset + len - 1) / CD_IMAGE_CHUNK_SIZE; index++) {
+            CdImageChunk *chunk = cd_image_get_chunk(image, index, &fetch);
+
+            g_ptr_array_add(read->chunks, cd_image_chunk_ref(chunk));
+            if (chunk->ready) {
+                cd_image_touch(image, chunk);
+            } else {
+                chunk->waiters = g_slist_prepend(chunk->waiters, task);
+                read->missing++;
+            }
+        }
+        cd_image_fetch_start(image, fetch);
+        cd_image_access(image, offset, len);
+    }
+
+    if (read->missing == 0) {
+        cd_image_read_return(task);
+    }
+}
+
+gboolean cd_image_read_finish(CdImage *image, GAsyncResult *result,
+                              uint8_t *buf, uint32_t *bytes_read,
+                              GError **error)
+{
+    GTask *task = G_TASK(result);
+    CdImageRead *read = g_task_get_task_data(task);
+
+    *bytes_read = 0;
+    if (!g_task_propagate_boolean(task, error)) {
+        return FALSE;
+    }
+    if (read->image != image) {
+        g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                            "media changed during the read");
+        return FALSE;
+    }
+    if (buf != NULL) {
+        cd_image_copy((CdImageChunk **) read->chunks->pdata, read->offset,
+                      buf, read->len);
+        *bytes_read = read->len;
+    }
+    return TRUE;
+}
+
+static gint cd_image_dirty_compare(gconstpointer a, gconstpointer b)
+{
+    const CdImageDirty *da = a, *db = b;
+
+    return da->index < db->index ? -1 : da->index > db->index;
+}
+
+/* write the runs of written sectors, in file order */
+static gboolean cd_image_write_back(CdImage *image, GHashTable *chunks,
+                                    gboolean sync, GError **error)
+{
+    GList *values = g_list_sort(g_hash_table_get_values(chunks), cd_image_dirty_compare);
+    gboolean ok = TRUE;
+    GList *l;
+
+    for (l = values; l != NULL && ok; l = l->next) {
+        CdImageDirty *dirty = l->data;
+        uint32_t first, last;
+
+        for (first = 0; first < CD_IMAGE_CHUNK_SECTORS && ok; first = last) {
+            uint64_t offset = dirty->index * CD_IMAGE_CHUNK_SIZE +
+                              first * CD_IMAGE_SECTOR_SIZE;
+
+            last = first + 1;
+            if (!cd_image_dirty_test(dirty, first)) {
+                continue;
+            }
+            while (last < CD_IMAGE_CHUNK_SECTORS && cd_image_dirty_test(dirty, last)) {
+                last++;
+            }
+            if (offset < image->size) {
+                ok = cd_image_pwrite(image, dirty->data + first * CD_IMAGE_SECTOR_SIZE, offset,
+                                     MIN((last - first) * CD_IMAGE_SECTOR_SIZE,
+                                         image->size - offset),
+                                     error);
+            }
+        }
+    }
+    g_list_free(values);
+
+    if (ok && sync) {
+        ok = cd_image_sync(image, error);
+    }
+    return ok;
+}
+
+/* give written data back to the write-back cache, unless it was
+ * written again */
+static void cd_image_dirty_restore(CdImage *image, CdImageDirty *dirty)
+{
+    CdImageDirty *newer = g_hash_table_lookup(image->dirty, &dirty->index);
+    uint32_t sector;
+
+    if (newer == NULL) {
+        g_hash_table_insert(image->dirty, &dirty->index, dirty);
+        return;
+    }
+    for (sector = 0; sector < CD_IMAGE_CHUNK_SECTORS; sector++) {
+        uint32_t start = sector * CD_IMAGE_SECTOR_SIZE;
+
+        if (cd_image_dirty_test(dirty, sector) && !cd_image_dirty_test(newer, sector)) {
+            memcpy(newer->data + start, dirty->data + start, CD_IMAGE_SECTOR_SIZE);
+            newer->sectors[sector / 64] |= G_GUINT64_CONSTANT(1) << (sector % 64);
+        }
+    }
+    g_free(dirty);
+}
+
+static void cd_image_flush_start(CdImage *image);
+
+static gboolean cd_image_flush_timeout(gpointer user_data)
+{
+    CdImage *image = user_data;
+
+    image->flush_timer = 0;
+    cd_image_flush_start(image);
+    return G_SOURCE_REMOVE;
+}
+
+/* the running write-back schedules the next one when it is done */
+static void cd_image_flush_schedule(CdImage *image)
+{
+    if (image->flush_timer == 0 && image->flushing == NULL &&
+        g_hash_table_size(image->dirty) > 0) {
+        image->flush_timer = g_timeout_add(CD_IMAGE_FLUSH_INTERVAL,
+                                           cd_image_flush_timeout, image);
+    }
+}
+
+static void cd_image_flush_thread(GTask *task,
+                                  gpointer source_object,
+                                  gpointer task_data,
+                                  GCancellable *cancellable)
+{
+    CdImageFlush *flush = task_data;
+    GError *error = NULL;
+
+    if (!cd_image_write_back(flush->image, flush->chunks, flush->sync, &error)) {
+        g_task_return_error(task, error);
+        return;
+    }
+    g_task_return_boolean(task, TRUE);
+}
+
+static void cd_image_flush_done(GObject *source_object,
+                                GAsyncResult *result,
+                                gpointer user_data)
+{
+    CdImageFlush *flush = user_data;
+    CdImage *image = flush->image;
+    GError *error = NULL;
+    GHashTableIter iter;
+    CdImageDirty *dirty;
+    gboolean reported = FALSE;
+    GSList *l;
+
+    if (!g_task_propagate_boolean(G_TASK(result), &error)) {
+        g_warning("%s: %s, the written data is discarded", __FUNCTION__, error->message);
+    }
+    image->flushing = NULL;
+    image->write_backs++;
+
+    g_hash_table_iter_init(&iter, flush->chunks);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &dirty)) {
+        CdImageChunk *chunk = g_hash_table_lookup(image->chunks, &dirty->index);
+
+        if (error != NULL) {
+            /* not retried, the guest is told it failed: the cache
+             * must not return data the file does not have */
+            if (chunk != NULL && chunk->ready) {
+                cd_image_chunk_drop(image, chunk);
+            }
+        } else if (chunk != NULL && !chunk->ready) {
+            /* a chunk read from the file during the write-back may miss
+             * the data, keep it until the next one */
+            g_hash_table_iter_steal(&iter);
+            cd_image_dirty_restore(image, dirty);
+        }
+    }
+
+    /* a periodic write-back has nobody to report its failure to */
+    if (error != NULL && flush->tasks == NULL && image->flush_error == NULL) {
+        image->flush_error = g_steal_pointer(&error);
+    }
+
+    for (l = flush->tasks; l != NULL; l = l->next) {
+        GTask *task = l->data;
+        const GError *task_error = error;
+
+        /* writes waiting for the write-back only get its own failure */
+        if (g_task_get_source_tag(task) == cd_image_flush_async) {
+            if (task_error == NULL) {
+                task_error = image->flush_error;
+            }
+            reported = TRUE;
+        }
+        if (task_error != NULL) {
+            g_task_return_error(task, g_error_copy(task_error));
+        } else {
+            g_task_return_boolean(task, TRUE);
+        }
+        g_object_unref(task);
+    }
+    if (reported) {
+        g_clear_error(&image->flush_error);
+    }
+
+    if (image->flush_waiters != NULL || image->flush_sync) {
+        cd_image_flush_start(image);
+    } else {
+        cd_image_flush_schedule(image);
+    }
+
+    g_clear_error(&error);
+    g_slist_free(flush->tasks);
+    g_hash_table_destroy(flush->chunks);
+    cd_image_unref(flush->image);
+    g_free(flush);
+}
+
+/* write back the written data and complete the waiting tasks */
+static void cd_image_flush_start(CdImage *image)
+{
+    CdImageFlush *flush;
+    GTask *task;
+
+    if (image->flushing != NULL) {
+        return;
+    }
+    if (image->flush_timer != 0) {
+        g_source_remove(image->flush_timer);
+        image->flush_timer = 0;
+    }
+    if (g_hash_table_size(image->dirty) == 0 &&
+        image->flush_waiters == NULL && !image->flush_sync) {
+        return;
+    }
+
+    flush = g_new0(CdImageFlush, 1);
+    flush->image = cd_image_ref(image);
+    flush->chunks = image->dirty;
+    flush->tasks = g_slist_reverse(g_steal_pointer(&image->flush_waiters));
+    flush->sync = image->flush_sync;
+
+    image->dirty = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, g_free);
+    image->flushing = flush->chunks;
+    image->flush_sync = FALSE;
+
+    task = g_task_new(NULL, NULL, cd_image_flush_done, flush);
+    g_task_set_task_data(task, flush, NULL);
+    g_task_run_in_thread(task, cd_image_flush_thread);
+    g_object_unref(task);
+}
+
+static void cd_image_write_cache(CdImage *image, uint64_t offset,
+                                 const uint8_t *buf, uint32_t len)
+{
+    while (len > 0) {
+        uint64_t index = offset / CD_IMAGE_CHUNK_SIZE;
+        uint32_t start = offset - index * CD_IMAGE_CHUNK_SIZE;
+        uint32_t n = MIN(len, CD_IMAGE_CHUNK_SIZE - start);
+        CdImageDirty *dirty = g_hash_table_lookup(image->dirty, &index);
+        CdImageChunk *chunk = g_hash_table_lookup(image->chunks, &index);
+        uint32_t sector;
+
+        if (dirty == NULL) {
+            dirty = g_new0(CdImageDirty, 1);
+            dirty->index = index;
+            g_hash_table_insert(image->dirty, &dirty->index, dirty);
+        }
+        memcpy(dirty->data + start, buf, n);
+        for (sector = start / CD_IMAGE_SECTOR_SIZE;
+             sector < (start + n) / CD_IMAGE_SECTOR_SIZE; sector++) {
+            dirty->sectors[sector / 64] |= G_GUINT64_CONSTANT(1) << (sector % 64);
+        }
+        /* chunks still being read get the data when they are ready */
+        if (chunk != NULL && chunk->ready) {
+            memcpy(chunk->data + start, buf, MIN(n, chunk->len - start));
+        }
+
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+void cd_image_write_async(CdImage *image, uint64_t offset,
+                          const uint8_t *buf, uint32_t len,
+                          GCancellable *cancellable,
+                          GAsyncReadyCallback callback,
+                          gpointer user_data)
+{
+    GTask *task = g_task_new(NULL, cancellable, callback, user_data);
+
+    g_task_set_task_data(task, cd_image_ref(image), (GDestroyNotify) cd_image_unref);
+
+    if (!image->writable) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_READ_ONLY,
+                                "%s is read-only", image->filename);
+        g_object_unref(task);
+        return;
+    }
+    if (offset % CD_IMAGE_SECTOR_SIZE != 0 || len % CD_IMAGE_SECTOR_SIZE != 0 ||
+        offset > image->size || len > image->size - offset) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                                "invalid write of %u bytes at %" G_GUINT64_FORMAT
+                                " to %s", len, offset, image->filename);
+        g_object_unref(task);
+        return;
+    }
+
+    cd_image_write_cache(image, offset, buf, len);
+    image->bytes_written += len;
+
+    if (g_hash_table_size(image->dirty) * CD_IMAGE_CHUNK_SIZE >= CD_IMAGE_MAX_DIRTY) {
+        /* let the writer wait for the write-back */
+        image->flush_waiters = g_slist_prepend(image->flush_waiters, task);
+        cd_image_flush_start(image);
+        return;
+    }
+    cd_image_flush_schedule(image);
+    g_task_return_boolean(task, TRUE);
+    g_object_unref(task);
+}
+
+gboolean cd_image_write_finish(CdImage *image, GAsyncResult *result,
+                               GError **error)
+{
+    return g_task_propagate_boolean(G_TASK(result), error);
+}
+
+void cd_image_flush_async(CdImage *image,
+                          GCancellable *cancellable,
+                          GAsyncReadyCallback callback,
+                          gpointer user_data)
+{
+    GTask *task = g_task_new(NULL, cancellable, callback, user_data);
+
+    g_task_set_source_tag(task, cd_image_flush_async);
+    g_task_set_task_data(task, cd_image_ref(image), (GDestroyNotify) cd_image_unref);
+
+    if (!image->writable) {
+        g_task_return_boolean(task, TRUE);
+        g_object_unref(task);
+        return;
+    }
+    image->flush_waiters = g_slist_prepend(image->flush_waiters, task);
+    image->flush_sync = TRUE;
+    cd_image_flush_start(image);
+}
+
+gboolean cd_image_flush_finish(CdImage *image, GAsyncResult *result,
+                               GError **error)
+{
+    return g_task_propagate_boolean(G_TASK(result), error);
+}
+
+typedef struct CdImageBlock {
+    uint64_t key;
+    GBytes *data;
+} CdImageBlock;
+
+struct CdImageBlockCache {
+    GMutex lock;
+    guint max_blocks;
+    GQueue blocks; /* most recently used first */
+};
+
+static void cd_image_block_free(CdImageBlock *block)
+{
+    g_bytes_unref(block->data);
+    g_free(block);
+}
+
+CdImageBlockCache *cd_image_block_cache_new(guint max_blocks)
+{
+    CdImageBlockCache *cache = g_new0(CdImageBlockCache, 1);
+
+    g_mutex_init(&cache->lock);
+    cache->max_blocks = max_blocks;
+    g_queue_init(&cache->blocks);
+    return cache;
+}
+
+void cd_image_block_cache_free(CdImageBlockCache *cache)
+{
+    g_queue_foreach(&cache->blocks, (GFunc) cd_image_block_free, NULL);
+    g_queue_clear(&cache->blocks);
+    g_mutex_clear(&cache->lock);
+    g_free(cache);
+}
+
+GBytes *cd_image_block_cache_lookup(CdImageBlockCache *cache, uint64_t key)
+{
+    GBytes *data = NULL;
+    GList *l;
+
+    g_mutex_lock(&cache->lock);
+    for (l = cache->blocks.head; l != NULL; l = l->next) {
+        CdImageBlock *block = l->data;
+
+        if (block->key == key) {
+            g_queue_unlink(&cache->blocks, l);
+            g_queue_push_head_link(&cache->blocks, l);
+            data = g_bytes_ref(block->data);
+            break;
+        }
+    }
+    g_mutex_unlock(&cache->lock);
+    return data;
+}
+
+void cd_image_block_cache_insert(CdImageBlockCache *cache, uint64_t key, GBytes *data)
+{
+    CdImageBlock *block = g_new0(CdImageBlock, 1);
+
+    block->key = key;
+    block->data = g_bytes_ref(data);
+
+    /* another thread might have inserted the same block meanwhile,
+     * the duplicate just ages out */
+    g_mutex_lock(&cache->lock);
+    g_queue_push_head(&cache->blocks, block);
+    while (cache->blocks.length > cache->max_blocks) {
+        cd_image_block_free(g_queue_pop_tail(&cache->blocks));
+    }
+    g_mutex_unlock(&cache->lock);
+}
+
+#endif /* USE_USBREDIR */
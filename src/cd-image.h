@@ -0,0 +1,109 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   CD device emulation - image I/O backend
+
+   Copyright (C) 2019 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Image data is read and cached in chunks of this size */
+#define CD_IMAGE_CHUNK_SIZE             (64 * 1024)
+#define CD_IMAGE_DEFAULT_CACHE_SIZE     (4 * 1024 * 1024)
+/* Writes are made of whole sectors of this size */
+#define CD_IMAGE_SECTOR_SIZE            512
+
+typedef struct CdImage CdImage;
+
+/* open the image (or device) at filename for positional reads,
+ * size is the size of the file in bytes. qcow2 and zstd seekable
+ * images are recognized, cd_image_get_size() returns the size of
+ * the image data
+ */
+CdImage *cd_image_open(const char *filename, uint64_t size, GError **error);
+
+/* open a raw image, the file content is not probed for another format */
+CdImage *cd_image_open_raw(const char *filename, uint64_t size, GError **error);
+
+/* open a raw image for writing too, the file content is not probed */
+CdImage *cd_image_open_writable(const char *filename, uint64_t size, GError **error);
+gboolean cd_image_is_writable(CdImage *image);
+
+CdImage *cd_image_ref(CdImage *image);
+void cd_image_unref(CdImage *image);
+
+uint64_t cd_image_get_size(CdImage *image);
+
+/* set the size in bytes of the chunk cache, 0 disables caching
+ * and read-ahead
+ */
+void cd_image_set_cache_size(CdImage *image, uint32_t cache_size);
+
+/* copy the data to buf if the whole range is cached,
+ * returns: TRUE and the number of bytes copied in bytes_read on hit,
+ * FALSE on miss, in which case cd_image_read_async() should be used
+ */
+gboolean cd_image_read_cached(CdImage *image, uint64_t offset,
+                              uint8_t *buf, uint32_t len,
+                              uint32_t *bytes_read);
+
+/* read the range in a worker thread, sequential access
+ * triggers read-ahead of the following chunks
+ */
+void cd_image_read_async(CdImage *image, uint64_t offset, uint32_t len,
+                         GCancellable *cancellable,
+                         GAsyncReadyCallback callback,
+                         gpointer user_data);
+
+/* copy the data read to buf, fails if image is not the image
+ * the read was started on
+ */
+gboolean cd_image_read_finish(CdImage *image, GAsyncResult *result,
+                              uint8_t *buf, uint32_t *bytes_read,
+                              GError **error);
+
+/* copy the data to the write-back cache, which is written to the file
+ * periodically and by cd_image_flush_async(), to be called before the
+ * image is released. The write completes once the data is cached,
+ * unless too much of it is waiting to be written back. offset and len
+ * must be multiples of CD_IMAGE_SECTOR_SIZE
+ */
+void cd_image_write_async(CdImage *image, uint64_t offset,
+                          const uint8_t *buf, uint32_t len,
+                          GCancellable *cancellable,
+                          GAsyncReadyCallback callback,
+                          gpointer user_data);
+
+gboolean cd_image_write_finish(CdImage *image, GAsyncResult *result,
+                               GError **error);
+
+/* write back the cached data and sync the file in a worker thread,
+ * the image is referenced until it is done. Data which fails to be
+ * written back is discarded, the error is returned to the writes and
+ * flushes waiting for it, or else to the next flush */
+void cd_image_flush_async(CdImage *image,
+                          GCancellable *cancellable,
+                          GAsyncReadyCallback callback,
+                          gpointer user_data);
+
+gboolean cd_image_flush_finish(CdImage *image, GAsyncResult *result,
+                               GError **error);
+
+G_END_DECLS
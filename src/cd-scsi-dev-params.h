@@ -25,11 +25,14 @@
 
 #include <gio/gio.h>
 
+#include "cd-image.h"
+
 typedef struct CdScsiDeviceParameters {
     const char *vendor;
     const char *product;
     const char *version;
     const char *serial;
+    gboolean disk; /* direct access disk, CD/DVD otherwise */
 } CdScsiDeviceParameters;
 
 typedef struct CdScsiDeviceInfo {
@@ -40,7 +43,8 @@ typedef struct CdScsiDeviceInfo {
 } CdScsiDeviceInfo;
 
 typedef struct CdScsiMediaParameters {
-    GFileInputStream *stream;
+    CdImage *image;
     uint64_t size;
     uint32_t block_size;
+    uint32_t cache_size; /* read cache size in bytes, 0 disables it */
 } CdScsiMediaParameters;
@@ -26,6 +26,7 @@
 #include "spice-common.h"
 #include "spice-util.h"
 #include "cd-scsi.h"
+#include "cd-image.h"
 
 #ifdef USE_USBREDIR
 
@@ -73,6 +74,7 @@ typedef struct CdScsiLU {
     gboolean loaded;
     gboolean prevent_media_removal;
     gboolean cd_rom;
+    gboolean disk; /* direct access block device instead of CD/DVD */
 
     CdScsiPowerCondition power_cond;
     uint32_t power_event;
@@ -82,14 +84,14 @@ typedef struct CdScsiLU {
 
     uint64_t size;
     uint32_t block_size;
-    uint32_t num_blocks;
+    uint64_t num_blocks;
 
     char *vendor;
     char *product;
     char *version;
     char *serial;
 
-    GFileInputStream *stream;
+    CdImage *image;
 
     ScsiShortSense short_sense; /* currently held sense of the scsi device */
     uint8_t fixed_sense[FIXED_SENSE_LEN];
@@ -104,8 +106,7 @@ struct CdScsiTarget {
     void *user_data;
 
     CdScsiTargetState state;
-    CdScsiRequest *cur_req;
-    GCancellable *cancellable;
+    GQueue requests; /* submitted and not yet released */
 
     uint32_t max_luns;
     CdScsiLU units[MAX_LUNS];
@@ -157,6 +158,11 @@ SENSE_CODE(sense_code_NOT_READY_NO_MEDIUM_TRAY_OPEN) = {
     .descr = "MEDIUM NOT PRESENT - TRAY OPEN"
 };
 
+SENSE_CODE(sense_code_WRITE_ERROR) = {
+    .key = MEDIUM_ERROR, .asc = 0x0c, .ascq = 0x00,
+    .descr = "WRITE ERROR"
+};
+
 SENSE_CODE(sense_code_TARGET_FAILURE) = {
     .key = HARDWARE_ERROR, .asc = 0x44, .ascq = 0x00,
     .descr = "INTERNAL TARGET FAILURE"
@@ -207,6 +213,11 @@ SENSE_CODE(sense_code_MEDIUM_REMOVAL_PREVENTED) = {
     .descr = "MEDIUM REMOVAL PREVENTED"
 };
 
+SENSE_CODE(sense_code_WRITE_PROTECTED) = {
+    .key = DATA_PROTECT, .asc = 0x27, .ascq = 0x00,
+    .descr = "WRITE PROTECTED"
+};
+
 SENSE_CODE(sense_code_PARAMETERS_CHANGED) = {
     .key = UNIT_ATTENTION, .asc = 0x2a, .ascq = 0x00,
     .descr = "PARAMETERS CHANGED"
@@ -294,6 +305,8 @@ static const char *cd_scsi_sense_key_descr(uint8_t sense_key)
         return "ILLEGAL REQUEST";
     case UNIT_ATTENTION:
         return "UNIT ATTENTION";
+    case DATA_PROTECT:
+        return "DATA PROTECT";
     case BLANK_CHECK:
         return "BLANK CHECK";
     case ABORTED_COMMAND:
@@ -351,7 +364,9 @@ static void cd_scsi_cmd_complete_check_cond(CdScsiLU *dev, CdScsiRequest *req,
     req->status = CHECK_CONDITION;
     req->in_len = 0;
 
-    cd_scsi_dev_sense_set(dev, short_sense);
+    if (!req->speculative) {
+        cd_scsi_dev_sense_set(dev, short_sense);
+    }
 
     SPICE_DEBUG("CHECK_COND, request lun:%u"
                 " op: 0x%02x, pending sense: 0x%02x %02x %02x - %s, %s",
@@ -388,10 +403,18 @@ SPICE_CONSTRUCTOR_FUNC(cd_scsi_cmd_names_init)
     scsi_cmd_name[READ_12] = "READ(12)";
     scsi_cmd_name[READ_16] = "READ(16)";
     scsi_cmd_name[READ_CAPACITY_10] = "READ CAPACITY(10)";
+    scsi_cmd_name[SERVICE_ACTION_IN_16] = "SERVICE ACTION IN(16)";
+    scsi_cmd_name[WRITE_6] = "WRITE(6)";
+    scsi_cmd_name[WRITE_10] = "WRITE(10)";
+    scsi_cmd_name[WRITE_12] = "WRITE(12)";
+    scsi_cmd_name[WRITE_16] = "WRITE(16)";
+    scsi_cmd_name[SYNCHRONIZE_CACHE] = "SYNCHRONIZE CACHE(10)";
+    scsi_cmd_name[SYNCHRONIZE_CACHE_16] = "SYNCHRONIZE CACHE(16)";
     scsi_cmd_name[READ_TOC] = "READ TOC";
     scsi_cmd_name[GET_EVENT_STATUS_NOTIFICATION] = "GET EVENT/STATUS NOTIFICATION";
     scsi_cmd_name[READ_DISC_INFORMATION] = "READ DISC INFO";
     scsi_cmd_name[READ_TRACK_INFORMATION] = "READ TRACK INFO";
+    scsi_cmd_name[MODE_SENSE] = "MODE SENSE(6)";
     scsi_cmd_name[MODE_SENSE_10] = "MODE SENSE(10)";
     scsi_cmd_name[MODE_SELECT] = "MODE SELECT(6)";
     scsi_cmd_name[MODE_SELECT_10] = "MODE SELECT(10)";
@@ -418,8 +441,7 @@ CdScsiTarget *cd_scsi_target_alloc(void *target_user_data, uint32_t max_luns)
 
     st->user_data = target_user_data;
     st->state = CD_SCSI_TGT_STATE_RUNNING;
-    st->cur_req = NULL;
-    st->cancellable = g_cancellable_new();
+    g_queue_init(&st->requests);
     st->max_luns = max_luns;
 
     return st;
@@ -435,9 +457,9 @@ void cd_scsi_target_free(CdScsiTarget *st)
         if (unit->realized) {
             cd_scsi_dev_unrealize(st, lun);
         }
-        g_clear_object(&unit->stream);
+        g_clear_pointer(&unit->image, cd_image_unref);
     }
-    g_clear_object(&st->cancellable);
+    g_queue_clear(&st->requests);
     g_free(st);
 }
 
@@ -477,6 +499,7 @@ int cd_scsi_dev_realize(CdScsiTarget *st, uint32_t lun,
     dev->loaded = FALSE;
     dev->prevent_media_removal = FALSE;
     dev->cd_rom = FALSE;
+    dev->disk = dev_params->disk;
 
     dev->power_cond = CD_SCSI_POWER_ACTIVE;
     dev->power_event = CD_POWER_EVENT_NO_CHANGE;
@@ -491,16 +514,17 @@ int cd_scsi_dev_realize(CdScsiTarget *st, uint32_t lun,
 
     cd_scsi_dev_sense_set_power_on(dev);
 
-    SPICE_DEBUG("Realize lun:%u bs:%u VR:[%s] PT:[%s] ver:[%s] SN[%s]",
+    SPICE_DEBUG("Realize lun:%u bs:%u VR:[%s] PT:[%s] ver:[%s] SN[%s]%s",
                 lun, dev->block_size, dev->vendor,
-                dev->product, dev->version, dev->serial);
+                dev->product, dev->version, dev->serial,
+                dev->disk ? " disk" : "");
     return 0;
 }
 
 static void cd_scsi_lu_media_reset(CdScsiLU *dev)
 {
     /* media_event is not set here, as it depends on the context */
-    g_clear_object(&dev->stream);
+    g_clear_pointer(&dev->image, cd_image_unref);
     dev->size = 0;
     dev->block_size = 0;
     dev->num_blocks = 0;
@@ -529,7 +553,8 @@ static void cd_scsi_lu_load(CdScsiLU *dev,
 {
     if (media_params != NULL) {
         dev->media_event = CD_MEDIA_EVENT_NEW_MEDIA;
-        dev->stream = g_object_ref(media_params->stream);
+        dev->image = cd_image_ref(media_params->image);
+        cd_image_set_cache_size(dev->image, media_params->cache_size);
         dev->size = media_params->size;
         dev->block_size = media_params->block_size;
         dev->num_blocks = media_params->size / media_params->block_size;
@@ -570,7 +595,7 @@ int cd_scsi_dev_load(CdScsiTarget *st, uint32_t lun,
     cd_scsi_dev_sense_set(dev, &sense_code_MEDIUM_CHANGED);
 
     SPICE_DEBUG("Load lun:%u size:%" G_GUINT64_FORMAT
-                " blk_sz:%u num_blocks:%u",
+                " blk_sz:%u num_blocks:%" G_GUINT64_FORMAT,
                 lun, dev->size, dev->block_size, dev->num_blocks);
     return 0;
 }
@@ -597,6 +622,7 @@ int cd_scsi_dev_get_info(CdScsiTarget *st, uint32_t lun, CdScsiDeviceInfo *lun_i
     lun_info->parameters.product = dev->product;
     lun_info->parameters.version = dev->version;
     lun_info->parameters.serial = dev->serial;
+    lun_info->parameters.disk = dev->disk;
 
     return 0;
 }
@@ -652,7 +678,7 @@ int cd_scsi_dev_unrealize(CdScsiTarget *st, uint32_t lun)
     g_clear_pointer(&dev->version, g_free);
     g_clear_pointer(&dev->serial, g_free);
 
-    g_clear_object(&dev->stream);
+    g_clear_pointer(&dev->image, cd_image_unref);
 
     dev->loaded = FALSE;
     dev->realized = FALSE;
@@ -713,9 +739,16 @@ int cd_scsi_target_reset(CdScsiTarget *st)
 
     st->state = CD_SCSI_TGT_STATE_RESET;
 
-    if (st->cur_req != NULL) {
-        cd_scsi_dev_request_cancel(st, st->cur_req);
-        if (st->cur_req != NULL) {
+    if (!g_queue_is_empty(&st->requests)) {
+        /* canceled requests might be released from the callbacks */
+        GList *reqs = g_list_copy(st->requests.head), *l;
+
+        for (l = reqs; l != NULL; l = l->next) {
+            cd_scsi_dev_request_cancel(st, l->data);
+        }
+        g_list_free(reqs);
+
+        if (!g_queue_is_empty(&st->requests)) {
             SPICE_DEBUG("Target reset in progress...");
             return 0;
         }
@@ -936,7 +969,7 @@ static void cd_scsi_cmd_inquiry_vpd(CdScsiLU *dev, CdScsiRequest *req)
     int buflen = 4;
     int start = 4;
 
-    outbuf[0] = TYPE_ROM;
+    outbuf[0] = dev->disk ? TYPE_DISK : TYPE_ROM;
     outbuf[1] = page_code ; /* this page */
     outbuf[2] = 0x00; /* page length MSB */
     outbuf[3] = 0x00; /* page length LSB, to write later */
@@ -1061,7 +1094,7 @@ static void cd_scsi_cmd_inquiry_standard(CdScsiLU *dev, CdScsiRequest *req)
     uint32_t resp_len =
         (dev->claim_version == 0) ? INQUIRY_STANDARD_LEN_NO_VER : INQUIRY_STANDARD_LEN;
 
-    outbuf[0] = (PERIF_QUALIFIER_CONNECTED << 5) | TYPE_ROM;
+    outbuf[0] = (PERIF_QUALIFIER_CONNECTED << 5) | (dev->disk ? TYPE_DISK : TYPE_ROM);
     outbuf[1] = (dev->removable) ? INQUIRY_REMOVABLE_MEDIUM : 0;
     outbuf[2] = (dev->claim_version == 0) ? INQUIRY_VERSION_NONE : INQUIRY_VERSION_SPC3;
     outbuf[3] = INQUIRY_RESP_NORM_ACA | INQUIRY_RESP_HISUP | INQUIRY_RESP_DATA_FORMAT_SPC3;
@@ -1082,11 +1115,16 @@ static void cd_scsi_cmd_inquiry_standard(CdScsiLU *dev, CdScsiRequest *req)
         outbuf[60] = (INQUIRY_VERSION_DESC_SPC3 >> 8) & 0xff;
         outbuf[61] = INQUIRY_VERSION_DESC_SPC3 & 0xff;
 
-        outbuf[62] = (INQUIRY_VERSION_DESC_MMC3 >> 8) & 0xff;
-        outbuf[63] = INQUIRY_VERSION_DESC_MMC3 & 0xff;
+        if (dev->disk) {
+            outbuf[62] = (INQUIRY_VERSION_DESC_SBC2 >> 8) & 0xff;
+            outbuf[63] = INQUIRY_VERSION_DESC_SBC2 & 0xff;
+        } else {
+            outbuf[62] = (INQUIRY_VERSION_DESC_MMC3 >> 8) & 0xff;
+            outbuf[63] = INQUIRY_VERSION_DESC_MMC3 & 0xff;
 
-        outbuf[64] = (INQUIRY_VERSION_DESC_SBC2 >> 8) & 0xff;
-        outbuf[65] = INQUIRY_VERSION_DESC_SBC2 & 0xff;
+            outbuf[64] = (INQUIRY_VERSION_DESC_SBC2 >> 8) & 0xff;
+            outbuf[65] = INQUIRY_VERSION_DESC_SBC2 & 0xff;
+        }
     }
 
     req->in_len = MIN(req->req_len, resp_len);
@@ -1136,7 +1174,8 @@ static void cd_scsi_cmd_inquiry(CdScsiLU *dev, CdScsiRequest *req)
 
 static void cd_scsi_cmd_read_capacity(CdScsiLU *dev, CdScsiRequest *req)
 {
-    uint32_t last_blk = dev->num_blocks - 1;
+    /* 0xFFFFFFFF tells the host to use READ CAPACITY(16) */
+    uint32_t last_blk = MIN(dev->num_blocks - 1, G_MAXUINT32);
     uint32_t blk_size = dev->block_size;
     uint32_t *last_blk_out = (uint32_t *)req->buf;
     uint32_t *blk_size_out = (uint32_t *)(req->buf + 4);
@@ -1154,6 +1193,43 @@ static void cd_scsi_cmd_read_capacity(CdScsiLU *dev, CdScsiRequest *req)
     cd_scsi_cmd_complete_good(dev, req);
 }
 
+#define CD_READ_CAPACITY_16_LEN     32
+
+static void cd_scsi_cmd_service_action_in_16(CdScsiLU *dev, CdScsiRequest *req)
+{
+    uint8_t *outbuf = req->buf;
+    uint32_t service_action = req->cdb[1] & 0x1f;
+    uint64_t last_blk = dev->num_blocks - 1;
+    uint64_t last_blk_out = GUINT64_TO_BE(last_blk);
+    uint32_t blk_size_out = GUINT32_TO_BE(dev->block_size);
+
+    req->xfer_dir = SCSI_XFER_FROM_DEV;
+
+    if (service_action != SAI_READ_CAPACITY_16) {
+        SPICE_DEBUG("service_action_in_16, lun:%u unsupported service action 0x%02x",
+                    req->lun, service_action);
+        cd_scsi_cmd_complete_check_cond(dev, req, &sense_code_INVALID_CDB_FIELD);
+        return;
+    }
+    if (!dev->loaded) {
+        cd_scsi_cmd_complete_check_cond(dev, req, &sense_code_NOT_READY_NO_MEDIUM);
+        return;
+    }
+
+    req->req_len = (req->cdb[10] << 24) | (req->cdb[11] << 16) |
+                   (req->cdb[12] << 8) | req->cdb[13];
+
+    memset(outbuf, 0, CD_READ_CAPACITY_16_LEN);
+    memcpy(outbuf, &last_blk_out, sizeof(last_blk_out));
+    memcpy(outbuf + 8, &blk_size_out, sizeof(blk_size_out));
+
+    SPICE_DEBUG("Read capacity(16), lun:%u last_blk: %" G_GUINT64_FORMAT " blk_sz: %u",
+                req->lun, last_blk, dev->block_size);
+
+    req->in_len = MIN(req->req_len, CD_READ_CAPACITY_16_LEN);
+    cd_scsi_cmd_complete_good(dev, req);
+}
+
 #define RDI_TYPE_STANDARD           0 /* Standard Disc Information */
 #define RDI_TYPE_TRACK_RESOURCES    1 /* Track Resources Information */
 #define RDI_TYPE_POW_RESOURCES      2 /* POW Resources Information */
@@ -1378,6 +1454,20 @@ static uint32_t cd_scsi_add_mode_page_rw_error_recovery(CdScsiLU *dev, uint8_t *
     return page_len;
 }
 
+#define CD_MODE_PAGE_LEN_CACHING                20
+#define CD_MODE_PAGE_CACHING_WCE                0x04
+
+static uint32_t cd_scsi_add_mode_page_caching(CdScsiLU *dev, uint8_t *outbuf)
+{
+    uint32_t page_len = CD_MODE_PAGE_LEN_CACHING;
+
+    outbuf[0] = MODE_PAGE_CACHING;
+    outbuf[1] = CD_MODE_PAGE_LEN_CACHING - 2;
+    outbuf[2] = CD_MODE_PAGE_CACHING_WCE; /* written data is cached by the image */
+
+    return page_len;
+}
+
 #define CD_MODE_PAGE_LEN_POWER                  12
 
 static uint32_t cd_scsi_add_mode_page_power_condition(CdScsiLU *dev, uint8_t *outbuf)
@@ -1436,11 +1526,111 @@ static uint32_t cd_scsi_add_mode_page_caps_mech_status(CdScsiLU *dev, uint8_t *o
     return page_len;
 }
 
+/* returns: the length of the page, 0 if it is not supported */
+static uint32_t cd_scsi_add_mode_page(CdScsiLU *dev, uint8_t *outbuf, int page)
+{
+    switch (page) {
+    case MODE_PAGE_R_W_ERROR:
+        /* Read/Write Error Recovery */
+        return cd_scsi_add_mode_page_rw_error_recovery(dev, outbuf);
+    case MODE_PAGE_CACHING:
+        return dev->disk ? cd_scsi_add_mode_page_caching(dev, outbuf) : 0;
+    case MODE_PAGE_POWER:
+        /* Power Condistions */
+        return cd_scsi_add_mode_page_power_condition(dev, outbuf);
+    case MODE_PAGE_FAULT_FAIL:
+        /* Fault / Failure Reporting Control */
+        return cd_scsi_add_mode_page_fault_reporting(dev, outbuf);
+    case MODE_PAGE_CAPS_MECH_STATUS:
+        return dev->disk ? 0 : cd_scsi_add_mode_page_caps_mech_status(dev, outbuf);
+
+    /* not implemented */
+    case MODE_PAGE_WRITE_PARAMETER: /* Writer Parameters */
+    case MODE_PAGE_MRW:
+    case MODE_PAGE_MRW_VENDOR: /* MRW (Mount Rainier Re-writable Disks */
+    case MODE_PAGE_CD_DEVICE: /* CD Device parameters */
+    case MODE_PAGE_TO_PROTECT: /* Time-out and Protect */
+    default:
+        return 0;
+    }
+}
+
+static uint32_t cd_scsi_add_mode_pages(CdScsiLU *dev, uint8_t *outbuf, int page)
+{
+    static const int all_pages[] = {
+        MODE_PAGE_R_W_ERROR, MODE_PAGE_CACHING, MODE_PAGE_POWER,
+        MODE_PAGE_FAULT_FAIL, MODE_PAGE_CAPS_MECH_STATUS,
+    };
+    uint32_t len = 0, i;
+
+    if (page != MODE_PAGE_ALLS) {
+        return cd_scsi_add_mode_page(dev, outbuf, page);
+    }
+    for (i = 0; i < G_N_ELEMENTS(all_pages); i++) {
+        len += cd_scsi_add_mode_page(dev, outbuf + len, all_pages[i]);
+    }
+    return len;
+}
+
+#define CD_MODE_DEV_PARAM_WP                    0x80
+
+/* device-specific parameter of the mode parameter header */
+static uint8_t cd_scsi_mode_dev_param(CdScsiLU *dev)
+{
+    if (dev->disk && dev->image != NULL && !cd_image_is_writable(dev->image)) {
+        return CD_MODE_DEV_PARAM_WP;
+    }
+    return 0;
+}
+
+static void cd_scsi_cmd_mode_sense_6(CdScsiLU *dev, CdScsiRequest *req)
+{
+    uint8_t *outbuf = req->buf;
+    int dbd, page, sub_page, pc;
+    uint32_t resp_len = CD_MODE_PARAM_6_LEN_HEADER;
+    uint32_t page_len;
+
+    req->xfer_dir = SCSI_XFER_FROM_DEV;
+
+    dbd = (req->cdb[1] >> 3) & 0x1;
+    page = req->cdb[2] & 0x3f;
+    pc = req->cdb[2] >> 6;
+    sub_page = req->cdb[3];
+
+    req->req_len = req->cdb[4];
+
+    memset(outbuf, 0, req->req_len);
+    outbuf[1] = 0; /* medium type */
+    outbuf[2] = cd_scsi_mode_dev_param(dev);
+
+    page_len = cd_scsi_add_mode_pages(dev, outbuf + resp_len, page);
+    if (page_len == 0) {
+        SPICE_DEBUG("mode_sense_6, lun:%u"
+                    " page 0x%x not implemented",
+                    req->lun, (unsigned)page);
+        cd_scsi_cmd_complete_check_cond(dev, req, &sense_code_INVALID_CDB_FIELD);
+        return;
+    }
+    resp_len += page_len;
+
+    outbuf[0] = resp_len - 1;
+
+    req->in_len = MIN(req->req_len, resp_len);
+
+    SPICE_DEBUG("mode_sense_6, lun:%u"
+                " dbd %d, page %d, sub_page %d, pc %d; "
+                "resp_len %u",
+                req->lun, dbd, page, sub_page, pc, resp_len);
+
+    cd_scsi_cmd_complete_good(dev, req);
+}
+
 static void cd_scsi_cmd_mode_sense_10(CdScsiLU *dev, CdScsiRequest *req)
 {
     uint8_t *outbuf = req->buf;
     int long_lba, dbd, page, sub_page, pc;
     uint32_t resp_len = CD_MODE_PARAM_10_LEN_HEADER;
+    uint32_t page_len;
 
     req->xfer_dir = SCSI_XFER_FROM_DEV;
 
@@ -1454,37 +1644,17 @@ static void cd_scsi_cmd_mode_sense_10(CdScsiLU *dev, CdScsiRequest *req)
 
     memset(outbuf, 0, req->req_len);
     outbuf[2] =  0; /* medium type */
+    outbuf[3] = cd_scsi_mode_dev_param(dev);
 
-    switch (page) {
-    case MODE_PAGE_R_W_ERROR:
-        /* Read/Write Error Recovery */
-        resp_len += cd_scsi_add_mode_page_rw_error_recovery(dev, outbuf + resp_len);
-        break;
-    case MODE_PAGE_POWER:
-        /* Power Condistions */
-        resp_len += cd_scsi_add_mode_page_power_condition(dev, outbuf + resp_len);
-        break;
-    case MODE_PAGE_FAULT_FAIL:
-        /* Fault / Failure Reporting Control */
-        resp_len += cd_scsi_add_mode_page_fault_reporting(dev, outbuf + resp_len);
-        break;
-    case MODE_PAGE_CAPS_MECH_STATUS:
-        resp_len += cd_scsi_add_mode_page_caps_mech_status(dev, outbuf + resp_len);
-        break;
-
-    /* not implemented */
-    case MODE_PAGE_WRITE_PARAMETER: /* Writer Parameters */
-    case MODE_PAGE_MRW:
-    case MODE_PAGE_MRW_VENDOR: /* MRW (Mount Rainier Re-writable Disks */
-    case MODE_PAGE_CD_DEVICE: /* CD Device parameters */
-    case MODE_PAGE_TO_PROTECT: /* Time-out and Protect */
-    default:
+    page_len = cd_scsi_add_mode_pages(dev, outbuf + resp_len, page);
+    if (page_len == 0) {
         SPICE_DEBUG("mode_sense_10, lun:%u"
                     " page 0x%x not implemented",
                     req->lun, (unsigned)page);
         cd_scsi_cmd_complete_check_cond(dev, req, &sense_code_INVALID_CDB_FIELD);
         return;
     }
+    resp_len += page_len;
 
     outbuf[0] = ((resp_len - 2) >> 8) & 0xff;
     outbuf[1] = (resp_len - 2) & 0xff;
@@ -1944,7 +2114,7 @@ static uint32_t cd_scsi_cmd_get_event_resp_add_media(CdScsiLU *dev, uint8_t *out
 {
     outbuf[0] = (uint8_t)dev->media_event & 0x0f;
     outbuf[1] = (uint8_t)((dev->loaded ? 0 : CD_MEDIA_STATUS_TRAY_OPEN) |
-                          (dev->stream != NULL ? CD_MEDIA_STATUS_MEDIA_PRESENT : 0));
+                          (dev->image != NULL ? CD_MEDIA_STATUS_MEDIA_PRESENT : 0));
 
     dev->media_event = CD_MEDIA_EVENT_NO_CHANGE; /* reset the event */
     return CD_GET_EVENT_LEN_MEDIA;
@@ -2089,6 +2259,7 @@ static void cd_scsi_cmd_send_event(CdScsiLU *dev, CdScsiRequest *req)
 
     /* ToDo: process the event */
 
+    req->in_len = param_list_len;
     cd_scsi_cmd_complete_good(dev, req);
 }
 
@@ -2435,21 +2606,27 @@ static void cd_scsi_read_async_complete(GObject *src_object,
                                         GAsyncResult *result,
                                         gpointer user_data)
 {
-    GFileInputStream *stream = G_FILE_INPUT_STREAM(src_object);
     CdScsiRequest *req = (CdScsiRequest *)user_data;
-    CdScsiTarget *st = (CdScsiTarget *)req->priv_data;
-    CdScsiLU *dev = &st->units[req->lun];
+    CdScsiTarget *st;
+    CdScsiLU *dev;
     GError *error = NULL;
-    gsize bytes_read;
-    gboolean finished;
+    uint32_t bytes_read;
+
+    if (g_cancellable_is_cancelled(g_task_get_cancellable(G_TASK(result)))) {
+        /* already completed by cd_scsi_async_canceled(),
+         * the target might be gone by now */
+        return;
+    }
 
+    st = (CdScsiTarget *)req->priv_data;
+    dev = &st->units[req->lun];
+
+    g_clear_object(&req->cancellable);
     req->req_state = SCSI_REQ_COMPLETE;
-    req->cancel_id = 0;
 
-//    g_assert(stream == dev->stream);
-    if (stream != dev->stream) {
+    if (dev->image == NULL) {
         uint32_t opcode = (uint32_t)req->cdb[0];
-        SPICE_DEBUG("read_async_complete BAD STREAM, lun: %u"
+        SPICE_DEBUG("read_async_complete NO MEDIA, lun: %u"
                     " req: %" G_GUINT64_FORMAT " op: 0x%02x",
                     req->lun, req->req_len, opcode);
         cd_scsi_cmd_complete_check_cond(dev, req, &sense_code_TARGET_FAILURE);
@@ -2457,37 +2634,29 @@ static void cd_scsi_read_async_complete(GObject *src_object,
         return;
     }
 
-    bytes_read = g_input_stream_read_finish(G_INPUT_STREAM(stream), result, &error);
-    finished = bytes_read > 0;
-    if (finished) {
+    if (cd_image_read_finish(dev->image, result, req->buf, &bytes_read, &error)) {
         SPICE_DEBUG("read_async_complete, lun: %u"
-                    " finished: %d bytes_read: %" G_GUINT64_FORMAT
-                    " req: %"  G_GUINT64_FORMAT,
-                    req->lun, finished, (uint64_t)bytes_read, req->req_len);
+                    " bytes_read: %u req: %" G_GUINT64_FORMAT,
+                    req->lun, bytes_read, req->req_len);
 
         req->in_len = MIN(bytes_read, req->req_len);
         req->status = GOOD;
     } else {
-        if (error != NULL) {
-            SPICE_ERROR("g_input_stream_read_finish failed: %s", error->message);
-            g_clear_error (&error);
-        } else {
-            SPICE_ERROR("g_input_stream_read_finish failed (no err provided)");
-        }
+        SPICE_ERROR("cd_image_read_finish failed: %s", error->message);
+        g_clear_error(&error);
         req->in_len = 0;
         req->status = GOOD;
     }
     cd_scsi_dev_request_complete(st->user_data, req);
 }
 
-static void cd_scsi_read_async_canceled(GCancellable *cancellable, gpointer user_data)
+/* completes reads and writes, the image completes the task later on */
+static void cd_scsi_async_canceled(GCancellable *cancellable, gpointer user_data)
 {
     CdScsiRequest *req = (CdScsiRequest *)user_data;
     CdScsiTarget *st = (CdScsiTarget *)req->priv_data;
 
-    g_assert(cancellable == st->cancellable);
-    g_cancellable_disconnect(cancellable, req->cancel_id);
-    req->cancel_id = 0;
+    g_assert(cancellable == req->cancellable);
 
     req->req_state =
         (st->state == CD_SCSI_TGT_STATE_RUNNING) ? SCSI_REQ_CANCELED : SCSI_REQ_DISPOSED;
@@ -2499,48 +2668,54 @@ static void cd_scsi_read_async_canceled(GCancellable *cancellable, gpointer user
 
 static int cd_scsi_read_async_start(CdScsiLU *dev, CdScsiRequest *req)
 {
-    CdScsiTarget *st = dev->tgt;
-    GFileInputStream *stream = dev->stream;
+    uint32_t len = MIN(req->req_len, req->buf_len);
+    uint32_t bytes_read;
 
     SPICE_DEBUG("read_async_start, lun:%u"
                 " lba: %" G_GUINT64_FORMAT " offset: %" G_GUINT64_FORMAT
                 " cnt: %" G_GUINT64_FORMAT " len: %" G_GUINT64_FORMAT,
                 req->lun, req->lba, req->offset, req->count, req->req_len);
 
-    req->cancel_id = g_cancellable_connect(st->cancellable,
-                                           G_CALLBACK(cd_scsi_read_async_canceled),
-                                           req, /* data */
-                                           NULL); /* data destroy cb */
-    if (req->cancel_id == 0) {
-        /* already canceled */
-        return -1;
+    /* served from the read-ahead cache, complete right away */
+    if (cd_image_read_cached(dev->image, req->offset, req->buf, len, &bytes_read)) {
+        req->in_len = MIN(bytes_read, req->req_len);
+        cd_scsi_cmd_complete_good(dev, req);
+        return 0;
     }
 
-    g_seekable_seek(G_SEEKABLE(stream),
-                    req->offset,
-                    G_SEEK_SET,
-                    NULL, /* cancellable */
-                    NULL); /* error */
+    /* a cancellable per request, several reads can be outstanding */
+    req->cancellable = g_cancellable_new();
+    g_cancellable_connect(req->cancellable,
+                          G_CALLBACK(cd_scsi_async_canceled),
+                          req, /* data */
+                          NULL); /* data destroy cb */
 
-    g_input_stream_read_async(G_INPUT_STREAM(stream),
-                              req->buf, /* buffer to fill */
-                              req->req_len,
-                              G_PRIORITY_DEFAULT,
-                              st->cancellable,
-                              cd_scsi_read_async_complete,
-                              (gpointer)req); /* callback argument */
+    cd_image_read_async(dev->image,
+                        req->offset,
+                        len,
+                        req->cancellable,
+                        cd_scsi_read_async_complete,
+                        (gpointer)req); /* callback argument */
     return 0;
 }
 
-static void cd_scsi_cmd_read(CdScsiLU *dev, CdScsiRequest *req)
+static gboolean cd_scsi_cmd_check_ready(CdScsiLU *dev, CdScsiRequest *req)
 {
     if (dev->power_cond == CD_SCSI_POWER_STOPPED) {
-        SPICE_DEBUG("read, lun: %u is stopped", req->lun);
+        SPICE_DEBUG("%s, lun: %u is stopped", scsi_cmd_name[req->cdb[0]], req->lun);
         cd_scsi_cmd_complete_check_cond(dev, req, &sense_code_INIT_CMD_REQUIRED);
-        return;
-    } else if (!dev->loaded || dev->stream == NULL) {
-        SPICE_DEBUG("read, lun: %u is not loaded", req->lun);
+        return FALSE;
+    } else if (!dev->loaded || dev->image == NULL) {
+        SPICE_DEBUG("%s, lun: %u is not loaded", scsi_cmd_name[req->cdb[0]], req->lun);
         cd_scsi_cmd_complete_check_cond(dev, req, &sense_code_NOT_READY_NO_MEDIUM);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void cd_scsi_cmd_read(CdScsiLU *dev, CdScsiRequest *req)
+{
+    if (!cd_scsi_cmd_check_ready(dev, req)) {
         return;
     }
 
@@ -2551,10 +2726,175 @@ static void cd_scsi_cmd_read(CdScsiLU *dev, CdScsiRequest *req)
 
     req->count = scsi_cdb_xfer_length(req->cdb, req->cdb_len); /* xfer in blocks */
     req->req_len = (uint64_t) req->count * dev->block_size;
+    if (req->req_len > INT32_MAX) {
+        /* rejected in cd_scsi_dev_request_submit() */
+        return;
+    }
 
     cd_scsi_read_async_start(dev, req);
 }
 
+/* returns: the unit of the request, NULL if it is already completed */
+static CdScsiLU *cd_scsi_write_async_get_dev(CdScsiRequest *req, GAsyncResult *result)
+{
+    CdScsiTarget *st;
+
+    if (g_cancellable_is_cancelled(g_task_get_cancellable(G_TASK(result)))) {
+        /* already completed by cd_scsi_async_canceled(),
+         * the target might be gone by now */
+        return NULL;
+    }
+    st = (CdScsiTarget *)req->priv_data;
+    return &st->units[req->lun];
+}
+
+static void cd_scsi_write_async_return(CdScsiLU *dev, CdScsiRequest *req,
+                                       gboolean ok, GError *error)
+{
+    g_clear_object(&req->cancellable);
+
+    if (ok) {
+        cd_scsi_cmd_complete_good(dev, req);
+    } else {
+        SPICE_ERROR("%s failed: %s", scsi_cmd_name[req->cdb[0]], error->message);
+        cd_scsi_cmd_complete_check_cond(dev, req, &sense_code_WRITE_ERROR);
+    }
+    g_clear_error(&error);
+    cd_scsi_dev_request_complete(dev->tgt->user_data, req);
+}
+
+static void cd_scsi_flush_async_complete(GObject *src_object,
+                                         GAsyncResult *result,
+                                         gpointer user_data)
+{
+    CdScsiRequest *req = (CdScsiRequest *)user_data;
+    CdScsiLU *dev = cd_scsi_write_async_get_dev(req, result);
+    GError *error = NULL;
+    gboolean ok;
+
+    if (dev == NULL) {
+        return;
+    }
+    if (dev->image == NULL) {
+        g_clear_object(&req->cancellable);
+        cd_scsi_cmd_complete_check_cond(dev, req, &sense_code_TARGET_FAILURE);
+        cd_scsi_dev_request_complete(dev->tgt->user_data, req);
+        return;
+    }
+
+    ok = cd_image_flush_finish(dev->image, result, &error);
+    cd_scsi_write_async_return(dev, req, ok, error);
+}
+
+#define CD_WRITE_FLAG_FUA           0x08
+
+static void cd_scsi_write_async_complete(GObject *src_object,
+                                         GAsyncResult *result,
+                                         gpointer user_data)
+{
+    CdScsiRequest *req = (CdScsiRequest *)user_data;
+    CdScsiLU *dev = cd_scsi_write_async_get_dev(req, result);
+    GError *error = NULL;
+    gboolean ok;
+
+    if (dev == NULL) {
+        return;
+    }
+    if (dev->image == NULL) {
+        g_clear_object(&req->cancellable);
+        cd_scsi_cmd_complete_check_cond(dev, req, &sense_code_TARGET_FAILURE);
+        cd_scsi_dev_request_complete(dev->tgt->user_data, req);
+        return;
+    }
+
+    ok = cd_image_write_finish(dev->image, result, &error);
+    if (ok && req->cdb[0] != WRITE_6 && (req->cdb[1] & CD_WRITE_FLAG_FUA)) {
+        /* forced unit access, the data must be on the medium */
+        cd_image_flush_async(dev->image, req->cancellable,
+                             cd_scsi_flush_async_complete, req);
+        return;
+    }
+    cd_scsi_write_async_return(dev, req, ok, error);
+}
+
+static void cd_scsi_cmd_write(CdScsiLU *dev, CdScsiRequest *req)
+{
+    req->xfer_dir = SCSI_XFER_TO_DEV;
+
+    if (!dev->disk) {
+        cd_scsi_cmd_complete_check_cond(dev, req, &sense_code_INVALID_OPCODE);
+        return;
+    }
+    if (!cd_scsi_cmd_check_ready(dev, req)) {
+        return;
+    }
+
+    req->cdb_len = scsi_cdb_length(req->cdb);
+
+    req->lba = scsi_cdb_lba(req->cdb, req->cdb_len);
+    req->count = scsi_cdb_xfer_length(req->cdb, req->cdb_len); /* xfer in blocks */
+    if (req->lba > dev->num_blocks || req->count > dev->num_blocks - req->lba) {
+        SPICE_DEBUG("write, lun: %u lba: %" G_GUINT64_FORMAT " cnt: %" G_GUINT64_FORMAT
+                    " out of range", req->lun, req->lba, req->count);
+        cd_scsi_cmd_complete_check_cond(dev, req, &sense_code_LBA_OUT_OF_RANGE);
+        return;
+    }
+    if (!cd_image_is_writable(dev->image)) {
+        cd_scsi_cmd_complete_check_cond(dev, req, &sense_code_WRITE_PROTECTED);
+        return;
+    }
+
+    req->offset = req->lba * dev->block_size;
+    req->req_len = req->count * dev->block_size;
+    if (req->req_len > req->buf_len) {
+        SPICE_DEBUG("write, lun: %u len: %" G_GUINT64_FORMAT " exceeds data_len: %u",
+                    req->lun, req->req_len, req->buf_len);
+        cd_scsi_cmd_complete_check_cond(dev, req, &sense_code_INVALID_PARAM_LEN);
+        return;
+    }
+    if (req->count == 0) {
+        cd_scsi_cmd_complete_good(dev, req);
+        return;
+    }
+
+    SPICE_DEBUG("write, lun:%u"
+                " lba: %" G_GUINT64_FORMAT " offset: %" G_GUINT64_FORMAT
+                " cnt: %" G_GUINT64_FORMAT " len: %" G_GUINT64_FORMAT,
+                req->lun, req->lba, req->offset, req->count, req->req_len);
+
+    req->in_len = req->req_len;
+    req->cancellable = g_cancellable_new();
+    g_cancellable_connect(req->cancellable,
+                          G_CALLBACK(cd_scsi_async_canceled),
+                          req, /* data */
+                          NULL); /* data destroy cb */
+
+    cd_image_write_async(dev->image, req->offset, req->buf, req->req_len,
+                         req->cancellable, cd_scsi_write_async_complete, req);
+}
+
+static void cd_scsi_cmd_synchronize_cache(CdScsiLU *dev, CdScsiRequest *req)
+{
+    req->xfer_dir = SCSI_XFER_NONE;
+
+    if (!cd_scsi_cmd_check_ready(dev, req)) {
+        return;
+    }
+    if (!cd_image_is_writable(dev->image)) {
+        cd_scsi_cmd_complete_good(dev, req);
+        return;
+    }
+
+    req->cancellable = g_cancellable_new();
+    g_cancellable_connect(req->cancellable,
+                          G_CALLBACK(cd_scsi_async_canceled),
+                          req, /* data */
+                          NULL); /* data destroy cb */
+
+    cd_image_flush_async(dev->image, req->cancellable,
+                         cd_scsi_flush_async_complete, req);
+}
+
 void cd_scsi_dev_request_submit(CdScsiTarget *st, CdScsiRequest *req)
 {
     uint32_t lun = req->lun;
@@ -2564,18 +2904,13 @@ void cd_scsi_dev_request_submit(CdScsiTarget *st, CdScsiRequest *req)
 
     SPICE_DEBUG("request_submit, lun: %u op: 0x%02x %s", lun, opcode, cmd_name);
 
-    if (st->cur_req != NULL) {
-        SPICE_ERROR("request_submit, request not idle");
-        cd_scsi_cmd_complete_check_cond(dev, req, &sense_code_TARGET_FAILURE);
-        goto done;
-    }
     if (req->req_state != SCSI_REQ_IDLE) {
         SPICE_ERROR("request_submit, prev request outstanding");
         cd_scsi_cmd_complete_check_cond(dev, req, &sense_code_TARGET_FAILURE);
         goto done;
     }
     req->req_state = SCSI_REQ_RUNNING;
-    st->cur_req = req;
+    g_queue_push_tail(&st->requests, req);
 
     /* INQUIRY should send response even for non-existing LUNs */
     if (!cd_scsi_target_lun_legal(st, lun)) {
@@ -2647,6 +2982,19 @@ void cd_scsi_dev_request_submit(CdScsiTarget *st, CdScsiRequest *req)
     case READ_CAPACITY_10:
         cd_scsi_cmd_read_capacity(dev, req);
         break;
+    case SERVICE_ACTION_IN_16:
+        cd_scsi_cmd_service_action_in_16(dev, req);
+        break;
+    case WRITE_6:
+    case WRITE_10:
+    case WRITE_12:
+    case WRITE_16:
+        cd_scsi_cmd_write(dev, req);
+        break;
+    case SYNCHRONIZE_CACHE:
+    case SYNCHRONIZE_CACHE_16:
+        cd_scsi_cmd_synchronize_cache(dev, req);
+        break;
     case READ_TOC:
         cd_scsi_cmd_read_toc(dev, req);
         break;
@@ -2659,6 +3007,9 @@ void cd_scsi_dev_request_submit(CdScsiTarget *st, CdScsiRequest *req)
     case READ_TRACK_INFORMATION:
         cd_scsi_cmd_get_read_track_information(dev, req);
         break;
+    case MODE_SENSE:
+        cd_scsi_cmd_mode_sense_6(dev, req);
+        break;
     case MODE_SENSE_10:
         cd_scsi_cmd_mode_sense_10(dev, req);
         break;
@@ -2715,26 +3066,27 @@ done:
 
 void cd_scsi_dev_request_cancel(CdScsiTarget *st, CdScsiRequest *req)
 {
-    if (st->cur_req == req) {
-        if (req->req_state == SCSI_REQ_RUNNING) {
+    if (g_queue_find(&st->requests, req) != NULL) {
+        if (req->req_state == SCSI_REQ_RUNNING && req->cancellable != NULL) {
             SPICE_DEBUG("request_cancel: lun: %u"
                          " op: 0x%02x len: %" G_GUINT64_FORMAT,
                         req->lun, (unsigned int)req->cdb[0], req->req_len);
-            g_cancellable_cancel(st->cancellable);
+            g_cancellable_cancel(req->cancellable);
         } else {
             SPICE_DEBUG("request_cancel: request is not running");
         }
     } else {
-        SPICE_DEBUG("request_cancel: other request is outstanding");
+        SPICE_DEBUG("request_cancel: request is not outstanding");
     }
 }
 
 void cd_scsi_dev_request_release(CdScsiTarget *st, CdScsiRequest *req)
 {
-    st->cur_req = NULL;
+    g_queue_remove(&st->requests, req);
+    g_clear_object(&req->cancellable);
     cd_scsi_req_init(req);
 
-    if (st->state == CD_SCSI_TGT_STATE_RESET) {
+    if (st->state == CD_SCSI_TGT_STATE_RESET && g_queue_is_empty(&st->requests)) {
         cd_scsi_target_do_reset(st);
     }
 }
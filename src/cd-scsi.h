@@ -62,10 +62,14 @@ typedef struct CdScsiRequest {
     uint8_t *buf;
     uint32_t buf_len;
 
+    /* submitted ahead of the command from the host, failures
+     * do not change the sense of the device */
+    gboolean speculative;
+
     /* internal */
     CdScsiReqState req_state;
     ScsiXferDir xfer_dir;
-    uint64_t cancel_id;
+    GCancellable *cancellable;
     void *priv_data;
 
     uint64_t lba; /* offset in logical blocks if relevant */
@@ -75,7 +79,8 @@ typedef struct CdScsiRequest {
     uint64_t req_len; /* scsi cdb request length, normalized to bytes */
 
     /* result */
-    uint64_t in_len; /* length of data actually available after read */
+    uint64_t in_len; /* length of data actually available after read,
+                      * or taken from buf by a data-out command */
     uint32_t status; /* SCSI status code */
 
 } CdScsiRequest;
@@ -74,24 +74,116 @@ typedef struct UsbCdBulkMsdRequest {
     CdScsiRequest scsi_req;
 
     uint32_t lun;
+    uint32_t cmd_len; /* length of the cdb in the CBW */
     uint32_t usb_req_len; /* length of data requested by usb */
     uint32_t scsi_in_len; /* length of data returned by scsi limited by usb request */
 
     uint32_t xfer_len; /* length of data transfered until now */
     uint32_t bulk_in_len; /* length of the last postponed bulk-in request */
+    gboolean data_out; /* data is received before the command is submitted */
 
     struct UsbCdCSW csw; /* usb status header */
+
+    CdUsbBulkBuffer *data_buf;
+    CdUsbBulkBuffer *spare_buf; /* previous data_buf, maybe still referenced */
 } UsbCdBulkMsdRequest;
 
+/* Bulk-only transport has a single command in flight, the host sends
+ * the next CBW only after receiving the CSW. Sequential READs are
+ * therefore submitted to the SCSI target ahead of their CBW, when the
+ * CBW arrives and matches the head of the queue, the request already
+ * running (or completed) is taken over. Status is still returned in
+ * the order of the commands. */
+#define USB_CD_QUEUE_DEPTH 4
+
 typedef struct UsbCdBulkMsdDevice {
     UsbCdState state;
     CdScsiTarget *scsi_target; /* scsi handle */
     void *usb_user_data; /* used in callbacks to usb */
-    UsbCdBulkMsdRequest usb_req; /* now supporting a single cmd */
-    uint8_t *data_buf;
-    uint32_t data_buf_len;
+    UsbCdBulkMsdRequest *usb_req; /* the command of the host */
+    UsbCdBulkMsdRequest reqs[USB_CD_QUEUE_DEPTH + 1];
+    GQueue ahead; /* READs submitted ahead of their CBW, in LBA order */
 } UsbCdBulkMsdDevice;
 
+#define USB_CD_DATA_BUF_LEN (256 * 1024)
+/* the data of a write command is gathered in a single buffer */
+#define USB_CD_MAX_DATA_OUT_LEN (16 * 1024 * 1024)
+
+struct CdUsbBulkBuffer {
+    gint refs;
+    uint32_t len;
+    uint8_t data[];
+};
+
+static CdUsbBulkBuffer *cd_usb_bulk_buffer_new(uint32_t len)
+{
+    CdUsbBulkBuffer *buffer = g_malloc(sizeof(*buffer) + len);
+    buffer->refs = 1;
+    buffer->len = len;
+    return buffer;
+}
+
+CdUsbBulkBuffer *cd_usb_bulk_buffer_ref(CdUsbBulkBuffer *buffer)
+{
+    g_atomic_int_inc(&buffer->refs);
+    return buffer;
+}
+
+void cd_usb_bulk_buffer_unref(CdUsbBulkBuffer *buffer)
+{
+    if (g_atomic_int_dec_and_test(&buffer->refs)) {
+        g_free(buffer);
+    }
+}
+
+/* data of the previous command may still be referenced by packets
+ * waiting to be written, in this case switch to another buffer */
+static CdUsbBulkBuffer *cd_usb_bulk_msd_get_data_buf(UsbCdBulkMsdRequest *usb_req,
+                                                     uint32_t min_len)
+{
+    min_len = MAX(min_len, USB_CD_DATA_BUF_LEN);
+
+    if (usb_req->data_buf == NULL || usb_req->data_buf->len < min_len) {
+        g_clear_pointer(&usb_req->data_buf, cd_usb_bulk_buffer_unref);
+        usb_req->data_buf = cd_usb_bulk_buffer_new(min_len);
+    } else if (g_atomic_int_get(&usb_req->data_buf->refs) != 1) {
+        CdUsbBulkBuffer *busy = usb_req->data_buf;
+
+        if (usb_req->spare_buf == NULL || g_atomic_int_get(&usb_req->spare_buf->refs) != 1 ||
+            usb_req->spare_buf->len < min_len) {
+            g_clear_pointer(&usb_req->spare_buf, cd_usb_bulk_buffer_unref);
+            usb_req->spare_buf = cd_usb_bulk_buffer_new(min_len);
+        }
+        usb_req->data_buf = usb_req->spare_buf;
+        usb_req->spare_buf = busy;
+    }
+    return usb_req->data_buf;
+}
+
+/* do not keep the buffers of a large write for the next commands,
+ * packets still referencing one keep it until they are written */
+static void cd_usb_bulk_msd_trim_data_buf(UsbCdBulkMsdRequest *usb_req)
+{
+    if (usb_req->data_buf != NULL && usb_req->data_buf->len > USB_CD_DATA_BUF_LEN) {
+        g_clear_pointer(&usb_req->data_buf, cd_usb_bulk_buffer_unref);
+    }
+    if (usb_req->spare_buf != NULL && usb_req->spare_buf->len > USB_CD_DATA_BUF_LEN) {
+        g_clear_pointer(&usb_req->spare_buf, cd_usb_bulk_buffer_unref);
+    }
+}
+
+static UsbCdBulkMsdRequest *cd_usb_bulk_msd_get_idle_req(UsbCdBulkMsdDevice *cd)
+{
+    uint32_t i;
+
+    for (i = 0; i < G_N_ELEMENTS(cd->reqs); i++) {
+        if (cd_scsi_get_req_state(&cd->reqs[i].scsi_req) == SCSI_REQ_IDLE) {
+            return &cd->reqs[i];
+        }
+    }
+    return NULL;
+}
+
 static inline const char *usb_cd_state_str(UsbCdState state)
 {
     switch (state) {
@@ -122,19 +214,163 @@ static void cd_usb_bulk_msd_set_state(UsbCdBulkMsdDevice *cd, UsbCdState state)
     cd->state = state;
 }
 
+static void usb_cd_req_prepare(UsbCdBulkMsdRequest *usb_req,
+                               uint32_t lun, uint32_t usb_req_len)
+{
+    usb_req->lun = lun;
+    usb_req->usb_req_len = usb_req_len;
+
+    usb_req->scsi_in_len = 0; /* no data from scsi yet */
+    usb_req->xfer_len = 0; /* no bulks transfered yet */
+    usb_req->bulk_in_len = 0; /* no bulk-in requests yet */
+    usb_req->data_out = FALSE;
+
+    /* prepare status - CSW, the tag is set from the CBW */
+    usb_req->csw.sig = htole32(0x53425355);
+    usb_req->csw.residue = 0;
+    usb_req->csw.status = (uint8_t)USB_MSD_STATUS_GOOD;
+}
+
+/* advance the LBA of a READ(10/12/16) cdb past the blocks it reads,
+ * returns FALSE if the command is not a READ which can be followed */
+static gboolean usb_cd_next_read_cdb(uint8_t *cdb, uint32_t cdb_len)
+{
+    uint32_t i, lba_len, count_pos, count_len;
+    uint64_t lba = 0, count = 0;
+
+    switch (cdb[0]) {
+    case READ_10:
+        lba_len = 4, count_pos = 7, count_len = 2;
+        break;
+    case READ_12:
+        lba_len = 4, count_pos = 6, count_len = 4;
+        break;
+    case READ_16:
+        lba_len = 8, count_pos = 10, count_len = 4;
+        break;
+    default:
+        return FALSE;
+    }
+    if (cdb_len < count_pos + count_len) {
+        return FALSE;
+    }
+
+    for (i = 0; i < lba_len; i++) {
+        lba = (lba << 8) | cdb[2 + i];
+    }
+    for (i = 0; i < count_len; i++) {
+        count = (count << 8) | cdb[count_pos + i];
+    }
+    if (count == 0 || lba + count < lba ||
+        (lba_len == 4 && lba + count > G_MAXUINT32)) {
+        return FALSE;
+    }
+
+    lba += count;
+    for (i = lba_len; i > 0; i--) {
+        cdb[1 + i] = lba & 0xff;
+        lba >>= 8;
+    }
+    return TRUE;
+}
+
+/* submit READs following the last one, to be taken over by the
+ * CBWs of the host */
+static void usb_cd_queue_ahead(UsbCdBulkMsdDevice *cd)
+{
+    UsbCdBulkMsdRequest *prev = g_queue_peek_tail(&cd->ahead) ? : cd->usb_req;
+
+    while (g_queue_get_length(&cd->ahead) < USB_CD_QUEUE_DEPTH &&
+           prev->scsi_req.status == GOOD) {
+        UsbCdBulkMsdRequest *usb_req = cd_usb_bulk_msd_get_idle_req(cd);
+        CdScsiRequest *scsi_req;
+        CdUsbBulkBuffer *data_buf;
+
+        if (usb_req == NULL) {
+            break;
+        }
+        scsi_req = &usb_req->scsi_req;
+
+        memcpy(scsi_req->cdb, prev->scsi_req.cdb, sizeof(scsi_req->cdb));
+        if (!usb_cd_next_read_cdb(scsi_req->cdb, prev->cmd_len)) {
+            break;
+        }
+        scsi_req->cdb_len = usb_req->cmd_len = prev->cmd_len;
+        scsi_req->lun = prev->lun;
+        scsi_req->speculative = TRUE;
+
+        data_buf = cd_usb_bulk_msd_get_data_buf(usb_req, 0);
+        scsi_req->buf = data_buf->data;
+        scsi_req->buf_len = data_buf->len;
+
+        usb_cd_req_prepare(usb_req, prev->lun, prev->usb_req_len);
+
+        SPICE_DEBUG("Queue ahead lun:%u op:0x%02x req_len:%u",
+                    usb_req->lun, scsi_req->cdb[0], usb_req->usb_req_len);
+
+        g_queue_push_tail(&cd->ahead, usb_req);
+        cd_scsi_dev_request_submit(cd->scsi_target, scsi_req);
+        prev = usb_req;
+    }
+}
+
+/* take over the head of the queued READs if the command matches */
+static gboolean usb_cd_take_ahead(UsbCdBulkMsdDevice *cd,
+                                  const struct UsbCdCBW *cbw, uint32_t cmd_len)
+{
+    UsbCdBulkMsdRequest *usb_req = g_queue_peek_head(&cd->ahead);
+
+    if (usb_req == NULL ||
+        !(cbw->flags & 0x80) ||
+        cbw->lun != usb_req->lun ||
+        le32toh(cbw->exp_data_len) != usb_req->usb_req_len ||
+        cmd_len != usb_req->cmd_len ||
+        memcmp(cbw->cmd, usb_req->scsi_req.cdb, cmd_len) != 0 ||
+        usb_req->scsi_req.status != GOOD) {
+        return FALSE;
+    }
+
+    g_queue_pop_head(&cd->ahead);
+    usb_req->scsi_req.speculative = FALSE;
+    usb_req->csw.tag = cbw->tag;
+    cd->usb_req = usb_req;
+
+    SPICE_DEBUG("CMD lun:%u tag:%#x taken from queue, req_state:%d",
+                usb_req->lun, le32toh(cbw->tag),
+                (int)cd_scsi_get_req_state(&usb_req->scsi_req));
+
+    cd_usb_bulk_msd_set_state(cd, USB_CD_STATE_DATAIN);
+    return TRUE;
+}
+
+/* cancel or release the queued READs */
+static void usb_cd_drop_ahead(UsbCdBulkMsdDevice *cd)
+{
+    UsbCdBulkMsdRequest *usb_req;
+
+    while ((usb_req = g_queue_pop_head(&cd->ahead)) != NULL) {
+        CdScsiRequest *scsi_req = &usb_req->scsi_req;
+
+        if (cd_scsi_get_req_state(scsi_req) == SCSI_REQ_RUNNING) {
+            /* released on completion */
+            cd_scsi_dev_request_cancel(cd->scsi_target, scsi_req);
+        } else {
+            cd_scsi_dev_request_release(cd->scsi_target, scsi_req);
+        }
+    }
+}
+
 UsbCdBulkMsdDevice *cd_usb_bulk_msd_alloc(void *usb_user_data, uint32_t max_luns)
 {
     UsbCdBulkMsdDevice *cd = g_new0(UsbCdBulkMsdDevice, 1);
 
-    cd->data_buf_len = 256 * 1024;
-    cd->data_buf = g_malloc(cd->data_buf_len);
-
     cd->scsi_target = cd_scsi_target_alloc(cd, max_luns);
     if (cd->scsi_target == NULL) {
-        g_free(cd->data_buf);
         g_free(cd);
         return NULL;
     }
+    cd->usb_req = &cd->reqs[0];
+    g_queue_init(&cd->ahead);
     cd_usb_bulk_msd_set_state(cd, USB_CD_STATE_INIT);
     cd->usb_user_data = usb_user_data;
 
@@ -152,6 +388,7 @@ int cd_usb_bulk_msd_realize(UsbCdBulkMsdDevice *cd, uint32_t lun,
     scsi_dev_params.product = dev_params->product ? : "USB-CD";
     scsi_dev_params.version = dev_params->version ? : "0.1";
     scsi_dev_params.serial = dev_params->serial ? : "123456";
+    scsi_dev_params.disk = dev_params->disk;
 
     rc = cd_scsi_dev_realize(cd->scsi_target, lun, &scsi_dev_params);
     if (rc != 0) {
@@ -162,7 +399,7 @@ int cd_usb_bulk_msd_realize(UsbCdBulkMsdDevice *cd, uint32_t lun,
     if (cd->state == USB_CD_STATE_INIT) {
         /* wait next request */
         cd_usb_bulk_msd_set_state(cd, USB_CD_STATE_CBW);
-        cd_scsi_dev_request_release(cd->scsi_target, &cd->usb_req.scsi_req);
+        cd_scsi_dev_request_release(cd->scsi_target, &cd->usb_req->scsi_req);
     }
 
     SPICE_DEBUG("Realize OK lun:%u", lun);
@@ -188,6 +425,7 @@ int cd_usb_bulk_msd_load(UsbCdBulkMsdDevice *cd, uint32_t lun,
 {
     int rc;
 
+    usb_cd_drop_ahead(cd);
     rc = cd_scsi_dev_load(cd->scsi_target, lun, media_params);
     if (rc != 0) {
         SPICE_ERROR("Failed to load lun:%u", lun);
@@ -215,6 +453,7 @@ int cd_usb_bulk_msd_unload(UsbCdBulkMsdDevice *cd, uint32_t lun)
 {
     int rc;
 
+    usb_cd_drop_ahead(cd);
     rc = cd_scsi_dev_unload(cd->scsi_target, lun);
     if (rc != 0) {
         SPICE_ERROR("Failed to unload lun:%u", lun);
@@ -241,8 +480,14 @@ int cd_usb_bulk_msd_unrealize(UsbCdBulkMsdDevice *cd, uint32_t lun)
 
 void cd_usb_bulk_msd_free(UsbCdBulkMsdDevice *cd)
 {
+    uint32_t i;
+
+    usb_cd_drop_ahead(cd);
     cd_scsi_target_free(cd->scsi_target);
-    g_free(cd->data_buf);
+    for (i = 0; i < G_N_ELEMENTS(cd->reqs); i++) {
+        g_clear_pointer(&cd->reqs[i].data_buf, cd_usb_bulk_buffer_unref);
+        g_clear_pointer(&cd->reqs[i].spare_buf, cd_usb_bulk_buffer_unref);
+    }
     g_free(cd);
 
     SPICE_DEBUG("Free");
@@ -250,6 +495,7 @@ void cd_usb_bulk_msd_free(UsbCdBulkMsdDevice *cd)
 
 int cd_usb_bulk_msd_reset(UsbCdBulkMsdDevice *cd)
 {
+    usb_cd_drop_ahead(cd);
     cd_scsi_target_reset(cd->scsi_target);
     cd_usb_bulk_msd_set_state(cd, USB_CD_STATE_CBW);
 
@@ -260,8 +506,8 @@ int cd_usb_bulk_msd_reset(UsbCdBulkMsdDevice *cd)
 static int parse_usb_msd_cmd(UsbCdBulkMsdDevice *cd, uint8_t *buf, uint32_t cbw_len)
 {
     struct UsbCdCBW *cbw = (struct UsbCdCBW *)buf;
-    UsbCdBulkMsdRequest *usb_req = &cd->usb_req;
-    CdScsiRequest *scsi_req = &usb_req->scsi_req;
+    UsbCdBulkMsdRequest *usb_req;
+    CdScsiRequest *scsi_req;
 
     if (cbw_len != sizeof(*cbw)) {
         SPICE_ERROR("CMD: Bad CBW size:%u", cbw_len);
@@ -277,12 +523,22 @@ static int parse_usb_msd_cmd(UsbCdBulkMsdDevice *cd, uint8_t *buf, uint32_t cbw_
         return -1;
     }
 
-    usb_req->lun = cbw->lun;
-    usb_req->usb_req_len = le32toh(cbw->exp_data_len);
+    if (usb_cd_take_ahead(cd, cbw, cmd_len)) {
+        return 0;
+    }
+    usb_cd_drop_ahead(cd);
 
-    usb_req->scsi_in_len = 0; /* no data from scsi yet */
-    usb_req->xfer_len = 0; /* no bulks transfered yet */
-    usb_req->bulk_in_len = 0; /* no bulk-in requests yet */
+    usb_req = cd_usb_bulk_msd_get_idle_req(cd);
+    if (usb_req == NULL) {
+        SPICE_ERROR("CMD: no idle request");
+        return -1;
+    }
+    cd->usb_req = usb_req;
+    scsi_req = &usb_req->scsi_req;
+
+    usb_cd_req_prepare(usb_req, cbw->lun, le32toh(cbw->exp_data_len));
+    usb_req->csw.tag = cbw->tag;
+    usb_req->cmd_len = cmd_len;
 
     if (usb_req->usb_req_len == 0) {
         cd_usb_bulk_msd_set_state(cd, USB_CD_STATE_CSW); /* no data - return status */
@@ -290,11 +546,18 @@ static int parse_usb_msd_cmd(UsbCdBulkMsdDevice *cd, uint8_t *buf, uint32_t cbw_
         scsi_req->buf_len = 0;
     } else if (cbw->flags & 0x80) {
         cd_usb_bulk_msd_set_state(cd, USB_CD_STATE_DATAIN); /* read command */
-        scsi_req->buf = cd->data_buf;
-        scsi_req->buf_len = cd->data_buf_len;
+        CdUsbBulkBuffer *data_buf = cd_usb_bulk_msd_get_data_buf(usb_req, 0);
+        scsi_req->buf = data_buf->data;
+        scsi_req->buf_len = data_buf->len;
     } else {
-        cd_usb_bulk_msd_set_state(cd, USB_CD_STATE_DATAOUT); /* write command */
-        scsi_req->buf = NULL;
+        /* write command, larger data is received but not kept,
+         * the SCSI command fails on the missing data */
+        CdUsbBulkBuffer *data_buf =
+            cd_usb_bulk_msd_get_data_buf(usb_req, MIN(usb_req->usb_req_len,
+                                                      USB_CD_MAX_DATA_OUT_LEN));
+        cd_usb_bulk_msd_set_state(cd, USB_CD_STATE_DATAOUT);
+        usb_req->data_out = TRUE;
+        scsi_req->buf = data_buf->data;
         scsi_req->buf_len = 0;
     }
 
@@ -303,33 +566,29 @@ static int parse_usb_msd_cmd(UsbCdBulkMsdDevice *cd, uint8_t *buf, uint32_t cbw_
     memcpy(scsi_req->cdb, cbw->cmd, scsi_req->cdb_len);
 
     scsi_req->lun = usb_req->lun;
+    scsi_req->speculative = FALSE;
 
     SPICE_DEBUG("CMD lun:%u tag:%#x flags:%08x "
                 "cdb_len:%u req_len:%u",
                 usb_req->lun, le32toh(cbw->tag), cbw->flags,
                 scsi_req->cdb_len, usb_req->usb_req_len);
 
-    /* prepare status - CSW */
-    usb_req->csw.sig = htole32(0x53425355);
-    usb_req->csw.tag = cbw->tag;
-    usb_req->csw.residue = 0;
-    usb_req->csw.status = (uint8_t)USB_MSD_STATUS_GOOD;
-
     return 0;
 }
 
 static void usb_cd_cmd_done(UsbCdBulkMsdDevice *cd)
 {
-    UsbCdBulkMsdRequest *usb_req = &cd->usb_req;
+    UsbCdBulkMsdRequest *usb_req = cd->usb_req;
     CdScsiRequest *scsi_req = &usb_req->scsi_req;
 
     cd_usb_bulk_msd_set_state(cd, USB_CD_STATE_CBW); /* Command next */
     cd_scsi_dev_request_release(cd->scsi_target, scsi_req);
+    cd_usb_bulk_msd_trim_data_buf(usb_req);
 }
 
 static void usb_cd_send_status(UsbCdBulkMsdDevice *cd)
 {
-    UsbCdBulkMsdRequest *usb_req = &cd->usb_req;
+    UsbCdBulkMsdRequest *usb_req = cd->usb_req;
 
     SPICE_DEBUG("Command CSW tag:0x%x msd_status:%d len:%" G_GUINT64_FORMAT,
                 le32toh(usb_req->csw.tag), (int)usb_req->csw.status, sizeof(usb_req->csw));
@@ -339,12 +598,12 @@ static void usb_cd_send_status(UsbCdBulkMsdDevice *cd)
     g_assert(usb_req->csw.sig == htole32(0x53425355));
     cd_usb_bulk_msd_read_complete(cd->usb_user_data,
                                   (uint8_t *)&usb_req->csw, sizeof(usb_req->csw),
-                                  BULK_STATUS_GOOD);
+                                  NULL, BULK_STATUS_GOOD);
 }
 
 static void usb_cd_send_canceled(UsbCdBulkMsdDevice *cd)
 {
-    UsbCdBulkMsdRequest *usb_req = &cd->usb_req;
+    UsbCdBulkMsdRequest *usb_req = cd->usb_req;
 
     SPICE_DEBUG("Canceled cmd tag:0x%x, len:%" G_GUINT64_FORMAT,
                 le32toh(usb_req->csw.tag), sizeof(usb_req->csw));
@@ -352,13 +611,13 @@ static void usb_cd_send_canceled(UsbCdBulkMsdDevice *cd)
     usb_cd_cmd_done(cd);
 
     cd_usb_bulk_msd_read_complete(cd->usb_user_data,
-                                  NULL, 0,
+                                  NULL, 0, NULL,
                                   BULK_STATUS_CANCELED);
 }
 
 static void usb_cd_send_data_in(UsbCdBulkMsdDevice *cd, uint32_t max_len)
 {
-    UsbCdBulkMsdRequest *usb_req = &cd->usb_req;
+    UsbCdBulkMsdRequest *usb_req = cd->usb_req;
     CdScsiRequest *scsi_req = &usb_req->scsi_req;
     uint8_t *buf = ((uint8_t *)scsi_req->buf) + usb_req->xfer_len;
     uint32_t avail_len = usb_req->scsi_in_len - usb_req->xfer_len;
@@ -371,7 +630,7 @@ static void usb_cd_send_data_in(UsbCdBulkMsdDevice *cd, uint32_t max_len)
     g_assert(max_len <= usb_req->usb_req_len);
 
     cd_usb_bulk_msd_read_complete(cd->usb_user_data,
-                                  buf, send_len,
+                                  buf, send_len, usb_req->data_buf,
                                   BULK_STATUS_GOOD);
 
     if (scsi_req->status == GOOD) {
@@ -393,7 +652,7 @@ static void usb_cd_send_data_in(UsbCdBulkMsdDevice *cd, uint32_t max_len)
 
 int cd_usb_bulk_msd_read(UsbCdBulkMsdDevice *cd, uint32_t max_len)
 {
-    UsbCdBulkMsdRequest *usb_req = &cd->usb_req;
+    UsbCdBulkMsdRequest *usb_req = cd->usb_req;
     CdScsiRequest *scsi_req = &usb_req->scsi_req;
 
     SPICE_DEBUG("msd_read, state: %s, len %u",
@@ -426,7 +685,7 @@ int cd_usb_bulk_msd_read(UsbCdBulkMsdDevice *cd, uint32_t max_len)
 
     case USB_CD_STATE_ZERO_DATAIN:
         cd_usb_bulk_msd_read_complete(cd->usb_user_data,
-                                      NULL, 0,
+                                      NULL, 0, NULL,
                                       BULK_STATUS_GOOD);
         cd_usb_bulk_msd_set_state(cd, USB_CD_STATE_CSW); /* Status next */
         break;
@@ -442,25 +701,46 @@ fail:
     return -1;
 }
 
-void cd_scsi_dev_request_complete(void *target_user_data, CdScsiRequest *scsi_req)
+static void usb_cd_req_complete(UsbCdBulkMsdRequest *usb_req)
 {
-    UsbCdBulkMsdDevice *cd = (UsbCdBulkMsdDevice *)target_user_data;
-    UsbCdBulkMsdRequest *usb_req = &cd->usb_req;
+    CdScsiRequest *scsi_req = &usb_req->scsi_req;
 
-    g_assert(scsi_req == &usb_req->scsi_req);
+    usb_req->scsi_in_len = (scsi_req->in_len <= usb_req->usb_req_len) ?
+                            scsi_req->in_len : usb_req->usb_req_len;
 
-    if (scsi_req->req_state == SCSI_REQ_COMPLETE) {
+    /* prepare CSW */
+    if (usb_req->data_out && scsi_req->status != GOOD) {
+        /* all the data was received, none of it is processed on failure */
+        usb_req->csw.residue = htole32(usb_req->usb_req_len);
+    } else if (usb_req->usb_req_len > usb_req->scsi_in_len) {
+        /* data not sent, or received but not processed */
+        usb_req->csw.residue = htole32(usb_req->usb_req_len - usb_req->scsi_in_len);
+    }
+    if (scsi_req->status != GOOD) {
+        usb_req->csw.status = (uint8_t)USB_MSD_STATUS_FAILED;
+    }
+}
+
+void cd_scsi_dev_request_complete(void *target_user_data, CdScsiRequest *scsi_req)
+{
+    UsbCdBulkMsdDevice *cd = (UsbCdBulkMsdDevice *)target_user_data;
+    UsbCdBulkMsdRequest *usb_req = cd->usb_req;
 
-        usb_req->scsi_in_len = (scsi_req->in_len <= usb_req->usb_req_len) ?
-                                scsi_req->in_len : usb_req->usb_req_len;
+    if (scsi_req != &usb_req->scsi_req) {
+        /* READ queued ahead of its CBW */
+        usb_req = SPICE_CONTAINEROF(scsi_req, UsbCdBulkMsdRequest, scsi_req);
 
-        /* prepare CSW */
-        if (usb_req->usb_req_len > usb_req->scsi_in_len) {
-            usb_req->csw.residue = htole32(usb_req->usb_req_len - usb_req->scsi_in_len);
-        }
-        if (scsi_req->status != GOOD) {
-            usb_req->csw.status = (uint8_t)USB_MSD_STATUS_FAILED;
+        if (scsi_req->req_state == SCSI_REQ_COMPLETE) {
+            usb_cd_req_complete(usb_req);
+        } else {
+            g_queue_remove(&cd->ahead, usb_req);
+            cd_scsi_dev_request_release(cd->scsi_target, scsi_req);
         }
+        return;
+    }
+
+    if (scsi_req->req_state == SCSI_REQ_COMPLETE) {
+        usb_cd_req_complete(usb_req);
 
         if (usb_req->bulk_in_len) {
             /* bulk-in request arrived while scsi was still running */
@@ -483,27 +763,52 @@ void cd_scsi_dev_request_complete(void *target_user_data, CdScsiRequest *scsi_re
 
 int cd_usb_bulk_msd_cancel_read(UsbCdBulkMsdDevice *cd)
 {
-    UsbCdBulkMsdRequest *usb_req = &cd->usb_req;
+    UsbCdBulkMsdRequest *usb_req = cd->usb_req;
     CdScsiRequest *scsi_req = &usb_req->scsi_req;
 
     cd_scsi_dev_request_cancel(cd->scsi_target, scsi_req);
     return 0;
 }
 
+/* gather the bulk-out packets, the command is submitted with all its data */
+static void usb_cd_recv_data_out(UsbCdBulkMsdDevice *cd, const uint8_t *buf, uint32_t len)
+{
+    UsbCdBulkMsdRequest *usb_req = cd->usb_req;
+    CdScsiRequest *scsi_req = &usb_req->scsi_req;
+    uint32_t keep;
+
+    len = MIN(len, usb_req->usb_req_len - usb_req->xfer_len);
+    if (usb_req->xfer_len < usb_req->data_buf->len) {
+        keep = MIN(len, usb_req->data_buf->len - usb_req->xfer_len);
+        memcpy(usb_req->data_buf->data + usb_req->xfer_len, buf, keep);
+        scsi_req->buf_len += keep;
+    }
+    usb_req->xfer_len += len;
+
+    SPICE_DEBUG("Data-out cmd tag 0x%x, received %u of %u",
+                le32toh(usb_req->csw.tag), usb_req->xfer_len, usb_req->usb_req_len);
+
+    if (len == 0 || usb_req->xfer_len == usb_req->usb_req_len) {
+        cd_usb_bulk_msd_set_state(cd, USB_CD_STATE_CSW); /* Status next */
+        cd_scsi_dev_request_submit(cd->scsi_target, scsi_req);
+    }
+}
+
 int cd_usb_bulk_msd_write(UsbCdBulkMsdDevice *cd, uint8_t *buf_out, uint32_t buf_out_len)
 {
     switch (cd->state) {
     case USB_CD_STATE_CBW: /* Command Block */
         parse_usb_msd_cmd(cd, buf_out, buf_out_len);
-        if (cd->state == USB_CD_STATE_DATAIN || cd->state == USB_CD_STATE_CSW) {
-            cd_scsi_dev_request_submit(cd->scsi_target, &cd->usb_req.scsi_req);
+        if ((cd->state == USB_CD_STATE_DATAIN || cd->state == USB_CD_STATE_CSW) &&
+            cd_scsi_get_req_state(&cd->usb_req->scsi_req) == SCSI_REQ_IDLE) {
+            cd_scsi_dev_request_submit(cd->scsi_target, &cd->usb_req->scsi_req);
+        }
+        if (cd->state == USB_CD_STATE_DATAIN) {
+            usb_cd_queue_ahead(cd);
         }
         break;
     case USB_CD_STATE_DATAOUT: /* Data-Out for a Write cmd */
-        cd->usb_req.scsi_req.buf = buf_out;
-        cd->usb_req.scsi_req.buf_len = buf_out_len;
-        cd_scsi_dev_request_submit(cd->scsi_target, &cd->usb_req.scsi_req);
-        cd_usb_bulk_msd_set_state(cd, USB_CD_STATE_CSW); /* Status next */
+        usb_cd_recv_data_out(cd, buf_out, buf_out_len);
         break;
     default:
         SPICE_DEBUG("Unexpected write state: %s, len %u",
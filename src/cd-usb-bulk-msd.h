@@ -36,14 +36,23 @@ typedef enum CdUsbBulkStatus {
 
 typedef struct UsbCdBulkMsdDevice UsbCdBulkMsdDevice;
 
+/* refcounted data buffer, not reused by the device while referenced */
+typedef struct CdUsbBulkBuffer CdUsbBulkBuffer;
+
+CdUsbBulkBuffer *cd_usb_bulk_buffer_ref(CdUsbBulkBuffer *buffer);
+void cd_usb_bulk_buffer_unref(CdUsbBulkBuffer *buffer);
+
 /* USB backend callbacks */
 
 /* called on completed read data bulk transfer
  * user_data - user_data in unit parameters structure
+ * buffer - buffer holding data, which can be referenced instead of
+ *          copied, or NULL
  * status - bulk status code
  */
 void cd_usb_bulk_msd_read_complete(void *user_data,
                                    uint8_t *data, uint32_t length,
+                                   CdUsbBulkBuffer *buffer,
                                    CdUsbBulkStatus status);
 
 /* called when state of device's unit changed to signal GUI component
@@ -1957,6 +1957,9 @@ static void display_handle_surface_create(SpiceChannel *channel, SpiceMsgIn *in)
     SpiceMsgSurfaceCreate *create = spice_msg_in_parsed(in);
     display_surface *surface = g_new0(display_surface, 1);
 
+    spice_session_timeline_mark(spice_channel_get_session(channel), channel,
+                                SPICE_SESSION_TIMELINE_FIRST_SURFACE);
+
     surface->surface_id = create->surface_id;
     surface->format = create->format;
     surface->width  = create->width;
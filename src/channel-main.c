@@ -72,6 +72,12 @@ typedef struct {
     GFileProgressCallback       progress_callback;
     gpointer                    progress_callback_data;
     GTask                      *task;
+    GFileCopyFlags              flags;
+    GCancellable               *cancellable;
+    /* tasks wait in pending until less than the batch window are active */
+    GQueue                      pending;
+    guint                       active;
+    guint                       enumerating; /* directories being listed */
     struct {
         goffset                 total_sent;
         goffset                 transfer_size;
@@ -79,9 +85,84 @@ typedef struct {
         guint                   succeed;
         guint                   cancelled;
         guint                   failed;
+        gint64                  start_time;
     } stats;
 } FileTransferOperation;
 
+/* Agent messages are queued per class: control messages are small and
+ * latency sensitive, they always go first. The bulk classes share the
+ * remaining tokens with a weighted round-robin.
+ * A control message about a stream of data (a clipboard selection or a
+ * file transfer task) must not overtake the data of that stream, it is
+ * queued after it when some is still queued. */
+typedef enum {
+    AGENT_MSG_CLASS_CONTROL,
+    AGENT_MSG_CLASS_CLIPBOARD,
+    AGENT_MSG_CLASS_FILE_XFER,
+    AGENT_MSG_CLASS_LAST
+} AgentMsgClass;
+
+/* Called after each part of a message is sent, or once with @error if
+ * the message is dropped before being fully sent */
+typedef void (*AgentMsgSentFunc)(SpiceMainChannel *channel, guint sent, guint total,
+                                 const GError *error, gpointer user_data);
+
+/* A whole agent message: its parts must be sent back to back, the agent
+ * can't interleave them with another message */
+typedef struct {
+    GQueue                      parts; /* SpiceMsgOut */
+    gpointer                    owner;
+    int                         type;
+    AgentMsgClass               klass;
+    /* the class carrying the data of the stream the message is about,
+     * AGENT_MSG_CLASS_CONTROL if none */
+    AgentMsgClass               stream_class;
+    guint32                     stream_id;
+    guint                       n_parts;
+    /* dropped if cancelled before its first part is sent */
+    GCancellable                *cancellable;
+    GSource                     *cancelled_source; /* while queued */
+    SpiceMainChannel            *channel;
+    AgentMsgSentFunc            sent_func;
+    gpointer                    sent_data;
+} AgentMsg;
+
+/* The messages of one owner (a file transfer operation for instance),
+ * in order */
+typedef struct {
+    gpointer                    owner;
+    GQueue                      msgs; /* AgentMsg */
+} AgentMsgLane;
+
+typedef struct {
+    GQueue                      lanes; /* AgentMsgLane, served round-robin */
+    guint                       depth; /* parts not sent yet */
+    guint                       max_depth;
+    guint                       credit;
+} AgentMsgQueue;
+
+/* Multi-part VD_AGENT_CLIPBOARD messages are not reassembled, the data
+ * is delivered in fragments of up to CLIPBOARD_FRAGMENT_SIZE instead.
+ * A full copy is only made if the main-clipboard(-selection) signals are
+ * connected, in a temporary file above CLIPBOARD_SPILL_SIZE. */
+#define CLIPBOARD_FRAGMENT_SIZE (64 * 1024)
+#define CLIPBOARD_SPILL_SIZE (16 * 1024 * 1024)
+
+typedef struct {
+    gboolean                    active;
+    guint8                      head[sizeof(guint32) + sizeof(VDAgentClipboard)];
+    guint                       head_size;
+    guint                       head_pos;
+    guint                       selection;
+    guint                       type;
+    guint                       offset; /* of the data delivered so far */
+    guint                       size;
+    GByteArray                  *fragment;
+    guint8                      *copy;
+    GFile                       *spill;
+    GFileIOStream               *spill_stream;
+} ClipboardStream;
+
 struct _SpiceMainChannelPrivate  {
     enum SpiceMouseMode         mouse_mode;
     enum SpiceMouseMode         requested_mouse_mode;
@@ -98,12 +179,14 @@ struct _SpiceMainChannelPrivate  {
     int                         agent_tokens;
     VDAgentMessage              agent_msg; /* partial msg reconstruction */
     guint8                      *agent_msg_data;
+    ClipboardStream             clipboard_stream;
     guint                       agent_msg_pos;
     uint8_t                     agent_msg_size;
     uint32_t                    agent_caps[VD_AGENT_CAPS_SIZE];
     SpiceDisplayConfig          display[MAX_DISPLAY];
     gint                        timer_id;
-    GQueue                      *agent_msg_queue;
+    AgentMsgQueue               agent_queues[AGENT_MSG_CLASS_LAST];
+    AgentMsg                    *agent_msg_sending; /* parts left of the msg being sent */
     GHashTable                  *file_xfer_tasks;
     GHashTable                  *flushing;
 
@@ -111,6 +194,8 @@ struct _SpiceMainChannelPrivate  {
     guint                       migrate_delayed_id;
     spice_migrate               *migrate_data;
     int                         max_clipboard;
+    guint                       file_xfer_window;
+    guint                       file_xfer_batch_window;
 
     gboolean                    agent_volume_playback_sync;
     gboolean                    agent_volume_record_sync;
@@ -147,6 +232,8 @@ enum {
     PROP_DISABLE_DISPLAY_POSITION,
     PROP_DISABLE_DISPLAY_ALIGN,
     PROP_MAX_CLIPBOARD,
+    PROP_FILE_TRANSFER_WINDOW,
+    PROP_FILE_TRANSFER_BATCH_WINDOW,
 };
 
 /* Signals */
@@ -158,6 +245,7 @@ enum {
     SPICE_MAIN_CLIPBOARD_REQUEST,
     SPICE_MAIN_CLIPBOARD_RELEASE,
     SPICE_MAIN_CLIPBOARD_SELECTION,
+    SPICE_MAIN_CLIPBOARD_SELECTION_FRAGMENT,
     SPICE_MAIN_CLIPBOARD_SELECTION_GRAB,
     SPICE_MAIN_CLIPBOARD_SELECTION_REQUEST,
     SPICE_MAIN_CLIPBOARD_SELECTION_RELEASE,
@@ -172,6 +260,8 @@ static void spice_main_handle_msg(SpiceChannel *channel, SpiceMsgIn *msg);
 static void channel_set_handlers(SpiceChannelClass *klass);
 static void agent_send_msg_queue(SpiceMainChannel *channel);
 static void agent_free_msg_queue(SpiceMainChannel *channel);
+static void agent_msg_queues_init(SpiceMainChannel *channel);
+static void clipboard_stream_reset(SpiceMainChannel *channel);
 static void migrate_channel_event_cb(SpiceChannel *channel, SpiceChannelEvent event,
                                      gpointer data);
 static gboolean main_migrate_handshake_done(gpointer data);
@@ -184,6 +274,10 @@ static void spice_main_set_max_clipboard(SpiceMainChannel *self, gint max);
 static void set_agent_connected(SpiceMainChannel *channel, gboolean connected);
 
 static void file_transfer_operation_free(FileTransferOperation *xfer_op);
+static gboolean file_transfer_operation_check_done(FileTransferOperation *xfer_op);
+static void file_transfer_operation_start_tasks(FileTransferOperation *xfer_op);
+static void file_transfer_operation_enumerate(FileTransferOperation *xfer_op,
+                                              GFile *dir, const gchar *name);
 static void spice_main_channel_reset_all_xfer_operations(SpiceMainChannel *channel);
 static SpiceFileTransferTask *spice_main_channel_find_xfer_task_by_task_id(SpiceMainChannel *channel,
                                                                            guint32 task_id);
@@ -250,7 +344,7 @@ static void spice_main_channel_init(SpiceMainChannel *channel)
     SpiceMainChannelPrivate *c;
 
     c = channel->priv = spice_main_channel_get_instance_private(channel);
-    c->agent_msg_queue = g_queue_new();
+    agent_msg_queues_init(channel);
     c->file_xfer_tasks = g_hash_table_new(g_direct_hash, g_direct_equal);
     c->flushing = g_hash_table_new(g_direct_hash, g_direct_equal);
     c->cancellable_volume_info = g_cancellable_new();
@@ -308,6 +402,12 @@ static void spice_main_get_property(GObject    *object,
     case PROP_MAX_CLIPBOARD:
         g_value_set_int(value, spice_main_get_max_clipboard(self));
         break;
+    case PROP_FILE_TRANSFER_WINDOW:
+        g_value_set_uint(value, c->file_xfer_window);
+        break;
+    case PROP_FILE_TRANSFER_BATCH_WINDOW:
+        g_value_set_uint(value, c->file_xfer_batch_window);
+        break;
     default:
 	G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
 	break;
@@ -342,6 +442,12 @@ static void spice_main_set_property(GObject *gobject, guint prop_id,
     case PROP_MAX_CLIPBOARD:
         spice_main_set_max_clipboard(self, g_value_get_int(value));
         break;
+    case PROP_FILE_TRANSFER_WINDOW:
+        c->file_xfer_window = g_value_get_uint(value);
+        break;
+    case PROP_FILE_TRANSFER_BATCH_WINDOW:
+        c->file_xfer_batch_window = g_value_get_uint(value);
+        break;
     default:
 	G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
 	break;
@@ -382,6 +488,7 @@ static void spice_main_channel_finalize(GObject *obj)
     SpiceMainChannelPrivate *c = SPICE_MAIN_CHANNEL(obj)->priv;
 
     g_free(c->agent_msg_data);
+    clipboard_stream_reset(SPICE_MAIN_CHANNEL(obj));
     agent_free_msg_queue(SPICE_MAIN_CHANNEL(obj));
 
     if (G_OBJECT_CLASS(spice_main_channel_parent_class)->finalize)
@@ -407,6 +514,7 @@ static void spice_main_channel_reset_agent(SpiceMainChannel *channel)
     c->agent_display_config_sent = FALSE;
     c->agent_msg_pos = 0;
     g_clear_pointer(&c->agent_msg_data, g_free);
+    clipboard_stream_reset(channel);
     c->agent_msg_size = 0;
 
     spice_main_channel_reset_all_xfer_operations(channel);
@@ -424,7 +532,7 @@ static void spice_main_channel_reset(SpiceChannel *channel, gboolean migrating)
        spicec did. Also see the TODO in server/reds.c reds_reset_vdp() */
     c->agent_tokens = 0;
     agent_free_msg_queue(SPICE_MAIN_CHANNEL(channel));
-    c->agent_msg_queue = g_queue_new();
+    agent_msg_queues_init(SPICE_MAIN_CHANNEL(channel));
 
     c->agent_volume_playback_sync = FALSE;
     c->agent_volume_record_sync = FALSE;
@@ -598,6 +706,45 @@ static void spice_main_channel_class_init(SpiceMainChannelClass *klass)
                           G_PARAM_CONSTRUCT |
                           G_PARAM_STATIC_STRINGS));
 
+    /**
+     * SpiceMainChannel:file-transfer-window:
+     *
+     * Number of file chunks each file transfer keeps in flight: read
+     * ahead from the disk, and queued to the agent at once. Changes
+     * apply to the transfers started afterwards.
+     *
+     * Since: 0.39
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_FILE_TRANSFER_WINDOW,
+         g_param_spec_uint("file-transfer-window",
+                           "File transfer window",
+                           "Number of file chunks in flight per transfer",
+                           1, 64, 4,
+                           G_PARAM_READWRITE |
+                           G_PARAM_CONSTRUCT |
+                           G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceMainChannel:file-transfer-batch-window:
+     *
+     * Number of files of a spice_main_channel_file_copy_async() operation
+     * that are transferred concurrently. The handshakes with the agent of
+     * the next files overlap with the data of the current ones, which
+     * matters when copying directories with many small files.
+     *
+     * Since: 0.39
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_FILE_TRANSFER_BATCH_WINDOW,
+         g_param_spec_uint("file-transfer-batch-window",
+                           "File transfer batch window",
+                           "Number of files transferred concurrently per operation",
+                           1, 1024, 16,
+                           G_PARAM_READWRITE |
+                           G_PARAM_CONSTRUCT |
+                           G_PARAM_STATIC_STRINGS));
+
     /* TODO use notify instead */
     /**
      * SpiceMainChannel::main-mouse-update:
@@ -677,6 +824,37 @@ static void spice_main_channel_class_init(SpiceMainChannelClass *klass)
                      4,
                      G_TYPE_UINT, G_TYPE_UINT, G_TYPE_POINTER, G_TYPE_UINT);
 
+    /**
+     * SpiceMainChannel::main-clipboard-selection-fragment:
+     * @main: the #SpiceMainChannel that emitted the signal
+     * @selection: a VD_AGENT_CLIPBOARD_SELECTION clipboard
+     * @type: the VD_AGENT_CLIPBOARD data type
+     * @offset: offset of @data in the clipboard data
+     * @data: a fragment of the clipboard data
+     * @size: size of @data in bytes
+     * @total: size of the whole clipboard data in bytes
+     *
+     * Provides clipboard selection data as it is received from the
+     * guest, without waiting for the whole data. The fragments come in
+     * order, the last one has @offset + @size equal to @total.
+     *
+     * Unlike #SpiceMainChannel::main-clipboard-selection, large data is
+     * never held in memory at once by the channel.
+     *
+     * Since: 0.39
+     **/
+    signals[SPICE_MAIN_CLIPBOARD_SELECTION_FRAGMENT] =
+        g_signal_new("main-clipboard-selection-fragment",
+                     G_OBJECT_CLASS_TYPE(gobject_class),
+                     G_SIGNAL_RUN_LAST,
+                     0,
+                     NULL, NULL,
+                     g_cclosure_user_marshal_VOID__UINT_UINT_UINT_POINTER_UINT_UINT,
+                     G_TYPE_NONE,
+                     6,
+                     G_TYPE_UINT, G_TYPE_UINT, G_TYPE_UINT,
+                     G_TYPE_POINTER, G_TYPE_UINT, G_TYPE_UINT);
+
     /**
      * SpiceMainChannel::main-clipboard-grab:
      * @main: the #SpiceMainChannel that emitted the signal
@@ -857,20 +1035,252 @@ static void spice_main_channel_class_init(SpiceMainChannelClass *klass)
 /* ------------------------------------------------------------------ */
 
 
+static const guint agent_msg_class_weight[AGENT_MSG_CLASS_LAST] = {
+    [AGENT_MSG_CLASS_CONTROL] = 0, /* strict priority */
+    [AGENT_MSG_CLASS_CLIPBOARD] = 4,
+    [AGENT_MSG_CLASS_FILE_XFER] = 1,
+};
+
+static const char *agent_msg_class_name[AGENT_MSG_CLASS_LAST] = {
+    [AGENT_MSG_CLASS_CONTROL] = "control",
+    [AGENT_MSG_CLASS_CLIPBOARD] = "clipboard",
+    [AGENT_MSG_CLASS_FILE_XFER] = "file-xfer",
+};
+
+static AgentMsgClass agent_msg_class_from_type(int type)
+{
+    switch (type) {
+    case VD_AGENT_CLIPBOARD:
+        return AGENT_MSG_CLASS_CLIPBOARD;
+    case VD_AGENT_FILE_XFER_DATA:
+        return AGENT_MSG_CLASS_FILE_XFER;
+    default:
+        return AGENT_MSG_CLASS_CONTROL;
+    }
+}
+
+static AgentMsg *agent_msg_new(int type, gpointer owner)
+{
+    AgentMsg *msg = g_new0(AgentMsg, 1);
+
+    g_queue_init(&msg->parts);
+    msg->owner = owner;
+    msg->type = type;
+    msg->klass = agent_msg_class_from_type(type);
+    msg->stream_class = AGENT_MSG_CLASS_CONTROL;
+
+    return msg;
+}
+
+/* find the stream @msg is about from its @head, the data following the
+ * agent message header */
+static void agent_msg_set_stream(SpiceMainChannel *channel, AgentMsg *msg,
+                                 const guint8 *head, gsize head_size)
+{
+    switch (msg->type) {
+    case VD_AGENT_CLIPBOARD:
+    case VD_AGENT_CLIPBOARD_GRAB:
+    case VD_AGENT_CLIPBOARD_RELEASE:
+        msg->stream_class = AGENT_MSG_CLASS_CLIPBOARD;
+        msg->stream_id = VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD;
+        if (test_agent_cap(channel, VD_AGENT_CAP_CLIPBOARD_SELECTION) && head_size >= 1)
+            msg->stream_id = head[0];
+        break;
+    case VD_AGENT_FILE_XFER_DATA:
+    case VD_AGENT_FILE_XFER_STATUS:
+        /* both start with the task id */
+        if (head_size >= sizeof(guint32)) {
+            msg->stream_class = AGENT_MSG_CLASS_FILE_XFER;
+            memcpy(&msg->stream_id, head, sizeof(guint32));
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void agent_msg_free(AgentMsg *msg)
+{
+    if (msg->sent_func != NULL && !g_queue_is_empty(&msg->parts)) {
+        GError *error = g_error_new_literal(SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
+                                            "The agent message was dropped");
+        msg->sent_func(NULL, msg->n_parts - g_queue_get_length(&msg->parts),
+                       msg->n_parts, error, msg->sent_data);
+        g_error_free(error);
+    }
+    if (msg->cancelled_source != NULL) {
+        g_source_destroy(msg->cancelled_source);
+        g_source_unref(msg->cancelled_source);
+    }
+    g_clear_object(&msg->cancellable);
+    g_queue_foreach(&msg->parts, (GFunc)spice_msg_out_unref, NULL);
+    g_queue_clear(&msg->parts);
+    g_free(msg);
+}
+
+static void agent_msg_queues_init(SpiceMainChannel *channel)
+{
+    SpiceMainChannelPrivate *c = channel->priv;
+    gint i;
+
+    for (i = 0; i < AGENT_MSG_CLASS_LAST; i++) {
+        g_queue_init(&c->agent_queues[i].lanes);
+        c->agent_queues[i].depth = 0;
+        c->agent_queues[i].max_depth = 0;
+        c->agent_queues[i].credit = agent_msg_class_weight[i];
+    }
+}
+
 static void agent_free_msg_queue(SpiceMainChannel *channel)
 {
     SpiceMainChannelPrivate *c = channel->priv;
-    SpiceMsgOut *out;
+    AgentMsgLane *lane;
+    gint i;
+
+    for (i = 0; i < AGENT_MSG_CLASS_LAST; i++) {
+        AgentMsgQueue *q = &c->agent_queues[i];
+
+        while ((lane = g_queue_pop_head(&q->lanes)) != NULL) {
+            g_queue_foreach(&lane->msgs, (GFunc)agent_msg_free, NULL);
+            g_queue_clear(&lane->msgs);
+            g_free(lane);
+        }
+        q->depth = 0;
+    }
+
+    g_clear_pointer(&c->agent_msg_sending, agent_msg_free);
+}
+
+static AgentMsgLane *agent_msg_queue_find_lane(AgentMsgQueue *q, gpointer owner)
+{
+    GList *l;
+
+    for (l = q->lanes.head; l != NULL; l = l->next) {
+        AgentMsgLane *lane = l->data;
+        if (lane->owner == owner)
+            return lane;
+    }
+
+    return NULL;
+}
+
+/* returns the lane of @q holding the last queued message of the stream
+ * @stream_id, if any */
+static AgentMsgLane *agent_msg_queue_find_stream(AgentMsgQueue *q, AgentMsgClass klass,
+                                                 guint32 stream_id)
+{
+    AgentMsgLane *found = NULL;
+    GList *l, *m;
 
-    if (!c->agent_msg_queue)
+    for (l = q->lanes.head; l != NULL; l = l->next) {
+        AgentMsgLane *lane = l->data;
+
+        for (m = lane->msgs.head; m != NULL; m = m->next) {
+            AgentMsg *msg = m->data;
+
+            if (msg->stream_class == klass && msg->stream_id == stream_id) {
+                found = lane;
+                break;
+            }
+        }
+    }
+
+    return found;
+}
+
+/* any context */
+static void agent_msg_enqueue(SpiceMainChannel *channel, AgentMsg *msg)
+{
+    SpiceMainChannelPrivate *c = channel->priv;
+    AgentMsgQueue *q;
+    AgentMsgLane *lane = NULL;
+
+    if (g_queue_is_empty(&msg->parts)) {
+        agent_msg_free(msg);
         return;
+    }
+
+    if (msg->klass == AGENT_MSG_CLASS_CONTROL &&
+        msg->stream_class != AGENT_MSG_CLASS_CONTROL) {
+        /* keep the order with the queued data of the stream */
+        lane = agent_msg_queue_find_stream(&c->agent_queues[msg->stream_class],
+                                           msg->stream_class, msg->stream_id);
+        if (lane != NULL)
+            msg->klass = msg->stream_class;
+    }
+
+    q = &c->agent_queues[msg->klass];
+    if (lane == NULL)
+        lane = agent_msg_queue_find_lane(q, msg->owner);
+    if (lane == NULL) {
+        lane = g_new0(AgentMsgLane, 1);
+        lane->owner = msg->owner;
+        g_queue_init(&lane->msgs);
+        g_queue_push_tail(&q->lanes, lane);
+    }
+    g_queue_push_tail(&lane->msgs, msg);
+
+    msg->n_parts = g_queue_get_length(&msg->parts);
+    q->depth += msg->n_parts;
+    if (q->depth > q->max_depth)
+        q->max_depth = q->depth;
+}
+
+/* take the next message of @q, rotating its lanes */
+static AgentMsg *agent_msg_queue_pop(AgentMsgQueue *q)
+{
+    AgentMsgLane *lane = g_queue_pop_head(&q->lanes);
+    AgentMsg *msg;
+
+    if (lane == NULL)
+        return NULL;
 
-    while (!g_queue_is_empty(c->agent_msg_queue)) {
-        out = g_queue_pop_head(c->agent_msg_queue);
-        spice_msg_out_unref(out);
+    msg = g_queue_pop_head(&lane->msgs);
+    if (g_queue_is_empty(&lane->msgs))
+        g_free(lane);
+    else
+        g_queue_push_tail(&q->lanes, lane);
+
+    return msg;
+}
+
+static AgentMsg *agent_msg_next(SpiceMainChannel *channel)
+{
+    SpiceMainChannelPrivate *c = channel->priv;
+    AgentMsgQueue *q;
+    gint i, round;
+
+    q = &c->agent_queues[AGENT_MSG_CLASS_CONTROL];
+    if (!g_queue_is_empty(&q->lanes))
+        return agent_msg_queue_pop(q);
+
+    /* when no class with pending messages has credit left, refill them
+     * all and try again */
+    for (round = 0; round < 2; round++) {
+        for (i = AGENT_MSG_CLASS_CONTROL + 1; i < AGENT_MSG_CLASS_LAST; i++) {
+            q = &c->agent_queues[i];
+            if (q->credit > 0 && !g_queue_is_empty(&q->lanes)) {
+                q->credit--;
+                return agent_msg_queue_pop(q);
+            }
+        }
+        for (i = AGENT_MSG_CLASS_CONTROL + 1; i < AGENT_MSG_CLASS_LAST; i++)
+            c->agent_queues[i].credit = agent_msg_class_weight[i];
     }
 
-    g_clear_pointer(&c->agent_msg_queue, g_queue_free);
+    return NULL;
+}
+
+static guint agent_msg_queue_depth(SpiceMainChannel *channel)
+{
+    SpiceMainChannelPrivate *c = channel->priv;
+    guint depth = 0;
+    gint i;
+
+    for (i = 0; i < AGENT_MSG_CLASS_LAST; i++)
+        depth += c->agent_queues[i].depth;
+
+    return depth;
 }
 
 static gboolean flush_foreach_remove(gpointer key G_GNUC_UNUSED,
@@ -897,7 +1307,8 @@ static void file_xfer_flush_async(SpiceFileTransferTask *xfer_task,
     GTask *task;
     SpiceMainChannel *channel;
     SpiceMainChannelPrivate *c;
-    gboolean was_empty;
+    AgentMsgLane *lane;
+    AgentMsg *msg = NULL;
 
     channel = spice_file_transfer_task_get_channel(xfer_task);
     task = g_task_new(xfer_task,
@@ -905,16 +1316,22 @@ static void file_xfer_flush_async(SpiceFileTransferTask *xfer_task,
                       callback,
                       user_data);
 
+    /* file data is queued with the transfer operation as owner */
     c = channel->priv;
-    was_empty = g_queue_is_empty(c->agent_msg_queue);
-    if (was_empty) {
+    lane = agent_msg_queue_find_lane(&c->agent_queues[AGENT_MSG_CLASS_FILE_XFER], user_data);
+    if (lane != NULL)
+        msg = g_queue_peek_tail(&lane->msgs);
+    else if (c->agent_msg_sending != NULL && c->agent_msg_sending->owner == user_data)
+        msg = c->agent_msg_sending;
+
+    if (msg == NULL) {
         g_task_return_boolean(task, TRUE);
         g_object_unref(task);
         return;
     }
 
-    /* wait until the last message currently in the queue has been sent */
-    g_hash_table_insert(c->flushing, g_queue_peek_tail(c->agent_msg_queue), task);
+    /* wait until the last message of this operation has been sent */
+    g_hash_table_insert(c->flushing, g_queue_peek_tail(&msg->parts), task);
 }
 
 static gboolean file_xfer_flush_finish(SpiceFileTransferTask *xfer_task,
@@ -928,18 +1345,111 @@ static gboolean file_xfer_flush_finish(SpiceFileTransferTask *xfer_task,
     return g_task_propagate_boolean(task, error);
 }
 
+/* drop @msg, which was taken out of the queues before being started */
+static void agent_msg_drop(SpiceMainChannel *channel, AgentMsg *msg, const GError *error)
+{
+    SpiceMainChannelPrivate *c = channel->priv;
+
+    c->agent_queues[msg->klass].depth -= g_queue_get_length(&msg->parts);
+    if (msg->sent_func != NULL) {
+        msg->sent_func(channel, 0, msg->n_parts, error, msg->sent_data);
+        msg->sent_func = NULL;
+    }
+    agent_msg_free(msg);
+}
+
+/* coroutine context: drop @msg if it was cancelled before being started */
+static gboolean agent_msg_drop_if_cancelled(SpiceMainChannel *channel, AgentMsg *msg)
+{
+    GError *error = NULL;
+
+    if (!g_cancellable_set_error_if_cancelled(msg->cancellable, &error))
+        return FALSE;
+
+    agent_msg_drop(channel, msg, error);
+    g_error_free(error);
+
+    return TRUE;
+}
+
+/* main context: the message may never be dequeued without agent tokens,
+ * take it out of its queue as soon as it is cancelled */
+static gboolean agent_msg_cancelled(GCancellable *cancellable, gpointer user_data)
+{
+    AgentMsg *msg = user_data;
+    SpiceMainChannel *channel = msg->channel;
+    AgentMsgQueue *q = &channel->priv->agent_queues[msg->klass];
+    GError *error = NULL;
+    GList *l;
+
+    for (l = q->lanes.head; l != NULL; l = l->next) {
+        AgentMsgLane *lane = l->data;
+
+        if (!g_queue_remove(&lane->msgs, msg))
+            continue;
+        if (g_queue_is_empty(&lane->msgs)) {
+            g_queue_delete_link(&q->lanes, l);
+            g_free(lane);
+        }
+        g_cancellable_set_error_if_cancelled(cancellable, &error);
+        agent_msg_drop(channel, msg, error);
+        g_error_free(error);
+        break;
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+/* any context: @msg must be queued */
+static void agent_msg_set_cancellable(SpiceMainChannel *channel, AgentMsg *msg,
+                                      GCancellable *cancellable)
+{
+    if (cancellable == NULL)
+        return;
+
+    msg->channel = channel;
+    msg->cancellable = g_object_ref(cancellable);
+    msg->cancelled_source = g_cancellable_source_new(cancellable);
+    g_source_set_callback(msg->cancelled_source, (GSourceFunc)agent_msg_cancelled, msg, NULL);
+    g_source_attach(msg->cancelled_source, NULL);
+}
+
 /* coroutine context */
 static void agent_send_msg_queue(SpiceMainChannel *channel)
 {
     SpiceMainChannelPrivate *c = channel->priv;
     SpiceMsgOut *out;
+    gint i;
 
-    while (c->agent_tokens > 0 &&
-           !g_queue_is_empty(c->agent_msg_queue)) {
+    while (c->agent_tokens > 0) {
         GTask *task;
+        AgentMsg *msg;
+
+        /* a message is always sent whole before picking the next one */
+        if (c->agent_msg_sending == NULL) {
+            msg = agent_msg_next(channel);
+            if (msg == NULL)
+                break;
+            if (agent_msg_drop_if_cancelled(channel, msg))
+                continue;
+            /* started, it can't be cancelled any more */
+            if (msg->cancelled_source != NULL) {
+                g_source_destroy(msg->cancelled_source);
+                g_clear_pointer(&msg->cancelled_source, g_source_unref);
+            }
+            c->agent_msg_sending = msg;
+        }
+        msg = c->agent_msg_sending;
+
         c->agent_tokens--;
-        out = g_queue_pop_head(c->agent_msg_queue);
+        out = g_queue_pop_head(&msg->parts);
+        c->agent_queues[msg->klass].depth--;
         spice_msg_out_send_internal(out);
+        if (msg->sent_func != NULL)
+            msg->sent_func(channel, msg->n_parts - g_queue_get_length(&msg->parts),
+                           msg->n_parts, NULL, msg->sent_data);
+        if (g_queue_is_empty(&msg->parts))
+            g_clear_pointer(&c->agent_msg_sending, agent_msg_free);
 
         task = g_hash_table_lookup(c->flushing, out);
         if (task) {
@@ -949,8 +1459,24 @@ static void agent_send_msg_queue(SpiceMainChannel *channel)
             g_object_unref(task);
         }
     }
-    if (g_queue_is_empty(c->agent_msg_queue) &&
-        g_hash_table_size(c->flushing) != 0) {
+
+    if (agent_msg_queue_depth(channel) != 0)
+        return;
+
+    if (c->agent_queues[AGENT_MSG_CLASS_CLIPBOARD].max_depth > 0 ||
+        c->agent_queues[AGENT_MSG_CLASS_FILE_XFER].max_depth > 0) {
+        GString *str = g_string_new("agent queues drained, max depth:");
+
+        for (i = 0; i < AGENT_MSG_CLASS_LAST; i++) {
+            g_string_append_printf(str, " %s %u", agent_msg_class_name[i],
+                                   c->agent_queues[i].max_depth);
+            c->agent_queues[i].max_depth = 0;
+        }
+        CHANNEL_DEBUG(channel, "%s", str->str);
+        g_string_free(str, TRUE);
+    }
+
+    if (g_hash_table_size(c->flushing) != 0) {
         g_warning("unexpected flush task in list, clearing");
         file_xfer_flushed(channel, TRUE);
     }
@@ -968,20 +1494,25 @@ G_GNUC_NULL_TERMINATED
 static void agent_msg_queue_many(SpiceMainChannel *channel, int type, const void *data, ...)
 {
     va_list args;
-    SpiceMainChannelPrivate *c = channel->priv;
+    AgentMsg *queued = agent_msg_new(type, NULL);
     SpiceMsgOut *out;
     VDAgentMessage msg;
     guint8 *payload;
-    gsize paysize, s, mins, size = 0;
+    gsize paysize, s, mins, size = 0, head_size = 0;
     const guint8 *d;
 
     G_STATIC_ASSERT(VD_AGENT_MAX_DATA_SIZE > sizeof(VDAgentMessage));
 
     va_start(args, data);
-    for (d = data; d != NULL; d = va_arg(args, void*)) {
-        size += va_arg(args, gsize);
+    if (data != NULL) {
+        /* the first pair is the message head */
+        head_size = size = va_arg(args, gsize);
+        for (d = va_arg(args, void*); d != NULL; d = va_arg(args, void*)) {
+            size += va_arg(args, gsize);
+        }
     }
     va_end(args);
+    agent_msg_set_stream(channel, queued, data, head_size);
 
     msg.protocol = VD_AGENT_PROTOCOL;
     msg.type = type;
@@ -995,7 +1526,7 @@ static void agent_msg_queue_many(SpiceMainChannel *channel, int type, const void
     payload += sizeof(VDAgentMessage);
     paysize -= sizeof(VDAgentMessage);
     if (paysize == 0) {
-        g_queue_push_tail(c->agent_msg_queue, out);
+        g_queue_push_tail(&queued->parts, out);
         out = NULL;
     }
 
@@ -1016,13 +1547,72 @@ static void agent_msg_queue_many(SpiceMainChannel *channel, int type, const void
             size -= mins;
             paysize -= mins;
             if (paysize == 0) {
-                g_queue_push_tail(c->agent_msg_queue, out);
+                g_queue_push_tail(&queued->parts, out);
                 out = NULL;
             }
         }
     }
     va_end(args);
     g_warn_if_fail(out == NULL);
+    agent_msg_enqueue(channel, queued);
+}
+
+/* any context: same as agent_msg_queue_many() with a @head/@head_size
+   pair followed by @data. Each part is a single marshaller item, so the
+   data is copied once, when queued, and not again when written out.
+   Messages of the same @owner are sent in order, distinct owners of the
+   same class are served round-robin.
+
+   Returns: the queued message, owned by the queue
+*/
+static AgentMsg *agent_msg_queue_bytes(SpiceMainChannel *channel, int type, gpointer owner,
+                                       const void *head, gsize head_size, GBytes *data)
+{
+    AgentMsg *queued;
+    SpiceMsgOut *out;
+    VDAgentMessage msg;
+    const guint8 *d = NULL;
+    guint8 *payload;
+    gsize paysize, size = 0;
+
+    g_return_val_if_fail(sizeof(VDAgentMessage) + head_size <= VD_AGENT_MAX_DATA_SIZE, NULL);
+
+    if (data != NULL)
+        d = g_bytes_get_data(data, &size);
+    queued = agent_msg_new(type, owner);
+    agent_msg_set_stream(channel, queued, head, head_size);
+
+    msg.protocol = VD_AGENT_PROTOCOL;
+    msg.type = type;
+    msg.opaque = 0;
+    msg.size = head_size + size;
+
+    /* the headers go in the first message */
+    paysize = MIN(VD_AGENT_MAX_DATA_SIZE, sizeof(VDAgentMessage) + head_size + size);
+    out = spice_msg_out_new(SPICE_CHANNEL(channel), SPICE_MSGC_MAIN_AGENT_DATA);
+    payload = spice_marshaller_reserve_space(out->marshaller, paysize);
+    memcpy(payload, &msg, sizeof(VDAgentMessage));
+    memcpy(payload + sizeof(VDAgentMessage), head, head_size);
+    payload += sizeof(VDAgentMessage) + head_size;
+    paysize -= sizeof(VDAgentMessage) + head_size;
+
+    for (;;) {
+        if (paysize > 0) {
+            memcpy(payload, d, paysize);
+            d += paysize;
+            size -= paysize;
+        }
+        g_queue_push_tail(&queued->parts, out);
+        if (size == 0)
+            break;
+
+        paysize = MIN(VD_AGENT_MAX_DATA_SIZE, size);
+        out = spice_msg_out_new(SPICE_CHANNEL(channel), SPICE_MSGC_MAIN_AGENT_DATA);
+        payload = spice_marshaller_reserve_space(out->marshaller, paysize);
+    }
+    agent_msg_enqueue(channel, queued);
+
+    return queued;
 }
 
 static int monitors_cmp(const void *p1, const void *p2, gpointer user_data)
@@ -1380,26 +1970,30 @@ static void agent_clipboard_grab(SpiceMainChannel *channel, guint selection,
 }
 
 /* any context: the message is not flushed immediately,
-   you can wakeup() the channel coroutine or send_msg_queue() */
-static void agent_clipboard_notify(SpiceMainChannel *self, guint selection,
-                                   guint32 type, const guchar *data, size_t size)
+   you can wakeup() the channel coroutine or send_msg_queue()
+
+   Returns: the queued message, owned by the queue, or NULL if it was
+   ignored */
+static AgentMsg *agent_clipboard_notify_bytes(SpiceMainChannel *self, guint selection,
+                                              guint32 type, GBytes *data)
 {
     SpiceMainChannelPrivate *c = self->priv;
     VDAgentClipboard *cb;
     guint8 *msg;
     size_t msgsize;
+    gsize size = data ? g_bytes_get_size(data) : 0;
     gint max_clipboard = spice_main_get_max_clipboard(self);
 
-    g_return_if_fail(c->agent_connected);
-    g_return_if_fail(test_agent_cap(self, VD_AGENT_CAP_CLIPBOARD_BY_DEMAND));
-    g_return_if_fail(max_clipboard == -1 || size < max_clipboard);
+    g_return_val_if_fail(c->agent_connected, NULL);
+    g_return_val_if_fail(test_agent_cap(self, VD_AGENT_CAP_CLIPBOARD_BY_DEMAND), NULL);
+    g_return_val_if_fail(max_clipboard == -1 || size < max_clipboard, NULL);
 
     msgsize = sizeof(VDAgentClipboard);
     if (test_agent_cap(self, VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
         msgsize += 4;
     } else if (selection != VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD) {
         CHANNEL_DEBUG(self, "Ignoring clipboard notify");
-        return;
+        return NULL;
     }
 
     msg = g_alloca(msgsize);
@@ -1413,7 +2007,18 @@ static void agent_clipboard_notify(SpiceMainChannel *self, guint selection,
     }
 
     cb->type = type;
-    agent_msg_queue_many(self, VD_AGENT_CLIPBOARD, msg, msgsize, data, size, NULL);
+    return agent_msg_queue_bytes(self, VD_AGENT_CLIPBOARD, NULL, msg, msgsize, data);
+}
+
+/* any context: the message is not flushed immediately,
+   you can wakeup() the channel coroutine or send_msg_queue() */
+static void agent_clipboard_notify(SpiceMainChannel *self, guint selection,
+                                   guint32 type, const guchar *data, size_t size)
+{
+    GBytes *bytes = g_bytes_new(data, size);
+
+    agent_clipboard_notify_bytes(self, selection, type, bytes);
+    g_bytes_unref(bytes);
 }
 
 /* any context: the message is not flushed immediately,
@@ -1791,6 +2396,29 @@ static void main_handle_agent_disconnected(SpiceChannel *channel, SpiceMsgIn *in
     agent_stopped(SPICE_MAIN_CHANNEL(channel));
 }
 
+/* main context: keep up to the window of chunks queued to the agent.
+ * Besides the first chunk, more are only read when the agent tokens
+ * allow sending what is already queued, so that the read-ahead follows
+ * the pace of the agent */
+static void file_xfer_pump(SpiceFileTransferTask *xfer_task, FileTransferOperation *xfer_op)
+{
+    SpiceMainChannel *channel = spice_file_transfer_task_get_channel(xfer_task);
+    SpiceMainChannelPrivate *c = channel->priv;
+    guint in_flight;
+
+    if (spice_file_transfer_task_is_completed(xfer_task) ||
+        spice_file_transfer_task_is_reading(xfer_task))
+        return;
+
+    in_flight = spice_file_transfer_task_get_in_flight(xfer_task);
+    if (in_flight > 0 &&
+        (in_flight >= spice_file_transfer_task_get_window(xfer_task) ||
+         (gint)agent_msg_queue_depth(channel) > c->agent_tokens))
+        return;
+
+    spice_file_transfer_task_read_async(xfer_task, file_xfer_read_async_cb, xfer_op);
+}
+
 static void file_xfer_data_flushed_cb(GObject *source_object,
                                       GAsyncResult *res,
                                       gpointer user_data)
@@ -1806,26 +2434,26 @@ static void file_xfer_data_flushed_cb(GObject *source_object,
 
     /* task might be completed while on idle */
     if (!spice_file_transfer_task_is_completed(xfer_task)) {
+        spice_file_transfer_task_chunk_sent(xfer_task);
         file_transfer_operation_send_progress(xfer_task);
         /* Read more data */
-        spice_file_transfer_task_read_async(xfer_task, file_xfer_read_async_cb, user_data);
+        file_xfer_pump(xfer_task, user_data);
     }
 }
 
 static void file_xfer_queue_msg_to_agent(SpiceMainChannel *channel,
+                                         FileTransferOperation *xfer_op,
                                          guint32 task_id,
-                                         gchar *buffer,
-                                         gint data_size)
+                                         GBytes *buffer)
 {
     VDAgentFileXferDataMessage msg;
 
     g_return_if_fail(channel != NULL);
 
     msg.id = task_id;
-    msg.size = data_size;
-    agent_msg_queue_many(channel, VD_AGENT_FILE_XFER_DATA,
-                         &msg, sizeof(msg),
-                         buffer, (gsize) data_size, NULL);
+    msg.size = buffer ? g_bytes_get_size(buffer) : 0;
+    agent_msg_queue_bytes(channel, VD_AGENT_FILE_XFER_DATA, xfer_op,
+                          &msg, sizeof(msg), buffer);
     spice_channel_wakeup(SPICE_CHANNEL(channel), FALSE);
 }
 
@@ -1838,7 +2466,7 @@ static void file_xfer_read_async_cb(GObject *source_object,
     SpiceFileTransferTask *xfer_task;
     SpiceMainChannel *channel;
     gssize count;
-    char *buffer;
+    GBytes *buffer = NULL;
     GError *error = NULL;
 
     xfer_task = SPICE_FILE_TRANSFER_TASK(source_object);
@@ -1860,7 +2488,9 @@ static void file_xfer_read_async_cb(GObject *source_object,
         return;
     }
 
-    file_xfer_queue_msg_to_agent(channel, spice_file_transfer_task_get_id(xfer_task), buffer, count);
+    file_xfer_queue_msg_to_agent(channel, xfer_op,
+                                 spice_file_transfer_task_get_id(xfer_task), buffer);
+    g_clear_pointer(&buffer, g_bytes_unref);
     if (count == 0 || spice_file_transfer_task_is_completed(xfer_task)) {
         /* on EOF just wait for VD_AGENT_FILE_XFER_STATUS from agent
          * in case the task was completed, nothing to do. */
@@ -1869,7 +2499,11 @@ static void file_xfer_read_async_cb(GObject *source_object,
 
     xfer_op->stats.total_sent += count;
 
+    /* one flush per chunk: they complete in order as the agent queue
+     * drains, while the next chunks are already being read */
+    spice_file_transfer_task_chunk_queued(xfer_task, count);
     file_xfer_flush_async(xfer_task, file_xfer_data_flushed_cb, xfer_op);
+    file_xfer_pump(xfer_task, xfer_op);
 }
 
 /* coroutine context */
@@ -1889,7 +2523,7 @@ static void main_agent_handle_xfer_status(SpiceMainChannel *channel,
     switch (msg->result) {
     case VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA:
         g_return_if_fail(spice_file_transfer_task_is_completed(xfer_task) == FALSE);
-        spice_file_transfer_task_read_async(xfer_task, file_xfer_read_async_cb, xfer_op);
+        file_xfer_pump(xfer_task, xfer_op);
         return;
     case VD_AGENT_FILE_XFER_STATUS_CANCELLED:
         error = g_error_new_literal(SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
@@ -2031,8 +2665,12 @@ static void main_agent_handle_msg(SpiceChannel *channel,
     case VD_AGENT_CLIPBOARD:
     {
         VDAgentClipboard *cb = payload;
+        guint size = msg->size - sizeof(VDAgentClipboard);
+
+        g_coroutine_signal_emit(self, signals[SPICE_MAIN_CLIPBOARD_SELECTION_FRAGMENT], 0,
+                                selection, cb->type, 0, cb->data, size, size);
         g_coroutine_signal_emit(self, signals[SPICE_MAIN_CLIPBOARD_SELECTION], 0, selection,
-                                cb->type, cb->data, msg->size - sizeof(VDAgentClipboard));
+                                cb->type, cb->data, size);
 
        if (selection == VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD)
            g_coroutine_signal_emit(self, signals[SPICE_MAIN_CLIPBOARD], 0,
@@ -2085,6 +2723,173 @@ static void main_agent_handle_msg(SpiceChannel *channel,
     }
 }
 
+/* main or coroutine context */
+static void clipboard_stream_reset(SpiceMainChannel *channel)
+{
+    ClipboardStream *cs = &channel->priv->clipboard_stream;
+
+    g_clear_pointer(&cs->fragment, g_byte_array_unref);
+    g_clear_pointer(&cs->copy, g_free);
+    g_clear_object(&cs->spill_stream);
+    if (cs->spill != NULL) {
+        g_file_delete(cs->spill, NULL, NULL);
+        g_clear_object(&cs->spill);
+    }
+    memset(cs, 0, sizeof(*cs));
+}
+
+static gboolean clipboard_wants_copy(SpiceMainChannel *channel)
+{
+    return g_signal_has_handler_pending(channel, signals[SPICE_MAIN_CLIPBOARD_SELECTION], 0, FALSE) ||
+           g_signal_has_handler_pending(channel, signals[SPICE_MAIN_CLIPBOARD], 0, FALSE);
+}
+
+/* coroutine context */
+static gboolean clipboard_stream_begin(SpiceMainChannel *channel, guint32 msg_size)
+{
+    ClipboardStream *cs = &channel->priv->clipboard_stream;
+
+    cs->head_size = sizeof(VDAgentClipboard);
+    if (test_agent_cap(channel, VD_AGENT_CAP_CLIPBOARD_SELECTION))
+        cs->head_size += sizeof(guint32);
+    if (msg_size < cs->head_size)
+        return FALSE;
+
+    cs->active = TRUE;
+    cs->head_pos = 0;
+    cs->selection = VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD;
+    cs->offset = 0;
+    cs->size = msg_size - cs->head_size;
+    cs->fragment = g_byte_array_sized_new(MIN(cs->size, CLIPBOARD_FRAGMENT_SIZE));
+
+    return TRUE;
+}
+
+/* coroutine context */
+static void clipboard_stream_parse_head(SpiceMainChannel *channel)
+{
+    ClipboardStream *cs = &channel->priv->clipboard_stream;
+    VDAgentClipboard cb;
+    GError *error = NULL;
+
+    if (cs->head_size > sizeof(VDAgentClipboard))
+        cs->selection = cs->head[0];
+    memcpy(&cb, cs->head + cs->head_size - sizeof(VDAgentClipboard), sizeof(cb));
+    cs->type = cb.type;
+
+    if (!clipboard_wants_copy(channel))
+        return;
+
+    if (cs->size < CLIPBOARD_SPILL_SIZE) {
+        cs->copy = g_malloc(cs->size);
+        return;
+    }
+
+    cs->spill = g_file_new_tmp("spice-clipboard-XXXXXX", &cs->spill_stream, &error);
+    if (cs->spill == NULL) {
+        g_warning("failed to create clipboard spill file: %s", error->message);
+        g_clear_error(&error);
+        cs->copy = g_malloc(cs->size);
+    }
+}
+
+/* coroutine context */
+static void clipboard_stream_flush(SpiceMainChannel *channel)
+{
+    ClipboardStream *cs = &channel->priv->clipboard_stream;
+    GError *error = NULL;
+
+    if (cs->copy != NULL) {
+        memcpy(cs->copy + cs->offset, cs->fragment->data, cs->fragment->len);
+    } else if (cs->spill_stream != NULL) {
+        GOutputStream *out = g_io_stream_get_output_stream(G_IO_STREAM(cs->spill_stream));
+
+        if (!g_output_stream_write_all(out, cs->fragment->data, cs->fragment->len,
+                                       NULL, NULL, &error)) {
+            g_warning("failed to write clipboard spill file: %s", error->message);
+            g_clear_error(&error);
+            g_clear_object(&cs->spill_stream);
+            g_file_delete(cs->spill, NULL, NULL);
+            g_clear_object(&cs->spill);
+        }
+    }
+
+    g_coroutine_signal_emit(channel, signals[SPICE_MAIN_CLIPBOARD_SELECTION_FRAGMENT], 0,
+                            cs->selection, cs->type, cs->offset,
+                            cs->fragment->data, cs->fragment->len, cs->size);
+    /* the agent may have been reset while the handlers ran */
+    if (!cs->active)
+        return;
+    cs->offset += cs->fragment->len;
+    g_byte_array_set_size(cs->fragment, 0);
+}
+
+/* coroutine context */
+static void clipboard_stream_feed(SpiceMainChannel *channel, const guint8 *data, guint size)
+{
+    ClipboardStream *cs = &channel->priv->clipboard_stream;
+    guint n;
+
+    if (cs->head_pos < cs->head_size) {
+        n = MIN(cs->head_size - cs->head_pos, size);
+        memcpy(cs->head + cs->head_pos, data, n);
+        cs->head_pos += n;
+        data += n;
+        size -= n;
+        if (cs->head_pos < cs->head_size)
+            return;
+        clipboard_stream_parse_head(channel);
+    }
+
+    while (size > 0 && cs->active) {
+        n = MIN(CLIPBOARD_FRAGMENT_SIZE - cs->fragment->len, size);
+        g_byte_array_append(cs->fragment, data, n);
+        data += n;
+        size -= n;
+        if (cs->fragment->len == CLIPBOARD_FRAGMENT_SIZE)
+            clipboard_stream_flush(channel);
+    }
+}
+
+/* coroutine context */
+static void clipboard_stream_end(SpiceMainChannel *channel)
+{
+    ClipboardStream *cs = &channel->priv->clipboard_stream;
+    GMappedFile *mapped = NULL;
+    const guint8 *copy = cs->copy;
+    GError *error = NULL;
+
+    if (cs->fragment->len > 0 || cs->size == 0)
+        clipboard_stream_flush(channel);
+    if (!cs->active)
+        return;
+
+    if (cs->spill_stream != NULL &&
+        g_io_stream_close(G_IO_STREAM(cs->spill_stream), NULL, &error)) {
+        gchar *path = g_file_get_path(cs->spill);
+
+        mapped = g_mapped_file_new(path, FALSE, &error);
+        if (mapped != NULL)
+            copy = (const guint8 *)g_mapped_file_get_contents(mapped);
+        g_free(path);
+    }
+    if (error != NULL) {
+        g_warning("failed to read clipboard spill file: %s", error->message);
+        g_clear_error(&error);
+    }
+
+    if (copy != NULL || (cs->size == 0 && clipboard_wants_copy(channel))) {
+        g_coroutine_signal_emit(channel, signals[SPICE_MAIN_CLIPBOARD_SELECTION], 0,
+                                cs->selection, cs->type, copy, cs->size);
+        if (cs->selection == VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD)
+            g_coroutine_signal_emit(channel, signals[SPICE_MAIN_CLIPBOARD], 0,
+                                    cs->type, copy, cs->size);
+    }
+
+    g_clear_pointer(&mapped, g_mapped_file_unref);
+    clipboard_stream_reset(channel);
+}
+
 /* coroutine context */
 static void main_handle_agent_data_msg(SpiceChannel* channel, int* msg_size, guchar** msg_pos)
 {
@@ -2101,20 +2906,29 @@ static void main_handle_agent_data_msg(SpiceChannel* channel, int* msg_size, guc
             SPICE_DEBUG("agent msg start: msg_size=%u, protocol=%u, type=%u",
                         c->agent_msg.size, c->agent_msg.protocol, c->agent_msg.type);
             g_return_if_fail(c->agent_msg_data == NULL);
-            c->agent_msg_data = g_malloc0(c->agent_msg.size);
+            if (c->agent_msg.protocol != VD_AGENT_PROTOCOL ||
+                c->agent_msg.type != VD_AGENT_CLIPBOARD ||
+                !clipboard_stream_begin(SPICE_MAIN_CHANNEL(channel), c->agent_msg.size))
+                c->agent_msg_data = g_malloc(c->agent_msg.size);
         }
     }
 
     if (c->agent_msg_pos >= sizeof(VDAgentMessage)) {
         n = MIN(sizeof(VDAgentMessage) + c->agent_msg.size - c->agent_msg_pos, *msg_size);
-        memcpy(c->agent_msg_data + c->agent_msg_pos - sizeof(VDAgentMessage), *msg_pos, n);
+        if (c->clipboard_stream.active)
+            clipboard_stream_feed(SPICE_MAIN_CHANNEL(channel), *msg_pos, n);
+        else
+            memcpy(c->agent_msg_data + c->agent_msg_pos - sizeof(VDAgentMessage), *msg_pos, n);
         c->agent_msg_pos += n;
         *msg_size -= n;
         *msg_pos += n;
     }
 
     if (c->agent_msg_pos == sizeof(VDAgentMessage) + c->agent_msg.size) {
-        main_agent_handle_msg(channel, &c->agent_msg, c->agent_msg_data);
+        if (c->clipboard_stream.active)
+            clipboard_stream_end(SPICE_MAIN_CHANNEL(channel));
+        else
+            main_agent_handle_msg(channel, &c->agent_msg, c->agent_msg_data);
         g_free(c->agent_msg_data);
         c->agent_msg_data = NULL;
         c->agent_msg_pos = 0;
@@ -2875,6 +3689,141 @@ void spice_main_channel_clipboard_selection_notify(SpiceMainChannel *channel, gu
     spice_channel_wakeup(SPICE_CHANNEL(channel), FALSE);
 }
 
+typedef struct {
+    GTask                   *task;
+    GFileProgressCallback   progress_callback;
+    gpointer                progress_callback_data;
+    goffset                 total;
+    gsize                   head_size;
+} ClipboardNotifyOperation;
+
+/* coroutine context */
+static void clipboard_notify_sent(SpiceMainChannel *channel, guint sent, guint total,
+                                  const GError *error, gpointer user_data)
+{
+    ClipboardNotifyOperation *op = user_data;
+
+    if (error != NULL) {
+        g_task_return_error(op->task, g_error_copy(error));
+    } else {
+        if (op->progress_callback != NULL) {
+            /* the first part also carries the headers */
+            goffset current = (goffset)sent * VD_AGENT_MAX_DATA_SIZE - op->head_size;
+            op->progress_callback(MIN(current, op->total), op->total,
+                                  op->progress_callback_data);
+        }
+        if (sent < total)
+            return;
+        g_task_return_boolean(op->task, TRUE);
+    }
+
+    g_object_unref(op->task);
+    g_free(op);
+}
+
+/**
+ * spice_main_channel_clipboard_selection_notify_async:
+ * @channel: a #SpiceMainChannel
+ * @selection: one of the clipboard #VD_AGENT_CLIPBOARD_SELECTION_*
+ * @type: a #VD_AGENT_CLIPBOARD type
+ * @data: clipboard data
+ * @cancellable: (allow-none): optional #GCancellable object, %NULL to ignore
+ * @progress_callback: (allow-none) (scope notified): function to callback with
+ *     progress information, or %NULL if progress information is not needed
+ * @progress_callback_data: (closure): user data to pass to @progress_callback
+ * @callback: a #GAsyncReadyCallback to call when the data has been sent
+ * @user_data: the data to pass to callback function
+ *
+ * Send the clipboard data to the guest, like
+ * spice_main_channel_clipboard_selection_notify(). The data goes out as
+ * the agent flow control allows, and @callback is called once it has all
+ * been sent.
+ *
+ * The guest can't receive partial clipboard data: cancelling only has an
+ * effect if the data didn't start to be sent yet.
+ *
+ * Since: 0.39
+ **/
+void spice_main_channel_clipboard_selection_notify_async(SpiceMainChannel *channel,
+                                                         guint selection,
+                                                         guint32 type,
+                                                         GBytes *data,
+                                                         GCancellable *cancellable,
+                                                         GFileProgressCallback progress_callback,
+                                                         gpointer progress_callback_data,
+                                                         GAsyncReadyCallback callback,
+                                                         gpointer user_data)
+{
+    ClipboardNotifyOperation *op;
+    AgentMsg *msg;
+    GTask *task;
+    gint max_clipboard;
+
+    g_return_if_fail(SPICE_IS_MAIN_CHANNEL(channel));
+    g_return_if_fail(data != NULL);
+
+    task = g_task_new(channel, cancellable, callback, user_data);
+    if (g_task_return_error_if_cancelled(task)) {
+        g_object_unref(task);
+        return;
+    }
+
+    max_clipboard = spice_main_get_max_clipboard(channel);
+    if (!channel->priv->agent_connected ||
+        !test_agent_cap(channel, VD_AGENT_CAP_CLIPBOARD_BY_DEMAND) ||
+        (max_clipboard != -1 && g_bytes_get_size(data) >= max_clipboard)) {
+        g_task_return_new_error(task, SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
+                                "The agent can't receive this clipboard data");
+        g_object_unref(task);
+        return;
+    }
+
+    msg = agent_clipboard_notify_bytes(channel, selection, type, data);
+    if (msg == NULL) {
+        g_task_return_new_error(task, SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
+                                "Clipboard data ignored for this selection");
+        g_object_unref(task);
+        return;
+    }
+
+    op = g_new0(ClipboardNotifyOperation, 1);
+    op->task = task;
+    op->progress_callback = progress_callback;
+    op->progress_callback_data = progress_callback_data;
+    op->total = g_bytes_get_size(data);
+    op->head_size = sizeof(VDAgentMessage) + sizeof(VDAgentClipboard);
+    if (test_agent_cap(channel, VD_AGENT_CAP_CLIPBOARD_SELECTION))
+        op->head_size += 4;
+    agent_msg_set_cancellable(channel, msg, cancellable);
+    msg->sent_func = clipboard_notify_sent;
+    msg->sent_data = op;
+
+    spice_channel_wakeup(SPICE_CHANNEL(channel), FALSE);
+}
+
+/**
+ * spice_main_channel_clipboard_selection_notify_finish:
+ * @channel: a #SpiceMainChannel
+ * @result: a #GAsyncResult
+ * @error: a #GError
+ *
+ * Finishes sending clipboard data started with
+ * spice_main_channel_clipboard_selection_notify_async().
+ *
+ * Returns: %TRUE if the data was sent to the guest, %FALSE otherwise.
+ *
+ * Since: 0.39
+ **/
+gboolean spice_main_channel_clipboard_selection_notify_finish(SpiceMainChannel *channel,
+                                                              GAsyncResult *result,
+                                                              GError **error)
+{
+    g_return_val_if_fail(SPICE_IS_MAIN_CHANNEL(channel), FALSE);
+    g_return_val_if_fail(g_task_is_valid(result, channel), FALSE);
+
+    return g_task_propagate_boolean(G_TASK(result), error);
+}
+
 /**
  * spice_main_clipboard_request:
  * @channel: a #SpiceMainChannel
@@ -3038,11 +3987,15 @@ static void file_xfer_init_task_async_cb(GObject *obj, GAsyncResult *res, gpoint
         goto failed;
 
     channel = spice_file_transfer_task_get_channel(xfer_task);
-    basename = g_file_info_get_attribute_byte_string(info, G_FILE_ATTRIBUTE_STANDARD_NAME);
+    basename = spice_file_transfer_task_get_name(xfer_task);
+    if (basename == NULL)
+        basename = g_file_info_get_attribute_byte_string(info, G_FILE_ATTRIBUTE_STANDARD_NAME);
     file_size = g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_STANDARD_SIZE);
 
+    /* files found in directories were accounted when listed */
     xfer_op = data;
-    xfer_op->stats.transfer_size += file_size;
+    xfer_op->stats.transfer_size += (goffset)file_size -
+                                    (goffset)spice_file_transfer_task_get_expected_size(xfer_task);
 
     keyfile = g_key_file_new();
     g_key_file_set_string(keyfile, "vdagent-file-xfer", "name", basename);
@@ -3084,7 +4037,8 @@ static void file_transfer_operation_free(FileTransferOperation *xfer_op)
                                     xfer_op->stats.failed);
         SPICE_DEBUG("Transfer failed (%p) %s", xfer_op, error->message);
         g_task_return_error(xfer_op->task, error);
-    } else if (xfer_op->stats.cancelled != 0 && xfer_op->stats.succeed == 0) {
+    } else if ((xfer_op->stats.cancelled != 0 || g_cancellable_is_cancelled(xfer_op->cancellable)) &&
+               xfer_op->stats.succeed == 0) {
         GError *error = g_error_new(G_IO_ERROR,
                                     G_IO_ERROR_CANCELLED,
                                     "Transferring %u files: %u succeed, %u cancelled, %u failed",
@@ -3098,8 +4052,20 @@ static void file_transfer_operation_free(FileTransferOperation *xfer_op)
         SPICE_DEBUG("Transfer successful (%p)", xfer_op);
         g_task_return_boolean(xfer_op->task, TRUE);
     }
+
+    if (spice_util_get_debug()) {
+        gint64 elapsed = g_get_monotonic_time() - xfer_op->stats.start_time;
+        gchar *rate = g_format_size(elapsed > 0 ?
+                                    xfer_op->stats.total_sent * G_USEC_PER_SEC / elapsed : 0);
+
+        SPICE_DEBUG("Transfer (%p) sent %" G_GINT64_FORMAT " bytes in %.1f seconds (%s/s)",
+                    xfer_op, (gint64)xfer_op->stats.total_sent,
+                    (double)elapsed / G_USEC_PER_SEC, rate);
+        g_free(rate);
+    }
     g_object_unref(xfer_op->task);
     g_hash_table_unref(xfer_op->xfer_task);
+    g_clear_object(&xfer_op->cancellable);
 
     spice_debug("Freeing file-transfer-operation %p", xfer_op);
     g_free(xfer_op);
@@ -3184,6 +4150,8 @@ static void file_transfer_operation_task_finished(SpiceFileTransferTask *xfer_ta
          * in the progress-callback */
         guint64 file_size = spice_file_transfer_task_get_total_bytes(xfer_task);
         guint64 bytes_read = spice_file_transfer_task_get_transferred_bytes(xfer_task);
+        if (file_size == 0)
+            file_size = spice_file_transfer_task_get_expected_size(xfer_task);
         xfer_op->stats.transfer_size -= (file_size - bytes_read);
         if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
             xfer_op->stats.cancelled++;
@@ -3200,9 +4168,274 @@ static void file_transfer_operation_task_finished(SpiceFileTransferTask *xfer_ta
     /* Keep file_xfer_tasks up to date. If no more elements, operation is over */
     g_hash_table_remove(channel->priv->file_xfer_tasks, GUINT_TO_POINTER(task_id));
 
+    if (!g_queue_remove(&xfer_op->pending, xfer_task))
+        xfer_op->active--;
+
     /* No more pending operations */
-    if (g_hash_table_size(xfer_op->xfer_task) == 0)
-        file_transfer_operation_free(xfer_op);
+    if (!file_transfer_operation_check_done(xfer_op))
+        file_transfer_operation_start_tasks(xfer_op);
+}
+
+/* main context: TRUE if @xfer_op is over, and has been freed */
+static gboolean file_transfer_operation_check_done(FileTransferOperation *xfer_op)
+{
+    if (g_hash_table_size(xfer_op->xfer_task) != 0 || xfer_op->enumerating != 0)
+        return FALSE;
+
+    file_transfer_operation_free(xfer_op);
+    return TRUE;
+}
+
+/* main context: complete all the pending tasks with @error. The last
+ * one might free @xfer_op */
+static void file_transfer_operation_fail_pending(FileTransferOperation *xfer_op,
+                                                 const GError *error)
+{
+    GList *it, *tasks = xfer_op->pending.head;
+
+    /* they are accounted as active, so that finishing them doesn't
+     * start the next ones */
+    xfer_op->active += g_queue_get_length(&xfer_op->pending);
+    g_queue_init(&xfer_op->pending);
+
+    for (it = tasks; it != NULL; it = it->next)
+        spice_file_transfer_task_completed(it->data, g_error_copy(error));
+    g_list_free(tasks);
+}
+
+/* main context: start the pending tasks, up to the batch window */
+static void file_transfer_operation_start_tasks(FileTransferOperation *xfer_op)
+{
+    SpiceMainChannelPrivate *c = xfer_op->channel->priv;
+
+    if (!c->agent_connected && !g_queue_is_empty(&xfer_op->pending)) {
+        GError *error = g_error_new_literal(SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
+                                            "The agent is not connected");
+        file_transfer_operation_fail_pending(xfer_op, error);
+        g_error_free(error);
+        return;
+    }
+
+    while (xfer_op->active < c->file_xfer_batch_window &&
+           !g_queue_is_empty(&xfer_op->pending)) {
+        SpiceFileTransferTask *xfer_task = g_queue_pop_head(&xfer_op->pending);
+
+        xfer_op->active++;
+        spice_file_transfer_task_init_task_async(xfer_task,
+                                                 file_xfer_init_task_async_cb,
+                                                 xfer_op);
+    }
+}
+
+/* main context: takes ownership of @xfer_task */
+static void file_transfer_operation_add_task(FileTransferOperation *xfer_op,
+                                             SpiceFileTransferTask *xfer_task)
+{
+    SpiceMainChannel *channel = xfer_op->channel;
+    guint32 task_id = spice_file_transfer_task_get_id(xfer_task);
+
+    SPICE_DEBUG("Insert a xfer task:%u to task list", task_id);
+
+    spice_file_transfer_task_set_window(xfer_task, channel->priv->file_xfer_window);
+
+    g_hash_table_insert(xfer_op->xfer_task, GUINT_TO_POINTER(task_id), xfer_task);
+    g_hash_table_insert(channel->priv->file_xfer_tasks, GUINT_TO_POINTER(task_id), xfer_op);
+    g_queue_push_tail(&xfer_op->pending, xfer_task);
+    xfer_op->stats.num_files++;
+    xfer_op->stats.transfer_size += spice_file_transfer_task_get_expected_size(xfer_task);
+
+    g_signal_connect(xfer_task, "finished", G_CALLBACK(file_transfer_operation_task_finished), NULL);
+    g_signal_emit(channel, signals[SPICE_MAIN_NEW_FILE_TRANSFER], 0, xfer_task);
+}
+
+/* also used while querying the type of a source, before it is known to
+ * be a directory */
+typedef struct {
+    FileTransferOperation       *xfer_op;
+    GFile                       *dir;
+    gchar                       *name; /* relative to the transferred directory */
+    GFileEnumerator             *enumerator;
+} FileTransferEnumeration;
+
+#define FILE_XFER_ENUMERATE_BATCH 64
+
+static void file_transfer_enumeration_free(FileTransferEnumeration *fe)
+{
+    FileTransferOperation *xfer_op = fe->xfer_op;
+
+    g_clear_object(&fe->enumerator);
+    g_object_unref(fe->dir);
+    g_free(fe->name);
+    g_free(fe);
+
+    xfer_op->enumerating--;
+    if (!file_transfer_operation_check_done(xfer_op))
+        file_transfer_operation_start_tasks(xfer_op);
+}
+
+/* a component of the name of a file for the agent: the agent splits the
+ * name on '/', and a Windows agent on '\\' too */
+static gchar *file_transfer_name_component(const gchar *basename)
+{
+    if (basename == NULL || *basename == '\0' ||
+        g_str_equal(basename, ".") || g_str_equal(basename, ".."))
+        return g_strdup("_");
+
+    return g_strdelimit(g_strdup(basename), "/\\", '_');
+}
+
+static void file_transfer_enumeration_failed(FileTransferEnumeration *fe, GError *error)
+{
+    if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        g_warning("failed to list %s: %s", fe->name, error->message);
+        fe->xfer_op->stats.failed++;
+    } else {
+        fe->xfer_op->stats.cancelled++;
+    }
+    g_error_free(error);
+}
+
+static void file_transfer_enumeration_next_cb(GObject *source_object,
+                                              GAsyncResult *res,
+                                              gpointer user_data)
+{
+    FileTransferEnumeration *fe = user_data;
+    FileTransferOperation *xfer_op = fe->xfer_op;
+    GError *error = NULL;
+    GList *infos, *it;
+
+    infos = g_file_enumerator_next_files_finish(fe->enumerator, res, &error);
+    if (error != NULL) {
+        file_transfer_enumeration_failed(fe, error);
+        file_transfer_enumeration_free(fe);
+        return;
+    }
+    if (infos == NULL) {
+        file_transfer_enumeration_free(fe);
+        return;
+    }
+
+    for (it = infos; it != NULL; it = it->next) {
+        GFileInfo *info = it->data;
+        const gchar *basename = g_file_info_get_name(info);
+        GFile *child = g_file_get_child(fe->dir, basename);
+        gchar *component = file_transfer_name_component(basename);
+        gchar *name = g_strconcat(fe->name, "/", component, NULL);
+
+        switch (g_file_info_get_file_type(info)) {
+        case G_FILE_TYPE_DIRECTORY:
+            file_transfer_operation_enumerate(xfer_op, child, name);
+            break;
+        case G_FILE_TYPE_REGULAR: {
+            SpiceFileTransferTask *xfer_task;
+
+            xfer_task = spice_file_transfer_task_new(xfer_op->channel, child,
+                                                     xfer_op->flags, xfer_op->cancellable);
+            spice_file_transfer_task_set_name(xfer_task, name, g_file_info_get_size(info));
+            file_transfer_operation_add_task(xfer_op, xfer_task);
+            break;
+        }
+        default:
+            SPICE_DEBUG("skipping %s, not a regular file", name);
+            break;
+        }
+        g_object_unref(child);
+        g_free(component);
+        g_free(name);
+    }
+    g_list_free_full(infos, g_object_unref);
+
+    file_transfer_operation_start_tasks(xfer_op);
+    g_file_enumerator_next_files_async(fe->enumerator, FILE_XFER_ENUMERATE_BATCH,
+                                       G_PRIORITY_DEFAULT, xfer_op->cancellable,
+                                       file_transfer_enumeration_next_cb, fe);
+}
+
+static void file_transfer_enumeration_cb(GObject *source_object,
+                                         GAsyncResult *res,
+                                         gpointer user_data)
+{
+    FileTransferEnumeration *fe = user_data;
+    GError *error = NULL;
+
+    fe->enumerator = g_file_enumerate_children_finish(fe->dir, res, &error);
+    if (fe->enumerator == NULL) {
+        file_transfer_enumeration_failed(fe, error);
+        file_transfer_enumeration_free(fe);
+        return;
+    }
+
+    g_file_enumerator_next_files_async(fe->enumerator, FILE_XFER_ENUMERATE_BATCH,
+                                       G_PRIORITY_DEFAULT, fe->xfer_op->cancellable,
+                                       file_transfer_enumeration_next_cb, fe);
+}
+
+/* main context: add the regular files of the tree under @dir to @xfer_op,
+ * named @name/... for the agent. Empty directories are not created, the
+ * agent has no message for it */
+static void file_transfer_operation_enumerate(FileTransferOperation *xfer_op,
+                                              GFile *dir, const gchar *name)
+{
+    FileTransferEnumeration *fe = g_new0(FileTransferEnumeration, 1);
+
+    fe->xfer_op = xfer_op;
+    fe->dir = g_object_ref(dir);
+    fe->name = g_strdup(name);
+    xfer_op->enumerating++;
+
+    g_file_enumerate_children_async(dir,
+                                    G_FILE_ATTRIBUTE_STANDARD_NAME ","
+                                    G_FILE_ATTRIBUTE_STANDARD_TYPE ","
+                                    G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                                    G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                    G_PRIORITY_DEFAULT, xfer_op->cancellable,
+                                    file_transfer_enumeration_cb, fe);
+}
+
+static void file_transfer_source_info_cb(GObject *source_object,
+                                         GAsyncResult *res,
+                                         gpointer user_data)
+{
+    FileTransferEnumeration *fe = user_data;
+    FileTransferOperation *xfer_op = fe->xfer_op;
+    GError *error = NULL;
+    GFileInfo *info;
+
+    info = g_file_query_info_finish(fe->dir, res, &error);
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        xfer_op->stats.cancelled++;
+    } else if (info != NULL && g_file_info_get_file_type(info) == G_FILE_TYPE_DIRECTORY) {
+        gchar *basename = g_file_get_basename(fe->dir);
+        gchar *name = file_transfer_name_component(basename);
+
+        file_transfer_operation_enumerate(xfer_op, fe->dir, name);
+        g_free(basename);
+        g_free(name);
+    } else {
+        /* other errors are reported by the task */
+        file_transfer_operation_add_task(xfer_op,
+            spice_file_transfer_task_new(xfer_op->channel, fe->dir,
+                                         xfer_op->flags, xfer_op->cancellable));
+    }
+    g_clear_error(&error);
+    g_clear_object(&info);
+
+    file_transfer_enumeration_free(fe);
+}
+
+/* main context: directories are listed in the background, their files
+ * are added to @xfer_op as they are found */
+static void file_transfer_operation_add_source(FileTransferOperation *xfer_op, GFile *file)
+{
+    FileTransferEnumeration *fe = g_new0(FileTransferEnumeration, 1);
+
+    fe->xfer_op = xfer_op;
+    fe->dir = g_object_ref(file);
+    xfer_op->enumerating++;
+
+    g_file_query_info_async(file, G_FILE_ATTRIBUTE_STANDARD_TYPE, G_FILE_QUERY_INFO_NONE,
+                            G_PRIORITY_DEFAULT, xfer_op->cancellable,
+                            file_transfer_source_info_cb, fe);
 }
 
 static void file_transfer_operation_send_progress(SpiceFileTransferTask *xfer_task)
@@ -3287,6 +4520,15 @@ void spice_main_file_copy_async(SpiceMainChannel *channel,
  * progress_callback (above). If you need to monitor the ending of individual
  * files, you can connect to "finished" signal from each SpiceFileTransferTask.
  *
+ * Since release 0.39, directories in @sources are copied with the regular
+ * files they contain, listed in the background. Their files are sent in
+ * the same operation, #SpiceMainChannel:file-transfer-batch-window of them
+ * at a time.
+ *
+ * If the agent is not connected or the file transfer is disabled, a
+ * #SpiceFileTransferTask is still announced for each of @sources with
+ * #SpiceMainChannel::new-file-transfer, and fails right away.
+ *
  * Since: 0.35
  **/
 void spice_main_channel_file_copy_async(SpiceMainChannel *channel,
@@ -3301,11 +4543,12 @@ void spice_main_channel_file_copy_async(SpiceMainChannel *channel,
     SpiceMainChannelPrivate *c;
     FileTransferOperation *xfer_op;
     GError *error = NULL;
-    GList *it, *keys;
+    GTask *task;
+    gint i;
 
     g_return_if_fail(channel != NULL);
     g_return_if_fail(SPICE_IS_MAIN_CHANNEL(channel));
-    g_return_if_fail(sources != NULL);
+    g_return_if_fail(sources != NULL && sources[0] != NULL);
 
     c = channel->priv;
     if (!c->agent_connected) {
@@ -3318,39 +4561,38 @@ void spice_main_channel_file_copy_async(SpiceMainChannel *channel,
                             _("The file transfer is disabled"));
     }
 
+    task = g_task_new(channel, cancellable, callback, user_data);
+    if (error == NULL && g_task_return_error_if_cancelled(task)) {
+        g_object_unref(task);
+        return;
+    }
+
     xfer_op = g_new0(FileTransferOperation, 1);
     xfer_op->channel = channel;
     xfer_op->progress_callback = progress_callback;
     xfer_op->progress_callback_data = progress_callback_data;
-    xfer_op->task = g_task_new(channel, cancellable, callback, user_data);
-    xfer_op->xfer_task = spice_file_transfer_task_create_tasks(sources,
-                                                               channel,
-                                                               flags,
-                                                               cancellable);
-    xfer_op->stats.num_files = g_hash_table_size(xfer_op->xfer_task);
-    keys = g_hash_table_get_keys(xfer_op->xfer_task);
-    for (it = keys; it != NULL; it = it->next) {
-        guint32 task_id;
-        SpiceFileTransferTask *xfer_task = g_hash_table_lookup(xfer_op->xfer_task, it->data);
-
-        task_id = spice_file_transfer_task_get_id(xfer_task);
-
-        SPICE_DEBUG("Insert a xfer task:%u to task list", task_id);
-
-        g_hash_table_insert(c->file_xfer_tasks, it->data, xfer_op);
-        g_signal_connect(xfer_task, "finished", G_CALLBACK(file_transfer_operation_task_finished), NULL);
-        g_signal_emit(channel, signals[SPICE_MAIN_NEW_FILE_TRANSFER], 0, xfer_task);
-
-        if (error == NULL) {
-            spice_file_transfer_task_init_task_async(xfer_task,
-                                                     file_xfer_init_task_async_cb,
-                                                     xfer_op);
-        } else {
-            spice_file_transfer_task_completed(xfer_task, g_error_copy(error));
-        }
+    xfer_op->task = task;
+    xfer_op->flags = flags;
+    xfer_op->cancellable = cancellable ? g_object_ref(cancellable) : NULL;
+    g_queue_init(&xfer_op->pending);
+    xfer_op->xfer_task = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                               NULL, g_object_unref);
+    xfer_op->stats.start_time = g_get_monotonic_time();
+
+    if (error != NULL) {
+        /* the sources are still announced with new-file-transfer, as
+         * tasks which fail right away. The last one frees @xfer_op */
+        for (i = 0; sources[i] != NULL; i++)
+            file_transfer_operation_add_task(xfer_op,
+                spice_file_transfer_task_new(channel, sources[i], flags, cancellable));
+        file_transfer_operation_fail_pending(xfer_op, error);
+        g_error_free(error);
+        return;
     }
-    g_list_free(keys);
-    g_clear_error(&error);
+
+    /* the tasks are started as the type of the sources is known */
+    for (i = 0; sources[i] != NULL; i++)
+        file_transfer_operation_add_source(xfer_op, sources[i]);
 }
 
 /**
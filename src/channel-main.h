@@ -84,6 +84,18 @@ void spice_main_channel_clipboard_selection_notify(SpiceMainChannel *channel, gu
                                                    guint32 type, const guchar *data, size_t size);
 void spice_main_channel_clipboard_selection_request(SpiceMainChannel *channel, guint selection,
                                                     guint32 type);
+void spice_main_channel_clipboard_selection_notify_async(SpiceMainChannel *channel,
+                                                         guint selection,
+                                                         guint32 type,
+                                                         GBytes *data,
+                                                         GCancellable *cancellable,
+                                                         GFileProgressCallback progress_callback,
+                                                         gpointer progress_callback_data,
+                                                         GAsyncReadyCallback callback,
+                                                         gpointer user_data);
+gboolean spice_main_channel_clipboard_selection_notify_finish(SpiceMainChannel *channel,
+                                                              GAsyncResult *result,
+                                                              GError **error);
 
 gboolean spice_main_channel_agent_test_capability(SpiceMainChannel *channel, guint32 cap);
 void spice_main_channel_file_copy_async(SpiceMainChannel *channel,
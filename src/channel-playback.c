@@ -46,9 +46,26 @@
  * record audio channels for your application.
  */
 
+typedef enum {
+    PLAYBACK_EVENT_START,
+    PLAYBACK_EVENT_DATA,
+    PLAYBACK_EVENT_STOP,
+} PlaybackEventType;
+
+/* Handed from the channel coroutine to the decoder thread, and then
+ * from the decoder thread to the main context */
+typedef struct {
+    PlaybackEventType           type;
+    gint                        mode;
+    gint                        format;
+    gint                        channels;
+    gint                        frequency;
+    gint32                      delta; /* ms since the previous packet */
+    GBytes                      *data;
+} PlaybackEvent;
+
 struct _SpicePlaybackChannelPrivate {
     int                         mode;
-    SndCodec                    codec;
     guint32                     frame_count;
     guint32                     last_time;
     guint8                      nchannels;
@@ -57,6 +74,24 @@ struct _SpicePlaybackChannelPrivate {
     gboolean                    is_active;
     guint32                     latency;
     guint32                     min_latency;
+    gint64                      last_arrival;
+    gint64                      jitter;
+
+    /* decoder thread, owns the codec and the decode_* fields */
+    GThreadPool                 *decode_pool;
+    gint                        decode_discard; /* atomic */
+    SndCodec                    codec;
+    gint                        decode_mode;
+    gint                        decode_channels;
+    gint                        decode_frequency;
+    gsize                       frame_bytes;
+    guint                       frame_ms;
+    gint                        concealed_frames; /* atomic */
+
+    /* decoded events waiting for the main context */
+    GAsyncQueue                 *decoded;
+    GMutex                      decoded_lock;
+    guint                       decoded_idle_id;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(SpicePlaybackChannel, spice_playback_channel, SPICE_TYPE_CHANNEL)
@@ -68,6 +103,7 @@ enum {
     PROP_VOLUME,
     PROP_MUTE,
     PROP_MIN_LATENCY,
+    PROP_CONCEALED_FRAMES,
 };
 
 /* Signals */
@@ -86,6 +122,10 @@ static void channel_set_handlers(SpiceChannelClass *klass);
 /* ------------------------------------------------------------------ */
 
 #define SPICE_PLAYBACK_DEFAULT_LATENCY_MS 200
+/* longer gaps are pauses of the guest audio, not lost packets */
+#define SPICE_PLAYBACK_MAX_CONCEAL_MS 200
+
+static void playback_decoder_stop(SpicePlaybackChannel *channel);
 
 static void spice_playback_channel_set_capabilities(SpiceChannel *channel)
 {
@@ -103,6 +143,9 @@ static void spice_playback_channel_init(SpicePlaybackChannel *channel)
 {
     channel->priv = spice_playback_channel_get_instance_private(channel);
 
+    channel->priv->decoded = g_async_queue_new();
+    g_mutex_init(&channel->priv->decoded_lock);
+
     spice_playback_channel_set_capabilities(SPICE_CHANNEL(channel));
 }
 
@@ -110,7 +153,10 @@ static void spice_playback_channel_finalize(GObject *obj)
 {
     SpicePlaybackChannelPrivate *c = SPICE_PLAYBACK_CHANNEL(obj)->priv;
 
+    playback_decoder_stop(SPICE_PLAYBACK_CHANNEL(obj));
     snd_codec_destroy(&c->codec);
+    g_clear_pointer(&c->decoded, g_async_queue_unref);
+    g_mutex_clear(&c->decoded_lock);
 
     g_clear_pointer(&c->volume, g_free);
 
@@ -139,6 +185,9 @@ static void spice_playback_channel_get_property(GObject    *gobject,
     case PROP_MIN_LATENCY:
         g_value_set_uint(value, c->min_latency);
         break;
+    case PROP_CONCEALED_FRAMES:
+        g_value_set_uint(value, g_atomic_int_get(&c->concealed_frames));
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
         break;
@@ -168,6 +217,7 @@ static void spice_playback_channel_reset(SpiceChannel *channel, gboolean migrati
 {
     SpicePlaybackChannelPrivate *c = SPICE_PLAYBACK_CHANNEL(channel)->priv;
 
+    playback_decoder_stop(SPICE_PLAYBACK_CHANNEL(channel));
     snd_codec_destroy(&c->codec);
     g_coroutine_signal_emit(channel, signals[SPICE_PLAYBACK_STOP], 0);
     c->is_active = FALSE;
@@ -219,6 +269,23 @@ static void spice_playback_channel_class_init(SpicePlaybackChannelClass *klass)
                            0, G_MAXUINT32, SPICE_PLAYBACK_DEFAULT_LATENCY_MS,
                            G_PARAM_READWRITE |
                            G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpicePlaybackChannel:concealed-frames:
+     *
+     * Number of audio frames synthesized to cover lost, late or
+     * undecodable packets since the channel was created.
+     *
+     * Since: 0.39
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_CONCEALED_FRAMES,
+         g_param_spec_uint("concealed-frames",
+                           "Concealed frames",
+                           "Number of concealed audio frames",
+                           0, G_MAXUINT, 0,
+                           G_PARAM_READABLE |
+                           G_PARAM_STATIC_STRINGS));
     /**
      * SpicePlaybackChannel::playback-start:
      * @channel: the #SpicePlaybackChannel that emitted the signal
@@ -297,11 +364,230 @@ static void spice_playback_channel_class_init(SpicePlaybackChannelClass *klass)
 
 /* ------------------------------------------------------------------ */
 
+static void playback_event_free(PlaybackEvent *ev)
+{
+    g_clear_pointer(&ev->data, g_bytes_unref);
+    g_free(ev);
+}
+
+/* main context */
+static gboolean playback_flush_decoded(gpointer user_data)
+{
+    SpicePlaybackChannel *channel = user_data;
+    SpicePlaybackChannelPrivate *c = channel->priv;
+    PlaybackEvent *ev;
+
+    g_mutex_lock(&c->decoded_lock);
+    c->decoded_idle_id = 0;
+    g_mutex_unlock(&c->decoded_lock);
+
+    while ((ev = g_async_queue_try_pop(c->decoded)) != NULL) {
+        gsize size;
+        gconstpointer data;
+
+        switch (ev->type) {
+        case PLAYBACK_EVENT_START:
+            g_signal_emit(channel, signals[SPICE_PLAYBACK_START], 0,
+                          ev->format, ev->channels, ev->frequency);
+            break;
+        case PLAYBACK_EVENT_DATA:
+            data = g_bytes_get_data(ev->data, &size);
+            g_signal_emit(channel, signals[SPICE_PLAYBACK_DATA], 0, data, (gint)size);
+            if ((c->frame_count++ % 100) == 0) {
+                g_signal_emit(channel, signals[SPICE_PLAYBACK_GET_DELAY], 0);
+            }
+            break;
+        case PLAYBACK_EVENT_STOP:
+            g_signal_emit(channel, signals[SPICE_PLAYBACK_STOP], 0);
+            break;
+        }
+        playback_event_free(ev);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+/* decoder thread */
+static void playback_queue_decoded(SpicePlaybackChannel *channel, PlaybackEvent *ev)
+{
+    SpicePlaybackChannelPrivate *c = channel->priv;
+
+    g_async_queue_push(c->decoded, ev);
+
+    g_mutex_lock(&c->decoded_lock);
+    if (c->decoded_idle_id == 0)
+        c->decoded_idle_id = g_idle_add(playback_flush_decoded, channel);
+    g_mutex_unlock(&c->decoded_lock);
+}
+
+/* decoder thread */
+static void playback_queue_pcm(SpicePlaybackChannel *channel, GBytes *pcm)
+{
+    PlaybackEvent *ev = g_new0(PlaybackEvent, 1);
+
+    ev->type = PLAYBACK_EVENT_DATA;
+    ev->data = pcm;
+    playback_queue_decoded(channel, ev);
+}
+
+/* decoder thread: synthesize one frame in place of a missing packet,
+ * using Opus packet loss concealment when available, silence otherwise */
+static void playback_conceal_frame(SpicePlaybackChannel *channel)
+{
+    SpicePlaybackChannelPrivate *c = channel->priv;
+    uint8_t pcm[SND_CODEC_MAX_FRAME_SIZE * 2 * 2];
+    int n = MIN(c->frame_bytes, sizeof(pcm));
+    GBytes *frame;
+
+    if (n == 0)
+        return;
+
+    if (c->decode_mode == SPICE_AUDIO_DATA_MODE_OPUS &&
+        snd_codec_decode(c->codec, NULL, 0, pcm, &n) == SND_CODEC_OK) {
+        frame = g_bytes_new(pcm, n);
+    } else {
+        /* raw packets are as long as the server makes them, not
+         * limited to a codec frame */
+        frame = g_bytes_new_take(g_malloc0(c->frame_bytes), c->frame_bytes);
+    }
+
+    g_atomic_int_inc(&c->concealed_frames);
+    playback_queue_pcm(channel, frame);
+}
+
+/* decoder thread */
+static void playback_decode_data(SpicePlaybackChannel *channel, PlaybackEvent *ev)
+{
+    SpicePlaybackChannelPrivate *c = channel->priv;
+    uint8_t pcm[SND_CODEC_MAX_FRAME_SIZE * 2 * 2];
+    int n = sizeof(pcm);
+    gsize size;
+    const guint8 *data = g_bytes_get_data(ev->data, &size);
+
+    /* packets are sent back to back, one frame apart: a bigger gap
+     * in the timestamps means some of them were lost */
+    if (c->frame_ms > 0 && ev->delta <= SPICE_PLAYBACK_MAX_CONCEAL_MS) {
+        gint missing = (ev->delta + c->frame_ms / 2) / c->frame_ms - 1;
+
+        if (missing > 0) {
+            SPICE_DEBUG("%s: concealing %d missing frames", __FUNCTION__, missing);
+        }
+        for (; missing > 0; missing--) {
+            playback_conceal_frame(channel);
+        }
+    }
+
+    if (c->decode_mode == SPICE_AUDIO_DATA_MODE_RAW) {
+        c->frame_bytes = size;
+        playback_queue_pcm(channel, g_steal_pointer(&ev->data));
+    } else if (snd_codec_decode(c->codec, (uint8_t *)data, size, pcm, &n) != SND_CODEC_OK) {
+        g_warning("snd_codec_decode() error");
+        playback_conceal_frame(channel);
+        return;
+    } else {
+        c->frame_bytes = n;
+        playback_queue_pcm(channel, g_bytes_new(pcm, n));
+    }
+
+    c->frame_ms = (guint64)c->frame_bytes * 1000 /
+        (c->decode_channels * 2 * c->decode_frequency);
+}
+
+/* decoder thread */
+static void playback_decode_event(gpointer data, gpointer user_data)
+{
+    PlaybackEvent *ev = data;
+    SpicePlaybackChannel *channel = user_data;
+    SpicePlaybackChannelPrivate *c = channel->priv;
+
+    if (g_atomic_int_get(&c->decode_discard)) {
+        playback_event_free(ev);
+        return;
+    }
+
+    switch (ev->type) {
+    case PLAYBACK_EVENT_START:
+        snd_codec_destroy(&c->codec);
+        c->decode_mode = ev->mode;
+        c->decode_channels = ev->channels;
+        c->decode_frequency = ev->frequency;
+        c->frame_bytes = 0;
+        c->frame_ms = 0;
+
+        if (c->decode_mode != SPICE_AUDIO_DATA_MODE_RAW) {
+            if (snd_codec_create(&c->codec, c->decode_mode, ev->frequency,
+                                 SND_CODEC_DECODE) != SND_CODEC_OK) {
+                g_warning("create decoder failed");
+                playback_event_free(ev);
+                return;
+            }
+        }
+        playback_queue_decoded(channel, ev);
+        break;
+    case PLAYBACK_EVENT_DATA:
+        if (c->decode_channels > 0 && c->decode_frequency > 0)
+            playback_decode_data(channel, ev);
+        playback_event_free(ev);
+        break;
+    case PLAYBACK_EVENT_STOP:
+        playback_queue_decoded(channel, ev);
+        break;
+    }
+}
+
+/* coroutine context */
+static void playback_decoder_push(SpicePlaybackChannel *channel, PlaybackEvent *ev)
+{
+    SpicePlaybackChannelPrivate *c = channel->priv;
+
+    if (c->decode_pool == NULL) {
+        GError *error = NULL;
+
+        /* a single thread keeps the events in order */
+        c->decode_pool = g_thread_pool_new(playback_decode_event, channel,
+                                           1, FALSE, &error);
+        if (c->decode_pool == NULL) {
+            g_warning("failed to create audio decoder thread: %s", error->message);
+            g_clear_error(&error);
+            playback_event_free(ev);
+            return;
+        }
+    }
+
+    g_thread_pool_push(c->decode_pool, ev, NULL);
+}
+
+/* main or coroutine context: drop pending audio and join the decoder */
+static void playback_decoder_stop(SpicePlaybackChannel *channel)
+{
+    SpicePlaybackChannelPrivate *c = channel->priv;
+    PlaybackEvent *ev;
+
+    if (c->decode_pool != NULL) {
+        g_atomic_int_set(&c->decode_discard, TRUE);
+        g_thread_pool_free(c->decode_pool, FALSE, TRUE);
+        c->decode_pool = NULL;
+        g_atomic_int_set(&c->decode_discard, FALSE);
+    }
+
+    g_mutex_lock(&c->decoded_lock);
+    if (c->decoded_idle_id != 0) {
+        g_source_remove(c->decoded_idle_id);
+        c->decoded_idle_id = 0;
+    }
+    g_mutex_unlock(&c->decoded_lock);
+
+    while ((ev = g_async_queue_try_pop(c->decoded)) != NULL) {
+        playback_event_free(ev);
+    }
+}
+
 /* coroutine context */
 static void playback_handle_data(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpicePlaybackChannelPrivate *c = SPICE_PLAYBACK_CHANNEL(channel)->priv;
     SpiceMsgPlaybackPacket *packet = spice_msg_in_parsed(in);
+    PlaybackEvent *ev;
 
 #ifdef DEBUG
     CHANNEL_DEBUG(channel, "%s: time %u data %p size %d", __FUNCTION__,
@@ -311,28 +597,22 @@ static void playback_handle_data(SpiceChannel *channel, SpiceMsgIn *in)
     if (spice_mmtime_diff(c->last_time, packet->time) > 0)
         g_warn_if_reached();
 
-    c->last_time = packet->time;
-
-    uint8_t *data = packet->data;
-    int n = packet->data_size;
-    uint8_t pcm[SND_CODEC_MAX_FRAME_SIZE * 2 * 2];
-
-    if (c->mode != SPICE_AUDIO_DATA_MODE_RAW) {
-        n = sizeof(pcm);
-        data = pcm;
-
-        if (snd_codec_decode(c->codec, packet->data, packet->data_size,
-                    pcm, &n) != SND_CODEC_OK) {
-            g_warning("snd_codec_decode() error");
-            return;
-        }
+    /* interarrival jitter estimate, as in RFC 3550 section 6.4.1 */
+    gint64 now = g_get_monotonic_time();
+    if (c->last_arrival != 0) {
+        gint64 d = (now - c->last_arrival) -
+            (gint64)spice_mmtime_diff(packet->time, c->last_time) * 1000;
+        c->jitter += (ABS(d) - c->jitter) / 16;
     }
+    c->last_arrival = now;
 
-    g_coroutine_signal_emit(channel, signals[SPICE_PLAYBACK_DATA], 0, data, n);
+    ev = g_new0(PlaybackEvent, 1);
+    ev->type = PLAYBACK_EVENT_DATA;
+    ev->delta = spice_mmtime_diff(packet->time, c->last_time);
+    ev->data = g_bytes_new(packet->data, packet->data_size);
+    playback_decoder_push(SPICE_PLAYBACK_CHANNEL(channel), ev);
 
-    if ((c->frame_count++ % 100) == 0) {
-        g_coroutine_signal_emit(channel, signals[SPICE_PLAYBACK_GET_DELAY], 0);
-    }
+    c->last_time = packet->time;
 }
 
 /* coroutine context */
@@ -361,6 +641,7 @@ static void playback_handle_start(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpicePlaybackChannelPrivate *c = SPICE_PLAYBACK_CHANNEL(channel)->priv;
     SpiceMsgPlaybackStart *start = spice_msg_in_parsed(in);
+    PlaybackEvent *ev;
 
     CHANNEL_DEBUG(channel, "%s: fmt %u channels %u freq %u time %u mode %s", __FUNCTION__,
                   start->format, start->channels, start->frequency, start->time,
@@ -368,18 +649,20 @@ static void playback_handle_start(SpiceChannel *channel, SpiceMsgIn *in)
 
     c->frame_count = 0;
     c->last_time = start->time;
+    c->last_arrival = 0;
+    c->jitter = 0;
     c->is_active = TRUE;
     c->min_latency = SPICE_PLAYBACK_DEFAULT_LATENCY_MS;
-    snd_codec_destroy(&c->codec);
 
-    if (c->mode != SPICE_AUDIO_DATA_MODE_RAW) {
-        if (snd_codec_create(&c->codec, c->mode, start->frequency, SND_CODEC_DECODE) != SND_CODEC_OK) {
-            g_warning("create decoder failed");
-            return;
-        }
-    }
-    g_coroutine_signal_emit(channel, signals[SPICE_PLAYBACK_START], 0,
-                            start->format, start->channels, start->frequency);
+    /* the decoder thread creates the codec, then playback-start is
+     * emitted ahead of the decoded data */
+    ev = g_new0(PlaybackEvent, 1);
+    ev->type = PLAYBACK_EVENT_START;
+    ev->mode = c->mode;
+    ev->format = start->format;
+    ev->channels = start->channels;
+    ev->frequency = start->frequency;
+    playback_decoder_push(SPICE_PLAYBACK_CHANNEL(channel), ev);
 }
 
 /* coroutine context */
@@ -387,7 +670,14 @@ static void playback_handle_stop(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpicePlaybackChannelPrivate *c = SPICE_PLAYBACK_CHANNEL(channel)->priv;
 
-    g_coroutine_signal_emit(channel, signals[SPICE_PLAYBACK_STOP], 0);
+    if (c->decode_pool != NULL) {
+        /* emitted once the pending audio has been played */
+        PlaybackEvent *ev = g_new0(PlaybackEvent, 1);
+        ev->type = PLAYBACK_EVENT_STOP;
+        playback_decoder_push(SPICE_PLAYBACK_CHANNEL(channel), ev);
+    } else {
+        g_coroutine_signal_emit(channel, signals[SPICE_PLAYBACK_STOP], 0);
+    }
     c->is_active = FALSE;
 }
 
@@ -489,6 +779,17 @@ guint32 spice_playback_channel_get_latency(SpicePlaybackChannel *channel)
     return channel->priv->latency;
 }
 
+/* Returns the estimated network jitter of the playback packets, in ms */
+G_GNUC_INTERNAL
+guint32 spice_playback_channel_get_jitter(SpicePlaybackChannel *channel)
+{
+    g_return_val_if_fail(SPICE_IS_PLAYBACK_CHANNEL(channel), 0);
+    if (!channel->priv->is_active) {
+        return 0;
+    }
+    return channel->priv->jitter / 1000;
+}
+
 G_GNUC_INTERNAL
 void spice_playback_channel_sync_latency(SpicePlaybackChannel *channel)
 {
@@ -20,6 +20,7 @@
 #include "spice-client.h"
 #include "spice-common.h"
 #include "spice-channel-priv.h"
+#include "channel-record-priv.h"
 
 #include "spice-marshal.h"
 #include "spice-session-priv.h"
@@ -54,9 +55,25 @@ struct _SpiceRecordChannelPrivate {
     gsize                       frame_bytes;
     guint8                      *last_frame;
     gsize                       last_frame_current;
+    guint32                     last_frame_time;
     guint8                      nchannels;
     guint16                     *volume;
     guint8                      mute;
+
+    /* capture format */
+    guint32                     frequency;
+    guint                       sample_bytes;
+
+    /* capture clock vs mm-time drift estimation */
+    guint32                     drift_start_time;
+    guint64                     drift_samples;
+    gint                        drift_ppm;
+
+    /* drift compensation resampler state */
+    gdouble                     resample_pos;
+    gint16                      *resample_last;
+    guint8                      *resample_buf;
+    gsize                       resample_buf_size;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(SpiceRecordChannel, spice_record_channel, SPICE_TYPE_CHANNEL)
@@ -67,6 +84,7 @@ enum {
     PROP_NCHANNELS,
     PROP_VOLUME,
     PROP_MUTE,
+    PROP_DRIFT_PPM,
 };
 
 /* Signals */
@@ -80,9 +98,20 @@ enum {
 static guint signals[SPICE_RECORD_LAST_SIGNAL];
 
 static void channel_set_handlers(SpiceChannelClass *klass);
+static void record_session_mm_time_reset_cb(SpiceSession *session, gpointer data);
 
 /* ------------------------------------------------------------------ */
 
+/* ~100ms of raw PCM at 48kHz in a single record data message */
+#define RECORD_RAW_MAX_FRAMES_PER_MSG 10
+
+/* the drift estimate needs a few seconds of audio to be meaningful */
+#define RECORD_DRIFT_WARMUP_MS 5000
+/* below this, resampling costs more than the drift does */
+#define RECORD_DRIFT_MIN_PPM 20
+/* anything above is a clock jump, not a drift */
+#define RECORD_DRIFT_MAX_PPM 1000
+
 static void spice_record_channel_set_capabilities(SpiceChannel *channel)
 {
     if (!g_getenv("SPICE_DISABLE_CELT"))
@@ -101,11 +130,26 @@ static void spice_record_channel_init(SpiceRecordChannel *channel)
     spice_record_channel_set_capabilities(SPICE_CHANNEL(channel));
 }
 
+static void spice_record_channel_constructed(GObject *object)
+{
+    SpiceSession *s = spice_channel_get_session(SPICE_CHANNEL(object));
+
+    g_return_if_fail(s != NULL);
+    spice_g_signal_connect_object(s, "mm-time-reset",
+                                  G_CALLBACK(record_session_mm_time_reset_cb),
+                                  SPICE_CHANNEL(object), 0);
+
+    if (G_OBJECT_CLASS(spice_record_channel_parent_class)->constructed)
+        G_OBJECT_CLASS(spice_record_channel_parent_class)->constructed(object);
+}
+
 static void spice_record_channel_finalize(GObject *obj)
 {
     SpiceRecordChannelPrivate *c = SPICE_RECORD_CHANNEL(obj)->priv;
 
     g_clear_pointer(&c->last_frame, g_free);
+    g_clear_pointer(&c->resample_last, g_free);
+    g_clear_pointer(&c->resample_buf, g_free);
 
     snd_codec_destroy(&c->codec);
 
@@ -133,6 +177,9 @@ static void spice_record_channel_get_property(GObject    *gobject,
     case PROP_MUTE:
         g_value_set_boolean(value, c->mute);
         break;
+    case PROP_DRIFT_PPM:
+        g_value_set_int(value, c->drift_ppm);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
         break;
@@ -176,6 +223,7 @@ static void spice_record_channel_class_init(SpiceRecordChannelClass *klass)
     GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
     SpiceChannelClass *channel_class = SPICE_CHANNEL_CLASS(klass);
 
+    gobject_class->constructed  = spice_record_channel_constructed;
     gobject_class->finalize     = spice_record_channel_finalize;
     gobject_class->get_property = spice_record_channel_get_property;
     gobject_class->set_property = spice_record_channel_set_property;
@@ -206,6 +254,25 @@ static void spice_record_channel_class_init(SpiceRecordChannelClass *klass)
                               FALSE,
                               G_PARAM_READWRITE |
                               G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceRecordChannel:drift-ppm:
+     *
+     * Measured drift of the audio capture clock against the session
+     * multimedia time, in parts per million. Positive when the capture
+     * device runs fast. This is a debugging aid.
+     *
+     * Since: 0.39
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_DRIFT_PPM,
+         g_param_spec_int("drift-ppm",
+                          "Capture clock drift",
+                          "Capture clock drift (ppm)",
+                          G_MININT, G_MAXINT, 0,
+                          G_PARAM_READABLE |
+                          G_PARAM_STATIC_STRINGS));
+
     /**
      * SpiceRecordChannel::record-start:
      * @channel: the #SpiceRecordChannel that emitted the signal
@@ -299,6 +366,175 @@ static void spice_record_start_mark(SpiceRecordChannel *channel, uint32_t time)
     spice_msg_out_send(msg);
 }
 
+static guint32 record_bytes_to_ms(SpiceRecordChannelPrivate *rc, gsize bytes)
+{
+    return (guint64)(bytes / rc->sample_bytes) * 1000 / rc->frequency;
+}
+
+/* Track the number of captured samples against the elapsed mm-time
+ * to estimate how fast the capture clock runs */
+static void record_update_drift(SpiceRecordChannel *channel, gsize bytes, guint32 time)
+{
+    SpiceRecordChannelPrivate *rc = channel->priv;
+    gint32 elapsed;
+    gint64 ppm;
+
+    if (rc->drift_samples == 0) {
+        rc->drift_start_time = time;
+    }
+
+    elapsed = spice_mmtime_diff(time, rc->drift_start_time);
+    if (elapsed >= RECORD_DRIFT_WARMUP_MS) {
+        gint64 captured_us = rc->drift_samples * G_USEC_PER_SEC / rc->frequency;
+        gint64 elapsed_us = (gint64)elapsed * 1000;
+
+        ppm = (captured_us - elapsed_us) * 1000000 / elapsed_us;
+        if (ABS(ppm) > RECORD_DRIFT_MAX_PPM) {
+            CHANNEL_DEBUG(channel, "capture clock jump (%" G_GINT64_FORMAT " ppm), "
+                          "restarting drift estimation", ppm);
+            rc->drift_samples = 0;
+            rc->drift_start_time = time;
+            ppm = 0;
+        }
+        if (rc->drift_ppm != ppm) {
+            rc->drift_ppm = ppm;
+            g_object_notify(G_OBJECT(channel), "drift-ppm");
+        }
+    } else if (elapsed < 0) {
+        rc->drift_samples = 0;
+        rc->drift_start_time = time;
+    }
+
+    rc->drift_samples += bytes / rc->sample_bytes;
+}
+
+/* the timestamps jumped, the samples counted so far no longer match
+ * the elapsed mm-time: start a new estimation window, keeping the
+ * current estimate meanwhile */
+G_GNUC_INTERNAL
+void spice_record_channel_reset_drift(SpiceRecordChannel *channel)
+{
+    g_return_if_fail(SPICE_IS_RECORD_CHANNEL(channel));
+
+    channel->priv->drift_samples = 0;
+}
+
+/* The backend lost @bytes of capture, e.g. on an overrun: they were
+ * captured in the elapsed mm-time although they are not sent */
+G_GNUC_INTERNAL
+void spice_record_channel_add_lost(SpiceRecordChannel *channel, gsize bytes)
+{
+    SpiceRecordChannelPrivate *rc;
+
+    g_return_if_fail(SPICE_IS_RECORD_CHANNEL(channel));
+    rc = channel->priv;
+
+    /* before the window starts, nothing to account for */
+    if (rc->drift_samples > 0 && rc->sample_bytes > 0)
+        rc->drift_samples += bytes / rc->sample_bytes;
+}
+
+static void record_session_mm_time_reset_cb(SpiceSession *session, gpointer data)
+{
+    SpiceChannel *channel = data;
+
+    CHANNEL_DEBUG(channel, "mm-time reset, restarting drift estimation");
+    spice_record_channel_reset_drift(SPICE_RECORD_CHANNEL(channel));
+}
+
+/* Linear interpolation resampler stretching the capture stream by the
+ * measured drift. Position 0 is the last sample of the previous call,
+ * position k the (k-1)th sample of @in.
+ * Returns: the number of bytes written to rc->resample_buf */
+static gsize record_resample(SpiceRecordChannelPrivate *rc, const gint16 *in, gsize bytes)
+{
+    guint nch = rc->sample_bytes / sizeof(gint16);
+    gsize in_samples = bytes / rc->sample_bytes;
+    gdouble step = 1.0 + rc->drift_ppm / 1000000.0;
+    /* a step below 1 produces more samples than it consumes,
+     * ceil(in_samples / step) plus one for the fractional start */
+    gsize out_size = ((gsize)(in_samples / step) + 3) * rc->sample_bytes;
+    gint16 *out;
+    gsize o = 0;
+    guint ch;
+
+    if (in_samples == 0)
+        return 0;
+
+    if (rc->resample_buf_size < out_size) {
+        g_free(rc->resample_buf);
+        rc->resample_buf = g_malloc(out_size);
+        rc->resample_buf_size = out_size;
+    }
+    out = (gint16 *)rc->resample_buf;
+
+    while (rc->resample_pos < in_samples) {
+        gsize i = (gsize)rc->resample_pos;
+        gdouble frac = rc->resample_pos - i;
+        const gint16 *a = (i == 0) ? rc->resample_last : &in[(i - 1) * nch];
+        const gint16 *b = &in[i * nch];
+
+        for (ch = 0; ch < nch; ch++) {
+            out[o * nch + ch] = a[ch] + (b[ch] - a[ch]) * frac;
+        }
+        o++;
+        rc->resample_pos += step;
+    }
+    rc->resample_pos -= in_samples;
+    memcpy(rc->resample_last, &in[(in_samples - 1) * nch], rc->sample_bytes);
+
+    return o * rc->sample_bytes;
+}
+
+/* Send @nframes complete frames of PCM data. Encoded frames are written
+ * straight into the marshaller, one message per frame since the server
+ * decodes a single frame per packet; raw PCM has no such constraint, so
+ * it is batched into fewer and bigger messages.
+ * Returns: %FALSE on encoding error */
+static gboolean record_send_frames(SpiceRecordChannel *channel, const guint8 *frames,
+                                   gsize nframes, uint32_t time)
+{
+    SpiceRecordChannelPrivate *rc = channel->priv;
+    SpiceMsgcRecordPacket p = {0, };
+
+    p.time = time;
+
+    while (nframes > 0) {
+        SpiceMsgOut *msg;
+        guint8 *buf;
+        gsize n;
+
+        msg = spice_msg_out_new(SPICE_CHANNEL(channel), SPICE_MSGC_RECORD_DATA);
+        msg->marshallers->msgc_record_data(msg->marshaller, &p);
+
+        if (rc->mode == SPICE_AUDIO_DATA_MODE_RAW) {
+            n = MIN(nframes, RECORD_RAW_MAX_FRAMES_PER_MSG);
+            buf = spice_marshaller_reserve_space(msg->marshaller, n * rc->frame_bytes);
+            memcpy(buf, frames, n * rc->frame_bytes);
+        } else {
+            int len = SND_CODEC_MAX_COMPRESSED_BYTES;
+
+            n = 1;
+            buf = spice_marshaller_reserve_space(msg->marshaller, len);
+            if (snd_codec_encode(rc->codec, (guint8 *)frames, rc->frame_bytes,
+                                 buf, &len) != SND_CODEC_OK) {
+                g_warning("encode failed");
+                spice_msg_out_unref(msg);
+                return FALSE;
+            }
+            spice_marshaller_unreserve_space(msg->marshaller,
+                                             SND_CODEC_MAX_COMPRESSED_BYTES - len);
+        }
+        spice_msg_out_send(msg);
+
+        frames += n * rc->frame_bytes;
+        nframes -= n;
+        p.time += record_bytes_to_ms(rc, n * rc->frame_bytes);
+    }
+
+    return TRUE;
+}
+
 /**
  * spice_record_send_data:
  * @channel: a #SpiceRecordChannel
@@ -331,7 +567,8 @@ void spice_record_channel_send_data(SpiceRecordChannel *channel, gpointer data,
                                     gsize bytes, uint32_t time)
 {
     SpiceRecordChannelPrivate *rc;
-    SpiceMsgcRecordPacket p = {0, };
+    SpiceSession *session;
+    const guint8 *in = data;
 
     g_return_if_fail(SPICE_IS_RECORD_CHANNEL(channel));
     rc = channel->priv;
@@ -342,7 +579,19 @@ void spice_record_channel_send_data(SpiceRecordChannel *channel, gpointer data,
 
     g_return_if_fail(spice_channel_get_read_only(SPICE_CHANNEL(channel)) == FALSE);
 
-    uint8_t *encode_buf = NULL;
+    session = spice_channel_get_session(SPICE_CHANNEL(channel));
+    if (time == 0 && session != NULL) {
+        /* backend did not timestamp the capture, use the current time */
+        time = spice_session_get_mm_time(session);
+    }
+
+    record_update_drift(channel, bytes, time);
+    if (ABS(rc->drift_ppm) >= RECORD_DRIFT_MIN_PPM) {
+        bytes = record_resample(rc, data, bytes);
+        in = rc->resample_buf;
+    } else {
+        rc->resample_pos = 1.0;
+    }
 
     if (!rc->started) {
         spice_record_mode(channel, time, rc->mode, NULL, 0);
@@ -350,61 +599,39 @@ void spice_record_channel_send_data(SpiceRecordChannel *channel, gpointer data,
         rc->started = TRUE;
     }
 
-    if (rc->mode != SPICE_AUDIO_DATA_MODE_RAW)
-        encode_buf = g_alloca(SND_CODEC_MAX_COMPRESSED_BYTES);
-
-    p.time = time;
-
-    while (bytes > 0) {
-        gsize n;
-        int frame_size;
-        SpiceMsgOut *msg;
-        uint8_t *frame;
-
-        if (rc->last_frame_current > 0) {
-            /* complete previous frame */
-            n = MIN(bytes, rc->frame_bytes - rc->last_frame_current);
-            memcpy(rc->last_frame + rc->last_frame_current, data, n);
-            rc->last_frame_current += n;
-            if (rc->last_frame_current < rc->frame_bytes)
-                /* if the frame is still incomplete, return */
-                break;
-            frame = rc->last_frame;
-            frame_size = rc->frame_bytes;
-        } else {
-            n = MIN(bytes, rc->frame_bytes);
-            frame_size = n;
-            frame = data;
-        }
-
-        if (rc->last_frame_current == 0 &&
-            n < rc->frame_bytes) {
-            /* start a new frame */
-            memcpy(rc->last_frame, data, n);
-            rc->last_frame_current = n;
-            break;
-        }
+    if (rc->last_frame_current > 0) {
+        /* complete previous frame */
+        gsize n = MIN(bytes, rc->frame_bytes - rc->last_frame_current);
 
-        if (rc->mode != SPICE_AUDIO_DATA_MODE_RAW) {
-            int len = SND_CODEC_MAX_COMPRESSED_BYTES;
-            if (snd_codec_encode(rc->codec, frame, frame_size, encode_buf, &len) != SND_CODEC_OK) {
-                g_warning("encode failed");
-                return;
-            }
-            frame = encode_buf;
-            frame_size = len;
-        }
+        memcpy(rc->last_frame + rc->last_frame_current, in, n);
+        rc->last_frame_current += n;
+        in += n;
+        bytes -= n;
+        if (rc->last_frame_current < rc->frame_bytes)
+            /* if the frame is still incomplete, return */
+            return;
+        rc->last_frame_current = 0;
+        if (!record_send_frames(channel, rc->last_frame, 1, rc->last_frame_time))
+            return;
+        time += record_bytes_to_ms(rc, n);
+    }
 
-        msg = spice_msg_out_new(SPICE_CHANNEL(channel), SPICE_MSGC_RECORD_DATA);
-        msg->marshallers->msgc_record_data(msg->marshaller, &p);
-        spice_marshaller_add(msg->marshaller, frame, frame_size);
-        spice_msg_out_send(msg);
+    /* whole frames are encoded straight from the caller buffer */
+    if (bytes >= rc->frame_bytes) {
+        gsize nframes = bytes / rc->frame_bytes;
 
-        if (rc->last_frame_current == rc->frame_bytes)
-            rc->last_frame_current = 0;
+        if (!record_send_frames(channel, in, nframes, time))
+            return;
+        in += nframes * rc->frame_bytes;
+        bytes -= nframes * rc->frame_bytes;
+        time += record_bytes_to_ms(rc, nframes * rc->frame_bytes);
+    }
 
-        bytes -= n;
-        data = (guint8*)data + n;
+    if (bytes > 0) {
+        /* start a new frame */
+        memcpy(rc->last_frame, in, bytes);
+        rc->last_frame_current = bytes;
+        rc->last_frame_time = time;
     }
 }
 
@@ -440,6 +667,14 @@ static void record_handle_start(SpiceChannel *channel, SpiceMsgIn *in)
     c->last_frame = g_malloc0(c->frame_bytes);
     c->last_frame_current = 0;
 
+    c->frequency = start->frequency;
+    c->sample_bytes = 16 * start->channels / 8;
+    c->drift_samples = 0;
+    c->drift_ppm = 0;
+    c->resample_pos = 1.0;
+    g_free(c->resample_last);
+    c->resample_last = g_malloc0(c->sample_bytes);
+
     g_coroutine_signal_emit(channel, signals[SPICE_RECORD_START], 0,
                             start->format, start->channels, start->frequency);
 }
@@ -24,6 +24,7 @@
 
 #include "spice-client.h"
 #include "usb-backend.h"
+#include "common/marshaller.h"
 
 G_BEGIN_DECLS
 
@@ -58,6 +59,10 @@ void spice_usbredir_channel_disconnect_device(SpiceUsbredirChannel *channel);
 
 SpiceUsbDevice *spice_usbredir_channel_get_device(SpiceUsbredirChannel *channel);
 
+/* statistics of the connected device, see
+   spice_usb_device_manager_get_device_stats() */
+GVariant *spice_usbredir_channel_get_device_stats(SpiceUsbredirChannel *channel);
+
 void spice_usbredir_channel_lock(SpiceUsbredirChannel *channel);
 
 void spice_usbredir_channel_unlock(SpiceUsbredirChannel *channel);
@@ -67,8 +72,15 @@ void spice_usbredir_channel_get_guest_filter(
                           const struct usbredirfilter_rule  **rules_ret,
                           int                                *rules_count_ret);
 
-/* Callback for USB backend */
-int spice_usbredir_write(SpiceUsbredirChannel *channel, uint8_t *data, int count);
+/* Callback for USB backend, isoch is set for isochronous packets */
+int spice_usbredir_write(SpiceUsbredirChannel *channel, uint8_t *data, int count,
+                         gboolean isoch);
+
+gboolean spice_usbredir_write_by_ref(SpiceUsbredirChannel *channel,
+                                     const uint8_t *header, int header_len,
+                                     uint8_t *data, int count,
+                                     spice_marshaller_item_free_func free_data,
+                                     void *opaque);
 
 G_END_DECLS
 
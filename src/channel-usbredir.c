@@ -52,6 +52,40 @@
  */
 
 #define COMPRESS_THRESHOLD 1000
+/* compression has to save 1/8 of the data to pay off */
+#define COMPRESS_MIN_GAIN_SHIFT 3
+/* after this many attempts in a row which did not pay off, packets are
+ * sent uncompressed for a while, then the data is sampled again */
+#define COMPRESS_SAMPLE_FAILURES 4
+#define COMPRESS_MIN_SKIP 16
+#define COMPRESS_MAX_SKIP 1024
+/* scratch buffers are pooled for packets up to this size */
+#define COMPRESS_POOL_PACKET_SIZE (256 * 1024)
+#define COMPRESS_POOL_MAX_BUFFERS 4
+
+/* isochronous packets of a device with isochronous endpoints are dropped
+ * if they are still queued after this delay in ms */
+#define ISO_DEADLINE 50
+
+/* Adaptive compression state and counters of the redirected device.
+ * Shared with the compressed buffers being sent, which return to
+ * the pool once written. */
+typedef struct UsbredirCompressor {
+    gint refs;
+    GMutex lock;
+    GSList *pool; /* free scratch buffers */
+    guint pool_size;
+
+    guint failures; /* attempts in a row which did not pay off */
+    guint skip; /* packets left to send without trying */
+    guint backoff; /* packets to skip after the next failures */
+
+    guint64 bytes;
+    guint64 compressed_in;
+    guint64 compressed_out;
+    guint64 skipped;
+} UsbredirCompressor;
+
 enum SpiceUsbredirChannelState {
     STATE_DISCONNECTED,
 #ifdef USE_POLKIT
@@ -71,6 +105,9 @@ struct _SpiceUsbredirChannelPrivate {
     SpiceUsbAclHelper *acl_helper;
 #endif
     GMutex device_connect_mutex;
+    UsbredirCompressor *compressor;
+    gint64 iso_deadline; /* us, 0 if isochronous packets are not dropped */
+    guint64 dropped_base; /* dropped messages of the channel at connection */
 };
 
 static void channel_set_handlers(SpiceChannelClass *klass);
@@ -85,10 +122,60 @@ G_DEFINE_TYPE_WITH_PRIVATE(SpiceUsbredirChannel, spice_usbredir_channel, SPICE_T
 
 /* ------------------------------------------------------------------ */
 
+static UsbredirCompressor *usbredir_compressor_new(void)
+{
+    UsbredirCompressor *comp = g_new0(UsbredirCompressor, 1);
+
+    comp->refs = 1;
+    g_mutex_init(&comp->lock);
+    comp->backoff = COMPRESS_MIN_SKIP;
+    return comp;
+}
+
+#ifdef USE_LZ4
+static UsbredirCompressor *usbredir_compressor_ref(UsbredirCompressor *comp)
+{
+    g_atomic_int_inc(&comp->refs);
+    return comp;
+}
+#endif
+
+static void usbredir_compressor_unref(UsbredirCompressor *comp)
+{
+    if (!g_atomic_int_dec_and_test(&comp->refs)) {
+        return;
+    }
+    g_slist_free_full(comp->pool, g_free);
+    g_mutex_clear(&comp->lock);
+    g_free(comp);
+}
+
+/* a new device is redirected */
+static void usbredir_compressor_reset(UsbredirCompressor *comp)
+{
+    g_mutex_lock(&comp->lock);
+    comp->failures = 0;
+    comp->skip = 0;
+    comp->backoff = COMPRESS_MIN_SKIP;
+    comp->bytes = 0;
+    comp->compressed_in = 0;
+    comp->compressed_out = 0;
+    comp->skipped = 0;
+    g_mutex_unlock(&comp->lock);
+}
+
+static void usbredir_compressor_count(UsbredirCompressor *comp, int count)
+{
+    g_mutex_lock(&comp->lock);
+    comp->bytes += count;
+    g_mutex_unlock(&comp->lock);
+}
+
 static void spice_usbredir_channel_init(SpiceUsbredirChannel *channel)
 {
     channel->priv = spice_usbredir_channel_get_instance_private(channel);
     g_mutex_init(&channel->priv->device_connect_mutex);
+    channel->priv->compressor = usbredir_compressor_new();
 }
 
 static void _channel_reset_finish(SpiceUsbredirChannel *channel, gboolean migrating)
@@ -200,6 +287,7 @@ static void spice_usbredir_channel_finalize(GObject *obj)
     if (channel->priv->host)
         spice_usb_backend_channel_delete(channel->priv->host);
     g_mutex_clear(&channel->priv->device_connect_mutex);
+    usbredir_compressor_unref(channel->priv->compressor);
 
     /* Chain up to the parent class */
     if (G_OBJECT_CLASS(spice_usbredir_channel_parent_class)->finalize)
@@ -361,6 +449,9 @@ void spice_usbredir_channel_connect_device_async(SpiceUsbredirChannel *channel,
     }
 
     priv->device = spice_usb_backend_device_ref(device);
+    usbredir_compressor_reset(priv->compressor);
+    priv->iso_deadline = spice_usb_backend_device_isoch(device) ? ISO_DEADLINE * 1000 : 0;
+    priv->dropped_base = SPICE_CHANNEL(channel)->priv->stats->messages_dropped;
 #ifdef USE_POLKIT
     if (info->bus != BUS_NUMBER_FOR_EMULATED_USB) {
         priv->task = task;
@@ -473,6 +564,68 @@ SpiceUsbDevice *spice_usbredir_channel_get_device(SpiceUsbredirChannel *channel)
     return channel->priv->device;
 }
 
+/**
+ * spice_usbredir_channel_get_compression_stats:
+ * @channel: a #SpiceUsbredirChannel
+ *
+ * Gets the counters of the data sent to the device redirected by
+ * @channel, since it was connected. The dictionary contains these
+ * keys, of type "t":
+ *
+ * - "bytes": usbredir data sent, before compression
+ * - "compressed-bytes-in": the part of it which was sent compressed
+ * - "compressed-bytes-out": the size of that part after compression
+ * - "skipped-bytes": data sent without trying to compress it, as the
+ *   recent data of the device did not compress well
+ *
+ * Returns: (transfer floating): a #GVariant dictionary of type a{sv}
+ *
+ * Since: 0.39
+ **/
+GVariant *spice_usbredir_channel_get_compression_stats(SpiceUsbredirChannel *channel)
+{
+    UsbredirCompressor *comp;
+    GVariantBuilder builder;
+
+    g_return_val_if_fail(SPICE_IS_USBREDIR_CHANNEL(channel), NULL);
+
+    comp = channel->priv->compressor;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+    g_mutex_lock(&comp->lock);
+    g_variant_builder_add(&builder, "{sv}", "bytes",
+                          g_variant_new_uint64(comp->bytes));
+    g_variant_builder_add(&builder, "{sv}", "compressed-bytes-in",
+                          g_variant_new_uint64(comp->compressed_in));
+    g_variant_builder_add(&builder, "{sv}", "compressed-bytes-out",
+                          g_variant_new_uint64(comp->compressed_out));
+    g_variant_builder_add(&builder, "{sv}", "skipped-bytes",
+                          g_variant_new_uint64(comp->skipped));
+    g_mutex_unlock(&comp->lock);
+
+    return g_variant_builder_end(&builder);
+}
+
+G_GNUC_INTERNAL
+GVariant *spice_usbredir_channel_get_device_stats(SpiceUsbredirChannel *channel)
+{
+    SpiceUsbredirChannelPrivate *priv = channel->priv;
+    GVariantBuilder builder;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+    spice_usbredir_channel_lock(channel);
+    if (priv->host != NULL) {
+        spice_usb_backend_channel_get_stats(priv->host, &builder);
+    }
+    spice_usbredir_channel_unlock(channel);
+    g_variant_builder_add(&builder, "{sv}", "iso-late-drops",
+                          g_variant_new_uint64(SPICE_CHANNEL(channel)->priv->stats->messages_dropped -
+                                               priv->dropped_base));
+    g_variant_builder_add(&builder, "{sv}", "compression",
+                          spice_usbredir_channel_get_compression_stats(channel));
+
+    return g_variant_builder_end(&builder);
+}
+
 G_GNUC_INTERNAL
 void spice_usbredir_channel_get_guest_filter(
                           SpiceUsbredirChannel               *channel,
@@ -498,18 +651,10 @@ static void usbredir_free_write_cb_data(uint8_t *data, void *user_data)
 }
 
 #ifdef USE_LZ4
-static int try_write_compress_LZ4(SpiceUsbredirChannel *channel, uint8_t *data, int count)
+static gboolean usbredir_can_compress(SpiceUsbredirChannel *channel, int count)
 {
-    SpiceChannelPrivate *c;
-    SpiceMsgOut *msg_out_compressed;
-    int bound, compressed_data_count;
-    uint8_t *compressed_buf;
-    SpiceMsgCompressedData compressed_data_msg = {
-        .type = SPICE_DATA_COMPRESSION_TYPE_LZ4,
-        .uncompressed_size = count
-    };
+    SpiceChannelPrivate *c = SPICE_CHANNEL(channel)->priv;
 
-    c = SPICE_CHANNEL(channel)->priv;
     if (g_socket_get_family(c->sock) == G_SOCKET_FAMILY_UNIX) {
         /* AF_LOCAL socket - data will not be compressed */
         return FALSE;
@@ -527,17 +672,120 @@ static int try_write_compress_LZ4(SpiceUsbredirChannel *channel, uint8_t *data,
         /* Don't compress - one of the device endpoints is isochronous */
         return FALSE;
     }
+    return TRUE;
+}
+
+static void usbredir_compressor_put_buf(uint8_t *buf, void *opaque)
+{
+    UsbredirCompressor *comp = opaque;
+
+    g_mutex_lock(&comp->lock);
+    if (comp->pool_size < COMPRESS_POOL_MAX_BUFFERS) {
+        comp->pool = g_slist_prepend(comp->pool, buf);
+        comp->pool_size++;
+        buf = NULL;
+    }
+    g_mutex_unlock(&comp->lock);
+
+    g_free(buf);
+    usbredir_compressor_unref(comp);
+}
+
+/* returns a scratch buffer for packets up to COMPRESS_POOL_PACKET_SIZE,
+ * to be released with usbredir_compressor_put_buf() */
+static uint8_t *usbredir_compressor_get_buf(UsbredirCompressor *comp)
+{
+    uint8_t *buf = NULL;
+
+    g_mutex_lock(&comp->lock);
+    if (comp->pool != NULL) {
+        buf = comp->pool->data;
+        comp->pool = g_slist_delete_link(comp->pool, comp->pool);
+        comp->pool_size--;
+    }
+    g_mutex_unlock(&comp->lock);
+
+    usbredir_compressor_ref(comp);
+    return buf ? buf : g_malloc(LZ4_COMPRESSBOUND(COMPRESS_POOL_PACKET_SIZE));
+}
+
+/* returns FALSE if the recent data of the device did not compress well,
+ * the packet is sent without trying then */
+static gboolean usbredir_compressor_sample(UsbredirCompressor *comp, int count)
+{
+    gboolean try = TRUE;
+
+    g_mutex_lock(&comp->lock);
+    if (comp->skip > 0) {
+        comp->skip--;
+        comp->skipped += count;
+        try = FALSE;
+    }
+    g_mutex_unlock(&comp->lock);
+    return try;
+}
+
+static void usbredir_compressor_update(UsbredirCompressor *comp,
+                                       int count, int compressed_count)
+{
+    g_mutex_lock(&comp->lock);
+    if (compressed_count > 0 && compressed_count < count) {
+        comp->compressed_in += count;
+        comp->compressed_out += compressed_count;
+    }
+    if (compressed_count > 0 &&
+        compressed_count <= count - (count >> COMPRESS_MIN_GAIN_SHIFT)) {
+        comp->failures = 0;
+        comp->backoff = COMPRESS_MIN_SKIP;
+    } else if (++comp->failures >= COMPRESS_SAMPLE_FAILURES) {
+        /* incompressible stream, skip it for longer each time */
+        comp->failures = 0;
+        comp->skip = comp->backoff;
+        comp->backoff = MIN(comp->backoff * 2, COMPRESS_MAX_SKIP);
+    }
+    g_mutex_unlock(&comp->lock);
+}
+
+static int try_write_compress_LZ4(SpiceUsbredirChannel *channel, uint8_t *data, int count)
+{
+    UsbredirCompressor *comp = channel->priv->compressor;
+    SpiceMsgOut *msg_out_compressed;
+    int bound, compressed_data_count;
+    uint8_t *compressed_buf;
+    spice_marshaller_item_free_func free_buf;
+    void *free_opaque;
+    SpiceMsgCompressedData compressed_data_msg = {
+        .type = SPICE_DATA_COMPRESSION_TYPE_LZ4,
+        .uncompressed_size = count
+    };
+
+    if (!usbredir_can_compress(channel, count)) {
+        return FALSE;
+    }
     bound = LZ4_compressBound(count);
     if (bound == 0) {
         /* Invalid bound - data will not be compressed */
         return FALSE;
     }
+    if (!usbredir_compressor_sample(comp, count)) {
+        return FALSE;
+    }
 
-    compressed_buf = g_malloc(bound);
+    if (count <= COMPRESS_POOL_PACKET_SIZE) {
+        compressed_buf = usbredir_compressor_get_buf(comp);
+        free_buf = usbredir_compressor_put_buf;
+        free_opaque = comp;
+    } else {
+        compressed_buf = g_malloc(bound);
+        free_buf = (spice_marshaller_item_free_func)g_free;
+        free_opaque = NULL;
+    }
     compressed_data_count = LZ4_compress_default((char*)data,
                                                  (char*)compressed_buf,
                                                  count,
                                                  bound);
+    usbredir_compressor_update(comp, count, compressed_data_count);
+
     if (compressed_data_count > 0 && compressed_data_count < count) {
         compressed_data_msg.compressed_data = compressed_buf;
         msg_out_compressed = spice_msg_out_new(SPICE_CHANNEL(channel),
@@ -547,38 +795,80 @@ static int try_write_compress_LZ4(SpiceUsbredirChannel *channel, uint8_t *data,
         spice_marshaller_add_by_ref_full(msg_out_compressed->marshaller,
                                          compressed_data_msg.compressed_data,
                                          compressed_data_count,
-                                         (spice_marshaller_item_free_func)g_free,
-                                         NULL);
+                                         free_buf, free_opaque);
         spice_msg_out_send(msg_out_compressed);
         return TRUE;
     }
 
     /* if not - free & fallback to sending the message uncompressed */
-    g_free(compressed_buf);
+    free_buf(compressed_buf, free_opaque);
     return FALSE;
 }
 #endif
 
-G_GNUC_INTERNAL
-int spice_usbredir_write(SpiceUsbredirChannel *channel, uint8_t *data, int count)
+static void usbredir_write_data(SpiceUsbredirChannel *channel, uint8_t *data, int count,
+                                gboolean isoch)
 {
+    SpiceUsbredirChannelPrivate *priv = channel->priv;
     SpiceMsgOut *msg_out;
 
+    usbredir_compressor_count(channel->priv->compressor, count);
 #ifdef USE_LZ4
     if (try_write_compress_LZ4(channel, data, count)) {
         spice_usb_backend_return_write_data(channel->priv->host, data);
-        return count;
+        return;
     }
 #endif
     msg_out = spice_msg_out_new(SPICE_CHANNEL(channel),
                                 SPICE_MSGC_SPICEVMC_DATA);
     spice_marshaller_add_by_ref_full(msg_out->marshaller, data, count,
                                      usbredir_free_write_cb_data, channel);
-    spice_msg_out_send(msg_out);
+    if (isoch && priv->iso_deadline > 0) {
+        spice_msg_out_send_deadline(msg_out, g_get_monotonic_time() + priv->iso_deadline);
+    } else {
+        spice_msg_out_send(msg_out);
+    }
+}
 
+G_GNUC_INTERNAL
+int spice_usbredir_write(SpiceUsbredirChannel *channel, uint8_t *data, int count,
+                         gboolean isoch)
+{
+    usbredir_write_data(channel, data, count, isoch);
     return count;
 }
 
+/*
+ * Send a usbredir packet whose payload is referenced rather than copied,
+ * free_data is called once it has been written.
+ * Returns FALSE if the payload has to go through spice_usbredir_write()
+ * to be compressed, the caller keeps the ownership of data in this case.
+ */
+G_GNUC_INTERNAL
+gboolean spice_usbredir_write_by_ref(SpiceUsbredirChannel *channel,
+                                     const uint8_t *header, int header_len,
+                                     uint8_t *data, int count,
+                                     spice_marshaller_item_free_func free_data,
+                                     void *opaque)
+{
+    SpiceMsgOut *msg_out;
+
+#ifdef USE_LZ4
+    if (usbredir_can_compress(channel, header_len + count)) {
+        return FALSE;
+    }
+#endif
+    usbredir_compressor_count(channel->priv->compressor, header_len + count);
+    msg_out = spice_msg_out_new(SPICE_CHANNEL(channel),
+                                SPICE_MSGC_SPICEVMC_DATA);
+    spice_marshaller_add(msg_out->marshaller, header, header_len);
+    spice_marshaller_add_by_ref_full(msg_out->marshaller, data, count,
+                                     free_data, opaque);
+    spice_msg_out_send(msg_out);
+
+    return TRUE;
+}
+
 G_GNUC_INTERNAL
 void spice_usbredir_channel_lock(SpiceUsbredirChannel *channel)
 {
@@ -737,4 +1027,11 @@ static void spice_usbredir_channel_class_init(SpiceUsbredirChannelClass *klass)
 {
 }
 
+GVariant *spice_usbredir_channel_get_compression_stats(SpiceUsbredirChannel *channel)
+{
+    g_return_val_if_fail(SPICE_IS_USBREDIR_CHANNEL(channel), NULL);
+
+    return g_variant_new_array(G_VARIANT_TYPE("{sv}"), NULL, 0);
+}
+
 #endif /* USE_USBREDIR */
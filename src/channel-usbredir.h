@@ -70,6 +70,8 @@ struct _SpiceUsbredirChannelClass {
 
 GType spice_usbredir_channel_get_type(void);
 
+GVariant *spice_usbredir_channel_get_compression_stats(SpiceUsbredirChannel *channel);
+
 G_END_DECLS
 
 #endif /* __SPICE_CLIENT_USBREDIR_CHANNEL_H__ */
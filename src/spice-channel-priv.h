@@ -51,6 +51,8 @@ struct _SpiceMsgOut {
     SpiceMarshaller       *marshaller;
     uint8_t               *header;
     gboolean              ro_check;
+    gint64                queued_time; /* for the queue wait statistics */
+    gint64                deadline; /* dropped if not written by then, 0 for never */
 };
 
 struct _SpiceMsgIn {
@@ -75,6 +77,53 @@ enum spice_channel_state {
     SPICE_CHANNEL_STATE_MIGRATION_HANDSHAKE,
 };
 
+/* message types above this are all counted in the bucket 0, which is
+ * not a valid type; it covers all the types defined by the protocol */
+#define SPICE_CHANNEL_STATS_MSG_TYPES 384
+
+typedef struct {
+    guint64 messages;
+    guint64 bytes;
+} SpiceChannelMsgStats;
+
+/* Only updated from the channel coroutine, so neither locks nor atomic
+ * operations are needed. Times are in microseconds. */
+typedef struct {
+    SpiceChannelMsgStats in[SPICE_CHANNEL_STATS_MSG_TYPES];
+    SpiceChannelMsgStats out[SPICE_CHANNEL_STATS_MSG_TYPES];
+    guint64 bytes_written;
+    guint64 parse_time;
+    guint64 handler_time;
+    guint64 queue_wait_time;
+    guint64 messages_dropped; /* messages past their deadline */
+
+    /* time from sending an ACK to the next message, an upper bound of
+     * the round-trip reached when the server waits on the ack window */
+    gint64  ack_sent_time;
+    guint64 ack_latency_last;
+    guint64 ack_latency_min;
+    guint64 ack_latency_total;
+    guint64 ack_samples;
+
+    /* TLS records and handshakes, on top of the channel data */
+    guint64 tls_overhead_in;
+    guint64 tls_overhead_out;
+    gsize   tls_base_in;
+    guint64 tls_base_out;
+} SpiceChannelStats;
+
+/* connection steps timed for startup profiling */
+typedef enum {
+    SPICE_CHANNEL_PHASE_START,      /* coroutine started */
+    SPICE_CHANNEL_PHASE_CONNECTED,  /* socket connected */
+    SPICE_CHANNEL_PHASE_TLS,        /* TLS handshake done */
+    SPICE_CHANNEL_PHASE_LINK_SENT,
+    SPICE_CHANNEL_PHASE_LINK_REPLY,
+    SPICE_CHANNEL_PHASE_READY,      /* auth result received */
+    SPICE_CHANNEL_PHASE_FIRST_MESSAGE,
+    SPICE_CHANNEL_PHASE_LAST
+} SpiceChannelPhase;
+
 struct _SpiceChannelClassPrivate
 {
     GArray *handlers;
@@ -145,6 +194,11 @@ struct _SpiceChannelPrivate {
     gboolean                    auth_needs_username;
     gboolean                    auth_needs_password;
     GError                      *error;
+
+    SpiceChannelStats           *stats;
+
+    gboolean                    tls_resumed;
+    gint64                      phase_time[SPICE_CHANNEL_PHASE_LAST];
 };
 
 SpiceMsgIn *spice_msg_in_new(SpiceChannel *channel);
@@ -161,6 +215,9 @@ SpiceMsgOut *spice_msg_out_new(SpiceChannel *channel, int type);
 void spice_msg_out_ref(SpiceMsgOut *out);
 void spice_msg_out_unref(SpiceMsgOut *out);
 void spice_msg_out_send(SpiceMsgOut *out);
+/* any context, queued as with spice_msg_out_send() but dropped if it
+ * is not written by deadline (monotonic time) */
+void spice_msg_out_send_deadline(SpiceMsgOut *out, gint64 deadline);
 void spice_msg_out_send_internal(SpiceMsgOut *out);
 void spice_msg_out_hexdump(SpiceMsgOut *out, unsigned char *data, int len);
 
@@ -49,11 +49,15 @@
 
 static void spice_channel_handle_msg(SpiceChannel *channel, SpiceMsgIn *msg);
 static void spice_channel_write_msg(SpiceChannel *channel, SpiceMsgOut *out);
-static void spice_channel_send_link(SpiceChannel *channel);
+static gboolean spice_channel_send_link(SpiceChannel *channel);
 static void channel_reset(SpiceChannel *channel, gboolean migrating);
 static void spice_channel_send_migration_handshake(SpiceChannel *channel);
 static gboolean channel_connect(SpiceChannel *channel, gboolean tls);
 
+/* SSL ex_data slot pointing back to the channel, the app data slot is
+ * used by the certificate verification */
+static int spice_channel_ssl_index = -1;
+
 #if OPENSSL_VERSION_NUMBER < 0x10100000 || \
     (defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x20700000)
 static RSA *EVP_PKEY_get0_RSA(EVP_PKEY *pkey)
@@ -128,6 +132,7 @@ static void spice_channel_init(SpiceChannel *channel)
 #endif
     g_queue_init(&c->xmit_queue);
     g_mutex_init(&c->xmit_queue_lock);
+    c->stats = g_new0(SpiceChannelStats, 1);
 }
 
 static void spice_channel_constructed(GObject *gobject)
@@ -193,6 +198,7 @@ static void spice_channel_finalize(GObject *gobject)
         g_array_free(c->remote_common_caps, TRUE);
 
     g_clear_pointer(&c->peer_msg, g_free);
+    g_free(c->stats);
 
     /* Chain up to the parent class */
     if (G_OBJECT_CLASS(spice_channel_parent_class)->finalize)
@@ -387,6 +393,7 @@ static void spice_channel_class_init(SpiceChannelClass *klass)
 
     SSL_library_init();
     SSL_load_error_strings();
+    spice_channel_ssl_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
 }
 
 /* ---------------------------------------------------------------- */
@@ -734,6 +741,7 @@ void spice_msg_out_send(SpiceMsgOut *out)
         goto end;
     }
 
+    out->queued_time = g_get_monotonic_time();
     was_empty = g_queue_is_empty(&c->xmit_queue);
     g_queue_push_tail(&c->xmit_queue, out);
     c->xmit_queue_size = (was_empty) ? size : c->xmit_queue_size + size;
@@ -752,6 +760,16 @@ end:
     g_mutex_unlock(&c->xmit_queue_lock);
 }
 
+/* any context (system/co-routine/usb-event-thread) */
+G_GNUC_INTERNAL
+void spice_msg_out_send_deadline(SpiceMsgOut *out, gint64 deadline)
+{
+    g_return_if_fail(out != NULL);
+
+    out->deadline = deadline;
+    spice_msg_out_send(out);
+}
+
 /* coroutine context */
 G_GNUC_INTERNAL
 void spice_msg_out_send_internal(SpiceMsgOut *out)
@@ -876,6 +894,7 @@ static void spice_channel_flush_sasl(SpiceChannel *channel, const void *data, si
 /* coroutine context */
 static void spice_channel_write(SpiceChannel *channel, const void *data, size_t len)
 {
+    channel->priv->stats->bytes_written += len;
 #ifdef HAVE_SASL
     if (channel->priv->sasl_conn) {
         spice_channel_flush_sasl(channel, data, len);
@@ -885,6 +904,60 @@ static void spice_channel_write(SpiceChannel *channel, const void *data, size_t
     spice_channel_flush_wire(channel, data, len);
 }
 
+static SpiceChannelMsgStats *stats_for_type(SpiceChannelMsgStats *table, int type)
+{
+    return &table[type < SPICE_CHANNEL_STATS_MSG_TYPES ? type : 0];
+}
+
+/* coroutine context */
+static void spice_channel_stats_sent(SpiceChannel *channel, SpiceMsgOut *out, size_t len)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    SpiceChannelStats *stats = c->stats;
+    int type = spice_header_get_msg_type(out->header, c->use_mini_header);
+    SpiceChannelMsgStats *msg_stats = stats_for_type(stats->out, type);
+    gint64 now = g_get_monotonic_time();
+
+    msg_stats->messages++;
+    msg_stats->bytes += len;
+    if (out->queued_time != 0)
+        stats->queue_wait_time += now - out->queued_time;
+    if (type == SPICE_MSGC_ACK)
+        stats->ack_sent_time = now;
+}
+
+/* Large messages made of several items, like data added by reference,
+ * are written item by item rather than copied into a linear buffer */
+#define SPICE_CHANNEL_WRITE_VECTORED_MIN_SIZE (16 * 1024)
+#define SPICE_CHANNEL_WRITE_MAX_VECTORS 16
+
+/* coroutine context */
+static gboolean spice_channel_write_vectored(SpiceChannel *channel,
+                                             SpiceMarshaller *m, size_t len)
+{
+    struct iovec vec[SPICE_CHANNEL_WRITE_MAX_VECTORS];
+    size_t total = 0;
+    int n, i;
+
+    n = spice_marshaller_fill_iovec(m, vec, G_N_ELEMENTS(vec), 0);
+    if (n < 2) {
+        /* a single item is not copied by spice_marshaller_linearize() */
+        return FALSE;
+    }
+    for (i = 0; i < n; i++) {
+        total += vec[i].iov_len;
+    }
+    if (total != len) {
+        /* too many items */
+        return FALSE;
+    }
+
+    for (i = 0; i < n; i++) {
+        spice_channel_write(channel, vec[i].iov_base, vec[i].iov_len);
+    }
+    return TRUE;
+}
+
 /* coroutine context */
 static void spice_channel_write_msg(SpiceChannel *channel, SpiceMsgOut *out)
 {
@@ -904,15 +977,19 @@ static void spice_channel_write_msg(SpiceChannel *channel, SpiceMsgOut *out)
     }
 
     spice_marshaller_flush(out->marshaller);
-    msg_size = spice_marshaller_get_total_size(out->marshaller) -
-               spice_header_get_header_size(channel->priv->use_mini_header);
+    len = spice_marshaller_get_total_size(out->marshaller);
+    msg_size = len - spice_header_get_header_size(channel->priv->use_mini_header);
     spice_header_set_msg_size(out->header, channel->priv->use_mini_header, msg_size);
-    data = spice_marshaller_linearize(out->marshaller, 0, &len, &free_data);
-    /* spice_msg_out_hexdump(out, data, len); */
-    spice_channel_write(channel, data, len);
+    if (len < SPICE_CHANNEL_WRITE_VECTORED_MIN_SIZE ||
+        !spice_channel_write_vectored(channel, out->marshaller, len)) {
+        data = spice_marshaller_linearize(out->marshaller, 0, &len, &free_data);
+        /* spice_msg_out_hexdump(out, data, len); */
+        spice_channel_write(channel, data, len);
 
-    if (free_data)
-        g_free(data);
+        if (free_data)
+            g_free(data);
+    }
+    spice_channel_stats_sent(channel, out, len);
 
     spice_msg_out_unref(out);
 }
@@ -1255,6 +1332,43 @@ cleanup:
     return ret;
 }
 
+/* coroutine context */
+static void spice_channel_mark_phase(SpiceChannel *channel, SpiceChannelPhase phase)
+{
+    static const gint timeline_events[SPICE_CHANNEL_PHASE_LAST] = {
+        [SPICE_CHANNEL_PHASE_START] = -1,
+        [SPICE_CHANNEL_PHASE_CONNECTED] = SPICE_SESSION_TIMELINE_SOCKET_CONNECTED,
+        [SPICE_CHANNEL_PHASE_TLS] = SPICE_SESSION_TIMELINE_TLS_HANDSHAKE,
+        [SPICE_CHANNEL_PHASE_LINK_SENT] = -1,
+        [SPICE_CHANNEL_PHASE_LINK_REPLY] = SPICE_SESSION_TIMELINE_LINK_REPLY,
+        [SPICE_CHANNEL_PHASE_READY] = SPICE_SESSION_TIMELINE_AUTH,
+        [SPICE_CHANNEL_PHASE_FIRST_MESSAGE] = SPICE_SESSION_TIMELINE_FIRST_MESSAGE,
+    };
+
+    channel->priv->phase_time[phase] = g_get_monotonic_time();
+    if (timeline_events[phase] >= 0)
+        spice_session_timeline_mark(channel->priv->session, channel,
+                                    timeline_events[phase]);
+}
+
+/* coroutine context */
+static void spice_channel_debug_phases(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    gint64 *t = c->phase_time;
+
+#define PHASE_MS(phase) (t[phase] ? (t[phase] - t[SPICE_CHANNEL_PHASE_START]) / 1000.0 : -1.0)
+    CHANNEL_DEBUG(channel, "connect timings (ms): connected %.1f, tls %.1f%s, "
+                  "link sent %.1f, link reply %.1f, ready %.1f",
+                  PHASE_MS(SPICE_CHANNEL_PHASE_CONNECTED),
+                  PHASE_MS(SPICE_CHANNEL_PHASE_TLS),
+                  c->tls_resumed ? " (resumed)" : "",
+                  PHASE_MS(SPICE_CHANNEL_PHASE_LINK_SENT),
+                  PHASE_MS(SPICE_CHANNEL_PHASE_LINK_REPLY),
+                  PHASE_MS(SPICE_CHANNEL_PHASE_READY));
+#undef PHASE_MS
+}
+
 /* coroutine context */
 static gboolean spice_channel_recv_auth(SpiceChannel *channel)
 {
@@ -1277,6 +1391,8 @@ static gboolean spice_channel_recv_auth(SpiceChannel *channel)
     }
 
     c->state = SPICE_CHANNEL_STATE_READY;
+    spice_channel_mark_phase(channel, SPICE_CHANNEL_PHASE_READY);
+    spice_channel_debug_phases(channel);
 
     g_coroutine_signal_emit(channel, signals[SPICE_CHANNEL_EVENT], 0, SPICE_CHANNEL_OPENED);
 
@@ -1302,7 +1418,7 @@ void spice_channel_up(SpiceChannel *channel)
 }
 
 /* coroutine context */
-static void spice_channel_send_link(SpiceChannel *channel)
+static gboolean spice_channel_send_link(SpiceChannel *channel)
 {
     SpiceChannelPrivate *c = channel->priv;
     uint8_t *buffer, *p;
@@ -1317,7 +1433,8 @@ static void spice_channel_send_link(SpiceChannel *channel)
     switch (protocol) {
     case 1: /* protocol 1 == major 1, old 0.4 protocol, last active minor */
         g_critical("deprecated major %d", protocol);
-        return;
+        c->event = SPICE_CHANNEL_ERROR_LINK;
+        return FALSE;
     case SPICE_VERSION_MAJOR: /* protocol 2 == current */
         c->link_hdr.major_version = SPICE_VERSION_MAJOR;
         c->link_hdr.minor_version = SPICE_VERSION_MINOR;
@@ -1326,7 +1443,8 @@ static void spice_channel_send_link(SpiceChannel *channel)
         break;
     default:
         g_critical("unknown major %d", protocol);
-        return;
+        c->event = SPICE_CHANNEL_ERROR_LINK;
+        return FALSE;
     }
 
     c->link_hdr.major_version = GUINT32_TO_LE(c->link_hdr.major_version);
@@ -1367,6 +1485,8 @@ static void spice_channel_send_link(SpiceChannel *channel)
                   c->caps->len);
     spice_channel_write(channel, buffer, p - buffer);
     g_free(buffer);
+
+    return TRUE;
 }
 
 /* coroutine context */
@@ -2027,6 +2147,36 @@ gboolean spice_channel_get_read_only(SpiceChannel *channel)
     return spice_session_get_read_only(channel->priv->session);
 }
 
+/* coroutine context */
+static void spice_channel_stats_received(SpiceChannel *channel, int type, size_t len)
+{
+    SpiceChannelStats *stats = channel->priv->stats;
+    SpiceChannelMsgStats *msg_stats = stats_for_type(stats->in, type);
+
+    msg_stats->messages++;
+    msg_stats->bytes += len;
+
+    if (stats->ack_sent_time != 0) {
+        guint64 latency = g_get_monotonic_time() - stats->ack_sent_time;
+
+        stats->ack_sent_time = 0;
+        stats->ack_latency_last = latency;
+        if (stats->ack_samples == 0 || latency < stats->ack_latency_min)
+            stats->ack_latency_min = latency;
+        stats->ack_latency_total += latency;
+        stats->ack_samples++;
+    }
+}
+
+/* adds the time elapsed since @start to @counter, returns the current time */
+static gint64 spice_channel_stats_add_time(guint64 *counter, gint64 start)
+{
+    gint64 now = g_get_monotonic_time();
+
+    *counter += now - start;
+    return now;
+}
+
 /* coroutine context */
 G_GNUC_INTERNAL
 void spice_channel_recv_msg(SpiceChannel *channel,
@@ -2037,6 +2187,7 @@ void spice_channel_recv_msg(SpiceChannel *channel,
     int msg_size;
     int msg_type;
     int sub_list_offset = 0;
+    gint64 t;
 
     in = spice_msg_in_new(channel);
 
@@ -2059,6 +2210,11 @@ void spice_channel_recv_msg(SpiceChannel *channel,
     msg_type = spice_header_get_msg_type(in->header, c->use_mini_header);
     sub_list_offset = spice_header_get_msg_sub_list(in->header, c->use_mini_header);
 
+    if (c->phase_time[SPICE_CHANNEL_PHASE_FIRST_MESSAGE] == 0)
+        spice_channel_mark_phase(channel, SPICE_CHANNEL_PHASE_FIRST_MESSAGE);
+    spice_channel_stats_received(channel, msg_type,
+                                 spice_header_get_header_size(c->use_mini_header) + msg_size);
+
     if (msg_type == SPICE_MSG_LIST || sub_list_offset) {
         SpiceSubMessageList *sub_list;
         SpiceSubMessage *sub;
@@ -2069,17 +2225,20 @@ void spice_channel_recv_msg(SpiceChannel *channel,
         for (i = 0; i < sub_list->size; i++) {
             sub = (SpiceSubMessage *)(in->data + sub_list->sub_messages[i]);
             sub_in = spice_msg_in_sub_new(channel, in, sub);
+            t = g_get_monotonic_time();
             sub_in->parsed = c->parser(sub_in->data, sub_in->data + sub_in->dpos,
                                        spice_header_get_msg_type(sub_in->header,
                                                                  c->use_mini_header),
                                        c->peer_hdr.minor_version,
                                        &sub_in->psize, &sub_in->pfree);
+            t = spice_channel_stats_add_time(&c->stats->parse_time, t);
             if (sub_in->parsed == NULL) {
                 g_critical("failed to parse sub-message: %s type %d",
                            c->name, spice_header_get_msg_type(sub_in->header, c->use_mini_header));
                 goto end;
             }
             msg_handler(channel, sub_in, data);
+            spice_channel_stats_add_time(&c->stats->handler_time, t);
             spice_msg_in_unref(sub_in);
         }
     }
@@ -2099,8 +2258,10 @@ void spice_channel_recv_msg(SpiceChannel *channel,
     }
 
     /* parse message */
+    t = g_get_monotonic_time();
     in->parsed = c->parser(in->data, in->data + msg_size, msg_type,
                            c->peer_hdr.minor_version, &in->psize, &in->pfree);
+    t = spice_channel_stats_add_time(&c->stats->parse_time, t);
     if (in->parsed == NULL) {
         g_critical("failed to parse message: %s type %d",
                    c->name, msg_type);
@@ -2110,6 +2271,7 @@ void spice_channel_recv_msg(SpiceChannel *channel,
     /* process message */
     /* spice_msg_in_hexdump(in); */
     msg_handler(channel, in, data);
+    spice_channel_stats_add_time(&c->stats->handler_time, t);
 
 end:
     /* If the server uses full header, the serial is not necessarily equal
@@ -2328,6 +2490,12 @@ static void spice_channel_iterate_write(SpiceChannel *channel)
         if (out) {
             guint32 size = spice_marshaller_get_total_size(out->marshaller);
             c->xmit_queue_size = (c->xmit_queue_size < size) ? 0 : c->xmit_queue_size - size;
+            if (out->deadline != 0 && g_get_monotonic_time() > out->deadline) {
+                /* stale, sending it would only delay the next ones */
+                c->stats->messages_dropped++;
+                spice_msg_out_unref(out);
+                continue;
+            }
             spice_channel_write_msg(channel, out);
         }
     } while (out);
@@ -2510,6 +2678,116 @@ static int spice_channel_load_ca(SpiceChannel *channel)
     return count;
 }
 
+/* adds the TLS overhead of the current connection to @in and @out */
+static void spice_channel_get_tls_overhead(SpiceChannel *channel,
+                                           guint64 *in, guint64 *out)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    guint64 wire_in, wire_out, plain_in, plain_out;
+
+    if (c->ssl == NULL)
+        return;
+
+    wire_in = BIO_number_read(SSL_get_rbio(c->ssl));
+    wire_out = BIO_number_written(SSL_get_wbio(c->ssl));
+    plain_in = c->total_read_bytes - c->stats->tls_base_in;
+    plain_out = c->stats->bytes_written - c->stats->tls_base_out;
+    *in += wire_in > plain_in ? wire_in - plain_in : 0;
+    *out += wire_out > plain_out ? wire_out - plain_out : 0;
+}
+
+static GVariant *msg_stats_to_variant(const SpiceChannelMsgStats *table,
+                                      guint64 *messages, guint64 *bytes)
+{
+    GVariantBuilder builder;
+    guint16 type;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(qtt)"));
+    for (type = 0; type < SPICE_CHANNEL_STATS_MSG_TYPES; type++) {
+        if (table[type].messages == 0)
+            continue;
+        g_variant_builder_add(&builder, "(qtt)", type,
+                              table[type].messages, table[type].bytes);
+        *messages += table[type].messages;
+        *bytes += table[type].bytes;
+    }
+
+    return g_variant_builder_end(&builder);
+}
+
+/**
+ * spice_channel_get_stats:
+ * @channel: a #SpiceChannel
+ *
+ * Gets the traffic and latency statistics of @channel, accumulated since
+ * it was created. They are kept up to date at a low cost and can be
+ * polled periodically. The returned dictionary contains:
+ *
+ * - "messages-in", "bytes-in", "messages-out", "bytes-out" (t): totals
+ * - "messages-in-by-type", "messages-out-by-type" (a(qtt)): message type,
+ *   message count and bytes, for the types that were seen. Type 0 counts
+ *   unknown types.
+ * - "parse-time", "handler-time" (t): microseconds spent parsing and
+ *   handling the received messages. Handling time includes the time the
+ *   handlers waited on other operations.
+ * - "queue-wait-time" (t): microseconds the sent messages spent queued
+ * - "queue-size" (t): bytes currently queued
+ * - "messages-dropped" (t): messages dropped as they were not sent by
+ *   their deadline, see #SpiceUsbredirChannel
+ * - "ack-latency", "ack-latency-min", "ack-latency-avg" (t): microseconds
+ *   between sending an ACK and receiving the next message. When the
+ *   server is waiting for the ACK window, this is the round-trip time.
+ * - "tls-overhead-in", "tls-overhead-out" (t): bytes used by TLS records
+ *   and handshakes on top of the channel data.
+ *
+ * Returns: (transfer floating): a #GVariant dictionary of type a{sv}
+ *
+ * Since: 0.39
+ **/
+GVariant *spice_channel_get_stats(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c;
+    SpiceChannelStats *stats;
+    GVariantBuilder builder;
+    GVariant *in_types, *out_types;
+    guint64 messages_in = 0, bytes_in = 0, messages_out = 0, bytes_out = 0;
+    guint64 tls_in, tls_out;
+
+    g_return_val_if_fail(SPICE_IS_CHANNEL(channel), NULL);
+
+    c = channel->priv;
+    stats = c->stats;
+    in_types = msg_stats_to_variant(stats->in, &messages_in, &bytes_in);
+    out_types = msg_stats_to_variant(stats->out, &messages_out, &bytes_out);
+    tls_in = stats->tls_overhead_in;
+    tls_out = stats->tls_overhead_out;
+    spice_channel_get_tls_overhead(channel, &tls_in, &tls_out);
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+#define ADD_STAT(name, value) \
+    g_variant_builder_add(&builder, "{sv}", name, g_variant_new_uint64(value))
+    ADD_STAT("messages-in", messages_in);
+    ADD_STAT("bytes-in", bytes_in);
+    ADD_STAT("messages-out", messages_out);
+    ADD_STAT("bytes-out", bytes_out);
+    ADD_STAT("parse-time", stats->parse_time);
+    ADD_STAT("handler-time", stats->handler_time);
+    ADD_STAT("queue-wait-time", stats->queue_wait_time);
+    ADD_STAT("queue-size", c->xmit_queue_size);
+    ADD_STAT("messages-dropped", stats->messages_dropped);
+    ADD_STAT("ack-latency", stats->ack_latency_last);
+    ADD_STAT("ack-latency-min", stats->ack_latency_min);
+    ADD_STAT("ack-latency-avg",
+             stats->ack_samples ? stats->ack_latency_total / stats->ack_samples : 0);
+    ADD_STAT("tls-overhead-in", tls_in);
+    ADD_STAT("tls-overhead-out", tls_out);
+#undef ADD_STAT
+    g_variant_builder_add(&builder, "{sv}", "messages-in-by-type", in_types);
+    g_variant_builder_add(&builder, "{sv}", "messages-out-by-type", out_types);
+
+    return g_variant_builder_end(&builder);
+}
+
 /**
  * spice_channel_get_error:
  * @channel: a #SpiceChannel
@@ -2530,6 +2808,19 @@ const GError* spice_channel_get_error(SpiceChannel *self)
     return c->error;
 }
 
+/* coroutine context, called when the server issues a session/ticket */
+static int spice_channel_new_tls_session(SSL *ssl, SSL_SESSION *tls_session)
+{
+    SpiceChannel *channel = SSL_get_ex_data(ssl, spice_channel_ssl_index);
+
+    if (channel == NULL)
+        return 0;
+
+    /* share it with the next channels of the session */
+    spice_session_set_tls_session(channel->priv->session, tls_session);
+    return 1;
+}
+
 /* coroutine context */
 static void *spice_channel_coroutine(void *data)
 {
@@ -2542,6 +2833,9 @@ static void *spice_channel_coroutine(void *data)
     long ssl_options = SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_TLSv1;
 
     CHANNEL_DEBUG(channel, "Started background coroutine %p", &c->coroutine);
+    memset(c->phase_time, 0, sizeof(c->phase_time));
+    c->tls_resumed = FALSE;
+    spice_channel_mark_phase(channel, SPICE_CHANNEL_PHASE_START);
 
     if (spice_session_get_client_provided_socket(c->session)) {
         if (c->fd < 0) {
@@ -2559,6 +2853,7 @@ static void *spice_channel_coroutine(void *data)
         g_socket_set_blocking(c->sock, FALSE);
         g_socket_set_keepalive(c->sock, TRUE);
         c->conn = g_socket_connection_factory_create_connection(c->sock);
+        spice_channel_mark_phase(channel, SPICE_CHANNEL_PHASE_CONNECTED);
         goto connected;
     }
 
@@ -2577,6 +2872,7 @@ reconnect:
         }
     }
     c->sock = g_object_ref(g_socket_connection_get_socket(c->conn));
+    spice_channel_mark_phase(channel, SPICE_CHANNEL_PHASE_CONNECTED);
 
     if (c->tls) {
         c->ctx = SSL_CTX_new(SSLv23_method());
@@ -2587,6 +2883,11 @@ reconnect:
         }
 
         SSL_CTX_set_options(c->ctx, ssl_options);
+        /* sessions are kept by the SpiceSession rather than in each
+         * channel's context, so that all its channels can resume them */
+        SSL_CTX_set_session_cache_mode(c->ctx, SSL_SESS_CACHE_CLIENT |
+                                       SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(c->ctx, spice_channel_new_tls_session);
 
         verify = spice_session_get_verify(c->session);
         if (verify &
@@ -2624,6 +2925,13 @@ reconnect:
         BIO *bio = bio_new_giostream(G_IO_STREAM(c->conn));
         SSL_set_bio(c->ssl, bio, bio);
 
+        SSL_set_ex_data(c->ssl, spice_channel_ssl_index, channel);
+        {
+            SSL_SESSION *tls_session = spice_session_get_tls_session(c->session);
+            if (tls_session != NULL && SSL_set_session(c->ssl, tls_session) != 1)
+                CHANNEL_DEBUG(channel, "could not reuse TLS session");
+        }
+
         {
             guint8 *pubkey;
             guint pubkey_len;
@@ -2649,6 +2957,10 @@ ssl_reconnect:
                 goto cleanup;
             }
         }
+        c->tls_resumed = SSL_session_reused(c->ssl);
+        c->stats->tls_base_in = c->total_read_bytes;
+        c->stats->tls_base_out = c->stats->bytes_written;
+        spice_channel_mark_phase(channel, SPICE_CHANNEL_PHASE_TLS);
     }
 
 connected:
@@ -2667,9 +2979,15 @@ connected:
                   strerror(errno));
     }
 
-    spice_channel_send_link(channel);
-    if (!spice_channel_recv_link_hdr(channel) ||
-        !spice_channel_recv_link_msg(channel) ||
+    if (!spice_channel_send_link(channel))
+        goto cleanup;
+    spice_channel_mark_phase(channel, SPICE_CHANNEL_PHASE_LINK_SENT);
+
+    if (!spice_channel_recv_link_hdr(channel))
+        goto cleanup;
+    spice_channel_mark_phase(channel, SPICE_CHANNEL_PHASE_LINK_REPLY);
+
+    if (!spice_channel_recv_link_msg(channel) ||
         !spice_channel_recv_auth(channel))
         goto cleanup;
 
@@ -2831,6 +3149,10 @@ static void channel_reset(SpiceChannel *channel, gboolean migrating)
 #endif
 
     g_clear_pointer(&c->sslverify, spice_openssl_verify_free);
+    if (c->ssl != NULL) {
+        spice_channel_get_tls_overhead(channel, &c->stats->tls_overhead_in,
+                                       &c->stats->tls_overhead_out);
+    }
     g_clear_pointer(&c->ssl, SSL_free);
     g_clear_pointer(&c->ctx, SSL_CTX_free);
 
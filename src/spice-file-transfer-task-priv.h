@@ -32,6 +32,10 @@ void spice_file_transfer_task_completed(SpiceFileTransferTask *self, GError *err
 guint32 spice_file_transfer_task_get_id(SpiceFileTransferTask *self);
 SpiceMainChannel *spice_file_transfer_task_get_channel(SpiceFileTransferTask *self);
 GCancellable *spice_file_transfer_task_get_cancellable(SpiceFileTransferTask *self);
+SpiceFileTransferTask *spice_file_transfer_task_new(SpiceMainChannel *channel,
+                                                    GFile *file,
+                                                    GFileCopyFlags flags,
+                                                    GCancellable *cancellable);
 GHashTable *spice_file_transfer_task_create_tasks(GFile **files,
                                                   SpiceMainChannel *channel,
                                                   GFileCopyFlags flags,
@@ -47,8 +51,19 @@ void spice_file_transfer_task_read_async(SpiceFileTransferTask *self,
                                          gpointer userdata);
 gssize spice_file_transfer_task_read_finish(SpiceFileTransferTask *self,
                                             GAsyncResult *result,
-                                            char **buffer,
+                                            GBytes **buffer,
                                             GError **error);
 gboolean spice_file_transfer_task_is_completed(SpiceFileTransferTask *self);
+gboolean spice_file_transfer_task_is_reading(SpiceFileTransferTask *self);
+void spice_file_transfer_task_set_window(SpiceFileTransferTask *self, guint window);
+guint spice_file_transfer_task_get_window(SpiceFileTransferTask *self);
+void spice_file_transfer_task_chunk_queued(SpiceFileTransferTask *self, gsize size);
+void spice_file_transfer_task_chunk_sent(SpiceFileTransferTask *self);
+guint spice_file_transfer_task_get_in_flight(SpiceFileTransferTask *self);
+void spice_file_transfer_task_set_name(SpiceFileTransferTask *self,
+                                       const gchar *name,
+                                       guint64 expected_size);
+const gchar *spice_file_transfer_task_get_name(SpiceFileTransferTask *self);
+guint64 spice_file_transfer_task_get_expected_size(SpiceFileTransferTask *self);
 
 G_END_DECLS
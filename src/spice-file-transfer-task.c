@@ -51,12 +51,31 @@ struct _SpiceFileTransferTask
     GCancellable                   *cancellable;
     GAsyncReadyCallback            callback;
     gpointer                       user_data;
-    char                           *buffer;
+    GBytes                         *buffer;
     uint64_t                       read_bytes;
     uint64_t                       file_size;
     gint64                         start_time;
+    gint64                         end_time;
     gint64                         last_update;
     GError                         *error;
+
+    /* read-ahead: the file is read in the background, up to window
+     * chunks ahead of the channel */
+    GQueue                         *chunks;
+    GTask                          *waiting;
+    GError                         *read_error;
+    uint64_t                       fetched_bytes;
+    gboolean                       eof;
+    guint                          window;
+
+    /* chunks handed to the channel and not sent to the agent yet */
+    GQueue                         *in_flight;
+    uint64_t                       sent_bytes;
+
+    /* set for files found in a directory: the path relative to the
+     * transferred directory, and the size seen when enumerating it */
+    gchar                          *name;
+    uint64_t                       expected_size;
 };
 
 struct _SpiceFileTransferTaskClass
@@ -67,6 +86,7 @@ struct _SpiceFileTransferTaskClass
 G_DEFINE_TYPE(SpiceFileTransferTask, spice_file_transfer_task, G_TYPE_OBJECT)
 
 #define FILE_XFER_CHUNK_SIZE (VD_AGENT_MAX_DATA_SIZE * 32)
+#define FILE_XFER_DEFAULT_WINDOW 4
 
 enum {
     PROP_TASK_ID = 1,
@@ -76,6 +96,7 @@ enum {
     PROP_TASK_TOTAL_BYTES,
     PROP_TASK_TRANSFERRED_BYTES,
     PROP_TASK_PROGRESS,
+    PROP_TASK_THROUGHPUT,
 };
 
 enum {
@@ -89,7 +110,8 @@ static guint task_signals[LAST_TASK_SIGNAL];
  * Helpers
  ******************************************************************************/
 
-static SpiceFileTransferTask *
+G_GNUC_INTERNAL
+SpiceFileTransferTask *
 spice_file_transfer_task_new(SpiceMainChannel *channel,
                              GFile *file,
                              GFileCopyFlags flags,
@@ -198,34 +220,31 @@ static void spice_file_transfer_task_read_file_cb(GObject *obj,
                             task);
 }
 
-static void spice_file_transfer_task_read_stream_cb(GObject *source_object,
-                                                    GAsyncResult *res,
-                                                    gpointer userdata)
+/* Hand the next chunk to the channel, if it is waiting for one */
+static void spice_file_transfer_task_deliver(SpiceFileTransferTask *self)
 {
-    SpiceFileTransferTask *self;
-    GTask *task;
-    gssize nbytes;
-    GError *error = NULL;
-
-    task = G_TASK(userdata);
-    self = g_task_get_source_object(task);
-
-    g_return_if_fail(self->pending == TRUE);
-    self->pending = FALSE;
+    GTask *task = self->waiting;
+    gsize nbytes = 0;
 
-    nbytes = g_input_stream_read_finish(G_INPUT_STREAM(self->file_stream), res, &error);
-    if (self->error) {
-        g_clear_error(&error);
-        /* On any pending error on SpiceFileTransferTask */
-        g_task_return_error(task, g_error_copy(self->error));
-        g_object_unref(task);
+    if (task == NULL)
         return;
-    } else if (error) {
-        g_task_return_error(task, error);
+
+    if (self->read_error != NULL) {
+        self->waiting = NULL;
+        g_task_return_error(task, g_steal_pointer(&self->read_error));
         g_object_unref(task);
         return;
     }
 
+    if (g_queue_is_empty(self->chunks) && !self->eof)
+        return;
+
+    self->waiting = NULL;
+    g_clear_pointer(&self->buffer, g_bytes_unref);
+    if (!g_queue_is_empty(self->chunks)) {
+        self->buffer = g_queue_pop_head(self->chunks);
+        nbytes = g_bytes_get_size(self->buffer);
+    }
     self->read_bytes += nbytes;
 
     if (spice_util_get_debug()) {
@@ -245,6 +264,75 @@ static void spice_file_transfer_task_read_stream_cb(GObject *source_object,
     g_object_unref(task);
 }
 
+static void spice_file_transfer_task_read_ahead(SpiceFileTransferTask *self);
+
+static void spice_file_transfer_task_read_stream_cb(GObject *source_object,
+                                                    GAsyncResult *res,
+                                                    gpointer userdata)
+{
+    SpiceFileTransferTask *self = userdata;
+    GBytes *chunk;
+    GError *error = NULL;
+
+    g_return_if_fail(self->pending == TRUE);
+    self->pending = FALSE;
+
+    chunk = g_input_stream_read_bytes_finish(G_INPUT_STREAM(self->file_stream), res, &error);
+    if (self->error) {
+        g_clear_error(&error);
+        g_clear_pointer(&chunk, g_bytes_unref);
+        if (self->waiting != NULL) {
+            /* On any pending error on SpiceFileTransferTask */
+            GTask *task = g_steal_pointer(&self->waiting);
+            g_task_return_error(task, g_error_copy(self->error));
+            g_object_unref(task);
+        } else if (self->completed) {
+            /* nobody is going to read again, finish the completion that
+             * was held back by this read */
+            spice_file_transfer_task_completed(self, NULL);
+        }
+        g_object_unref(self);
+        return;
+    } else if (error) {
+        /* reported on the next read */
+        self->read_error = error;
+        spice_file_transfer_task_deliver(self);
+        g_object_unref(self);
+        return;
+    }
+
+    self->fetched_bytes += g_bytes_get_size(chunk);
+    if (g_bytes_get_size(chunk) == 0 || self->fetched_bytes >= self->file_size)
+        self->eof = TRUE;
+    if (g_bytes_get_size(chunk) > 0)
+        g_queue_push_tail(self->chunks, chunk);
+    else
+        g_bytes_unref(chunk);
+
+    spice_file_transfer_task_deliver(self);
+    spice_file_transfer_task_read_ahead(self);
+    g_object_unref(self);
+}
+
+/* Keep reading while there is room in the read-ahead window, so that
+ * disk reads overlap with sending the previous chunks */
+static void spice_file_transfer_task_read_ahead(SpiceFileTransferTask *self)
+{
+    if (self->pending || self->completed || self->eof || self->read_error != NULL)
+        return;
+
+    if (g_queue_get_length(self->chunks) >= self->window)
+        return;
+
+    self->pending = TRUE;
+    g_input_stream_read_bytes_async(G_INPUT_STREAM(self->file_stream),
+                                    FILE_XFER_CHUNK_SIZE,
+                                    G_PRIORITY_DEFAULT,
+                                    self->cancellable,
+                                    spice_file_transfer_task_read_stream_cb,
+                                    g_object_ref(self));
+}
+
 /* main context */
 static void spice_file_transfer_task_close_stream_cb(GObject      *object,
                                                      GAsyncResult *close_res,
@@ -266,11 +354,11 @@ static void spice_file_transfer_task_close_stream_cb(GObject      *object,
     }
 
     if (self->error == NULL && spice_util_get_debug()) {
-        gint64 now = g_get_monotonic_time();
         gchar *basename = g_file_get_basename(self->file);
-        double seconds = (double) (now - self->start_time) / G_TIME_SPAN_SECOND;
+        double seconds = (double) (self->end_time - self->start_time) / G_TIME_SPAN_SECOND;
         gchar *file_size_str = g_format_size(self->file_size);
-        gchar *transfer_speed_str = g_format_size(self->file_size / seconds);
+        gchar *transfer_speed_str =
+            g_format_size(spice_file_transfer_task_get_throughput(self));
 
         g_warn_if_fail(self->read_bytes == self->file_size);
         SPICE_DEBUG("transferred file %s of %s size in %.1f seconds (%s/s)",
@@ -292,6 +380,8 @@ G_GNUC_INTERNAL
 void spice_file_transfer_task_completed(SpiceFileTransferTask *self,
                                         GError *error)
 {
+    if (!self->completed)
+        self->end_time = g_get_monotonic_time();
     self->completed = TRUE;
 
     /* In case of multiple errors we only report the first error */
@@ -421,7 +511,7 @@ void spice_file_transfer_task_read_async(SpiceFileTransferTask *self,
     GTask *task;
 
     g_return_if_fail(self != NULL);
-    if (self->pending) {
+    if (self->waiting != NULL) {
         g_task_report_new_error(self, callback, userdata,
                                 spice_file_transfer_task_read_async,
                                 SPICE_CLIENT_ERROR,
@@ -435,6 +525,7 @@ void spice_file_transfer_task_read_async(SpiceFileTransferTask *self,
      * should call read-async when it expects EOF. */
     g_coroutine_object_notify(G_OBJECT(self), "progress");
     g_coroutine_object_notify(G_OBJECT(self), "transferred-bytes");
+    g_coroutine_object_notify(G_OBJECT(self), "throughput");
 
     task = g_task_new(self, self->cancellable, callback, userdata);
 
@@ -448,20 +539,17 @@ void spice_file_transfer_task_read_async(SpiceFileTransferTask *self,
         return;
     }
 
-    self->pending = TRUE;
-    g_input_stream_read_async(G_INPUT_STREAM(self->file_stream),
-                              self->buffer,
-                              FILE_XFER_CHUNK_SIZE,
-                              G_PRIORITY_DEFAULT,
-                              self->cancellable,
-                              spice_file_transfer_task_read_stream_cb,
-                              task);
+    self->waiting = task;
+    spice_file_transfer_task_deliver(self);
+    spice_file_transfer_task_read_ahead(self);
 }
 
+/* @buffer gets a reference on the chunk, which stays valid while the
+ * next ones are read; %NULL at EOF */
 G_GNUC_INTERNAL
 gssize spice_file_transfer_task_read_finish(SpiceFileTransferTask *self,
                                             GAsyncResult *result,
-                                            char **buffer,
+                                            GBytes **buffer,
                                             GError **error)
 {
     gssize nbytes;
@@ -471,7 +559,7 @@ gssize spice_file_transfer_task_read_finish(SpiceFileTransferTask *self,
 
     nbytes = g_task_propagate_int(task, error);
     if (nbytes >= 0 && buffer != NULL)
-        *buffer = self->buffer;
+        *buffer = (nbytes > 0) ? g_bytes_ref(self->buffer) : NULL;
 
     return nbytes;
 }
@@ -486,6 +574,82 @@ gboolean spice_file_transfer_task_is_completed(SpiceFileTransferTask *self)
     return self->completed;
 }
 
+/* Whether a spice_file_transfer_task_read_async() is waiting for data */
+G_GNUC_INTERNAL
+gboolean spice_file_transfer_task_is_reading(SpiceFileTransferTask *self)
+{
+    g_return_val_if_fail(self != NULL, FALSE);
+    return self->waiting != NULL;
+}
+
+/* Number of chunks read ahead of the channel, and of chunks the channel
+ * may have queued to the agent at once */
+G_GNUC_INTERNAL
+void spice_file_transfer_task_set_window(SpiceFileTransferTask *self, guint window)
+{
+    g_return_if_fail(self != NULL);
+    self->window = MAX(window, 1);
+}
+
+G_GNUC_INTERNAL
+guint spice_file_transfer_task_get_window(SpiceFileTransferTask *self)
+{
+    g_return_val_if_fail(self != NULL, 0);
+    return self->window;
+}
+
+/* The channel queued a chunk of @size bytes to the agent */
+G_GNUC_INTERNAL
+void spice_file_transfer_task_chunk_queued(SpiceFileTransferTask *self, gsize size)
+{
+    g_return_if_fail(self != NULL);
+    g_queue_push_tail(self->in_flight, GSIZE_TO_POINTER(size));
+}
+
+/* The oldest queued chunk left the agent queue */
+G_GNUC_INTERNAL
+void spice_file_transfer_task_chunk_sent(SpiceFileTransferTask *self)
+{
+    g_return_if_fail(self != NULL);
+    g_return_if_fail(!g_queue_is_empty(self->in_flight));
+    self->sent_bytes += GPOINTER_TO_SIZE(g_queue_pop_head(self->in_flight));
+}
+
+G_GNUC_INTERNAL
+guint spice_file_transfer_task_get_in_flight(SpiceFileTransferTask *self)
+{
+    g_return_val_if_fail(self != NULL, 0);
+    return g_queue_get_length(self->in_flight);
+}
+
+/* Name of the file for the agent, which may contain subdirectories
+ * separated by '/'. The basename of the file is used if not set */
+G_GNUC_INTERNAL
+void spice_file_transfer_task_set_name(SpiceFileTransferTask *self,
+                                       const gchar *name,
+                                       guint64 expected_size)
+{
+    g_return_if_fail(self != NULL);
+
+    g_free(self->name);
+    self->name = g_strdup(name);
+    self->expected_size = expected_size;
+}
+
+G_GNUC_INTERNAL
+const gchar *spice_file_transfer_task_get_name(SpiceFileTransferTask *self)
+{
+    g_return_val_if_fail(self != NULL, NULL);
+    return self->name;
+}
+
+G_GNUC_INTERNAL
+guint64 spice_file_transfer_task_get_expected_size(SpiceFileTransferTask *self)
+{
+    g_return_val_if_fail(self != NULL, 0);
+    return self->expected_size;
+}
+
 /*******************************************************************************
  * External API
  ******************************************************************************/
@@ -579,6 +743,30 @@ guint64 spice_file_transfer_task_get_transferred_bytes(SpiceFileTransferTask *se
     return self->read_bytes;
 }
 
+/**
+ * spice_file_transfer_task_get_throughput:
+ * @self: a file transfer task
+ *
+ * Gets the average rate at which the file has been sent to the agent
+ * since the transfer started.
+ *
+ * Returns: The throughput, in bytes per second
+ *
+ * Since: 0.39
+ **/
+guint64 spice_file_transfer_task_get_throughput(SpiceFileTransferTask *self)
+{
+    gint64 elapsed;
+
+    g_return_val_if_fail(SPICE_IS_FILE_TRANSFER_TASK(self), 0);
+
+    elapsed = (self->completed ? self->end_time : g_get_monotonic_time()) - self->start_time;
+    if (elapsed <= 0)
+        return 0;
+
+    return self->sent_bytes * G_USEC_PER_SEC / elapsed;
+}
+
 /*******************************************************************************
  * GObject
  ******************************************************************************/
@@ -608,6 +796,9 @@ spice_file_transfer_task_get_property(GObject *object,
         case PROP_TASK_PROGRESS:
             g_value_set_double(value, spice_file_transfer_task_get_progress(self));
             break;
+        case PROP_TASK_THROUGHPUT:
+            g_value_set_uint64(value, spice_file_transfer_task_get_throughput(self));
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
     }
@@ -648,6 +839,7 @@ spice_file_transfer_task_dispose(GObject *object)
     g_clear_object(&self->file);
     g_clear_object(&self->file_stream);
     g_clear_error(&self->error);
+    g_clear_error(&self->read_error);
     g_clear_object(&self->channel);
     g_clear_object(&self->cancellable);
 
@@ -659,7 +851,10 @@ spice_file_transfer_task_finalize(GObject *object)
 {
     SpiceFileTransferTask *self = SPICE_FILE_TRANSFER_TASK(object);
 
-    g_free(self->buffer);
+    g_clear_pointer(&self->buffer, g_bytes_unref);
+    g_queue_free_full(self->chunks, (GDestroyNotify)g_bytes_unref);
+    g_queue_free(self->in_flight);
+    g_free(self->name);
 
     G_OBJECT_CLASS(spice_file_transfer_task_parent_class)->finalize(object);
 }
@@ -669,9 +864,9 @@ spice_file_transfer_task_constructed(GObject *object)
 {
     SpiceFileTransferTask *self = SPICE_FILE_TRANSFER_TASK(object);
 
+    self->start_time = g_get_monotonic_time();
     if (spice_util_get_debug()) {
         gchar *basename = g_file_get_basename(self->file);
-        self->start_time = g_get_monotonic_time();
         self->last_update = self->start_time;
 
         SPICE_DEBUG("transfer of file %s has started", basename);
@@ -799,6 +994,23 @@ spice_file_transfer_task_class_init(SpiceFileTransferTaskClass *klass)
                                                         G_PARAM_READABLE |
                                                         G_PARAM_STATIC_STRINGS));
 
+    /**
+     * SpiceFileTransferTask:throughput:
+     *
+     * The average rate at which the file has been sent to the agent, in
+     * bytes per second. It is updated along with
+     * #SpiceFileTransferTask:progress.
+     *
+     * Since: 0.39
+     **/
+    g_object_class_install_property(object_class, PROP_TASK_THROUGHPUT,
+                                    g_param_spec_uint64("throughput",
+                                                        "Throughput",
+                                                        "The transfer rate in bytes per second",
+                                                        0, G_MAXUINT64, 0,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_STATIC_STRINGS));
+
     /**
      * SpiceFileTransferTask::finished:
      * @task: the file transfer task that emitted the signal
@@ -821,5 +1033,7 @@ spice_file_transfer_task_class_init(SpiceFileTransferTaskClass *klass)
 static void
 spice_file_transfer_task_init(SpiceFileTransferTask *self)
 {
-    self->buffer = g_malloc0(FILE_XFER_CHUNK_SIZE);
+    self->chunks = g_queue_new();
+    self->in_flight = g_queue_new();
+    self->window = FILE_XFER_DEFAULT_WINDOW;
 }
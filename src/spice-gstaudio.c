@@ -164,10 +164,10 @@ static gboolean record_bus_cb(GstBus *bus, GstMessage *msg, gpointer data)
             return TRUE;
         }
 
+        /* a 0 timestamp lets the channel stamp the data with the
+         * current session mm-time */
         spice_record_channel_send_data(SPICE_RECORD_CHANNEL(p->rchannel),
-                               /* FIXME: server side doesn't care about ts?
-                                  what is the unit? ms apparently */
-                               mapping.data, mapping.size, 0);
+                                       mapping.data, mapping.size, 0);
         gst_buffer_unmap(buffer, &mapping);
         gst_sample_unref(s);
         break;
@@ -59,6 +59,8 @@ struct _SpiceGtkSessionPrivate {
     gboolean                clip_hasdata[CLIPBOARD_LAST];
     gboolean                clip_grabbed[CLIPBOARD_LAST];
     gboolean                clipboard_by_guest[CLIPBOARD_LAST];
+    /* cancels data being sent to the guest when the owner changes */
+    GCancellable            *clip_notify[CLIPBOARD_LAST];
     /* auto-usbredir related */
     gboolean                auto_usbredir_enable;
     int                     auto_usbredir_reqs;
@@ -226,8 +228,16 @@ static void spice_gtk_session_dispose(GObject *gobject)
 {
     SpiceGtkSession *self = SPICE_GTK_SESSION(gobject);
     SpiceGtkSessionPrivate *s = self->priv;
+    int i;
 
     /* release stuff */
+    for (i = 0; i < CLIPBOARD_LAST; i++) {
+        if (s->clip_notify[i]) {
+            g_cancellable_cancel(s->clip_notify[i]);
+            g_clear_object(&s->clip_notify[i]);
+        }
+    }
+
     if (s->clipboard) {
         g_signal_handlers_disconnect_by_func(s->clipboard,
                 G_CALLBACK(clipboard_owner_change), self);
@@ -660,6 +670,12 @@ static void clipboard_owner_change(GtkClipboard        *clipboard,
         return;
     }
 
+    /* Data of the previous owner that didn't start to be sent is stale */
+    if (s->clip_notify[selection]) {
+        g_cancellable_cancel(s->clip_notify[selection]);
+        g_clear_object(&s->clip_notify[selection]);
+    }
+
     /* In case we sent a grab to the agent, we need to release it now as
      * previous clipboard data should not be reachable anymore */
     if (s->clip_grabbed[selection]) {
@@ -703,6 +719,7 @@ typedef struct
     GtkSelectionData *selection_data;
     guint info;
     guint selection;
+    GByteArray *data;
 } RunInfo;
 
 static void clipboard_got_from_guest(SpiceMainChannel *main, guint selection,
@@ -738,6 +755,29 @@ static void clipboard_got_from_guest(SpiceMainChannel *main, guint selection,
     g_free(conv);
 }
 
+static void clipboard_got_fragment_from_guest(SpiceMainChannel *main, guint selection,
+                                              guint type, guint offset,
+                                              const guchar *data, guint size,
+                                              guint total, gpointer user_data)
+{
+    RunInfo *ri = user_data;
+
+    g_return_if_fail(selection == ri->selection);
+
+    /* whole data at once, no need to gather it */
+    if (offset == 0 && size == total) {
+        clipboard_got_from_guest(main, selection, type, data, size, ri);
+        return;
+    }
+
+    if (ri->data == NULL)
+        ri->data = g_byte_array_sized_new(total);
+    g_byte_array_append(ri->data, data, size);
+
+    if (offset + size == total)
+        clipboard_got_from_guest(main, selection, type, ri->data->data, ri->data->len, ri);
+}
+
 static void clipboard_agent_connected(RunInfo *ri)
 {
     g_warning("agent status changed, cancel clipboard request");
@@ -773,8 +813,8 @@ static void clipboard_get(GtkClipboard *clipboard,
     ri.selection = selection;
     ri.self = self;
 
-    clipboard_handler = g_signal_connect(s->main, "main-clipboard-selection",
-                                         G_CALLBACK(clipboard_got_from_guest),
+    clipboard_handler = g_signal_connect(s->main, "main-clipboard-selection-fragment",
+                                         G_CALLBACK(clipboard_got_fragment_from_guest),
                                          &ri);
     agent_handler = g_signal_connect_swapped(s->main, "notify::agent-connected",
                                      G_CALLBACK(clipboard_agent_connected),
@@ -802,6 +842,8 @@ static void clipboard_get(GtkClipboard *clipboard,
 
 cleanup:
     g_clear_pointer(&ri.loop, g_main_loop_unref);
+    if (ri.data != NULL)
+        g_byte_array_unref(ri.data);
     g_signal_handler_disconnect(s->main, clipboard_handler);
     g_signal_handler_disconnect(s->main, agent_handler);
 }
@@ -894,6 +936,37 @@ static gboolean check_clipboard_size_limits(SpiceGtkSession *session,
     return TRUE;
 }
 
+static void clipboard_notify_cb(GObject *source_object,
+                                GAsyncResult *res,
+                                gpointer user_data)
+{
+    GError *error = NULL;
+
+    if (!spice_main_channel_clipboard_selection_notify_finish(SPICE_MAIN_CHANNEL(source_object),
+                                                              res, &error)) {
+        SPICE_DEBUG("clipboard data not sent: %s", error->message);
+        g_clear_error(&error);
+    }
+}
+
+/* The data is sent as the agent tokens allow, so that large clipboard
+ * contents don't block the UI */
+static void clipboard_notify(SpiceGtkSession *self, int selection,
+                             guint32 type, GBytes *data)
+{
+    SpiceGtkSessionPrivate *s = self->priv;
+
+    g_return_if_fail(s->main != NULL);
+
+    if (s->clip_notify[selection] == NULL)
+        s->clip_notify[selection] = g_cancellable_new();
+
+    spice_main_channel_clipboard_selection_notify_async(s->main, selection, type, data,
+                                                        s->clip_notify[selection],
+                                                        NULL, NULL,
+                                                        clipboard_notify_cb, NULL);
+}
+
 /* This will convert line endings if needed (between Windows/Unix conventions),
  * and will make sure 'len' does not take into account any trailing \0 as this could
  * cause some confusion guest side.
@@ -930,7 +1003,7 @@ static void clipboard_received_text_cb(GtkClipboard *clipboard,
     char *conv = NULL;
     int len = 0;
     int selection;
-    const guchar *data = NULL;
+    GBytes *data = NULL;
 
     if (self == NULL)
         return;
@@ -958,12 +1031,15 @@ static void clipboard_received_text_cb(GtkClipboard *clipboard,
         goto notify_agent;
     }
 
-    data = (const guchar *) (conv != NULL ? conv : text);
+    if (conv != NULL)
+        data = g_bytes_new_take(g_steal_pointer(&conv), len);
+    else
+        data = g_bytes_new(text, len);
 notify_agent:
-    spice_main_channel_clipboard_selection_notify(self->priv->main, selection,
-                                                  VD_AGENT_CLIPBOARD_UTF8_TEXT,
-                                                  data,
-                                                  (data != NULL) ? len : 0);
+    if (data == NULL)
+        data = g_bytes_new(NULL, 0);
+    clipboard_notify(self, selection, VD_AGENT_CLIPBOARD_UTF8_TEXT, data);
+    g_bytes_unref(data);
     g_free(conv);
 }
 
@@ -1009,14 +1085,16 @@ static void clipboard_received_cb(GtkClipboard *clipboard,
         g_free(name);
     }
 
-    const guchar *data = gtk_selection_data_get_data(selection_data);
+    /* the selection data is only valid during this callback */
+    GBytes *data = g_bytes_new(gtk_selection_data_get_data(selection_data), len);
 
     /* text should be handled through clipboard_received_text_cb(), not
      * clipboard_received_cb().
      */
     g_warn_if_fail(type != VD_AGENT_CLIPBOARD_UTF8_TEXT);
 
-    spice_main_channel_clipboard_selection_notify(s->main, selection, type, data, len);
+    clipboard_notify(self, selection, type, data);
+    g_bytes_unref(data);
 }
 
 static gboolean clipboard_request(SpiceMainChannel *main, guint selection,
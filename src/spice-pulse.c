@@ -22,6 +22,9 @@
 #include "spice-session-priv.h"
 #include "spice-channel-priv.h"
 #include "spice-util-priv.h"
+#include "spice-audio-priv.h"
+#include "channel-playback-priv.h"
+#include "channel-record-priv.h"
 
 #include <pulse/glib-mainloop.h>
 #include <pulse/pulseaudio.h>
@@ -38,6 +41,16 @@ struct async_task {
     gulong                     cancel_id;
 };
 
+/* Adaptive latency controller, all values in ms */
+struct latency_ctl {
+    guint                      current;
+    guint                      target;
+    guint                      floor;
+    guint                      ceiling;
+    guint                      underflows;
+    gint64                     last_adjust;
+};
+
 struct stream {
     pa_sample_spec             spec;
     pa_stream                  *stream;
@@ -49,6 +62,7 @@ struct stream {
     gboolean                   info_updated;
     gchar                      *name;
     pa_ext_stream_restore_info info;
+    struct latency_ctl         latency;
 };
 
 struct _SpicePulsePrivate {
@@ -60,14 +74,27 @@ struct _SpicePulsePrivate {
     int                     state;
     struct stream           playback;
     struct stream           record;
-    guint                   last_delay;
-    guint                   target_delay;
+    guint                   min_delay;
     struct async_task       *pending_restore_task;
     GList                   *results;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(SpicePulse, spice_pulse, SPICE_TYPE_AUDIO)
 
+enum {
+    PROP_0,
+    PROP_PLAYBACK_LATENCY,
+    PROP_PLAYBACK_TARGET_LATENCY,
+    PROP_RECORD_LATENCY,
+    PROP_RECORD_TARGET_LATENCY,
+};
+
+#define RECORD_DEFAULT_LATENCY_MS 20
+#define LATENCY_GROW_STEP_MS      20
+#define LATENCY_SHRINK_STEP_MS    5
+/* how long the stream must run without glitches before shrinking */
+#define LATENCY_STABLE_PERIOD_US  (10 * G_USEC_PER_SEC)
+
 static const char *stream_state_names[] = {
     [ PA_STREAM_UNCONNECTED ] = "unconnected",
     [ PA_STREAM_CREATING    ] = "creating",
@@ -150,6 +177,32 @@ static void spice_pulse_dispose(GObject *obj)
     G_OBJECT_CLASS(spice_pulse_parent_class)->dispose(obj);
 }
 
+static void spice_pulse_get_property(GObject    *gobject,
+                                     guint       prop_id,
+                                     GValue     *value,
+                                     GParamSpec *pspec)
+{
+    SpicePulsePrivate *p = SPICE_PULSE(gobject)->priv;
+
+    switch (prop_id) {
+    case PROP_PLAYBACK_LATENCY:
+        g_value_set_uint(value, p->playback.latency.current);
+        break;
+    case PROP_PLAYBACK_TARGET_LATENCY:
+        g_value_set_uint(value, p->playback.latency.target);
+        break;
+    case PROP_RECORD_LATENCY:
+        g_value_set_uint(value, p->record.latency.current);
+        break;
+    case PROP_RECORD_TARGET_LATENCY:
+        g_value_set_uint(value, p->record.latency.target);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
+        break;
+    }
+}
+
 static void spice_pulse_init(SpicePulse *pulse)
 {
     pulse->priv = spice_pulse_get_instance_private(pulse);
@@ -168,6 +221,139 @@ static void spice_pulse_class_init(SpicePulseClass *klass)
 
     gobject_class->finalize = spice_pulse_finalize;
     gobject_class->dispose = spice_pulse_dispose;
+    gobject_class->get_property = spice_pulse_get_property;
+
+    g_object_class_install_property
+        (gobject_class, PROP_PLAYBACK_LATENCY,
+         g_param_spec_uint("playback-latency",
+                           "Playback latency",
+                           "Measured playback stream latency (ms)",
+                           0, G_MAXUINT32, 0,
+                           G_PARAM_READABLE |
+                           G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property
+        (gobject_class, PROP_PLAYBACK_TARGET_LATENCY,
+         g_param_spec_uint("playback-target-latency",
+                           "Playback target latency",
+                           "Adaptive playback stream target latency (ms)",
+                           0, G_MAXUINT32, 0,
+                           G_PARAM_READABLE |
+                           G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property
+        (gobject_class, PROP_RECORD_LATENCY,
+         g_param_spec_uint("record-latency",
+                           "Record latency",
+                           "Measured record stream latency (ms)",
+                           0, G_MAXUINT32, 0,
+                           G_PARAM_READABLE |
+                           G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property
+        (gobject_class, PROP_RECORD_TARGET_LATENCY,
+         g_param_spec_uint("record-target-latency",
+                           "Record target latency",
+                           "Adaptive record stream target latency (ms)",
+                           0, G_MAXUINT32, 0,
+                           G_PARAM_READABLE |
+                           G_PARAM_STATIC_STRINGS));
+}
+
+/* ------------------------------------------------------------------ */
+static void latency_ctl_set_bounds(SpicePulse *pulse, struct latency_ctl *l, guint floor_ms)
+{
+    SpiceSession *session = SPICE_AUDIO(pulse)->priv->session;
+    guint min_ms = 0, max_ms = G_MAXUINT32;
+
+    if (session != NULL)
+        spice_session_get_audio_latency_bounds(session, &min_ms, &max_ms);
+
+    l->floor = MAX(floor_ms, min_ms);
+    l->ceiling = MAX(l->floor, max_ms);
+    l->underflows = 0;
+    l->last_adjust = g_get_monotonic_time();
+}
+
+static void latency_ctl_set_current(SpicePulse *pulse, struct stream *s, guint current)
+{
+    if (s->latency.current == current)
+        return;
+
+    s->latency.current = current;
+    g_object_notify(G_OBJECT(pulse),
+                    s == &pulse->priv->playback ? "playback-latency" : "record-latency");
+}
+
+/* Push the new target to the PulseAudio server: tlength controls the
+ * playback buffering, fragsize the record one */
+static void stream_set_target_latency(SpicePulse *pulse, struct stream *s, guint target)
+{
+    SpicePulsePrivate *p = pulse->priv;
+    gboolean playback = (s == &p->playback);
+    const pa_buffer_attr *cur;
+    pa_buffer_attr attr;
+    pa_operation *op;
+
+    target = CLAMP(target, s->latency.floor, s->latency.ceiling);
+    s->latency.last_adjust = g_get_monotonic_time();
+    s->latency.underflows = 0;
+    if (s->latency.target == target)
+        return;
+
+    SPICE_DEBUG("%s: %s target latency %u -> %u ms", __FUNCTION__,
+                playback ? "playback" : "record", s->latency.target, target);
+    s->latency.target = target;
+    g_object_notify(G_OBJECT(pulse),
+                    playback ? "playback-target-latency" : "record-target-latency");
+    /* the capture timestamps move with the record latency */
+    if (!playback && p->rchannel != NULL)
+        spice_record_channel_reset_drift(SPICE_RECORD_CHANNEL(p->rchannel));
+
+    if (!s->stream || pa_stream_get_state(s->stream) != PA_STREAM_READY)
+        return;
+
+    cur = pa_stream_get_buffer_attr(s->stream);
+    g_return_if_fail(cur != NULL);
+
+    attr = *cur;
+    if (playback) {
+        attr.tlength = pa_usec_to_bytes(target * PA_USEC_PER_MSEC, &s->spec);
+        attr.prebuf = (uint32_t) -1;
+        attr.minreq = (uint32_t) -1;
+    } else {
+        attr.fragsize = pa_usec_to_bytes(target * PA_USEC_PER_MSEC, &s->spec);
+    }
+
+    if (!(op = pa_stream_set_buffer_attr(s->stream, &attr, NULL, NULL))) {
+        g_warning("pa_stream_set_buffer_attr() failed: %s",
+                  pa_strerror(pa_context_errno(p->context)));
+        return;
+    }
+    pa_operation_unref(op);
+}
+
+static void latency_ctl_grow(SpicePulse *pulse, struct stream *s)
+{
+    guint target = s->latency.target;
+
+    stream_set_target_latency(pulse, s, target + MAX(LATENCY_GROW_STEP_MS, target / 4));
+}
+
+/* Called on each latency measurement: converge towards @wanted, but only
+ * shrink once the stream has been glitch-free for a while */
+static void latency_ctl_update(SpicePulse *pulse, struct stream *s, guint wanted)
+{
+    struct latency_ctl *l = &s->latency;
+
+    wanted = MAX(wanted, l->floor);
+    if (wanted > l->target) {
+        stream_set_target_latency(pulse, s, wanted);
+    } else if (wanted < l->target && l->underflows == 0 &&
+               g_get_monotonic_time() - l->last_adjust > LATENCY_STABLE_PERIOD_US) {
+        guint step = MIN(LATENCY_SHRINK_STEP_MS, l->target - wanted);
+        stream_set_target_latency(pulse, s, l->target - step);
+    }
 }
 
 /* ------------------------------------------------------------------ */
@@ -301,20 +487,8 @@ static void stream_underflow_cb(pa_stream *s, void *userdata)
     p = pulse->priv;
     g_return_if_fail(p != NULL);
     p->playback.num_underflow++;
-#ifdef PULSE_ADJUST_LATENCY
-    const pa_buffer_attr *buffer_attr;
-    pa_buffer_attr new_buffer_attr;
-    pa_operation *op;
-
-    buffer_attr = pa_stream_get_buffer_attr(s);
-    g_return_if_fail(buffer_attr != NULL);
-
-    new_buffer_attr = *buffer_attr;
-    new_buffer_attr.tlength *= 2;
-    new_buffer_attr.minreq *= 2;
-    op = pa_stream_set_buffer_attr(s, &new_buffer_attr, NULL, NULL);
-    pa_operation_unref(op);
-#endif
+    p->playback.latency.underflows++;
+    latency_ctl_grow(pulse, &p->playback);
 }
 
 static void stream_update_latency_callback(pa_stream *s, void *userdata)
@@ -338,16 +512,24 @@ static void stream_update_latency_callback(pa_stream *s, void *userdata)
     }
 
     g_return_if_fail(negative == FALSE);
-    p->last_delay = usec / PA_USEC_PER_MSEC;
+    latency_ctl_set_current(pulse, &p->playback, usec / PA_USEC_PER_MSEC);
     spice_playback_channel_set_delay(SPICE_PLAYBACK_CHANNEL(p->pchannel), usec / 1000);
     if (pa_stream_is_corked(p->playback.stream)) {
-        if (p->last_delay >= p->target_delay) {
-            SPICE_DEBUG("%s: uncork playback. delay %u target %u",  __FUNCTION__, p->last_delay, p->target_delay);
+        if (p->playback.latency.current >= p->playback.latency.target) {
+            SPICE_DEBUG("%s: uncork playback. delay %u target %u",  __FUNCTION__,
+                        p->playback.latency.current, p->playback.latency.target);
             stream_uncork(pulse, &p->playback);
         } else {
-            SPICE_DEBUG("%s: still corked. delay %u target %u",  __FUNCTION__, p->last_delay, p->target_delay);
+            SPICE_DEBUG("%s: still corked. delay %u target %u",  __FUNCTION__,
+                        p->playback.latency.current, p->playback.latency.target);
         }
+        return;
     }
+
+    /* leave room for twice the network jitter on top of the minimum */
+    latency_ctl_update(pulse, &p->playback,
+                       p->playback.latency.floor +
+                       2 * spice_playback_channel_get_jitter(SPICE_PLAYBACK_CHANNEL(p->pchannel)));
 }
 
 static void create_playback(SpicePulse *pulse)
@@ -369,7 +551,8 @@ static void create_playback(SpicePulse *pulse)
     pa_stream_set_latency_update_callback(p->playback.stream, stream_update_latency_callback, pulse);
 
     buffer_attr.maxlength = -1;
-    buffer_attr.tlength = pa_usec_to_bytes(p->target_delay * PA_USEC_PER_MSEC, &p->playback.spec);
+    buffer_attr.tlength = pa_usec_to_bytes(p->playback.latency.target * PA_USEC_PER_MSEC,
+                                           &p->playback.spec);
     buffer_attr.prebuf = -1;
     buffer_attr.minreq = -1;
     flags = PA_STREAM_ADJUST_LATENCY | PA_STREAM_AUTO_TIMING_UPDATE;
@@ -398,7 +581,7 @@ static void playback_start(SpicePlaybackChannel *channel, gint format, gint chan
     if (p->playback.stream &&
         (p->playback.spec.rate != frequency ||
          p->playback.spec.channels != channels ||
-         p->target_delay != latency)) {
+         p->min_delay != latency)) {
         stream_stop(pulse, &p->playback);
     }
 
@@ -406,8 +589,12 @@ static void playback_start(SpicePlaybackChannel *channel, gint format, gint chan
     p->playback.spec.format   = PA_SAMPLE_S16LE;
     p->playback.spec.rate     = frequency;
     p->playback.spec.channels = channels;
-    p->target_delay = latency;
-    p->last_delay = 0;
+    if (p->playback.stream == NULL) {
+        latency_ctl_set_bounds(pulse, &p->playback.latency, latency);
+        stream_set_target_latency(pulse, &p->playback, latency);
+    }
+    p->min_delay = latency;
+    latency_ctl_set_current(pulse, &p->playback, 0);
 
     state = pa_context_get_state(p->context);
     switch (state) {
@@ -483,8 +670,17 @@ static void stream_read_callback(pa_stream *s, size_t length, void *data)
     SpicePulse *pulse = data;
     SpicePulsePrivate *p = pulse->priv;
 
+    SpiceSession *session = SPICE_AUDIO(pulse)->priv->session;
+    guint32 time = 0;
+
     g_return_if_fail(p != NULL);
 
+    if (session != NULL) {
+        /* mm-time at which the oldest readable sample was captured */
+        time = spice_session_get_mm_time(session) - p->record.latency.current -
+            pa_bytes_to_usec(pa_stream_readable_size(s), &p->record.spec) / PA_USEC_PER_MSEC;
+    }
+
     while (pa_stream_readable_size(s) > 0) {
         const void *snddata;
 
@@ -494,14 +690,20 @@ static void stream_read_callback(pa_stream *s, size_t length, void *data)
             return;
         }
 
-        g_return_if_fail(snddata);
         g_return_if_fail(length > 0);
 
-        if (p->rchannel != NULL)
+        if (snddata == NULL) {
+            /* a hole: the source overran while we were not reading */
+            SPICE_DEBUG("PA record stream overrun (%" G_GSIZE_FORMAT " bytes)", length);
+            p->record.num_underflow++;
+            p->record.latency.underflows++;
+            latency_ctl_grow(pulse, &p->record);
+            if (p->rchannel != NULL)
+                spice_record_channel_add_lost(SPICE_RECORD_CHANNEL(p->rchannel), length);
+        } else if (p->rchannel != NULL)
             spice_record_channel_send_data(SPICE_RECORD_CHANNEL(p->rchannel),
-                                           /* FIXME: server side doesn't care about ts?
-                                           what is the unit? ms apparently */
-                                           (gpointer)snddata, length, 0);
+                                           (gpointer)snddata, length, time);
+        time += pa_bytes_to_usec(length, &p->record.spec) / PA_USEC_PER_MSEC;
 
         if (pa_stream_drop(s) < 0) {
             g_warning("pa_stream_drop() failed: %s",
@@ -511,6 +713,27 @@ static void stream_read_callback(pa_stream *s, size_t length, void *data)
     }
 }
 
+static void stream_record_latency_callback(pa_stream *s, void *userdata)
+{
+    SpicePulse *pulse = userdata;
+    SpicePulsePrivate *p = pulse->priv;
+    pa_usec_t usec;
+    int negative = 0;
+
+    g_return_if_fail(s != NULL);
+
+    if (!p->record.stream || !p->record.started)
+        return;
+
+    if (pa_stream_get_latency(s, &usec, &negative) < 0) {
+        g_warning("Failed to get latency: %s", pa_strerror(pa_context_errno(p->context)));
+        return;
+    }
+
+    latency_ctl_set_current(pulse, &p->record, negative ? 0 : usec / PA_USEC_PER_MSEC);
+    latency_ctl_update(pulse, &p->record, p->record.latency.floor);
+}
+
 static void create_record(SpicePulse *pulse)
 {
     SpicePulsePrivate *p = pulse->priv;
@@ -527,13 +750,14 @@ static void create_record(SpicePulse *pulse)
                                      &p->record.spec, NULL);
     pa_stream_set_read_callback(p->record.stream, stream_read_callback, pulse);
     pa_stream_set_state_callback(p->record.stream, stream_state_callback, pulse);
+    pa_stream_set_latency_update_callback(p->record.stream, stream_record_latency_callback, pulse);
 
-    /* FIXME: we might want customizable latency */
     buffer_attr.maxlength = -1;
     buffer_attr.prebuf = -1;
-    buffer_attr.fragsize = buffer_attr.tlength = pa_usec_to_bytes(20 * PA_USEC_PER_MSEC, &p->record.spec);
+    buffer_attr.fragsize = buffer_attr.tlength =
+        pa_usec_to_bytes(p->record.latency.target * PA_USEC_PER_MSEC, &p->record.spec);
     buffer_attr.minreq = (uint32_t) -1;
-    flags = PA_STREAM_ADJUST_LATENCY;
+    flags = PA_STREAM_ADJUST_LATENCY | PA_STREAM_AUTO_TIMING_UPDATE;
 
     if (pa_stream_connect_record(p->record.stream, NULL, &buffer_attr, flags) < 0) {
         g_warning("pa_stream_connect_record() failed: %s",
@@ -549,6 +773,7 @@ static void record_start(SpiceRecordChannel *channel, gint format, gint channels
     pa_context_state_t state;
 
     p->record.started = TRUE;
+    p->record.num_underflow = 0;
 
     if (p->record.stream &&
         (p->record.spec.rate != frequency ||
@@ -560,6 +785,10 @@ static void record_start(SpiceRecordChannel *channel, gint format, gint channels
     p->record.spec.format = PA_SAMPLE_S16LE;
     p->record.spec.rate = frequency;
     p->record.spec.channels = channels;
+    if (p->record.stream == NULL) {
+        latency_ctl_set_bounds(pulse, &p->record.latency, 0);
+        stream_set_target_latency(pulse, &p->record, RECORD_DEFAULT_LATENCY_MS);
+    }
 
     state = pa_context_get_state(p->context);
     switch (state) {
@@ -586,7 +815,7 @@ static void record_stop(SpicePulse *pulse)
 {
     SpicePulsePrivate *p = pulse->priv;
 
-    SPICE_DEBUG("%s", __FUNCTION__);
+    SPICE_DEBUG("%s: #overrun %u", __FUNCTION__, p->record.num_underflow);
 
     p->record.started = FALSE;
     if (!p->record.stream)
@@ -663,9 +892,12 @@ static void playback_min_latency_changed(GObject *object, GParamSpec *pspec, gpo
     guint min_latency;
 
     g_object_get(object, "min-latency", &min_latency, NULL);
-    p->target_delay = min_latency;
+    p->min_delay = min_latency;
+    latency_ctl_set_bounds(pulse, &p->playback.latency, min_latency);
+    stream_set_target_latency(pulse, &p->playback,
+                              MAX(p->playback.latency.target, min_latency));
 
-    if (p->last_delay < p->target_delay) {
+    if (p->playback.latency.current < p->playback.latency.target) {
         SPICE_DEBUG("%s: corking", __FUNCTION__);
         if (p->playback.stream)
             stream_cork(pulse, &p->playback, FALSE);
@@ -21,6 +21,7 @@
 
 #include <glib.h>
 #include <gio/gio.h>
+#include <openssl/ssl.h>
 
 #ifdef USE_PHODAV
 #include <libphodav/phodav.h>
@@ -69,6 +70,9 @@ const gchar* spice_session_get_ciphers(SpiceSession *session);
 const gchar* spice_session_get_ca_file(SpiceSession *session);
 void spice_session_get_ca(SpiceSession *session, guint8 **ca, guint *size);
 
+SSL_SESSION *spice_session_get_tls_session(SpiceSession *session);
+void spice_session_set_tls_session(SpiceSession *session, SSL_SESSION *tls_session);
+
 void spice_session_set_caches_hints(SpiceSession *session,
                                     uint32_t pci_ram_size,
                                     uint32_t n_display_channels);
@@ -89,6 +93,8 @@ gboolean spice_session_get_audio_enabled(SpiceSession *session);
 gboolean spice_session_get_smartcard_enabled(SpiceSession *session);
 gboolean spice_session_get_usbredir_enabled(SpiceSession *session);
 gboolean spice_session_get_gl_scanout_enabled(SpiceSession *session);
+void spice_session_get_audio_latency_bounds(SpiceSession *session,
+                                            guint *min_ms, guint *max_ms);
 
 const guint8* spice_session_get_webdav_magic(SpiceSession *session);
 PhodavServer *spice_session_get_webdav_server(SpiceSession *session);
@@ -34,6 +34,7 @@
 #include "spice-uri-priv.h"
 #include "channel-playback-priv.h"
 #include "spice-audio-priv.h"
+#include "common/recorder.h"
 
 #if !defined(SOL_TCP) && defined(IPPROTO_TCP)
 #define SOL_TCP IPPROTO_TCP
@@ -45,6 +46,12 @@
 #define IMAGES_CACHE_SIZE_DEFAULT (1024 * 1024 * 80)
 #define MIN_GLZ_WINDOW_SIZE_DEFAULT (1024 * 1024 * 12)
 #define MAX_GLZ_WINDOW_SIZE_DEFAULT MIN((LZ_MAX_WINDOW_SIZE * 4), 1024 * 1024 * 64)
+RECORDER(session_timeline, 64, "Session startup timeline");
+
+static void spice_session_timeline_reset(SpiceSession *session);
+
+#define SPICE_SESSION_MIN_AUDIO_LATENCY_DEFAULT_MS 20
+#define SPICE_SESSION_MAX_AUDIO_LATENCY_DEFAULT_MS 1000
 
 struct _SpiceSessionPrivate {
     char              *host;
@@ -67,6 +74,10 @@ struct _SpiceSessionPrivate {
     /* whether to enable audio */
     gboolean          audio;
 
+    /* bounds for the audio backend adaptive latency, in ms */
+    guint             min_audio_latency;
+    guint             max_audio_latency;
+
     /* whether to enable smartcard event forwarding to the server */
     gboolean          smartcard;
 
@@ -120,6 +131,16 @@ struct _SpiceSessionPrivate {
     gchar             *name;
     SpiceImageCompression preferred_compression;
 
+    /* TLS session of the first channel to connect, resumed by the
+     * following ones. Only valid for the server described by
+     * tls_session_key. */
+    gchar             *tls_session_key;
+    SSL_SESSION       *tls_session;
+
+    /* startup timeline, SpiceSessionTimelineEntry relative to timeline_start */
+    GArray            *timeline;
+    gint64            timeline_start;
+
     /* associated objects */
     SpiceAudio        *audio_manager;
     SpiceUsbDeviceManager *usb_manager;
@@ -201,6 +222,8 @@ enum {
     PROP_UNIX_PATH,
     PROP_PREF_COMPRESSION,
     PROP_GL_SCANOUT,
+    PROP_MIN_AUDIO_LATENCY,
+    PROP_MAX_AUDIO_LATENCY,
 };
 
 /* signals */
@@ -250,6 +273,7 @@ spice_image_compress_get_type (void)
 static guint signals[SPICE_SESSION_LAST_SIGNAL];
 
 static void spice_session_channel_destroy(SpiceSession *session, SpiceChannel *channel);
+static void spice_session_clear_tls_session(SpiceSession *session);
 
 static void update_proxy(SpiceSession *self, const gchar *str)
 {
@@ -292,6 +316,8 @@ static void spice_session_init(SpiceSession *session)
 
     s->images = cache_image_new((GDestroyNotify)pixman_image_unref);
     s->glz_window = glz_decoder_window_new();
+    s->timeline = g_array_new(FALSE, FALSE, sizeof(SpiceSessionTimelineEntry));
+    s->timeline_start = g_get_monotonic_time();
     update_proxy(session, NULL);
 }
 
@@ -375,6 +401,8 @@ spice_session_finalize(GObject *gobject)
 
     g_clear_pointer(&s->pubkey, g_byte_array_unref);
     g_clear_pointer(&s->ca, g_byte_array_unref);
+    spice_session_clear_tls_session(session);
+    g_array_unref(s->timeline);
 
     /* Chain up to the parent class */
     if (G_OBJECT_CLASS(spice_session_parent_class)->finalize)
@@ -712,6 +740,12 @@ static void spice_session_get_property(GObject    *gobject,
     case PROP_GL_SCANOUT:
         g_value_set_boolean(value, s->gl_scanout);
         break;
+    case PROP_MIN_AUDIO_LATENCY:
+        g_value_set_uint(value, s->min_audio_latency);
+        break;
+    case PROP_MAX_AUDIO_LATENCY:
+        g_value_set_uint(value, s->max_audio_latency);
+        break;
     default:
 	G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
 	break;
@@ -858,6 +892,12 @@ static void spice_session_set_property(GObject      *gobject,
         g_warning("SpiceSession:gl-scanout is only available on Unix");
 #endif
         break;
+    case PROP_MIN_AUDIO_LATENCY:
+        s->min_audio_latency = g_value_get_uint(value);
+        break;
+    case PROP_MAX_AUDIO_LATENCY:
+        s->max_audio_latency = g_value_get_uint(value);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
         break;
@@ -1525,6 +1565,45 @@ static void spice_session_class_init(SpiceSessionClass *klass)
 #endif
                               G_PARAM_READWRITE |
                               G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:min-audio-latency:
+     *
+     * Lower bound in milliseconds for the audio backend buffering. The
+     * playback and record streams adapt their latency at runtime but
+     * never go below this value (or below the latency requested by the
+     * server for playback).
+     *
+     * Since: 0.39
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_MIN_AUDIO_LATENCY,
+         g_param_spec_uint("min-audio-latency",
+                           "Minimum audio latency",
+                           "Minimum audio buffering latency (ms)",
+                           0, G_MAXUINT32, SPICE_SESSION_MIN_AUDIO_LATENCY_DEFAULT_MS,
+                           G_PARAM_READWRITE |
+                           G_PARAM_CONSTRUCT |
+                           G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:max-audio-latency:
+     *
+     * Upper bound in milliseconds for the audio backend buffering. The
+     * playback and record streams grow their latency on underflows and
+     * network jitter, but never above this value.
+     *
+     * Since: 0.39
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_MAX_AUDIO_LATENCY,
+         g_param_spec_uint("max-audio-latency",
+                           "Maximum audio latency",
+                           "Maximum audio buffering latency (ms)",
+                           0, G_MAXUINT32, SPICE_SESSION_MAX_AUDIO_LATENCY_DEFAULT_MS,
+                           G_PARAM_READWRITE |
+                           G_PARAM_CONSTRUCT |
+                           G_PARAM_STATIC_STRINGS));
 }
 
 G_GNUC_INTERNAL
@@ -1533,6 +1612,86 @@ gboolean spice_session_get_gl_scanout_enabled(SpiceSession *session)
     return session->priv->gl_scanout;
 }
 
+G_GNUC_INTERNAL
+void spice_session_get_audio_latency_bounds(SpiceSession *session,
+                                            guint *min_ms, guint *max_ms)
+{
+    SpiceSessionPrivate *s;
+
+    g_return_if_fail(SPICE_IS_SESSION(session));
+
+    s = session->priv;
+    if (min_ms != NULL)
+        *min_ms = s->min_audio_latency;
+    if (max_ms != NULL)
+        *max_ms = MAX(s->min_audio_latency, s->max_audio_latency);
+}
+
+static gchar *spice_session_tls_session_key(SpiceSession *session)
+{
+    SpiceSessionPrivate *s = session->priv;
+
+    if (s->unix_path != NULL)
+        return g_strdup(s->unix_path);
+
+    return g_strdup_printf("%s:%s:%s",
+                           s->host ? s->host : "",
+                           s->port ? s->port : "",
+                           s->tls_port ? s->tls_port : "");
+}
+
+/* drop the TLS session if it was received from another server,
+ * returns whether it is still usable */
+static gboolean spice_session_tls_session_check(SpiceSession *session)
+{
+    SpiceSessionPrivate *s = session->priv;
+    gchar *key = spice_session_tls_session_key(session);
+    gboolean valid = g_strcmp0(key, s->tls_session_key) == 0;
+
+    if (!valid) {
+        spice_session_clear_tls_session(session);
+        s->tls_session_key = key;
+    } else {
+        g_free(key);
+    }
+
+    return valid;
+}
+
+static void spice_session_clear_tls_session(SpiceSession *session)
+{
+    SpiceSessionPrivate *s = session->priv;
+
+    g_clear_pointer(&s->tls_session_key, g_free);
+    g_clear_pointer(&s->tls_session, SSL_SESSION_free);
+}
+
+G_GNUC_INTERNAL
+SSL_SESSION *spice_session_get_tls_session(SpiceSession *session)
+{
+    g_return_val_if_fail(SPICE_IS_SESSION(session), NULL);
+
+    if (!spice_session_tls_session_check(session))
+        return NULL;
+
+    return session->priv->tls_session;
+}
+
+/* takes ownership of @tls_session */
+G_GNUC_INTERNAL
+void spice_session_set_tls_session(SpiceSession *session, SSL_SESSION *tls_session)
+{
+    SpiceSessionPrivate *s;
+
+    g_return_if_fail(SPICE_IS_SESSION(session));
+
+    s = session->priv;
+    spice_session_tls_session_check(session);
+    g_clear_pointer(&s->tls_session, SSL_SESSION_free);
+    s->tls_session = tls_session;
+}
+
+
 /* ------------------------------------------------------------------ */
 /* public functions                                                   */
 
@@ -1644,6 +1803,7 @@ gboolean spice_session_connect(SpiceSession *session)
     session_disconnect(session, TRUE);
 
     s->client_provided_sockets = FALSE;
+    spice_session_timeline_reset(session);
 
     if (s->cmain == NULL)
         s->cmain = spice_channel_new(session, SPICE_CHANNEL_MAIN, 0);
@@ -1687,6 +1847,7 @@ gboolean spice_session_open_fd(SpiceSession *session, int fd)
     session_disconnect(session, TRUE);
 
     s->client_provided_sockets = TRUE;
+    spice_session_timeline_reset(session);
 
     if (s->cmain == NULL)
         s->cmain = spice_channel_new(session, SPICE_CHANNEL_MAIN, 0);
@@ -2002,6 +2163,9 @@ void spice_session_disconnect(SpiceSession *session)
     if (s->disconnecting != 0)
         return;
 
+    /* connection settings may change before the next connect */
+    spice_session_clear_tls_session(session);
+
     g_object_ref(session);
     s->disconnecting = g_idle_add((GSourceFunc)session_disconnect_idle, session);
 }
@@ -2088,6 +2252,21 @@ end:
     coroutine_yieldto(open_host->from, NULL);
 }
 
+/* main context */
+static void socket_client_event(GSocketClient *client, GSocketClientEvent event,
+                                GSocketConnectable *connectable, GIOStream *connection,
+                                gpointer data)
+{
+    spice_open_host *open_host = data;
+
+    if (event == G_SOCKET_CLIENT_RESOLVED)
+        spice_session_timeline_mark(open_host->session, open_host->channel,
+                                    SPICE_SESSION_TIMELINE_RESOLVED);
+    else if (event == G_SOCKET_CLIENT_PROXY_NEGOTIATED)
+        spice_session_timeline_mark(open_host->session, open_host->channel,
+                                    SPICE_SESSION_TIMELINE_PROXY_NEGOTIATED);
+}
+
 /* main context */
 static void open_host_connectable_connect(spice_open_host *open_host, GSocketConnectable *connectable)
 {
@@ -2116,6 +2295,8 @@ static void proxy_lookup_ready(GObject *source_object, GAsyncResult *result,
         coroutine_yieldto(open_host->from, NULL);
         return;
     }
+    spice_session_timeline_mark(session, open_host->channel,
+                                SPICE_SESSION_TIMELINE_RESOLVED);
 
     for (it = addresses; it != NULL; it = it->next) {
         address = g_proxy_address_new(G_INET_ADDRESS(it->data),
@@ -2242,6 +2423,8 @@ GSocketConnection* spice_session_channel_open_host(SpiceSession *session, SpiceC
     }
 
     open_host.client = g_socket_client_new();
+    g_signal_connect(open_host.client, "event",
+                     G_CALLBACK(socket_client_event), &open_host);
     g_socket_client_set_enable_proxy(open_host.client, s->proxy != NULL);
     g_socket_client_set_timeout(open_host.client, SOCKET_TIMEOUT);
 
@@ -2849,6 +3032,109 @@ gboolean spice_session_is_for_migration(SpiceSession *session)
     return session->priv->for_migration;
 }
 
+static const char *const timeline_event_names[] = {
+    [SPICE_SESSION_TIMELINE_CONNECT] = "connect",
+    [SPICE_SESSION_TIMELINE_RESOLVED] = "resolved",
+    [SPICE_SESSION_TIMELINE_PROXY_NEGOTIATED] = "proxy-negotiated",
+    [SPICE_SESSION_TIMELINE_SOCKET_CONNECTED] = "socket-connected",
+    [SPICE_SESSION_TIMELINE_TLS_HANDSHAKE] = "tls-handshake",
+    [SPICE_SESSION_TIMELINE_LINK_REPLY] = "link-reply",
+    [SPICE_SESSION_TIMELINE_AUTH] = "auth",
+    [SPICE_SESSION_TIMELINE_FIRST_MESSAGE] = "first-message",
+    [SPICE_SESSION_TIMELINE_FIRST_SURFACE] = "first-surface",
+    [SPICE_SESSION_TIMELINE_FIRST_PAINT] = "first-paint",
+};
+
+static void spice_session_timeline_reset(SpiceSession *session)
+{
+    SpiceSessionPrivate *s = session->priv;
+
+    g_array_set_size(s->timeline, 0);
+    s->timeline_start = g_get_monotonic_time();
+    spice_session_timeline_mark(session, NULL, SPICE_SESSION_TIMELINE_CONNECT);
+}
+
+/**
+ * spice_session_timeline_mark:
+ * @session: a Spice session
+ * @channel: (allow-none): the #SpiceChannel concerned, or %NULL
+ * @event: the #SpiceSessionTimelineEvent to record
+ *
+ * Records that @event happened now in the startup timeline of @session.
+ * Only the first occurrence of an event is kept for a given channel, so
+ * that this can be called every time the event happens. The timeline is
+ * restarted by spice_session_connect() and spice_session_open_fd().
+ *
+ * This is used by the library itself; applications drawing the display
+ * without #SpiceDisplay can record %SPICE_SESSION_TIMELINE_FIRST_PAINT.
+ *
+ * When built with recorder support, events are also sent to the
+ * "session_timeline" recorder.
+ *
+ * Since: 0.39
+ **/
+void spice_session_timeline_mark(SpiceSession *session, SpiceChannel *channel,
+                                 SpiceSessionTimelineEvent event)
+{
+    SpiceSessionPrivate *s;
+    SpiceSessionTimelineEntry entry = { event, -1, -1, 0 };
+    guint i;
+
+    g_return_if_fail(SPICE_IS_SESSION(session));
+    g_return_if_fail(channel == NULL || SPICE_IS_CHANNEL(channel));
+    g_return_if_fail(event <= SPICE_SESSION_TIMELINE_FIRST_PAINT);
+
+    s = session->priv;
+    if (channel != NULL) {
+        entry.channel_type = spice_channel_get_channel_type(channel);
+        entry.channel_id = spice_channel_get_channel_id(channel);
+    }
+
+    for (i = 0; i < s->timeline->len; i++) {
+        SpiceSessionTimelineEntry *e =
+            &g_array_index(s->timeline, SpiceSessionTimelineEntry, i);
+        if (e->event == event &&
+            e->channel_type == entry.channel_type &&
+            e->channel_id == entry.channel_id)
+            return;
+    }
+
+    entry.time = g_get_monotonic_time() - s->timeline_start;
+    g_array_append_val(s->timeline, entry);
+
+    record(session_timeline, "%s %s:%d at %u us",
+           timeline_event_names[event],
+           channel != NULL ? spice_channel_type_to_string(entry.channel_type) : "session",
+           entry.channel_id, (guint)entry.time);
+}
+
+/**
+ * spice_session_get_timeline:
+ * @session: a Spice session
+ *
+ * Gets the startup timeline of @session: when its channels resolved,
+ * connected, finished their TLS handshake and link, authenticated and
+ * received their first messages, and when the display was first
+ * received and painted. Entries are in chronological order.
+ *
+ * Returns: (element-type SpiceSessionTimelineEntry) (transfer full): a
+ * copy of the timeline, free with g_array_unref()
+ *
+ * Since: 0.39
+ **/
+GArray *spice_session_get_timeline(SpiceSession *session)
+{
+    GArray *timeline;
+
+    g_return_val_if_fail(SPICE_IS_SESSION(session), NULL);
+
+    timeline = session->priv->timeline;
+    return g_array_append_vals(g_array_sized_new(FALSE, FALSE,
+                                                 sizeof(SpiceSessionTimelineEntry),
+                                                 timeline->len),
+                               timeline->data, timeline->len);
+}
+
 G_GNUC_INTERNAL
 gboolean spice_session_set_migration_session(SpiceSession *session, SpiceSession *mig_session)
 {
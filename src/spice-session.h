@@ -67,6 +67,55 @@ typedef enum {
     SPICE_SESSION_MIGRATION_CONNECTING,
 } SpiceSessionMigration;
 
+/**
+ * SpiceSessionTimelineEvent:
+ * @SPICE_SESSION_TIMELINE_CONNECT: the session started connecting
+ * @SPICE_SESSION_TIMELINE_RESOLVED: the host (or proxy) name was resolved
+ * @SPICE_SESSION_TIMELINE_PROXY_NEGOTIATED: the proxy connection was established
+ * @SPICE_SESSION_TIMELINE_SOCKET_CONNECTED: the channel socket is connected
+ * @SPICE_SESSION_TIMELINE_TLS_HANDSHAKE: the channel TLS handshake is done
+ * @SPICE_SESSION_TIMELINE_LINK_REPLY: the server replied to the channel link
+ * @SPICE_SESSION_TIMELINE_AUTH: the channel is authenticated and ready
+ * @SPICE_SESSION_TIMELINE_FIRST_MESSAGE: the channel received its first message
+ * @SPICE_SESSION_TIMELINE_FIRST_SURFACE: the display channel received its first surface
+ * @SPICE_SESSION_TIMELINE_FIRST_PAINT: a widget painted the display for the first time
+ *
+ * Startup steps recorded in the session timeline, see
+ * spice_session_get_timeline().
+ *
+ * Since: 0.39
+ **/
+typedef enum {
+    SPICE_SESSION_TIMELINE_CONNECT,
+    SPICE_SESSION_TIMELINE_RESOLVED,
+    SPICE_SESSION_TIMELINE_PROXY_NEGOTIATED,
+    SPICE_SESSION_TIMELINE_SOCKET_CONNECTED,
+    SPICE_SESSION_TIMELINE_TLS_HANDSHAKE,
+    SPICE_SESSION_TIMELINE_LINK_REPLY,
+    SPICE_SESSION_TIMELINE_AUTH,
+    SPICE_SESSION_TIMELINE_FIRST_MESSAGE,
+    SPICE_SESSION_TIMELINE_FIRST_SURFACE,
+    SPICE_SESSION_TIMELINE_FIRST_PAINT,
+} SpiceSessionTimelineEvent;
+
+/**
+ * SpiceSessionTimelineEntry:
+ * @event: the #SpiceSessionTimelineEvent
+ * @channel_type: the type of the channel it happened on, or -1
+ * @channel_id: the id of the channel it happened on, or -1
+ * @time: microseconds elapsed since the session started connecting
+ *
+ * An entry of the session startup timeline.
+ *
+ * Since: 0.39
+ **/
+typedef struct _SpiceSessionTimelineEntry {
+    SpiceSessionTimelineEvent event;
+    gint channel_type;
+    gint channel_id;
+    gint64 time;
+} SpiceSessionTimelineEntry;
+
 /**
  * SpiceSession:
  *
@@ -114,6 +163,9 @@ gboolean spice_session_has_channel_type(SpiceSession *session, gint type);
 gboolean spice_session_get_read_only(SpiceSession *session);
 SpiceURI *spice_session_get_proxy_uri(SpiceSession *session);
 gboolean spice_session_is_for_migration(SpiceSession *session);
+GArray *spice_session_get_timeline(SpiceSession *session);
+void spice_session_timeline_mark(SpiceSession *session, SpiceChannel *channel,
+                                 SpiceSessionTimelineEvent event);
 
 G_END_DECLS
 
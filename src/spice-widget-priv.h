@@ -71,6 +71,7 @@ struct _SpiceDisplayPrivate {
     /* state */
     gboolean                ready;
     gboolean                monitor_ready;
+    gboolean                painted; /* recorded in the session timeline */
     struct {
         enum SpiceSurfaceFmt    format;
         gint                    width, height, stride;
@@ -1390,6 +1390,18 @@ static void set_egl_enabled(SpiceDisplay *display, bool enabled)
 }
 #endif
 
+static void mark_painted(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = display->priv;
+
+    if (d->painted || d->display == NULL)
+        return;
+
+    d->painted = TRUE;
+    spice_session_timeline_mark(d->session, SPICE_CHANNEL(d->display),
+                                SPICE_SESSION_TIMELINE_FIRST_PAINT);
+}
+
 static gboolean draw_event(GtkWidget *widget, cairo_t *cr, gpointer data)
 {
     SpiceDisplay *display = SPICE_DISPLAY(data);
@@ -1400,6 +1412,7 @@ static gboolean draw_event(GtkWidget *widget, cairo_t *cr, gpointer data)
     if (egl_enabled(d) &&
         g_str_equal(gtk_stack_get_visible_child_name(d->stack), "draw-area")) {
         spice_egl_update_display(display);
+        mark_painted(display);
         return false;
     }
 #endif
@@ -1410,6 +1423,7 @@ static gboolean draw_event(GtkWidget *widget, cairo_t *cr, gpointer data)
 
     spice_cairo_draw_event(display, cr);
     update_mouse_pointer(display);
+    mark_painted(display);
 
     return true;
 }
@@ -3195,6 +3209,7 @@ static void channel_new(SpiceSession *s, SpiceChannel *channel, SpiceDisplay *di
         if (id != d->channel_id)
             return;
         d->display = SPICE_DISPLAY_CHANNEL(channel);
+        d->painted = FALSE;
         spice_g_signal_connect_object(channel, "display-primary-create",
                                       G_CALLBACK(primary_create), display, 0);
         spice_g_signal_connect_object(channel, "display-primary-destroy",
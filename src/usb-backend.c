@@ -45,6 +45,26 @@
 #define LOUD_DEBUG(x, ...)
 #define USBREDIR_CALLBACK_NOT_IMPLEMENTED() spice_debug("%s not implemented - FIXME", __func__)
 
+/* Descriptor data and strings of a physical device. They are read in
+ * the metadata thread when the device is plugged, before the device is
+ * reported, so that filters and descriptions do not access the device
+ * from the main loop. Cached by bus, address and port path. */
+typedef struct UsbDeviceMetadata {
+    gint ref_count;
+    gchar *key;
+
+    gboolean config_valid; /* the active configuration could be read */
+    uint16_t bcd_device;
+    uint8_t interface_count;
+    uint8_t interface_class[32];
+    uint8_t interface_subclass[32];
+    uint8_t interface_protocol[32];
+    gboolean isochronous;
+
+    gchar *manufacturer;
+    gchar *product;
+} UsbDeviceMetadata;
+
 struct _SpiceUsbDevice
 {
     /* Pointer to device. Either real device (libusb_device)
@@ -57,6 +77,7 @@ struct _SpiceUsbDevice
     bool cached_isochronous_valid;
     bool cached_isochronous;
     gboolean edev_configured;
+    UsbDeviceMetadata *metadata; /* physical devices, once reported */
 };
 
 struct _SpiceUsbBackend
@@ -68,6 +89,12 @@ struct _SpiceUsbBackend
     GThread *event_thread;
     gint event_thread_run;
 
+    /* hotplug events are processed in order by a single thread,
+     * which reads the metadata of the arriving devices */
+    GThreadPool *metadata_thread;
+    GMutex metadata_lock;
+    GHashTable *metadata_cache; /* key -> UsbDeviceMetadata */
+
 #ifdef G_OS_WIN32
     HANDLE hWnd;
     libusb_device **libusb_device_list;
@@ -79,6 +106,64 @@ struct _SpiceUsbBackend
     uint32_t own_devices_mask;
 };
 
+/* Statistics of the packets of the attached device. The packets sent
+ * to the device are framed from the data read from the server, those
+ * sent from the device are complete in each write. */
+enum {
+    USB_STATS_CONTROL,
+    USB_STATS_BULK,
+    USB_STATS_ISO,
+    USB_STATS_INTERRUPT,
+    USB_STATS_PACKET_TYPES
+};
+
+enum {
+    USB_STATS_TO_DEVICE,
+    USB_STATS_FROM_DEVICE,
+    USB_STATS_DIRECTIONS
+};
+
+static const char * const usb_stats_type_names[USB_STATS_PACKET_TYPES] = {
+    "control", "bulk", "iso", "interrupt"
+};
+
+/* histogram bucket i counts the values below min << i,
+ * the last bucket counts the larger ones */
+#define USB_STATS_HISTOGRAM_BUCKETS 16
+#define USB_STATS_LATENCY_MIN       64      /* us */
+#define USB_STATS_QUEUE_MIN         4096    /* bytes */
+/* control and bulk requests waiting for completion, by id */
+#define USB_STATS_PENDING           256
+
+typedef struct UsbStatsPending {
+    uint64_t id;
+    gint64 time; /* 0 when the slot is free */
+} UsbStatsPending;
+
+typedef struct UsbBackendStats {
+    guint64 packets[USB_STATS_DIRECTIONS][USB_STATS_PACKET_TYPES];
+    guint64 bytes[USB_STATS_DIRECTIONS][USB_STATS_PACKET_TYPES];
+    guint64 iso_drops;
+
+    UsbStatsPending pending[USB_STATS_PENDING];
+    guint64 latency_count;
+    guint64 latency_total;
+    guint64 latency_max;
+    guint64 latency_histogram[USB_STATS_HISTOGRAM_BUCKETS];
+
+    guint64 queue_size;
+    guint64 queue_max;
+    guint64 queue_histogram[USB_STATS_HISTOGRAM_BUCKETS];
+} UsbBackendStats;
+
+/* framing of the data read from the server */
+typedef struct UsbStatsScan {
+    uint8_t header[16];
+    uint32_t header_len;
+    uint32_t payload_left;
+    gboolean hello; /* the current packet is the hello */
+} UsbStatsScan;
+
 typedef enum {
     USB_CHANNEL_STATE_INITIALIZING,
     USB_CHANNEL_STATE_HOST,
@@ -100,8 +185,207 @@ struct _SpiceUsbBackendChannel
     SpiceUsbredirChannel *usbredir_channel;
     SpiceUsbBackend *backend;
     GError **error;
+
+    GMutex stats_lock;
+    UsbBackendStats stats;
+    UsbStatsScan read_scan;
 };
 
+static int usb_stats_packet_type(uint32_t type)
+{
+    switch (type) {
+    case usb_redir_control_packet:
+        return USB_STATS_CONTROL;
+    case usb_redir_bulk_packet:
+    case usb_redir_buffered_bulk_packet:
+        return USB_STATS_BULK;
+    case usb_redir_iso_packet:
+        return USB_STATS_ISO;
+    case usb_redir_interrupt_packet:
+        return USB_STATS_INTERRUPT;
+    default:
+        return -1;
+    }
+}
+
+/* size of the packet header, as in usbredirparser: the ids are 64 bits
+ * when both sides have the capability, except in the hello */
+static uint32_t usb_stats_header_len(SpiceUsbBackendChannel *ch, uint32_t type)
+{
+    if (type != usb_redir_hello && ch->parser != NULL &&
+        usbredirparser_have_cap(ch->parser, usb_redir_cap_64bits_ids) &&
+        usbredirparser_peer_has_cap(ch->parser, usb_redir_cap_64bits_ids)) {
+        return 16;
+    }
+    return 12;
+}
+
+static uint32_t usbredir_packet_type(const uint8_t *data)
+{
+    uint32_t type;
+
+    memcpy(&type, data, 4);
+    return GUINT32_FROM_LE(type);
+}
+
+static void usb_stats_parse_header(const uint8_t *header, uint32_t header_len,
+                                   uint32_t *type, uint32_t *length, uint64_t *id)
+{
+    uint32_t value;
+
+    memcpy(&value, header, 4);
+    *type = GUINT32_FROM_LE(value);
+    memcpy(&value, header + 4, 4);
+    *length = GUINT32_FROM_LE(value);
+    if (header_len == 16) {
+        uint64_t id64;
+        memcpy(&id64, header + 8, 8);
+        *id = GUINT64_FROM_LE(id64);
+    } else {
+        memcpy(&value, header + 8, 4);
+        *id = GUINT32_FROM_LE(value);
+    }
+}
+
+static void usb_stats_histogram_add(guint64 *histogram, guint64 min, guint64 value)
+{
+    guint i = 0;
+
+    while (i < USB_STATS_HISTOGRAM_BUCKETS - 1 && value >= (min << i)) {
+        i++;
+    }
+    histogram[i]++;
+}
+
+static void usb_stats_reset(SpiceUsbBackendChannel *ch)
+{
+    g_mutex_lock(&ch->stats_lock);
+    memset(&ch->stats, 0, sizeof(ch->stats));
+    g_mutex_unlock(&ch->stats_lock);
+}
+
+static void usb_stats_to_device(SpiceUsbBackendChannel *ch,
+                                uint32_t type, uint32_t length, uint64_t id)
+{
+    UsbBackendStats *stats = &ch->stats;
+    int t = usb_stats_packet_type(type);
+
+    if (t < 0) {
+        return;
+    }
+    g_mutex_lock(&ch->stats_lock);
+    stats->packets[USB_STATS_TO_DEVICE][t]++;
+    stats->bytes[USB_STATS_TO_DEVICE][t] += length;
+    if (t == USB_STATS_CONTROL || t == USB_STATS_BULK) {
+        UsbStatsPending *slot = &stats->pending[id % USB_STATS_PENDING];
+        slot->id = id;
+        slot->time = g_get_monotonic_time();
+    }
+    g_mutex_unlock(&ch->stats_lock);
+}
+
+static void usb_stats_from_device(SpiceUsbBackendChannel *ch,
+                                  uint32_t type, uint32_t length, uint64_t id,
+                                  uint8_t status)
+{
+    UsbBackendStats *stats = &ch->stats;
+    int t = usb_stats_packet_type(type);
+
+    if (t < 0) {
+        return;
+    }
+    g_mutex_lock(&ch->stats_lock);
+    stats->packets[USB_STATS_FROM_DEVICE][t]++;
+    stats->bytes[USB_STATS_FROM_DEVICE][t] += length;
+    if (t == USB_STATS_ISO && status != usb_redir_success) {
+        stats->iso_drops++;
+    }
+    if (t == USB_STATS_CONTROL || t == USB_STATS_BULK) {
+        UsbStatsPending *slot = &stats->pending[id % USB_STATS_PENDING];
+        if (slot->time != 0 && slot->id == id) {
+            guint64 latency = g_get_monotonic_time() - slot->time;
+
+            slot->time = 0;
+            stats->latency_count++;
+            stats->latency_total += latency;
+            stats->latency_max = MAX(stats->latency_max, latency);
+            usb_stats_histogram_add(stats->latency_histogram,
+                                    USB_STATS_LATENCY_MIN, latency);
+        }
+    }
+    g_mutex_unlock(&ch->stats_lock);
+}
+
+/* a complete packet written to the server */
+static void usb_stats_scan_write(SpiceUsbBackendChannel *ch, const uint8_t *data, int count)
+{
+    uint32_t type, length, header_len;
+    uint64_t id;
+    uint8_t status = usb_redir_success;
+
+    if (count < 12) {
+        return;
+    }
+    header_len = usb_stats_header_len(ch, usbredir_packet_type(data));
+    if (count < header_len) {
+        return;
+    }
+    usb_stats_parse_header(data, header_len, &type, &length, &id);
+    if (type == usb_redir_iso_packet && count >= header_len + 2) {
+        /* endpoint, then status */
+        status = data[header_len + 1];
+    }
+    usb_stats_from_device(ch, type, length, id, status);
+}
+
+/* Frames the packets in the data read from the server. Stops after
+ * the hello, as the header size of the following packets depends on
+ * the capabilities it carries: returns the number of bytes scanned. */
+static int usb_stats_scan_read(SpiceUsbBackendChannel *ch, const uint8_t *data, int count)
+{
+    UsbStatsScan *scan = &ch->read_scan;
+    int scanned = 0;
+
+    while (scanned < count) {
+        uint32_t type, length, header_len, n;
+        uint64_t id;
+
+        if (scan->payload_left > 0) {
+            n = MIN(scan->payload_left, count - scanned);
+            scan->payload_left -= n;
+            scanned += n;
+            if (scan->payload_left == 0 && scan->hello) {
+                scan->hello = FALSE;
+                break;
+            }
+            continue;
+        }
+
+        /* the type comes first and gives the header size */
+        header_len = 4;
+        if (scan->header_len >= 4) {
+            header_len = usb_stats_header_len(ch, usbredir_packet_type(scan->header));
+        }
+        n = MIN(header_len - scan->header_len, count - scanned);
+        memcpy(scan->header + scan->header_len, data + scanned, n);
+        scan->header_len += n;
+        scanned += n;
+        if (scan->header_len < header_len || header_len == 4) {
+            continue;
+        }
+
+        usb_stats_parse_header(scan->header, header_len, &type, &length, &id);
+        usb_stats_to_device(ch, type, length, id);
+        scan->header_len = 0;
+        scan->payload_left = length;
+        scan->hello = (type == usb_redir_hello && length > 0);
+        if (type == usb_redir_hello && length == 0) {
+            break;
+        }
+    }
+    return scanned;
+}
+
 static void get_usb_device_info_from_libusb_device(UsbDeviceInformation *info,
                                                    libusb_device *libdev)
 {
@@ -140,6 +424,139 @@ static SpiceUsbDevice *allocate_backend_device(libusb_device *libdev)
     return dev;
 }
 
+static UsbDeviceMetadata *usb_metadata_ref(UsbDeviceMetadata *metadata)
+{
+    g_atomic_int_inc(&metadata->ref_count);
+    return metadata;
+}
+
+static void usb_metadata_unref(UsbDeviceMetadata *metadata)
+{
+    if (g_atomic_int_dec_and_test(&metadata->ref_count)) {
+        g_free(metadata->key);
+        g_free(metadata->manufacturer);
+        g_free(metadata->product);
+        g_free(metadata);
+    }
+}
+
+static gchar *usb_metadata_key(libusb_device *libdev)
+{
+    uint8_t ports[8];
+    GString *key;
+    int i, n;
+
+    key = g_string_new(NULL);
+    g_string_printf(key, "%u-%u@", libusb_get_bus_number(libdev),
+                    libusb_get_device_address(libdev));
+    n = libusb_get_port_numbers(libdev, ports, sizeof(ports));
+    for (i = 0; i < n; i++) {
+        g_string_append_printf(key, i ? ".%u" : "%u", ports[i]);
+    }
+    return g_string_free(key, FALSE);
+}
+
+/* metadata thread */
+static UsbDeviceMetadata *usb_metadata_read(SpiceUsbDevice *dev, gchar *key)
+{
+    libusb_device *libdev = dev->libusb_device;
+    UsbDeviceMetadata *metadata = g_new0(UsbDeviceMetadata, 1);
+    struct libusb_device_descriptor desc;
+    struct libusb_config_descriptor *config;
+    int i, j, k, rc;
+
+    metadata->ref_count = 1;
+    metadata->key = key;
+
+    libusb_get_device_descriptor(libdev, &desc);
+    metadata->bcd_device = desc.bcdDevice;
+
+    rc = libusb_get_active_config_descriptor(libdev, &config);
+    if (rc == 0) {
+        /* as usbredirhost_check_device_filter() does */
+        metadata->config_valid = TRUE;
+        metadata->interface_count = MIN(config->bNumInterfaces,
+                                        G_N_ELEMENTS(metadata->interface_class));
+        for (i = 0; i < metadata->interface_count; i++) {
+            const struct libusb_interface_descriptor *intf = config->interface[i].altsetting;
+
+            metadata->interface_class[i] = intf->bInterfaceClass;
+            metadata->interface_subclass[i] = intf->bInterfaceSubClass;
+            metadata->interface_protocol[i] = intf->bInterfaceProtocol;
+        }
+        for (i = 0; !metadata->isochronous && i < config->bNumInterfaces; i++) {
+            const struct libusb_interface *intf = &config->interface[i];
+
+            for (j = 0; !metadata->isochronous && j < intf->num_altsetting; j++) {
+                for (k = 0; k < intf->altsetting[j].bNumEndpoints; k++) {
+                    gint attributes = intf->altsetting[j].endpoint[k].bmAttributes;
+
+                    if ((attributes & LIBUSB_TRANSFER_TYPE_MASK) ==
+                        LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+                        metadata->isochronous = TRUE;
+                        break;
+                    }
+                }
+            }
+        }
+        libusb_free_config_descriptor(config);
+    } else {
+        SPICE_DEBUG("%s: no configuration descriptor for %s, %s [%i]", __FUNCTION__,
+                    key, libusb_strerror(rc), rc);
+    }
+
+    spice_usb_util_get_device_strings(dev->device_info.bus, dev->device_info.address,
+                                      dev->device_info.vid, dev->device_info.pid,
+                                      &metadata->manufacturer, &metadata->product);
+    return metadata;
+}
+
+typedef struct HotplugEvent {
+    SpiceUsbDevice *dev;
+    gboolean arrived;
+} HotplugEvent;
+
+/* metadata thread, or the registering thread for the devices present */
+static void hotplug_event_process(gpointer data, gpointer user_data)
+{
+    HotplugEvent *event = data;
+    SpiceUsbBackend *be = user_data;
+    SpiceUsbDevice *dev = event->dev;
+    gchar *key = usb_metadata_key(dev->libusb_device);
+    UsbDeviceMetadata *metadata;
+    usb_hot_plug_callback callback;
+    void *callback_data;
+
+    g_mutex_lock(&be->metadata_lock);
+    metadata = g_hash_table_lookup(be->metadata_cache, key);
+    if (metadata != NULL) {
+        dev->metadata = usb_metadata_ref(metadata);
+    }
+    if (!event->arrived) {
+        g_hash_table_remove(be->metadata_cache, key);
+    }
+    /* cleared by spice_usb_backend_deregister_hotplug() */
+    callback = be->hotplug_callback;
+    callback_data = be->hotplug_user_data;
+    g_mutex_unlock(&be->metadata_lock);
+
+    if (event->arrived && dev->metadata == NULL) {
+        metadata = usb_metadata_read(dev, key);
+        key = NULL;
+        dev->metadata = usb_metadata_ref(metadata);
+        g_mutex_lock(&be->metadata_lock);
+        g_hash_table_replace(be->metadata_cache, metadata->key, metadata);
+        g_mutex_unlock(&be->metadata_lock);
+    }
+    g_free(key);
+
+    if (callback) {
+        callback(callback_data, dev, event->arrived);
+    }
+    spice_usb_backend_device_unref(dev);
+    g_free(event);
+}
+
 static int LIBUSB_CALL hotplug_callback(libusb_context *ctx,
                                         libusb_device *libdev,
                                         libusb_hotplug_event event,
@@ -149,18 +566,43 @@ static int LIBUSB_CALL hotplug_callback(libusb_context *ctx,
     SpiceUsbDevice *dev;
     gboolean arrived = event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED;
 
-    g_return_val_if_fail(be->hotplug_callback != NULL, 0);
-
+    /* the hotplug callback is checked when the event is processed */
     dev = allocate_backend_device(libdev);
     if (dev) {
+        HotplugEvent *hotplug_event = g_new(HotplugEvent, 1);
+
         SPICE_DEBUG("created dev %p, usblib dev %p", dev, libdev);
         libusb_ref_device(libdev);
-        be->hotplug_callback(be->hotplug_user_data, dev, arrived);
-        spice_usb_backend_device_unref(dev);
+        hotplug_event->dev = dev;
+        hotplug_event->arrived = arrived;
+        if (be->metadata_thread == NULL) {
+            /* initial enumeration, the device list is complete
+             * once spice_usb_backend_register_hotplug() returns */
+            hotplug_event_process(hotplug_event, be);
+        } else {
+            g_thread_pool_push(be->metadata_thread, hotplug_event, NULL);
+        }
     }
     return 0;
 }
 
+/* emulated devices, reported from the caller's context */
+static void hotplug_report_device(SpiceUsbBackend *be, SpiceUsbDevice *dev,
+                                  gboolean arrived)
+{
+    usb_hot_plug_callback callback;
+    void *callback_data;
+
+    g_mutex_lock(&be->metadata_lock);
+    callback = be->hotplug_callback;
+    callback_data = be->hotplug_user_data;
+    g_mutex_unlock(&be->metadata_lock);
+
+    if (callback) {
+        callback(callback_data, dev, arrived);
+    }
+}
+
 #ifdef G_OS_WIN32
 /* Windows-specific: get notification on device change */
 
@@ -374,11 +816,13 @@ gboolean spice_usb_backend_device_isoch(SpiceUsbDevice *dev)
         return FALSE;
     }
 
+    if (dev->metadata != NULL && dev->metadata->config_valid) {
+        return dev->metadata->isochronous;
+    }
     if (dev->cached_isochronous_valid) {
         return dev->cached_isochronous;
     }
 
-
     rc = libusb_get_active_config_descriptor(libdev, &conf_desc);
     if (rc) {
         const char *desc = libusb_strerror(rc);
@@ -453,6 +897,9 @@ SpiceUsbBackend *spice_usb_backend_new(GError **error)
 #endif
         /* exclude addresses 0 (reserved) and 1 (root hub) */
         be->own_devices_mask = 3;
+        g_mutex_init(&be->metadata_lock);
+        be->metadata_cache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                                   (GDestroyNotify)usb_metadata_unref);
     }
     SPICE_DEBUG("%s <<", __FUNCTION__);
     return be;
@@ -486,13 +933,21 @@ void spice_usb_backend_deregister_hotplug(SpiceUsbBackend *be)
         disable_hotplug_support(be);
         be->hotplug_handle = 0;
     }
+    g_mutex_lock(&be->metadata_lock);
     be->hotplug_callback = NULL;
+    g_mutex_unlock(&be->metadata_lock);
     g_atomic_int_set(&be->event_thread_run, FALSE);
     if (be->event_thread) {
         libusb_interrupt_event_handler(be->libusb_context);
         g_thread_join(be->event_thread);
         be->event_thread = NULL;
     }
+    if (be->metadata_thread) {
+        /* the callback is cleared, the queued events are only released,
+         * the one being processed is reported before this returns */
+        g_thread_pool_free(be->metadata_thread, FALSE, TRUE);
+        be->metadata_thread = NULL;
+    }
 }
 
 gboolean spice_usb_backend_register_hotplug(SpiceUsbBackend *be,
@@ -504,19 +959,27 @@ gboolean spice_usb_backend_register_hotplug(SpiceUsbBackend *be,
     const char *desc;
     g_return_val_if_fail(be != NULL, FALSE);
 
+    g_mutex_lock(&be->metadata_lock);
     be->hotplug_callback = proc;
     be->hotplug_user_data = user_data;
+    g_mutex_unlock(&be->metadata_lock);
 
+    /* the devices already present are reported synchronously */
     rc = enable_hotplug_support(be, &desc);
 
     if (rc != LIBUSB_SUCCESS) {
         g_warning("Error initializing USB hotplug support: %s [%i]", desc, rc);
+        g_mutex_lock(&be->metadata_lock);
         be->hotplug_callback = NULL;
+        g_mutex_unlock(&be->metadata_lock);
         g_set_error(error, SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
                     _("Error on USB hotplug detection: %s [%i]"), desc, rc);
         return FALSE;
     }
 
+    /* later hotplug events are processed off the event thread */
+    be->metadata_thread = g_thread_pool_new(hotplug_event_process, be, 1, FALSE, NULL);
+
     g_atomic_int_set(&be->event_thread_run, TRUE);
     be->event_thread = g_thread_try_new("usb_ev_thread",
                                         handle_libusb_events,
@@ -544,6 +1007,8 @@ void spice_usb_backend_delete(SpiceUsbBackend *be)
     if (be->libusb_context) {
         libusb_exit(be->libusb_context);
     }
+    g_hash_table_destroy(be->metadata_cache);
+    g_mutex_clear(&be->metadata_lock);
     g_free(be);
     SPICE_DEBUG("%s <<", __FUNCTION__);
 }
@@ -558,6 +1023,28 @@ gconstpointer spice_usb_backend_device_get_libdev(const SpiceUsbDevice *dev)
     return dev->libusb_device;
 }
 
+gboolean spice_usb_backend_device_same_port(const SpiceUsbDevice *dev1,
+                                            const SpiceUsbDevice *dev2)
+{
+    uint8_t ports1[8], ports2[8];
+    int n1, n2;
+
+    if (dev1->device_info.bus != dev2->device_info.bus) {
+        return FALSE;
+    }
+    if (dev1->libusb_device == NULL || dev2->libusb_device == NULL) {
+        /* emulated devices have no port */
+        return dev1->device_info.address == dev2->device_info.address;
+    }
+
+    n1 = libusb_get_port_numbers(dev1->libusb_device, ports1, sizeof(ports1));
+    n2 = libusb_get_port_numbers(dev2->libusb_device, ports2, sizeof(ports2));
+    if (n1 <= 0 || n2 <= 0) {
+        return dev1->device_info.address == dev2->device_info.address;
+    }
+    return n1 == n2 && memcmp(ports1, ports2, n1) == 0;
+}
+
 SpiceUsbDevice *spice_usb_backend_device_ref(SpiceUsbDevice *dev)
 {
     LOUD_DEBUG("%s >> %p", __FUNCTION__, dev);
@@ -576,6 +1063,7 @@ void spice_usb_backend_device_unref(SpiceUsbDevice *dev)
         if (dev->edev) {
             device_ops(dev->edev)->unrealize(dev->edev);
         }
+        g_clear_pointer(&dev->metadata, usb_metadata_unref);
         g_free(dev);
     }
 }
@@ -620,7 +1108,21 @@ static int check_edev_device_filter(SpiceUsbDevice *dev,
 int spice_usb_backend_device_check_filter(SpiceUsbDevice *dev,
                                           const struct usbredirfilter_rule *rules, int count)
 {
-    if (dev->libusb_device != NULL) {
+    UsbDeviceMetadata *metadata = dev->metadata;
+
+    if (metadata != NULL && metadata->config_valid) {
+        return usbredirfilter_check(rules, count,
+                                    dev->device_info.class,
+                                    dev->device_info.subclass,
+                                    dev->device_info.protocol,
+                                    metadata->interface_class,
+                                    metadata->interface_subclass,
+                                    metadata->interface_protocol,
+                                    metadata->interface_count,
+                                    dev->device_info.vid,
+                                    dev->device_info.pid,
+                                    metadata->bcd_device, 0);
+    } else if (dev->libusb_device != NULL) {
         return usbredirhost_check_device_filter(rules, count, dev->libusb_device, 0);
     } else if (dev->edev != NULL) {
         return check_edev_device_filter(dev, rules, count);
@@ -727,17 +1229,42 @@ static int usbredir_write_callback(void *user_data, uint8_t *data, int count)
 
         return 0;
     }
-    res = spice_usbredir_write(ch->usbredir_channel, data, count);
+    usb_stats_scan_write(ch, data, count);
+    res = spice_usbredir_write(ch->usbredir_channel, data, count,
+                               count >= 4 && usbredir_packet_type(data) == usb_redir_iso_packet);
     return res;
 }
 
 static uint64_t usbredir_buffered_output_size_callback(void *user_data)
 {
     SpiceUsbBackendChannel *ch = user_data;
-    return spice_channel_get_queue_size(SPICE_CHANNEL(ch->usbredir_channel));
+    uint64_t size = spice_channel_get_queue_size(SPICE_CHANNEL(ch->usbredir_channel));
+
+    g_mutex_lock(&ch->stats_lock);
+    ch->stats.queue_size = size;
+    ch->stats.queue_max = MAX(ch->stats.queue_max, size);
+    usb_stats_histogram_add(ch->stats.queue_histogram, USB_STATS_QUEUE_MIN, size);
+    g_mutex_unlock(&ch->stats_lock);
+
+    return size;
 }
 
+static int read_guest_data(SpiceUsbBackendChannel *ch, uint8_t *data, int count);
+
 int spice_usb_backend_read_guest_data(SpiceUsbBackendChannel *ch, uint8_t *data, int count)
+{
+    int scanned, res;
+
+    /* the packets following the hello are scanned once it was parsed */
+    scanned = usb_stats_scan_read(ch, data, count);
+    res = read_guest_data(ch, data, count);
+    if (scanned < count) {
+        usb_stats_scan_read(ch, data + scanned, count - scanned);
+    }
+    return res;
+}
+
+static int read_guest_data(SpiceUsbBackendChannel *ch, uint8_t *data, int count)
 {
     int res = 0;
 
@@ -821,6 +1348,49 @@ GError *spice_usb_backend_get_error_details(int error_code, gchar *desc)
     return err;
 }
 
+static GVariant *usb_stats_histogram_to_variant(const guint64 *histogram)
+{
+    return g_variant_new_fixed_array(G_VARIANT_TYPE_UINT64, histogram,
+                                     USB_STATS_HISTOGRAM_BUCKETS, sizeof(guint64));
+}
+
+void spice_usb_backend_channel_get_stats(SpiceUsbBackendChannel *ch, GVariantBuilder *builder)
+{
+    UsbBackendStats stats;
+    guint dir, t;
+
+    g_mutex_lock(&ch->stats_lock);
+    stats = ch->stats;
+    g_mutex_unlock(&ch->stats_lock);
+
+    for (dir = 0; dir < USB_STATS_DIRECTIONS; dir++) {
+        GVariantBuilder types;
+
+        g_variant_builder_init(&types, G_VARIANT_TYPE("a(stt)"));
+        for (t = 0; t < USB_STATS_PACKET_TYPES; t++) {
+            g_variant_builder_add(&types, "(stt)", usb_stats_type_names[t],
+                                  stats.packets[dir][t], stats.bytes[dir][t]);
+        }
+        g_variant_builder_add(builder, "{sv}",
+                              dir == USB_STATS_TO_DEVICE ? "to-device" : "from-device",
+                              g_variant_builder_end(&types));
+    }
+#define ADD_STAT(name, value) \
+    g_variant_builder_add(builder, "{sv}", name, g_variant_new_uint64(value))
+    ADD_STAT("iso-drops", stats.iso_drops);
+    ADD_STAT("latency-count", stats.latency_count);
+    ADD_STAT("latency-avg",
+             stats.latency_count ? stats.latency_total / stats.latency_count : 0);
+    ADD_STAT("latency-max", stats.latency_max);
+    ADD_STAT("queue-size", stats.queue_size);
+    ADD_STAT("queue-size-max", stats.queue_max);
+#undef ADD_STAT
+    g_variant_builder_add(builder, "{sv}", "latency-histogram",
+                          usb_stats_histogram_to_variant(stats.latency_histogram));
+    g_variant_builder_add(builder, "{sv}", "queue-histogram",
+                          usb_stats_histogram_to_variant(stats.queue_histogram));
+}
+
 void spice_usb_backend_return_write_data(SpiceUsbBackendChannel *ch, void *data)
 {
     if (ch->state == USB_CHANNEL_STATE_HOST) {
@@ -1198,6 +1768,7 @@ static gboolean attach_edev(SpiceUsbBackendChannel *ch,
     ch->wait_disconnect_ack = 0;
     ch->attached = dev;
     dev->attached_to = ch;
+    usb_stats_reset(ch);
     device_ops(dev->edev)->attach(dev->edev, ch->parser);
     if (ch->state == USB_CHANNEL_STATE_PARSER) {
         /* send device info */
@@ -1254,6 +1825,7 @@ gboolean spice_usb_backend_channel_attach(SpiceUsbBackendChannel *ch,
     } else {
         ch->attached = dev;
         dev->attached_to = ch;
+        usb_stats_reset(ch);
     }
     ch->error = NULL;
     return TRUE;
@@ -1298,6 +1870,7 @@ spice_usb_backend_channel_new(SpiceUsbBackend *be,
     ch = g_new0(SpiceUsbBackendChannel, 1);
     SPICE_DEBUG("%s >>", __FUNCTION__);
     ch->usbredir_channel = usbredir_channel;
+    g_mutex_init(&ch->stats_lock);
     if (be->libusb_context) {
         ch->backend = be;
         ch->usbredirhost =
@@ -1368,6 +1941,7 @@ void spice_usb_backend_channel_delete(SpiceUsbBackendChannel *ch)
         free(ch->rules);
     }
 
+    g_mutex_clear(&ch->stats_lock);
     g_free(ch);
     SPICE_DEBUG("%s << %p", __FUNCTION__, ch);
 }
@@ -1417,7 +1991,10 @@ gchar *spice_usb_backend_device_get_description(SpiceUsbDevice *dev,
         descriptor = g_strdup("");
     }
 
-    if (dev->libusb_device) {
+    if (dev->metadata) {
+        manufacturer = g_strdup(dev->metadata->manufacturer);
+        product = g_strdup(dev->metadata->product);
+    } else if (dev->libusb_device) {
         spice_usb_util_get_device_strings(bus, address, vid, pid,
                                           &manufacturer, &product);
     } else {
@@ -1456,9 +2033,67 @@ void spice_usb_backend_device_eject(SpiceUsbBackend *be, SpiceUsbDevice *dev)
     if (dev->edev) {
         be->own_devices_mask &= ~(1 << dev->device_info.address);
     }
-    if (be->hotplug_callback) {
-        be->hotplug_callback(be->hotplug_user_data, dev, FALSE);
+    hotplug_report_device(be, dev, FALSE);
+}
+
+gboolean
+spice_usb_backend_send_bulk_packet_by_ref(struct usbredirparser *parser, uint64_t id,
+                                          const struct usb_redir_bulk_packet_header *h,
+                                          uint8_t *data, uint32_t data_len,
+                                          UsbEmulatedDataFree free_data, void *opaque)
+{
+    SpiceUsbBackendChannel *ch = parser->priv;
+    /* type, length and id, then the bulk packet header */
+    uint8_t header[4 + 4 + 8 + sizeof(*h)];
+    uint32_t header_len, bulk_header_len;
+    uint32_t value;
+    gboolean id64, length32;
+
+    if (ch->state != USB_CHANNEL_STATE_PARSER ||
+        !is_channel_ready(ch->usbredir_channel)) {
+        return FALSE;
     }
+
+    /* packets already queued in the parser must go first */
+    usbredirparser_do_write(parser);
+    if (usbredirparser_has_data_to_write(parser)) {
+        return FALSE;
+    }
+
+    /* the header layout depends on the negotiated capabilities,
+     * as in usbredirparser */
+    id64 = usbredirparser_have_cap(parser, usb_redir_cap_64bits_ids) &&
+           usbredirparser_peer_has_cap(parser, usb_redir_cap_64bits_ids);
+    length32 = usbredirparser_have_cap(parser, usb_redir_cap_32bits_bulk_length) &&
+               usbredirparser_peer_has_cap(parser, usb_redir_cap_32bits_bulk_length);
+    if (!length32 && h->length_high != 0) {
+        return FALSE;
+    }
+    bulk_header_len = length32 ? sizeof(*h) : sizeof(*h) - sizeof(h->length_high);
+
+    value = GUINT32_TO_LE(usb_redir_bulk_packet);
+    memcpy(header, &value, 4);
+    value = GUINT32_TO_LE(bulk_header_len + data_len);
+    memcpy(header + 4, &value, 4);
+    if (id64) {
+        uint64_t id_le = GUINT64_TO_LE(id);
+        memcpy(header + 8, &id_le, 8);
+        header_len = 16;
+    } else {
+        value = GUINT32_TO_LE((uint32_t) id);
+        memcpy(header + 8, &value, 4);
+        header_len = 12;
+    }
+    memcpy(header + header_len, h, bulk_header_len);
+    header_len += bulk_header_len;
+
+    if (!spice_usbredir_write_by_ref(ch->usbredir_channel, header, header_len,
+                                     data, data_len, free_data, opaque)) {
+        return FALSE;
+    }
+    usb_stats_from_device(ch, usb_redir_bulk_packet, bulk_header_len + data_len, id,
+                          h->status);
+    return TRUE;
 }
 
 gboolean
@@ -1514,9 +2149,7 @@ spice_usb_backend_create_emulated_device(SpiceUsbBackend *be,
     dev->device_info.subclass = desc->bDeviceSubClass;
     dev->device_info.protocol = desc->bDeviceProtocol;
 
-    if (be->hotplug_callback) {
-        be->hotplug_callback(be->hotplug_user_data, dev, TRUE);
-    }
+    hotplug_report_device(be, dev, TRUE);
     spice_usb_backend_device_unref(dev);
 
     return TRUE;
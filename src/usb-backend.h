@@ -68,6 +68,10 @@ SpiceUsbDevice *spice_usb_backend_device_ref(SpiceUsbDevice *dev);
 void spice_usb_backend_device_unref(SpiceUsbDevice *dev);
 gconstpointer spice_usb_backend_device_get_libdev(const SpiceUsbDevice *dev);
 const UsbDeviceInformation* spice_usb_backend_device_get_info(const SpiceUsbDevice *dev);
+/* whether the devices are plugged in the same port, a re-enumerated
+ * device gets a new address on the same port */
+gboolean spice_usb_backend_device_same_port(const SpiceUsbDevice *dev1,
+                                            const SpiceUsbDevice *dev2);
 gboolean spice_usb_backend_device_isoch(SpiceUsbDevice *dev);
 void spice_usb_backend_device_eject(SpiceUsbBackend *be, SpiceUsbDevice *device);
 void spice_usb_backend_device_report_change(SpiceUsbBackend *be, SpiceUsbDevice *device);
@@ -93,6 +97,8 @@ void spice_usb_backend_channel_get_guest_filter(SpiceUsbBackendChannel *ch,
                                                 const struct usbredirfilter_rule  **rules,
                                                 int *count);
 void spice_usb_backend_return_write_data(SpiceUsbBackendChannel *ch, void *data);
+/* adds the statistics of the attached device to an a{sv} builder */
+void spice_usb_backend_channel_get_stats(SpiceUsbBackendChannel *ch, GVariantBuilder *builder);
 gchar *spice_usb_backend_device_get_description(SpiceUsbDevice *dev, const gchar *format);
 
 G_END_DECLS
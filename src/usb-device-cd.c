@@ -45,14 +45,18 @@
 #include "usb-emulation.h"
 #include "usb-device-cd.h"
 #include "cd-usb-bulk-msd.h"
+#include "cd-image.h"
 
 typedef struct SpiceCdLU {
     char *filename;
-    GFileInputStream *stream;
+    CdImage *image;
     uint64_t size;
     uint32_t blockSize;
+    uint32_t cache_size;
     uint32_t loaded : 1;
     uint32_t device : 1;
+    uint32_t disk : 1;
+    uint32_t read_only : 1;
 } SpiceCdLU;
 
 #define MAX_LUN_PER_DEVICE              1
@@ -91,6 +95,18 @@ struct SpiceUsbEmulatedDevice {
 
 typedef struct SpiceUsbEmulatedDevice UsbCd;
 
+/* disks are raw, only CD media are probed for another format */
+static CdImage *cd_image_open_unit(SpiceCdLU *unit, GError **error)
+{
+    if (!unit->disk) {
+        return cd_image_open(unit->filename, unit->size, error);
+    }
+    if (unit->read_only) {
+        return cd_image_open_raw(unit->filename, unit->size, error);
+    }
+    return cd_image_open_writable(unit->filename, unit->size, error);
+}
+
 #ifndef G_OS_WIN32
 
 static int cd_device_open_stream(SpiceCdLU *unit, const char *filename)
@@ -126,14 +142,20 @@ static int cd_device_open_stream(SpiceCdLU *unit, const char *filename)
     unit->size = file_stat.st_size;
     close(fd);
     if (unit->size) {
-        GFile *file_object = g_file_new_for_path(unit->filename);
-        unit->stream = g_file_read(file_object, NULL, NULL);
-        g_clear_object(&file_object);
+        GError *error = NULL;
+
+        unit->image = cd_image_open_unit(unit, &error);
+        if (error) {
+            SPICE_DEBUG("%s: %s", __FUNCTION__, error->message);
+            g_clear_error(&error);
+        }
     }
-    if (!unit->stream) {
-        SPICE_DEBUG("%s: can't open stream on %s", __FUNCTION__, unit->filename);
+    if (!unit->image) {
+        SPICE_DEBUG("%s: can't open image %s", __FUNCTION__, unit->filename);
         return -1;
     }
+    /* differs from the file size for compressed images */
+    unit->size = cd_image_get_size(unit->image);
 
     return 0;
 }
@@ -277,14 +299,20 @@ static int cd_device_open_stream(SpiceCdLU *unit, const char *filename)
     unit->size = size.QuadPart;
     CloseHandle(h);
     if (unit->size) {
-        GFile *file_object = g_file_new_for_path(unit->filename);
-        unit->stream = g_file_read(file_object, NULL, NULL);
-        g_clear_object(&file_object);
+        GError *error = NULL;
+
+        unit->image = cd_image_open_unit(unit, &error);
+        if (error) {
+            SPICE_DEBUG("%s: %s", __FUNCTION__, error->message);
+            g_clear_error(&error);
+        }
     }
-    if (!unit->stream) {
-        SPICE_DEBUG("%s: can't open stream on %s", __FUNCTION__, unit->filename);
+    if (!unit->image) {
+        SPICE_DEBUG("%s: can't open image %s", __FUNCTION__, unit->filename);
         return -1;
     }
+    /* differs from the file size for compressed images */
+    unit->size = cd_image_get_size(unit->image);
     return 0;
 }
 
@@ -342,9 +370,29 @@ static gboolean open_stream(SpiceCdLU *unit, const char *filename)
     return b;
 }
 
+static void close_stream_flushed(GObject *source_object, GAsyncResult *result,
+                                 gpointer user_data)
+{
+    CdImage *image = user_data;
+    GError *error = NULL;
+
+    if (!cd_image_flush_finish(image, result, &error)) {
+        g_warning("%s: %s", __FUNCTION__, error->message);
+        g_clear_error(&error);
+    }
+    cd_image_unref(image);
+}
+
 static void close_stream(SpiceCdLU *unit)
 {
-    g_clear_object(&unit->stream);
+    CdImage *image = g_steal_pointer(&unit->image);
+
+    if (image == NULL) {
+        return;
+    }
+    /* write back what the guest wrote without blocking the main loop,
+     * the image is released once it is done */
+    cd_image_flush_async(image, NULL, close_stream_flushed, image);
 }
 
 static gboolean load_lun(UsbCd *d, int unit, gboolean load)
@@ -363,10 +411,12 @@ static gboolean load_lun(UsbCd *d, int unit, gboolean load)
     if (load) {
         CdScsiMediaParameters media_params = { 0 };
 
-        media_params.stream = d->units[unit].stream;
+        media_params.image = d->units[unit].image;
         media_params.size = d->units[unit].size;
+        media_params.cache_size = d->units[unit].cache_size;
         media_params.block_size = d->units[unit].blockSize;
-        if (media_params.block_size == CD_DEV_BLOCK_SIZE &&
+        if (!d->units[unit].disk &&
+            media_params.block_size == CD_DEV_BLOCK_SIZE &&
             media_params.size % DVD_DEV_BLOCK_SIZE == 0) {
             media_params.block_size = DVD_DEV_BLOCK_SIZE;
         }
@@ -452,6 +502,7 @@ static gboolean usb_cd_get_descriptor(UsbCd *d, uint8_t type, uint8_t index,
     static uint16_t s0[2] = { 0x304, 0x409 };
     static uint16_t s1[8] = { 0x310, 'R', 'e', 'd', ' ', 'H', 'a', 't' };
     static uint16_t s2[9] = { 0x312, 'S', 'p', 'i', 'c', 'e', ' ', 'C', 'D' };
+    static uint16_t s2_disk[11] = { 0x316, 'S', 'p', 'i', 'c', 'e', ' ', 'D', 'i', 's', 'k' };
 
     void *p = NULL;
     uint16_t len = 0;
@@ -470,6 +521,8 @@ static gboolean usb_cd_get_descriptor(UsbCd *d, uint8_t type, uint8_t index,
             p = s0; len = sizeof(s0);
         } else if (index == 1) {
             p = s1; len = sizeof(s1);
+        } else if (index == 2 && d->units[0].disk) {
+            p = s2_disk; len = sizeof(s2_disk);
         } else if (index == 2) {
             p = s2; len = sizeof(s2);
         } else if (index == 3) {
@@ -547,8 +600,33 @@ static void usb_cd_bulk_out_request(UsbCd *device,
     }
 }
 
+static void usb_cd_release_buffer(uint8_t *data, void *opaque)
+{
+    cd_usb_bulk_buffer_unref(opaque);
+}
+
+// send sector data straight from the SCSI buffer, without
+// copying it to the parser, when possible
+static gboolean usb_cd_send_by_ref(UsbCd *d, struct BufferedBulkRead *read,
+                                   uint8_t *data, uint32_t length,
+                                   CdUsbBulkBuffer *buffer)
+{
+    if (buffer == NULL || length == 0) {
+        return FALSE;
+    }
+    cd_usb_bulk_buffer_ref(buffer);
+    if (!spice_usb_backend_send_bulk_packet_by_ref(d->parser, read->id, &read->hout,
+                                                   data, length,
+                                                   usb_cd_release_buffer, buffer)) {
+        cd_usb_bulk_buffer_unref(buffer);
+        return FALSE;
+    }
+    return TRUE;
+}
+
 void cd_usb_bulk_msd_read_complete(void *user_data,
-                                   uint8_t *data, uint32_t length, CdUsbBulkStatus status)
+                                   uint8_t *data, uint32_t length,
+                                   CdUsbBulkBuffer *buffer, CdUsbBulkStatus status)
 {
     UsbCd *d = (UsbCd *)user_data;
 
@@ -590,10 +668,13 @@ void cd_usb_bulk_msd_read_complete(void *user_data,
             SPICE_DEBUG("%s: responding %" G_GUINT64_FORMAT " with len %u out of %u, status %d",
                         __FUNCTION__, d->read_bulk[nread].id, max_len,
                         length, d->read_bulk[nread].hout.status);
-            usbredirparser_send_bulk_packet(d->parser, d->read_bulk[nread].id,
-                                            &d->read_bulk[nread].hout,
-                                            max_len ? (data + offset) : NULL,
-                                            max_len);
+            if (!usb_cd_send_by_ref(d, &d->read_bulk[nread],
+                                    data + offset, max_len, buffer)) {
+                usbredirparser_send_bulk_packet(d->parser, d->read_bulk[nread].id,
+                                                &d->read_bulk[nread].hout,
+                                                max_len ? (data + offset) : NULL,
+                                                max_len);
+            }
             offset += max_len;
             length -= max_len;
         }
@@ -654,7 +735,7 @@ static void usb_cd_cancel_request(UsbCd *d, uint64_t id)
     for (nread = 0; nread < d->num_reads; nread++) {
         if (d->read_bulk[nread].id == id) {
             if (cd_usb_bulk_msd_cancel_read(d->msc)) {
-                cd_usb_bulk_msd_read_complete(d, NULL, 0, BULK_STATUS_CANCELED);
+                cd_usb_bulk_msd_read_complete(d, NULL, 0, NULL, BULK_STATUS_CANCELED);
             }
             return;
         }
@@ -689,7 +770,8 @@ void cd_usb_bulk_msd_lun_changed(void *user_data, uint32_t lun)
 static gchar *usb_cd_get_product_description(UsbCd *device)
 {
     gchar *base_name = g_path_get_basename(device->units[0].filename);
-    gchar *res = g_strdup_printf("SPICE CD (%s)", base_name);
+    gchar *res = g_strdup_printf(device->units[0].disk ? "SPICE Disk (%s)" : "SPICE CD (%s)",
+                                 base_name);
     g_free(base_name);
     return res;
 }
@@ -734,8 +816,9 @@ static UsbCd* usb_cd_create(SpiceUsbBackend *be,
     d->max_lun_index = MAX_LUN_PER_DEVICE - 1;
 
     dev_params.vendor = "Red Hat";
-    dev_params.product = "SPICE CD";
+    dev_params.product = param->disk ? "SPICE Disk" : "SPICE CD";
     dev_params.version = "0";
+    dev_params.disk = !!param->disk;
 
     d->msc = cd_usb_bulk_msd_alloc(d, MAX_LUN_PER_DEVICE);
     if (!d->msc) {
@@ -745,6 +828,12 @@ static UsbCd* usb_cd_create(SpiceUsbBackend *be,
         return NULL;
     }
     d->units[unit].blockSize = CD_DEV_BLOCK_SIZE;
+    d->units[unit].disk = !!param->disk;
+    d->units[unit].read_only = !!param->read_only;
+    /* callers leave cache_size zeroed for the default, the cache can
+     * only be disabled at the SCSI level */
+    d->units[unit].cache_size =
+        param->cache_size ? param->cache_size : CD_IMAGE_DEFAULT_CACHE_SIZE;
     if (!cd_usb_bulk_msd_realize(d->msc, unit, &dev_params)) {
         if (open_stream(&d->units[unit], param->filename) &&
             load_lun(d, unit, TRUE)) {
@@ -26,6 +26,13 @@
 typedef struct CdEmulationParams {
     const char *filename;
     uint32_t delete_on_eject : 1;
+    /* size in bytes of the read-ahead cache of the unit,
+     * 0 for the default */
+    uint32_t cache_size;
+    /* emulate a disk (USB stick) instead of a CD, the image is
+     * written to unless read_only is set */
+    uint32_t disk : 1;
+    uint32_t read_only : 1;
 } CdEmulationParams;
 
 gboolean
@@ -82,6 +82,7 @@ enum
     DEVICE_REMOVED,
     AUTO_CONNECT_FAILED,
     DEVICE_ERROR,
+    DEVICES_CHANGED,
     LAST_SIGNAL,
 };
 
@@ -103,9 +104,22 @@ struct _SpiceUsbDeviceManagerPrivate {
 #endif
     GPtrArray *devices;
     GPtrArray *channels;
+
+    /* hotplug events queued from the backend, processed in batches */
+    GMutex hotplug_lock;
+    GQueue hotplug_events;
+    guint hotplug_timeout_id;
+    gint64 hotplug_first_event;
+    gint64 hotplug_last_event;
 #endif
 };
 
+/* A burst of hotplug events (a hub being plugged in, a device
+ * re-enumerating) is processed once no new event came for
+ * HOTPLUG_DEBOUNCE_MS, or HOTPLUG_MAX_DELAY_MS after its first event */
+#define HOTPLUG_DEBOUNCE_MS     50
+#define HOTPLUG_MAX_DELAY_MS    500
+
 enum {
     SPICE_USB_DEVICE_STATE_NONE = 0, /* this is also DISCONNECTED */
     SPICE_USB_DEVICE_STATE_CONNECTING,
@@ -134,6 +148,7 @@ static void spice_usb_device_manager_check_redir_on_connect(SpiceUsbDeviceManage
 static SpiceUsbDevice *spice_usb_device_new(SpiceUsbDevice *bdev);
 static SpiceUsbDevice *spice_usb_device_ref(SpiceUsbDevice *device);
 static void spice_usb_device_unref(SpiceUsbDevice *device);
+static void hotplug_event_free(gpointer data);
 
 #ifdef G_OS_WIN32
 static void _usbdk_hider_update(SpiceUsbDeviceManager *manager);
@@ -218,6 +233,8 @@ static void spice_usb_device_manager_init(SpiceUsbDeviceManager *manager)
     priv->channels = g_ptr_array_new();
     priv->devices  = g_ptr_array_new_with_free_func((GDestroyNotify)
                                                     spice_usb_device_unref);
+    g_mutex_init(&priv->hotplug_lock);
+    g_queue_init(&priv->hotplug_events);
 #endif
 }
 
@@ -293,6 +310,9 @@ static void spice_usb_device_manager_finalize(GObject *gobject)
     }
     free(priv->auto_conn_filter_rules);
     free(priv->redirect_on_connect_rules);
+    g_queue_foreach(&priv->hotplug_events, (GFunc)hotplug_event_free, NULL);
+    g_queue_clear(&priv->hotplug_events);
+    g_mutex_clear(&priv->hotplug_lock);
 #ifdef G_OS_WIN32
     _usbdk_hider_clear(manager);
     usbdk_api_unload(priv->usbdk_api);
@@ -614,6 +634,34 @@ static void spice_usb_device_manager_class_init(SpiceUsbDeviceManagerClass *klas
                      2,
                      SPICE_TYPE_USB_DEVICE,
                      G_TYPE_ERROR);
+
+    /**
+     * SpiceUsbDeviceManager::devices-changed:
+     * @manager: the #SpiceUsbDeviceManager that emitted the signal
+     * @added: (element-type SpiceUsbDevice): the devices which have been plugged in
+     * @removed: (element-type SpiceUsbDevice): the devices which have been removed
+     *
+     * Hotplug events are collected and processed in batches. The
+     * #SpiceUsbDeviceManager::devices-changed signal is emitted once per
+     * batch, after #SpiceUsbDeviceManager::device-added and
+     * #SpiceUsbDeviceManager::device-removed have been emitted for each of
+     * the devices, so that the whole device list only needs to be updated
+     * once. A device which was plugged in and removed again within the same
+     * batch is not reported at all.
+     *
+     * Since: 0.39
+     **/
+    signals[DEVICES_CHANGED] =
+        g_signal_new("devices-changed",
+                     G_OBJECT_CLASS_TYPE(gobject_class),
+                     G_SIGNAL_RUN_FIRST,
+                     0,
+                     NULL, NULL,
+                     g_cclosure_user_marshal_VOID__BOXED_BOXED,
+                     G_TYPE_NONE,
+                     2,
+                     G_TYPE_PTR_ARRAY,
+                     G_TYPE_PTR_ARRAY);
 }
 
 /**
@@ -754,8 +802,9 @@ spice_usb_device_manager_find_device(SpiceUsbDeviceManager *manager,
     return device;
 }
 
-static void spice_usb_device_manager_add_dev(SpiceUsbDeviceManager *manager,
-                                             SpiceUsbDevice *bdev)
+/* returns: the new device, or NULL if it was not added */
+static SpiceUsbDevice *spice_usb_device_manager_add_dev(SpiceUsbDeviceManager *manager,
+                                                        SpiceUsbDevice *bdev)
 {
     SpiceUsbDeviceManagerPrivate *priv = manager->priv;
     const UsbDeviceInformation *b_info = spice_usb_backend_device_get_info(bdev);
@@ -769,41 +818,27 @@ static void spice_usb_device_manager_add_dev(SpiceUsbDeviceManager *manager,
                     b_info->address,
                     b_info->vid,
                     b_info->pid);
-        return;
+        return NULL;
     }
 
     device = spice_usb_device_new(bdev);
     if (!device) {
-        return;
+        return NULL;
     }
 
     g_ptr_array_add(priv->devices, device);
 
-    if (priv->auto_connect) {
-        gboolean can_redirect, auto_ok;
-
-        can_redirect = spice_usb_device_manager_can_redirect_device(manager, device, NULL);
-
-        auto_ok = spice_usb_backend_device_check_filter(bdev,
-                                                        priv->auto_conn_filter_rules,
-                                                        priv->auto_conn_filter_rules_count) == 0;
-
-        if (can_redirect && auto_ok) {
-            spice_usb_device_manager_connect_device_async(manager, device, NULL,
-                                                          spice_usb_device_manager_auto_connect_cb,
-                                                          spice_usb_device_ref(device));
-        }
-    }
-
     SPICE_DEBUG("device added %04x:%04x (%p)",
                 spice_usb_device_get_vid(device),
                 spice_usb_device_get_pid(device),
                 device);
     g_signal_emit(manager, signals[DEVICE_ADDED], 0, device);
+    return device;
 }
 
-static void spice_usb_device_manager_remove_dev(SpiceUsbDeviceManager *manager,
-                                                SpiceUsbDevice *bdev)
+/* returns: a reference to the removed device, or NULL */
+static SpiceUsbDevice *spice_usb_device_manager_remove_dev(SpiceUsbDeviceManager *manager,
+                                                           SpiceUsbDevice *bdev)
 {
     SpiceUsbDeviceManagerPrivate *priv = manager->priv;
     SpiceUsbDevice *device;
@@ -813,7 +848,7 @@ static void spice_usb_device_manager_remove_dev(SpiceUsbDeviceManager *manager,
     if (!device) {
         g_warning("Could not find USB device to remove " DEV_ID_FMT,
                   b_info->bus, b_info->address);
-        return;
+        return NULL;
     }
 
     /* TODO: check usage of the sync version is ok here */
@@ -826,30 +861,180 @@ static void spice_usb_device_manager_remove_dev(SpiceUsbDeviceManager *manager,
     spice_usb_device_ref(device);
     g_ptr_array_remove(priv->devices, device);
     g_signal_emit(manager, signals[DEVICE_REMOVED], 0, device);
-    spice_usb_device_unref(device);
+    return device;
 }
 
-struct hotplug_idle_cb_args {
-    SpiceUsbDeviceManager *manager;
-    SpiceUsbDevice *device;
-    gboolean               added;
-};
+/* Evaluate the auto-connect filter over the devices of a batch, and
+ * connect those which pass it and can be redirected */
+static void spice_usb_device_manager_auto_connect_devices(SpiceUsbDeviceManager *manager,
+                                                          GPtrArray *devices)
+{
+    SpiceUsbDeviceManagerPrivate *priv = manager->priv;
+    GPtrArray *candidates;
+    guint i;
+
+    if (!priv->auto_connect || devices->len == 0) {
+        return;
+    }
 
-static gboolean spice_usb_device_manager_hotplug_idle_cb(gpointer user_data)
+    candidates = g_ptr_array_sized_new(devices->len);
+    for (i = 0; i < devices->len; i++) {
+        SpiceUsbDevice *device = g_ptr_array_index(devices, i);
+
+        if (spice_usb_backend_device_check_filter(device,
+                                                  priv->auto_conn_filter_rules,
+                                                  priv->auto_conn_filter_rules_count) == 0) {
+            g_ptr_array_add(candidates, device);
+        }
+    }
+
+    for (i = 0; i < candidates->len; i++) {
+        SpiceUsbDevice *device = g_ptr_array_index(candidates, i);
+
+        if (!spice_usb_device_manager_can_redirect_device(manager, device, NULL)) {
+            continue;
+        }
+        spice_usb_device_manager_connect_device_async(manager, device, NULL,
+                                                      spice_usb_device_manager_auto_connect_cb,
+                                                      spice_usb_device_ref(device));
+    }
+    g_ptr_array_unref(candidates);
+}
+
+typedef struct HotplugEvent {
+    SpiceUsbDevice *bdev;
+    gboolean added;
+} HotplugEvent;
+
+static void hotplug_event_free(gpointer data)
 {
-    struct hotplug_idle_cb_args *args = user_data;
-    SpiceUsbDeviceManager *manager = SPICE_USB_DEVICE_MANAGER(args->manager);
+    HotplugEvent *event = data;
 
-    if (args->added) {
-        spice_usb_device_manager_add_dev(manager, args->device);
-    } else {
-        spice_usb_device_manager_remove_dev(manager, args->device);
+    spice_usb_backend_device_unref(event->bdev);
+    g_free(event);
+}
+
+static gboolean hotplug_event_same_port(HotplugEvent *a, HotplugEvent *b)
+{
+    return spice_usb_backend_device_same_port(a->bdev, b->bdev);
+}
+
+/* Drop the events which cancel out within the batch: a device plugged in
+ * and removed again is never shown, a repeated arrival is reported once */
+static void hotplug_events_coalesce(SpiceUsbDeviceManager *manager, GQueue *events)
+{
+    GList *l, *next;
+
+    for (l = events->head; l != NULL; l = next) {
+        HotplugEvent *event = l->data;
+        GList *prev;
+
+        next = l->next;
+        if (event->added) {
+            for (prev = l->prev; prev != NULL; prev = prev->prev) {
+                HotplugEvent *p = prev->data;
+
+                if (!hotplug_event_same_port(event, p)) {
+                    continue;
+                }
+                if (p->added) {
+                    /* the first arrival was not followed by a removal */
+                    hotplug_event_free(p);
+                    g_queue_delete_link(events, prev);
+                }
+                break;
+            }
+            continue;
+        }
+
+        for (prev = l->prev; prev != NULL; prev = prev->prev) {
+            HotplugEvent *p = prev->data;
+
+            if (!hotplug_event_same_port(event, p)) {
+                continue;
+            }
+            if (p->added) {
+                const UsbDeviceInformation *info =
+                    spice_usb_backend_device_get_info(event->bdev);
+
+                hotplug_event_free(p);
+                g_queue_delete_link(events, prev);
+                /* arrived and left within the batch */
+                if (!spice_usb_device_manager_find_device(manager, info->bus,
+                                                          info->address)) {
+                    hotplug_event_free(event);
+                    g_queue_delete_link(events, l);
+                }
+            }
+            break;
+        }
     }
+}
 
-    spice_usb_backend_device_unref(args->device);
-    g_object_unref(manager);
-    g_free(args);
-    return FALSE;
+static void spice_usb_device_manager_process_hotplug(SpiceUsbDeviceManager *manager,
+                                                     GQueue *events)
+{
+    GPtrArray *added, *removed;
+    HotplugEvent *event;
+
+    hotplug_events_coalesce(manager, events);
+    if (g_queue_is_empty(events)) {
+        return;
+    }
+
+    added = g_ptr_array_new_with_free_func((GDestroyNotify)spice_usb_device_unref);
+    removed = g_ptr_array_new_with_free_func((GDestroyNotify)spice_usb_device_unref);
+
+    /* keep the order of the events, a port may be left and re-used */
+    while ((event = g_queue_pop_head(events)) != NULL) {
+        SpiceUsbDevice *device;
+
+        if (event->added) {
+            device = spice_usb_device_manager_add_dev(manager, event->bdev);
+            if (device) {
+                g_ptr_array_add(added, spice_usb_device_ref(device));
+            }
+        } else {
+            device = spice_usb_device_manager_remove_dev(manager, event->bdev);
+            if (device) {
+                g_ptr_array_remove(added, device);
+                g_ptr_array_add(removed, device);
+            }
+        }
+        hotplug_event_free(event);
+    }
+
+    spice_usb_device_manager_auto_connect_devices(manager, added);
+
+    SPICE_DEBUG("hotplug batch: %u added, %u removed", added->len, removed->len);
+    if (added->len > 0 || removed->len > 0) {
+        g_signal_emit(manager, signals[DEVICES_CHANGED], 0, added, removed);
+    }
+    g_ptr_array_unref(added);
+    g_ptr_array_unref(removed);
+}
+
+static gboolean spice_usb_device_manager_hotplug_timeout_cb(gpointer user_data)
+{
+    SpiceUsbDeviceManager *manager = SPICE_USB_DEVICE_MANAGER(user_data);
+    SpiceUsbDeviceManagerPrivate *priv = manager->priv;
+    GQueue events;
+    gint64 now = g_get_monotonic_time();
+
+    g_mutex_lock(&priv->hotplug_lock);
+    /* wait for the end of the burst */
+    if (now - priv->hotplug_last_event < HOTPLUG_DEBOUNCE_MS * 1000 &&
+        now - priv->hotplug_first_event < HOTPLUG_MAX_DELAY_MS * 1000) {
+        g_mutex_unlock(&priv->hotplug_lock);
+        return G_SOURCE_CONTINUE;
+    }
+    events = priv->hotplug_events;
+    g_queue_init(&priv->hotplug_events);
+    priv->hotplug_timeout_id = 0;
+    g_mutex_unlock(&priv->hotplug_lock);
+
+    spice_usb_device_manager_process_hotplug(manager, &events);
+    return G_SOURCE_REMOVE;
 }
 
 /* Can be called from both the main-thread as well as the event_thread */
@@ -858,12 +1043,23 @@ static void spice_usb_device_manager_hotplug_cb(void *user_data,
                                                 gboolean added)
 {
     SpiceUsbDeviceManager *manager = SPICE_USB_DEVICE_MANAGER(user_data);
-    struct hotplug_idle_cb_args *args = g_malloc0(sizeof(*args));
-
-    args->manager = g_object_ref(manager);
-    args->device = spice_usb_backend_device_ref(dev);
-    args->added = added;
-    g_idle_add(spice_usb_device_manager_hotplug_idle_cb, args);
+    SpiceUsbDeviceManagerPrivate *priv = manager->priv;
+    HotplugEvent *event = g_new0(HotplugEvent, 1);
+
+    event->bdev = spice_usb_backend_device_ref(dev);
+    event->added = added;
+
+    g_mutex_lock(&priv->hotplug_lock);
+    g_queue_push_tail(&priv->hotplug_events, event);
+    priv->hotplug_last_event = g_get_monotonic_time();
+    if (priv->hotplug_timeout_id == 0) {
+        priv->hotplug_first_event = priv->hotplug_last_event;
+        priv->hotplug_timeout_id =
+            g_timeout_add_full(G_PRIORITY_DEFAULT, HOTPLUG_DEBOUNCE_MS,
+                               spice_usb_device_manager_hotplug_timeout_cb,
+                               g_object_ref(manager), g_object_unref);
+    }
+    g_mutex_unlock(&priv->hotplug_lock);
 }
 
 static void spice_usb_device_manager_channel_connect_cb(GObject *gobject,
@@ -1052,6 +1248,57 @@ gboolean spice_usb_device_manager_is_device_connected(SpiceUsbDeviceManager *man
     return !!spice_usb_device_manager_get_channel_for_dev(manager, device);
 }
 
+/**
+ * spice_usb_device_manager_get_device_stats:
+ * @manager: the #SpiceUsbDeviceManager manager
+ * @device: a #SpiceUsbDevice
+ *
+ * Gets the statistics of the redirection of @device, accumulated since
+ * it was connected. The returned dictionary contains:
+ *
+ * - "to-device", "from-device" (a(stt)): packet type ("control", "bulk",
+ *   "iso" or "interrupt"), packet count and bytes, in each direction
+ * - "iso-drops" (t): isochronous packets the device completed with an
+ *   error status
+ * - "iso-late-drops" (t): isochronous packets dropped by the client as
+ *   they waited too long to be sent. The isochronous packets of devices
+ *   with isochronous endpoints are sent in order with the other packets,
+ *   and dropped if they are still queued after 50ms.
+ * - "latency-count", "latency-avg", "latency-max" (t): number, average
+ *   and maximum in microseconds of the completions of the control and
+ *   bulk requests
+ * - "latency-histogram" (at): bucket i counts the completions faster
+ *   than 64 << i microseconds, the last bucket the slower ones
+ * - "queue-size", "queue-size-max" (t): bytes queued for the server,
+ *   sampled when the isochronous, interrupt and buffered bulk streams
+ *   check it
+ * - "queue-histogram" (at): bucket i counts the samples below
+ *   4096 << i bytes, the last bucket the larger ones
+ * - "compression" (a{sv}): see
+ *   spice_usbredir_channel_get_compression_stats()
+ *
+ * Returns: (transfer floating) (nullable): a #GVariant dictionary of
+ * type a{sv}, or %NULL if @device is not connected
+ *
+ * Since: 0.39
+ */
+GVariant *spice_usb_device_manager_get_device_stats(SpiceUsbDeviceManager *manager,
+                                                   SpiceUsbDevice *device)
+{
+    g_return_val_if_fail(SPICE_IS_USB_DEVICE_MANAGER(manager), NULL);
+    g_return_val_if_fail(device != NULL, NULL);
+
+#ifdef USE_USBREDIR
+    SpiceUsbredirChannel *channel =
+        spice_usb_device_manager_get_channel_for_dev(manager, device);
+
+    if (channel != NULL) {
+        return spice_usbredir_channel_get_device_stats(channel);
+    }
+#endif
+    return NULL;
+}
+
 #ifdef USE_USBREDIR
 
 static gboolean
@@ -110,6 +110,8 @@ GPtrArray *spice_usb_device_manager_get_devices(SpiceUsbDeviceManager *manager);
 GPtrArray* spice_usb_device_manager_get_devices_with_filter(SpiceUsbDeviceManager *manager,
                                                             const gchar *filter);
 
+GVariant *spice_usb_device_manager_get_device_stats(SpiceUsbDeviceManager *manager,
+                                                   SpiceUsbDevice *device);
 gboolean spice_usb_device_manager_is_device_connected(SpiceUsbDeviceManager *manager,
                                                       SpiceUsbDevice *device);
 void spice_usb_device_manager_connect_device_async(SpiceUsbDeviceManager *manager,
@@ -60,6 +60,8 @@ static void device_added_cb(SpiceUsbDeviceManager *manager, SpiceUsbDevice *devi
                             gpointer user_data);
 static void device_removed_cb(SpiceUsbDeviceManager *manager, SpiceUsbDevice *device,
                               gpointer user_data);
+static void devices_changed_cb(SpiceUsbDeviceManager *manager, GPtrArray *added,
+                               GPtrArray *removed, gpointer user_data);
 static void device_error_cb(SpiceUsbDeviceManager *manager, SpiceUsbDevice *device,
                             GError *err, gpointer user_data);
 static gboolean spice_usb_device_widget_update_status(gpointer user_data);
@@ -224,6 +226,8 @@ static void spice_usb_device_widget_constructed(GObject *gobject)
                      G_CALLBACK(device_added_cb), self);
     g_signal_connect(priv->manager, "device-removed",
                      G_CALLBACK(device_removed_cb), self);
+    g_signal_connect(priv->manager, "devices-changed",
+                     G_CALLBACK(devices_changed_cb), self);
     g_signal_connect(priv->manager, "device-error",
                      G_CALLBACK(device_error_cb), self);
 
@@ -250,6 +254,8 @@ static void spice_usb_device_widget_finalize(GObject *object)
                                              device_added_cb, self);
         g_signal_handlers_disconnect_by_func(priv->manager,
                                              device_removed_cb, self);
+        g_signal_handlers_disconnect_by_func(priv->manager,
+                                             devices_changed_cb, self);
         g_signal_handlers_disconnect_by_func(priv->manager,
                                              device_error_cb, self);
     }
@@ -557,7 +563,6 @@ static void device_added_cb(SpiceUsbDeviceManager *manager,
 
     gtk_widget_set_margin_start(check, 12);
     gtk_box_pack_end(GTK_BOX(self), check, FALSE, FALSE, 0);
-    spice_usb_device_widget_update_status(self);
     gtk_widget_show_all(check);
 }
 
@@ -576,8 +581,15 @@ static void device_removed_cb(SpiceUsbDeviceManager *manager,
 
     gtk_container_foreach(GTK_CONTAINER(self),
                           destroy_widget_by_usb_device, device);
+}
 
-    spice_usb_device_widget_update_status(self);
+/* the status is updated once per hotplug batch */
+static void devices_changed_cb(SpiceUsbDeviceManager *manager,
+                               GPtrArray *added,
+                               GPtrArray *removed,
+                               gpointer user_data)
+{
+    spice_usb_device_widget_update_status(SPICE_USB_DEVICE_WIDGET(user_data));
 }
 
 static void set_inactive_by_usb_device(GtkWidget *widget, gpointer user_data)
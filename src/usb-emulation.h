@@ -84,3 +84,19 @@ spice_usb_backend_create_emulated_device(SpiceUsbBackend *be,
                                          SpiceUsbEmulatedDeviceCreate create_proc,
                                          void *create_params,
                                          GError **err);
+
+typedef void (*UsbEmulatedDataFree)(uint8_t *data, void *opaque);
+
+/*
+    send a bulk packet on the parser attached to the device
+    without copying data to the parser:
+    - returns true if the packet is sent, free_data is called with
+      data and opaque once the data is written
+    - returns false if the packet should be sent with
+      usbredirparser_send_bulk_packet instead, data is not referenced
+*/
+gboolean
+spice_usb_backend_send_bulk_packet_by_ref(struct usbredirparser *parser, uint64_t id,
+                                          const struct usb_redir_bulk_packet_header *h,
+                                          uint8_t *data, uint32_t data_len,
+                                          UsbEmulatedDataFree free_data, void *opaque);
@@ -0,0 +1,189 @@
+/*
+   Copyright (C) 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Check the order agent messages are scheduled in.
+ *
+ * As in cd-emu.c, the source is included directly to access the static
+ * queue functions; the channel is never connected, messages are taken
+ * out of the queues instead of being sent.
+ */
+#include "../src/channel-main.c"
+
+static const guint8 content_data[] = "0123456789_spice-agent-queue";
+
+typedef struct _Fixture {
+    SpiceSession     *session;
+    SpiceMainChannel *channel;
+} Fixture;
+
+static void
+f_setup(Fixture *f, gconstpointer user_data G_GNUC_UNUSED)
+{
+    SpiceMainChannelPrivate *c;
+
+    f->session = spice_session_new();
+    f->channel = SPICE_MAIN_CHANNEL(spice_channel_new(f->session, SPICE_CHANNEL_MAIN, 0));
+    g_assert_nonnull(f->channel);
+
+    c = f->channel->priv;
+    c->agent_connected = TRUE;
+    c->agent_caps_received = TRUE;
+    VD_AGENT_SET_CAPABILITY(c->agent_caps, VD_AGENT_CAP_CLIPBOARD_BY_DEMAND);
+    VD_AGENT_SET_CAPABILITY(c->agent_caps, VD_AGENT_CAP_CLIPBOARD_SELECTION);
+}
+
+static void
+f_teardown(Fixture *f, gconstpointer user_data G_GNUC_UNUSED)
+{
+    agent_free_msg_queue(f->channel);
+    /* the session releases its channels */
+    spice_session_disconnect(f->session);
+    g_object_unref(f->session);
+    while (g_main_context_iteration(NULL, FALSE)) {
+        continue;
+    }
+}
+
+/* take the next message out of the queues, check its type and stream */
+static void
+next_msg_check(Fixture *f, int type, guint32 stream_id)
+{
+    AgentMsg *msg = agent_msg_next(f->channel);
+
+    g_assert_nonnull(msg);
+    g_assert_cmpint(msg->type, ==, type);
+    g_assert_cmpuint(msg->stream_id, ==, stream_id);
+    f->channel->priv->agent_queues[msg->klass].depth -= g_queue_get_length(&msg->parts);
+    agent_msg_free(msg);
+}
+
+/* a grab or release must not overtake queued data of its selection */
+static void
+test_agent_queue_clipboard(Fixture *f, gconstpointer user_data G_GNUC_UNUSED)
+{
+    guint32 type = VD_AGENT_CLIPBOARD_UTF8_TEXT;
+    static const guchar text[] = "clipboard";
+
+    agent_clipboard_notify(f->channel, VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD,
+                           type, text, sizeof(text));
+    agent_clipboard_grab(f->channel, VD_AGENT_CLIPBOARD_SELECTION_PRIMARY, &type, 1);
+    agent_clipboard_grab(f->channel, VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD, &type, 1);
+    agent_clipboard_release(f->channel, VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD);
+    agent_clipboard_request(f->channel, VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD, type);
+
+    /* not related to the queued data */
+    next_msg_check(f, VD_AGENT_CLIPBOARD_GRAB, VD_AGENT_CLIPBOARD_SELECTION_PRIMARY);
+    next_msg_check(f, VD_AGENT_CLIPBOARD_REQUEST, 0);
+    /* in order */
+    next_msg_check(f, VD_AGENT_CLIPBOARD, VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD);
+    next_msg_check(f, VD_AGENT_CLIPBOARD_GRAB, VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD);
+    next_msg_check(f, VD_AGENT_CLIPBOARD_RELEASE, VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD);
+    g_assert_null(agent_msg_next(f->channel));
+}
+
+static void
+queue_file_xfer_data(Fixture *f, gpointer owner, guint32 task_id)
+{
+    VDAgentFileXferDataMessage msg;
+    GBytes *data = g_bytes_new_static(content_data, sizeof(content_data));
+
+    msg.id = task_id;
+    msg.size = g_bytes_get_size(data);
+    agent_msg_queue_bytes(f->channel, VD_AGENT_FILE_XFER_DATA, owner, &msg, sizeof(msg), data);
+    g_bytes_unref(data);
+}
+
+static void
+queue_file_xfer_status(Fixture *f, guint32 task_id)
+{
+    VDAgentFileXferStatusMessage msg;
+
+    msg.id = task_id;
+    msg.result = VD_AGENT_FILE_XFER_STATUS_CANCELLED;
+    agent_msg_queue_many(f->channel, VD_AGENT_FILE_XFER_STATUS, &msg, sizeof(msg), NULL);
+}
+
+/* the status of a task must not overtake its queued data */
+static void
+test_agent_queue_file_xfer(Fixture *f, gconstpointer user_data G_GNUC_UNUSED)
+{
+    gint owner;
+
+    queue_file_xfer_data(f, &owner, 1);
+    queue_file_xfer_data(f, &owner, 2);
+    queue_file_xfer_status(f, 1);
+    queue_file_xfer_status(f, 3);
+
+    /* task 3 has no data queued */
+    next_msg_check(f, VD_AGENT_FILE_XFER_STATUS, 3);
+    next_msg_check(f, VD_AGENT_FILE_XFER_DATA, 1);
+    next_msg_check(f, VD_AGENT_FILE_XFER_DATA, 2);
+    next_msg_check(f, VD_AGENT_FILE_XFER_STATUS, 1);
+    g_assert_null(agent_msg_next(f->channel));
+}
+
+static void
+clipboard_notify_cancelled_cb(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+    gboolean *done = user_data;
+    GError *error = NULL;
+
+    g_assert_false(spice_main_channel_clipboard_selection_notify_finish(
+                       SPICE_MAIN_CHANNEL(source_object), res, &error));
+    g_assert_error(error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+    g_clear_error(&error);
+    *done = TRUE;
+}
+
+/* without agent tokens, a cancelled message is dropped from its queue */
+static void
+test_agent_queue_cancel(Fixture *f, gconstpointer user_data G_GNUC_UNUSED)
+{
+    GCancellable *cancellable = g_cancellable_new();
+    GBytes *data = g_bytes_new_static(content_data, sizeof(content_data));
+    gboolean done = FALSE;
+
+    spice_main_channel_clipboard_selection_notify_async(f->channel,
+                                                        VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD,
+                                                        VD_AGENT_CLIPBOARD_UTF8_TEXT, data,
+                                                        cancellable, NULL, NULL,
+                                                        clipboard_notify_cancelled_cb, &done);
+    g_bytes_unref(data);
+    g_assert_cmpuint(agent_msg_queue_depth(f->channel), ==, 1);
+
+    g_cancellable_cancel(cancellable);
+    while (!done) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    g_assert_cmpuint(agent_msg_queue_depth(f->channel), ==, 0);
+    g_assert_null(agent_msg_next(f->channel));
+    g_object_unref(cancellable);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add("/agent-queue/clipboard", Fixture, NULL,
+               f_setup, test_agent_queue_clipboard, f_teardown);
+    g_test_add("/agent-queue/file-xfer", Fixture, NULL,
+               f_setup, test_agent_queue_file_xfer, f_teardown);
+    g_test_add("/agent-queue/cancel", Fixture, NULL,
+               f_setup, test_agent_queue_cancel, f_teardown);
+
+    return g_test_run();
+}
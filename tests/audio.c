@@ -0,0 +1,642 @@
+/*
+   Copyright (C) 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Drive the playback and record channels against a minimal in-process
+ * server, with the test acting as a null audio backend.
+ *
+ * Besides checking the audio gets through (and that a lost playback
+ * packet is concealed), this reports the CPU spent decoding/encoding,
+ * the latency between the server sending a packet and the backend
+ * receiving the PCM, and the jitter of that delivery. Run with
+ * --verbose to see the figures. */
+
+#include <string.h>
+#include <time.h>
+
+#include <gio/gio.h>
+#include <spice-client.h>
+#include <spice/protocol.h>
+
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+#include "common/snd_codec.h"
+
+#define AUDIO_FREQUENCY     48000
+#define AUDIO_CHANNELS      2
+#define AUDIO_FRAME_SAMPLES 480 /* 10ms */
+#define AUDIO_FRAME_BYTES   (AUDIO_FRAME_SAMPLES * AUDIO_CHANNELS * 2)
+#define AUDIO_FRAME_MS      10
+#define AUDIO_MS_BYTES(ms)  ((ms) * AUDIO_FREQUENCY / 1000 * AUDIO_CHANNELS * 2)
+
+#define PLAYBACK_FRAMES     50
+#define PLAYBACK_LOST_FRAME 25
+#define PLAYBACK_LARGE_MS   40 /* raw packets longer than a codec frame */
+#define RECORD_MS           1000
+
+#define TEST_TIMEOUT_MS     10000
+
+typedef struct _Fixture {
+    GMainLoop       *loop;
+    GSocketListener *listener;
+    guint16          port;
+    GThread         *server;
+    gint             server_done; /* atomic */
+    gint             channel_type;
+    gint             mode;
+
+    SpiceSession    *session;
+    SpiceChannel    *channel;
+    guint            timeout_id;
+
+    /* playback */
+    guint            frame_ms;     /* duration of a packet */
+    GPtrArray       *packets;
+    gint64           send_time[PLAYBACK_FRAMES];
+    guint            received;
+    gint64           last_received;
+    gint64           latency_sum;
+    gint64           latency_max;
+    gint64           jitter;
+
+    /* record */
+    gsize            recorded;     /* atomic, PCM bytes decoded by the server */
+    guint            record_msgs;  /* atomic */
+    gsize            record_expected;
+    gint64           encode_time;
+} Fixture;
+
+/* ------------------------------------------------------------------ */
+/* fake server, running in its own thread with blocking I/O */
+
+static void
+server_read(GInputStream *in, gpointer buf, gsize size)
+{
+    gsize n = 0;
+
+    g_assert_true(g_input_stream_read_all(in, buf, size, &n, NULL, NULL));
+    g_assert_cmpuint(n, ==, size);
+}
+
+static void
+server_write(GOutputStream *out, gconstpointer buf, gsize size)
+{
+    g_assert_true(g_output_stream_write_all(out, buf, size, NULL, NULL, NULL));
+}
+
+static EVP_PKEY *
+server_new_key(void)
+{
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+    EVP_PKEY *key = NULL;
+
+    g_assert_nonnull(ctx);
+    g_assert_cmpint(EVP_PKEY_keygen_init(ctx), ==, 1);
+    g_assert_cmpint(EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, SPICE_TICKET_KEY_PAIR_LENGTH), ==, 1);
+    g_assert_cmpint(EVP_PKEY_keygen(ctx, &key), ==, 1);
+    EVP_PKEY_CTX_free(ctx);
+
+    return key;
+}
+
+/* plain spice ticket link, with the mini header */
+static void
+server_link(Fixture *f, GIOStream *stream, guint32 channel_caps)
+{
+    GInputStream *in = g_io_stream_get_input_stream(stream);
+    GOutputStream *out = g_io_stream_get_output_stream(stream);
+    SpiceLinkHeader hdr;
+    SpiceLinkMess *mess;
+    SpiceLinkReply reply = { 0, };
+    guint32 caps[2], result = GUINT32_TO_LE(SPICE_LINK_ERR_OK);
+    EVP_PKEY *key;
+    guint8 *der = NULL, *ticket;
+
+    server_read(in, &hdr, sizeof(hdr));
+    g_assert_cmpuint(GUINT32_FROM_LE(hdr.magic), ==, SPICE_MAGIC);
+    g_assert_cmpuint(GUINT32_FROM_LE(hdr.major_version), ==, SPICE_VERSION_MAJOR);
+    mess = g_malloc(GUINT32_FROM_LE(hdr.size));
+    server_read(in, mess, GUINT32_FROM_LE(hdr.size));
+    g_assert_cmpint(mess->channel_type, ==, f->channel_type);
+    g_free(mess);
+
+    key = server_new_key();
+    g_assert_cmpint(i2d_PUBKEY(key, &der), ==, SPICE_TICKET_PUBKEY_BYTES);
+    memcpy(reply.pub_key, der, SPICE_TICKET_PUBKEY_BYTES);
+    OPENSSL_free(der);
+
+    hdr.magic = GUINT32_TO_LE(SPICE_MAGIC);
+    hdr.major_version = GUINT32_TO_LE(SPICE_VERSION_MAJOR);
+    hdr.minor_version = GUINT32_TO_LE(SPICE_VERSION_MINOR);
+    hdr.size = GUINT32_TO_LE(sizeof(reply) + sizeof(caps));
+    reply.error = GUINT32_TO_LE(SPICE_LINK_ERR_OK);
+    reply.num_common_caps = GUINT32_TO_LE(1);
+    reply.num_channel_caps = GUINT32_TO_LE(1);
+    reply.caps_offset = GUINT32_TO_LE(sizeof(reply));
+    caps[0] = GUINT32_TO_LE(1 << SPICE_COMMON_CAP_MINI_HEADER);
+    caps[1] = GUINT32_TO_LE(channel_caps);
+    server_write(out, &hdr, sizeof(hdr));
+    server_write(out, &reply, sizeof(reply));
+    server_write(out, caps, sizeof(caps));
+
+    /* any password will do */
+    ticket = g_malloc(EVP_PKEY_size(key));
+    server_read(in, ticket, EVP_PKEY_size(key));
+    g_free(ticket);
+    EVP_PKEY_free(key);
+
+    server_write(out, &result, sizeof(result));
+}
+
+static void
+put_u16(guint8 *p, guint16 v)
+{
+    v = GUINT16_TO_LE(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static void
+put_u32(guint8 *p, guint32 v)
+{
+    v = GUINT32_TO_LE(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static void
+server_send(GIOStream *stream, guint16 type, gconstpointer data, gsize size)
+{
+    GOutputStream *out = g_io_stream_get_output_stream(stream);
+    SpiceMiniDataHeader hdr;
+
+    hdr.type = GUINT16_TO_LE(type);
+    hdr.size = GUINT32_TO_LE(size);
+    server_write(out, &hdr, sizeof(hdr));
+    if (size > 0)
+        server_write(out, data, size);
+}
+
+/* Returns: the message body, or %NULL when the client went away */
+static GBytes *
+server_recv(GIOStream *stream, guint16 *type)
+{
+    GInputStream *in = g_io_stream_get_input_stream(stream);
+    SpiceMiniDataHeader hdr;
+    gsize n = 0, size;
+    guint8 *data;
+
+    if (!g_input_stream_read_all(in, &hdr, sizeof(hdr), &n, NULL, NULL) ||
+        n != sizeof(hdr))
+        return NULL;
+
+    *type = GUINT16_FROM_LE(hdr.type);
+    size = GUINT32_FROM_LE(hdr.size);
+    data = g_malloc(size);
+    if (!g_input_stream_read_all(in, data, size, &n, NULL, NULL) || n != size) {
+        g_free(data);
+        return NULL;
+    }
+
+    return g_bytes_new_take(data, size);
+}
+
+static void
+server_drain(GIOStream *stream)
+{
+    GBytes *msg;
+    guint16 type;
+
+    while ((msg = server_recv(stream, &type)) != NULL)
+        g_bytes_unref(msg);
+}
+
+static void
+server_playback(Fixture *f, GIOStream *stream)
+{
+    guint8 buf[10 + SND_CODEC_MAX_COMPRESSED_BYTES + AUDIO_MS_BYTES(PLAYBACK_LARGE_MS)];
+    guint32 time = 1000;
+    guint i;
+
+    /* mode: time, mode */
+    put_u32(buf, time);
+    put_u16(buf + 4, f->mode);
+    server_send(stream, SPICE_MSG_PLAYBACK_MODE, buf, 6);
+
+    /* start: channels, format, frequency, time */
+    put_u32(buf, AUDIO_CHANNELS);
+    put_u16(buf + 4, SPICE_AUDIO_FMT_S16);
+    put_u32(buf + 6, AUDIO_FREQUENCY);
+    put_u32(buf + 10, time);
+    server_send(stream, SPICE_MSG_PLAYBACK_START, buf, 14);
+
+    /* data: time, payload, paced like a real server */
+    for (i = 0; i < PLAYBACK_FRAMES; i++) {
+        GBytes *packet = g_ptr_array_index(f->packets, i);
+        gsize size;
+        gconstpointer data = g_bytes_get_data(packet, &size);
+
+        time += f->frame_ms;
+        f->send_time[i] = g_get_monotonic_time();
+        if (i != PLAYBACK_LOST_FRAME) {
+            put_u32(buf, time);
+            memcpy(buf + 4, data, size);
+            server_send(stream, SPICE_MSG_PLAYBACK_DATA, buf, 4 + size);
+        }
+        g_usleep(f->frame_ms * 1000);
+    }
+
+    server_send(stream, SPICE_MSG_PLAYBACK_STOP, NULL, 0);
+    server_drain(stream);
+}
+
+static void
+server_record(Fixture *f, GIOStream *stream)
+{
+    guint8 buf[10];
+    SndCodec codec = NULL;
+    GBytes *msg;
+    guint16 type;
+
+    if (f->mode != SPICE_AUDIO_DATA_MODE_RAW)
+        g_assert_cmpint(snd_codec_create(&codec, f->mode, AUDIO_FREQUENCY,
+                                         SND_CODEC_DECODE), ==, SND_CODEC_OK);
+
+    /* start: channels, format, frequency */
+    put_u32(buf, AUDIO_CHANNELS);
+    put_u16(buf + 4, SPICE_AUDIO_FMT_S16);
+    put_u32(buf + 6, AUDIO_FREQUENCY);
+    server_send(stream, SPICE_MSG_RECORD_START, buf, 10);
+
+    while ((msg = server_recv(stream, &type)) != NULL) {
+        gsize size;
+        const guint8 *data = g_bytes_get_data(msg, &size);
+
+        if (type == SPICE_MSGC_RECORD_MODE) {
+            g_assert_cmpuint(size, >=, 6);
+            g_assert_cmpint(data[4] | data[5] << 8, ==, f->mode);
+        } else if (type == SPICE_MSGC_RECORD_DATA) {
+            g_assert_cmpuint(size, >, 4);
+            if (codec != NULL) {
+                guint8 pcm[SND_CODEC_MAX_FRAME_SIZE * 2 * 2];
+                int n = sizeof(pcm);
+
+                g_assert_cmpint(snd_codec_decode(codec, (guint8 *)data + 4, size - 4,
+                                                 pcm, &n), ==, SND_CODEC_OK);
+                g_atomic_pointer_add(&f->recorded, n);
+            } else {
+                g_atomic_pointer_add(&f->recorded, size - 4);
+            }
+            g_atomic_int_inc(&f->record_msgs);
+        }
+        g_bytes_unref(msg);
+    }
+
+    snd_codec_destroy(&codec);
+}
+
+static gpointer
+server_thread(gpointer user_data)
+{
+    Fixture *f = user_data;
+    GSocketConnection *conn;
+    guint32 caps = 0;
+
+    conn = g_socket_listener_accept(f->listener, NULL, NULL, NULL);
+    g_assert_nonnull(conn);
+
+    if (f->channel_type == SPICE_CHANNEL_PLAYBACK) {
+        server_link(f, G_IO_STREAM(conn), caps);
+        server_playback(f, G_IO_STREAM(conn));
+    } else {
+        if (f->mode == SPICE_AUDIO_DATA_MODE_OPUS)
+            caps = 1 << SPICE_RECORD_CAP_OPUS;
+        server_link(f, G_IO_STREAM(conn), caps);
+        server_record(f, G_IO_STREAM(conn));
+    }
+
+    g_object_unref(conn);
+    g_atomic_int_set(&f->server_done, TRUE);
+
+    return NULL;
+}
+
+/* ------------------------------------------------------------------ */
+
+static gboolean
+test_timeout(gpointer user_data G_GNUC_UNUSED)
+{
+    g_assert_not_reached();
+    return G_SOURCE_REMOVE;
+}
+
+static void
+f_setup(Fixture *f, gconstpointer user_data)
+{
+    GSocketAddress *addr, *effective = NULL;
+    GInetAddress *loopback;
+    GError *err = NULL;
+    gchar *port;
+
+    f->mode = GPOINTER_TO_INT(user_data);
+    if (f->mode != SPICE_AUDIO_DATA_MODE_RAW &&
+        !snd_codec_is_capable(f->mode, AUDIO_FREQUENCY)) {
+        g_test_skip("codec not available");
+        return;
+    }
+
+    f->loop = g_main_loop_new(NULL, FALSE);
+    f->listener = g_socket_listener_new();
+    loopback = g_inet_address_new_loopback(G_SOCKET_FAMILY_IPV4);
+    addr = g_inet_socket_address_new(loopback, 0);
+    g_socket_listener_add_address(f->listener, addr, G_SOCKET_TYPE_STREAM,
+                                  G_SOCKET_PROTOCOL_TCP, NULL, &effective, &err);
+    g_assert_no_error(err);
+    f->port = g_inet_socket_address_get_port(G_INET_SOCKET_ADDRESS(effective));
+    g_object_unref(effective);
+    g_object_unref(addr);
+    g_object_unref(loopback);
+
+    port = g_strdup_printf("%u", f->port);
+    f->session = spice_session_new();
+    g_object_set(f->session, "host", "127.0.0.1", "port", port, NULL);
+    g_free(port);
+
+    f->timeout_id = g_timeout_add(TEST_TIMEOUT_MS, test_timeout, NULL);
+}
+
+static void
+f_teardown(Fixture *f, gconstpointer user_data G_GNUC_UNUSED)
+{
+    gint64 deadline;
+
+    if (f->session == NULL)
+        return;
+
+    /* close our end, so that the server thread sees EOF */
+    spice_session_disconnect(f->session);
+    deadline = g_get_monotonic_time() + TEST_TIMEOUT_MS * G_TIME_SPAN_MILLISECOND;
+    while (!g_atomic_int_get(&f->server_done)) {
+        g_assert_cmpint(g_get_monotonic_time(), <, deadline);
+        if (!g_main_context_iteration(NULL, FALSE))
+            g_usleep(1000);
+    }
+    g_thread_join(f->server);
+
+    g_source_remove(f->timeout_id);
+    g_clear_object(&f->channel);
+    g_clear_object(&f->session);
+    while (g_main_context_iteration(NULL, FALSE))
+        ;
+
+    g_clear_object(&f->listener);
+    g_clear_pointer(&f->packets, g_ptr_array_unref);
+    g_main_loop_unref(f->loop);
+}
+
+static void
+connect_channel(Fixture *f, gint type)
+{
+    f->channel_type = type;
+    f->server = g_thread_new("audio-server", server_thread, f);
+    f->channel = spice_channel_new(f->session, type, 0);
+    g_object_ref(f->channel);
+    g_assert_true(spice_channel_connect(f->channel));
+}
+
+static void
+report_cpu(const gchar *what, clock_t start, guint audio_ms)
+{
+    gdouble cpu_ms = (gdouble)(clock() - start) * 1000 / CLOCKS_PER_SEC;
+
+    g_test_message("%s: %.1f ms CPU for %u ms of audio (%.2f%%)",
+                   what, cpu_ms, audio_ms, cpu_ms * 100 / audio_ms);
+}
+
+/*******************************************************************************
+ * PLAYBACK
+ ******************************************************************************/
+
+static void
+playback_on_start(SpicePlaybackChannel *channel G_GNUC_UNUSED,
+                  gint format, gint channels, gint frequency,
+                  gpointer user_data G_GNUC_UNUSED)
+{
+    g_assert_cmpint(format, ==, SPICE_AUDIO_FMT_S16);
+    g_assert_cmpint(channels, ==, AUDIO_CHANNELS);
+    g_assert_cmpint(frequency, ==, AUDIO_FREQUENCY);
+}
+
+static void
+playback_on_data(SpicePlaybackChannel *channel G_GNUC_UNUSED,
+                 gpointer data G_GNUC_UNUSED, gint size,
+                 gpointer user_data)
+{
+    Fixture *f = user_data;
+    gint64 now = g_get_monotonic_time();
+    gint64 latency;
+
+    g_assert_cmpint(size, ==, AUDIO_MS_BYTES(f->frame_ms));
+    g_assert_cmpuint(f->received, <, PLAYBACK_FRAMES);
+
+    /* the concealed frame takes the place of the lost one, so
+     * frames and packets stay in step */
+    latency = now - f->send_time[f->received];
+    f->latency_sum += latency;
+    f->latency_max = MAX(f->latency_max, latency);
+
+    /* same estimator as RFC 3550, on the delivery to the backend */
+    if (f->last_received != 0) {
+        gint64 d = (now - f->last_received) - f->frame_ms * G_TIME_SPAN_MILLISECOND;
+        f->jitter += (ABS(d) - f->jitter) / 16;
+    }
+    f->last_received = now;
+    f->received++;
+}
+
+static void
+playback_on_stop(SpicePlaybackChannel *channel G_GNUC_UNUSED,
+                 gpointer user_data)
+{
+    Fixture *f = user_data;
+
+    g_main_loop_quit(f->loop);
+}
+
+static void
+test_playback(Fixture *f, gconstpointer user_data G_GNUC_UNUSED)
+{
+    SndCodec codec = NULL;
+    gint16 *pcm;
+    gsize frame_bytes;
+    clock_t start;
+    guint i, j, concealed;
+
+    if (f->session == NULL)
+        return;
+
+    if (f->frame_ms == 0)
+        f->frame_ms = AUDIO_FRAME_MS;
+    frame_bytes = AUDIO_MS_BYTES(f->frame_ms);
+    pcm = g_malloc(frame_bytes);
+
+    /* encode upfront, so that only the client side is measured */
+    if (f->mode != SPICE_AUDIO_DATA_MODE_RAW)
+        g_assert_cmpint(snd_codec_create(&codec, f->mode, AUDIO_FREQUENCY,
+                                         SND_CODEC_ENCODE), ==, SND_CODEC_OK);
+    f->packets = g_ptr_array_new_with_free_func((GDestroyNotify)g_bytes_unref);
+    for (i = 0; i < PLAYBACK_FRAMES; i++) {
+        for (j = 0; j < frame_bytes / 2; j++)
+            pcm[j] = g_test_rand_int_range(-8000, 8000);
+        if (codec != NULL) {
+            guint8 out[SND_CODEC_MAX_COMPRESSED_BYTES];
+            int n = sizeof(out);
+
+            g_assert_cmpint(snd_codec_encode(codec, (guint8 *)pcm, frame_bytes,
+                                             out, &n), ==, SND_CODEC_OK);
+            g_ptr_array_add(f->packets, g_bytes_new(out, n));
+        } else {
+            g_ptr_array_add(f->packets, g_bytes_new(pcm, frame_bytes));
+        }
+    }
+    snd_codec_destroy(&codec);
+    g_free(pcm);
+
+    start = clock();
+    connect_channel(f, SPICE_CHANNEL_PLAYBACK);
+    g_signal_connect(f->channel, "playback-start", G_CALLBACK(playback_on_start), f);
+    g_signal_connect(f->channel, "playback-data", G_CALLBACK(playback_on_data), f);
+    g_signal_connect(f->channel, "playback-stop", G_CALLBACK(playback_on_stop), f);
+    g_main_loop_run(f->loop);
+
+    report_cpu("playback decode", start, PLAYBACK_FRAMES * f->frame_ms);
+    g_test_message("playback latency: avg %.2f ms, max %.2f ms, jitter %.2f ms",
+                   (gdouble)f->latency_sum / f->received / 1000,
+                   (gdouble)f->latency_max / 1000, (gdouble)f->jitter / 1000);
+
+    g_object_get(f->channel, "concealed-frames", &concealed, NULL);
+    g_assert_cmpuint(concealed, ==, 1);
+    g_assert_cmpuint(f->received, ==, PLAYBACK_FRAMES);
+}
+
+/* the lost packet is concealed with a frame as long as the others */
+static void
+test_playback_large(Fixture *f, gconstpointer user_data)
+{
+    f->frame_ms = PLAYBACK_LARGE_MS;
+    test_playback(f, user_data);
+}
+
+/*******************************************************************************
+ * RECORD
+ ******************************************************************************/
+
+/* feed the capture in odd sized chunks, as a real backend would */
+static gboolean
+record_feed(gpointer user_data)
+{
+    Fixture *f = user_data;
+    const gsize total = AUDIO_FREQUENCY * RECORD_MS / 1000 * AUDIO_CHANNELS * 2;
+    const gsize chunk = 7 * AUDIO_FREQUENCY / 1000 * AUDIO_CHANNELS * 2;
+    gint16 *pcm = g_new(gint16, total / 2);
+    clock_t start;
+    gsize i;
+    gint64 t;
+
+    for (i = 0; i < total / 2; i++)
+        pcm[i] = g_test_rand_int_range(-8000, 8000);
+
+    start = clock();
+    t = g_get_monotonic_time();
+    for (i = 0; i < total; i += chunk) {
+        spice_record_channel_send_data(SPICE_RECORD_CHANNEL(f->channel),
+                                       (guint8 *)pcm + i, MIN(chunk, total - i), 0);
+    }
+    f->encode_time = g_get_monotonic_time() - t;
+    report_cpu("record encode", start, RECORD_MS);
+    g_free(pcm);
+
+    /* the last partial frame is kept until more data comes */
+    f->record_expected = total / AUDIO_FRAME_BYTES * AUDIO_FRAME_BYTES;
+
+    return G_SOURCE_REMOVE;
+}
+
+static void
+record_on_start(SpiceRecordChannel *channel G_GNUC_UNUSED,
+                gint format, gint channels, gint frequency,
+                gpointer user_data)
+{
+    g_assert_cmpint(format, ==, SPICE_AUDIO_FMT_S16);
+    g_assert_cmpint(channels, ==, AUDIO_CHANNELS);
+    g_assert_cmpint(frequency, ==, AUDIO_FREQUENCY);
+
+    /* signals are emitted from the channel coroutine */
+    g_idle_add(record_feed, user_data);
+}
+
+static gboolean
+record_check_done(gpointer user_data)
+{
+    Fixture *f = user_data;
+
+    if (f->record_expected == 0 ||
+        (gsize)g_atomic_pointer_get(&f->recorded) < f->record_expected)
+        return G_SOURCE_CONTINUE;
+
+    g_main_loop_quit(f->loop);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+test_record(Fixture *f, gconstpointer user_data G_GNUC_UNUSED)
+{
+    if (f->session == NULL)
+        return;
+
+    connect_channel(f, SPICE_CHANNEL_RECORD);
+    g_signal_connect(f->channel, "record-start", G_CALLBACK(record_on_start), f);
+    g_timeout_add(5, record_check_done, f);
+    g_main_loop_run(f->loop);
+
+    g_test_message("record: %u messages, %.2f ms to send %u ms of audio",
+                   g_atomic_int_get(&f->record_msgs),
+                   (gdouble)f->encode_time / 1000, RECORD_MS);
+    g_assert_cmpuint((gsize)g_atomic_pointer_get(&f->recorded), ==, f->record_expected);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add("/audio/playback/raw", Fixture,
+               GINT_TO_POINTER(SPICE_AUDIO_DATA_MODE_RAW),
+               f_setup, test_playback, f_teardown);
+    g_test_add("/audio/playback/raw-large", Fixture,
+               GINT_TO_POINTER(SPICE_AUDIO_DATA_MODE_RAW),
+               f_setup, test_playback_large, f_teardown);
+    g_test_add("/audio/playback/opus", Fixture,
+               GINT_TO_POINTER(SPICE_AUDIO_DATA_MODE_OPUS),
+               f_setup, test_playback, f_teardown);
+    g_test_add("/audio/record/raw", Fixture,
+               GINT_TO_POINTER(SPICE_AUDIO_DATA_MODE_RAW),
+               f_setup, test_record, f_teardown);
+    g_test_add("/audio/record/opus", Fixture,
+               GINT_TO_POINTER(SPICE_AUDIO_DATA_MODE_OPUS),
+               f_setup, test_record, f_teardown);
+
+    return g_test_run();
+}
@@ -0,0 +1,223 @@
+/*
+   Copyright (C) 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Check the READs the bulk MSD layer queues ahead of the host commands.
+ *
+ * As in cd-emu.c, the source is included directly to access the queue
+ * of the device; the USB backend callbacks are mocked, the bulk
+ * transfers of the host are made directly on the MSD device.
+ */
+#include "../src/cd-usb-bulk-msd.c"
+
+#include "cd-image.h"
+
+#define TEST_MSD_IMAGE_FILE "test-cd-emu-msd.iso"
+#define TEST_MSD_SECTORS 64
+#define TEST_MSD_SECTOR_SIZE 2048
+#define TEST_MSD_CSW_LEN 13
+
+static guint reads_completed = 0;
+static CdUsbBulkStatus read_status;
+static GByteArray *read_data = NULL;
+
+void cd_usb_bulk_msd_read_complete(void *user_data,
+                                   uint8_t *data, uint32_t length,
+                                   CdUsbBulkBuffer *buffer,
+                                   CdUsbBulkStatus status)
+{
+    g_byte_array_set_size(read_data, 0);
+    if (length) {
+        g_byte_array_append(read_data, data, length);
+    }
+    read_status = status;
+    reads_completed++;
+}
+
+void cd_usb_bulk_msd_lun_changed(void *user_data, uint32_t lun)
+{
+}
+
+void cd_usb_bulk_msd_reset_complete(void *user_data, int status)
+{
+}
+
+static void send_cbw(UsbCdBulkMsdDevice *cd, uint32_t tag, uint32_t data_len,
+                     const uint8_t *cdb, uint8_t cdb_len)
+{
+    struct UsbCdCBW cbw = { 0 };
+
+    cbw.sig = htole32(0x43425355);
+    cbw.tag = htole32(tag);
+    cbw.exp_data_len = htole32(data_len);
+    cbw.flags = data_len ? 0x80 : 0;
+    cbw.cmd_len = cdb_len;
+    memcpy(cbw.cmd, cdb, cdb_len);
+    g_assert_cmpint(cd_usb_bulk_msd_write(cd, (uint8_t *)&cbw, sizeof(cbw)), ==, 0);
+}
+
+static void send_read_10(UsbCdBulkMsdDevice *cd, uint32_t tag, uint32_t lba)
+{
+    const uint8_t cdb[10] = {
+        READ_10, 0, lba >> 24, lba >> 16, lba >> 8, lba, 0, 0, 1, 0
+    };
+
+    send_cbw(cd, tag, TEST_MSD_SECTOR_SIZE, cdb, sizeof(cdb));
+}
+
+/* bulk-in transfer of the host, waits for the data to be returned */
+static void bulk_read(UsbCdBulkMsdDevice *cd, uint32_t len)
+{
+    guint expected = reads_completed + 1;
+
+    g_assert_cmpint(cd_usb_bulk_msd_read(cd, len), ==, 0);
+    while (reads_completed < expected) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    g_assert_cmpint(read_status, ==, BULK_STATUS_GOOD);
+}
+
+static void check_csw(UsbCdBulkMsdDevice *cd, uint32_t tag)
+{
+    const struct UsbCdCSW *csw;
+
+    bulk_read(cd, TEST_MSD_CSW_LEN);
+    g_assert_cmpuint(read_data->len, ==, TEST_MSD_CSW_LEN);
+    csw = (const struct UsbCdCSW *)read_data->data;
+    g_assert_cmphex(le32toh(csw->sig), ==, 0x53425355);
+    g_assert_cmpuint(le32toh(csw->tag), ==, tag);
+    g_assert_cmpuint(le32toh(csw->residue), ==, 0);
+    g_assert_cmpuint(csw->status, ==, USB_MSD_STATUS_GOOD);
+}
+
+static void check_read_10(UsbCdBulkMsdDevice *cd, uint32_t tag, uint32_t lba)
+{
+    uint32_t n;
+
+    bulk_read(cd, TEST_MSD_SECTOR_SIZE);
+    g_assert_cmpuint(read_data->len, ==, TEST_MSD_SECTOR_SIZE);
+    memcpy(&n, read_data->data, sizeof(n));
+    g_assert_cmpuint(GUINT32_FROM_LE(n), ==, lba);
+    check_csw(cd, tag);
+}
+
+/* the READs queued ahead follow @lba, one block each */
+static void check_ahead(UsbCdBulkMsdDevice *cd, uint32_t lba)
+{
+    GList *l;
+
+    g_assert_cmpuint(g_queue_get_length(&cd->ahead), ==, USB_CD_QUEUE_DEPTH);
+    for (l = cd->ahead.head; l != NULL; l = l->next) {
+        UsbCdBulkMsdRequest *usb_req = l->data;
+        const uint8_t *cdb = usb_req->scsi_req.cdb;
+
+        lba++;
+        g_assert_true(usb_req->scsi_req.speculative);
+        g_assert_cmpuint(cdb[0], ==, READ_10);
+        g_assert_cmpuint((uint32_t)cdb[2] << 24 | cdb[3] << 16 | cdb[4] << 8 | cdb[5], ==, lba);
+    }
+}
+
+static void write_test_image(void)
+{
+    uint8_t sector[TEST_MSD_SECTOR_SIZE];
+    FILE *f = fopen(TEST_MSD_IMAGE_FILE, "wb");
+
+    g_assert_nonnull(f);
+    for (uint32_t i = 0; i < TEST_MSD_SECTORS; i++) {
+        uint32_t n = GUINT32_TO_LE(i);
+        memset(sector, i & 0xff, sizeof(sector));
+        memcpy(sector, &n, sizeof(n));
+        fwrite(sector, sizeof(sector), 1, f);
+    }
+    fclose(f);
+}
+
+static void read_ahead(void)
+{
+    static const uint8_t request_sense[6] = { REQUEST_SENSE, 0, 0, 0, 18, 0 };
+    static const uint8_t test_unit_ready[6] = { TEST_UNIT_READY, 0, 0, 0, 0, 0 };
+    CdScsiDeviceParameters dev_params = { 0 };
+    CdScsiMediaParameters media_params = { 0 };
+    UsbCdBulkMsdRequest *usb_req;
+    UsbCdBulkMsdDevice *cd;
+    GError *err = NULL;
+    uint32_t i;
+
+    write_test_image();
+    read_data = g_byte_array_new();
+
+    cd = cd_usb_bulk_msd_alloc(NULL, 1);
+    g_assert_nonnull(cd);
+    g_assert_cmpint(cd_usb_bulk_msd_realize(cd, 0, &dev_params), ==, 0);
+
+    // no cache, the reads run in the image worker threads
+    media_params.image = cd_image_open(TEST_MSD_IMAGE_FILE,
+                                       TEST_MSD_SECTORS * TEST_MSD_SECTOR_SIZE, &err);
+    g_assert_no_error(err);
+    g_assert_nonnull(media_params.image);
+    media_params.size = TEST_MSD_SECTORS * TEST_MSD_SECTOR_SIZE;
+    media_params.block_size = TEST_MSD_SECTOR_SIZE;
+    media_params.cache_size = 0;
+    g_assert_cmpint(cd_usb_bulk_msd_load(cd, 0, &media_params), ==, 0);
+
+    // clear the unit attention of the load, nothing is queued ahead
+    send_cbw(cd, 1, 18, request_sense, sizeof(request_sense));
+    g_assert_true(g_queue_is_empty(&cd->ahead));
+    bulk_read(cd, 18);
+    check_csw(cd, 1);
+
+    // a READ queues the following ones
+    send_read_10(cd, 2, 0);
+    check_ahead(cd, 0);
+    check_read_10(cd, 2, 0);
+
+    // a matching command takes over the head of the queue
+    usb_req = g_queue_peek_head(&cd->ahead);
+    send_read_10(cd, 3, 1);
+    g_assert_true(cd->usb_req == usb_req);
+    g_assert_false(usb_req->scsi_req.speculative);
+    check_ahead(cd, 1);
+    check_read_10(cd, 3, 1);
+
+    // another READ drops the queue and starts a new one
+    send_read_10(cd, 4, 10);
+    check_ahead(cd, 10);
+    check_read_10(cd, 4, 10);
+
+    // any other command drops the queue
+    send_cbw(cd, 5, 0, test_unit_ready, sizeof(test_unit_ready));
+    g_assert_true(g_queue_is_empty(&cd->ahead));
+    check_csw(cd, 5);
+    for (i = 0; i < G_N_ELEMENTS(cd->reqs); i++) {
+        g_assert_cmpint(cd_scsi_get_req_state(&cd->reqs[i].scsi_req), ==, SCSI_REQ_IDLE);
+    }
+
+    cd_usb_bulk_msd_free(cd);
+    cd_image_unref(media_params.image);
+    g_byte_array_unref(read_data);
+    read_data = NULL;
+    unlink(TEST_MSD_IMAGE_FILE);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/cd-emu/msd/read_ahead", read_ahead);
+
+    return g_test_run();
+}
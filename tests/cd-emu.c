@@ -34,7 +34,13 @@
 #define spice_channel_get_state mock_spice_channel_get_state
 #include "../src/usb-backend.c"
 
+#include <zlib.h>
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
 #include "usb-device-cd.h"
+#include "cd-image.h"
 
 static SpiceUsbDevice *device = NULL;
 
@@ -89,7 +95,8 @@ static unsigned int hellos_sent = 0;
 static SpiceUsbBackendChannel *usb_ch;
 
 int
-mock_spice_usbredir_write(SpiceUsbredirChannel *channel, uint8_t *data, int count)
+mock_spice_usbredir_write(SpiceUsbredirChannel *channel, uint8_t *data, int count,
+                          gboolean isoch)
 {
     messages_sent++;
     g_assert_cmpint(count, >=, 4);
@@ -298,6 +305,432 @@ write_test_iso(void)
     fclose(f);
 }
 
+#define TEST_CD_IMAGE_FILE "test-cd-image.iso"
+#define TEST_CD_IMAGE_SECTORS 1024
+#define TEST_CD_SECTOR_SIZE 2048
+
+static void image_read_done(GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+    GAsyncResult **res = user_data;
+    *res = g_object_ref(result);
+}
+
+static uint32_t image_read(CdImage *image, uint64_t offset, uint8_t *buf, uint32_t len)
+{
+    GAsyncResult *result = NULL;
+    GError *err = NULL;
+    uint32_t bytes_read;
+
+    if (cd_image_read_cached(image, offset, buf, len, &bytes_read)) {
+        return bytes_read;
+    }
+    cd_image_read_async(image, offset, len, NULL, image_read_done, &result);
+    while (result == NULL) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    g_assert_true(cd_image_read_finish(image, result, buf, &bytes_read, &err));
+    g_assert_null(err);
+    g_object_unref(result);
+    return bytes_read;
+}
+
+static void fill_sectors(uint8_t *buf, uint32_t first, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t *sector = buf + i * TEST_CD_SECTOR_SIZE;
+        uint32_t n = GUINT32_TO_LE(first + i);
+        memset(sector, (first + i) & 0xff, TEST_CD_SECTOR_SIZE);
+        memcpy(sector, &n, sizeof(n));
+    }
+}
+
+static void check_sectors(const uint8_t *buf, uint32_t first, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t *sector = buf + i * TEST_CD_SECTOR_SIZE;
+        g_assert_cmpuint(GUINT32_FROM_LE(*(uint32_t *)sector), ==, first + i);
+        g_assert_cmpuint(sector[TEST_CD_SECTOR_SIZE - 1], ==, (first + i) & 0xff);
+    }
+}
+
+static void image_cache(void)
+{
+    const uint32_t chunk_sectors = CD_IMAGE_CHUNK_SIZE / TEST_CD_SECTOR_SIZE;
+    uint8_t *buf = g_malloc(CD_IMAGE_CHUNK_SIZE);
+    GError *err = NULL;
+    uint32_t bytes_read;
+    uint64_t offset;
+    CdImage *image;
+    FILE *f;
+
+    f = fopen(TEST_CD_IMAGE_FILE, "wb");
+    g_assert_nonnull(f);
+    for (uint32_t i = 0; i < TEST_CD_IMAGE_SECTORS; i++) {
+        fill_sectors(buf, i, 1);
+        fwrite(buf, TEST_CD_SECTOR_SIZE, 1, f);
+    }
+    fclose(f);
+
+    image = cd_image_open(TEST_CD_IMAGE_FILE,
+                          TEST_CD_IMAGE_SECTORS * TEST_CD_SECTOR_SIZE, &err);
+    g_assert_nonnull(image);
+    g_assert_null(err);
+
+    // nothing is cached yet
+    g_assert_false(cd_image_read_cached(image, 0, buf, CD_IMAGE_CHUNK_SIZE, &bytes_read));
+
+    // sequential reads
+    for (offset = 0; offset < 4 * CD_IMAGE_CHUNK_SIZE; offset += CD_IMAGE_CHUNK_SIZE) {
+        g_assert_cmpuint(image_read(image, offset, buf, CD_IMAGE_CHUNK_SIZE), ==,
+                         CD_IMAGE_CHUNK_SIZE);
+        check_sectors(buf, offset / TEST_CD_SECTOR_SIZE, chunk_sectors);
+    }
+
+    // the following data is read ahead
+    while (!cd_image_read_cached(image, offset, buf, CD_IMAGE_CHUNK_SIZE, &bytes_read)) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    g_assert_cmpuint(bytes_read, ==, CD_IMAGE_CHUNK_SIZE);
+    check_sectors(buf, offset / TEST_CD_SECTOR_SIZE, chunk_sectors);
+
+    // unaligned read crossing chunks
+    offset = CD_IMAGE_CHUNK_SIZE - TEST_CD_SECTOR_SIZE;
+    g_assert_cmpuint(image_read(image, offset, buf, 2 * TEST_CD_SECTOR_SIZE), ==,
+                     2 * TEST_CD_SECTOR_SIZE);
+    check_sectors(buf, offset / TEST_CD_SECTOR_SIZE, 2);
+
+    // reads are clipped to the end of the image
+    offset = (TEST_CD_IMAGE_SECTORS - 1) * TEST_CD_SECTOR_SIZE;
+    g_assert_cmpuint(image_read(image, offset, buf, CD_IMAGE_CHUNK_SIZE), ==,
+                     TEST_CD_SECTOR_SIZE);
+    check_sectors(buf, TEST_CD_IMAGE_SECTORS - 1, 1);
+
+    // no cache, everything is read again
+    cd_image_set_cache_size(image, 0);
+    g_assert_false(cd_image_read_cached(image, 0, buf, CD_IMAGE_CHUNK_SIZE, &bytes_read));
+    g_assert_cmpuint(image_read(image, 0, buf, CD_IMAGE_CHUNK_SIZE), ==, CD_IMAGE_CHUNK_SIZE);
+    check_sectors(buf, 0, chunk_sectors);
+    g_assert_false(cd_image_read_cached(image, 0, buf, CD_IMAGE_CHUNK_SIZE, &bytes_read));
+
+    cd_image_unref(image);
+    g_free(buf);
+    unlink(TEST_CD_IMAGE_FILE);
+}
+
+#define TEST_CD_QCOW2_FILE "test-cd-image.qcow2"
+#define TEST_QCOW2_CLUSTER_BITS 16
+#define TEST_QCOW2_CLUSTER_SIZE (1 << TEST_QCOW2_CLUSTER_BITS)
+
+static void image_qcow2(void)
+{
+    const uint32_t cluster_size = TEST_QCOW2_CLUSTER_SIZE;
+    const uint32_t cluster_sectors = cluster_size / TEST_CD_SECTOR_SIZE;
+    const uint32_t clusters = TEST_CD_IMAGE_SECTORS / cluster_sectors;
+    // header, L1, L2, a raw cluster, then compressed clusters
+    uint8_t *file = g_malloc0((clusters + 4) * cluster_size);
+    uint64_t *l1 = (uint64_t *)(file + cluster_size);
+    uint64_t *l2 = (uint64_t *)(file + 2 * cluster_size);
+    uint64_t file_len = 4 * cluster_size;
+    uint8_t *buf = g_malloc(cluster_size);
+    GError *err = NULL;
+    CdImage *image;
+
+    *(uint32_t *)(file + 0) = GUINT32_TO_BE(0x514649fb);
+    *(uint32_t *)(file + 4) = GUINT32_TO_BE(2);
+    *(uint32_t *)(file + 20) = GUINT32_TO_BE(TEST_QCOW2_CLUSTER_BITS);
+    *(uint64_t *)(file + 24) = GUINT64_TO_BE((uint64_t)clusters * cluster_size);
+    *(uint32_t *)(file + 36) = GUINT32_TO_BE(1);
+    *(uint64_t *)(file + 40) = GUINT64_TO_BE(cluster_size);
+    l1[0] = GUINT64_TO_BE(2 * cluster_size);
+
+    for (uint32_t i = 0; i < clusters; i++) {
+        z_stream strm = { 0 };
+        uint64_t nb_sectors;
+
+        fill_sectors(buf, i * cluster_sectors, cluster_sectors);
+        if (i == 2) {
+            // unallocated, reads as zeros
+            continue;
+        }
+        if (i == 1) {
+            memcpy(file + 3 * cluster_size, buf, cluster_size);
+            l2[i] = GUINT64_TO_BE(3 * cluster_size);
+            continue;
+        }
+
+        g_assert_cmpint(deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                                     -12, 9, Z_DEFAULT_STRATEGY), ==, Z_OK);
+        strm.next_in = buf;
+        strm.avail_in = cluster_size;
+        strm.next_out = file + file_len;
+        strm.avail_out = cluster_size;
+        g_assert_cmpint(deflate(&strm, Z_FINISH), ==, Z_STREAM_END);
+        nb_sectors = (strm.total_out + 511) / 512;
+        deflateEnd(&strm);
+
+        l2[i] = GUINT64_TO_BE((1ULL << 62) | /* compressed */
+                              ((nb_sectors - 1) << (62 - (TEST_QCOW2_CLUSTER_BITS - 8))) |
+                              file_len);
+        file_len += nb_sectors * 512;
+    }
+    g_assert_true(g_file_set_contents(TEST_CD_QCOW2_FILE, (char *)file, file_len, NULL));
+
+    image = cd_image_open(TEST_CD_QCOW2_FILE, file_len, &err);
+    g_assert_no_error(err);
+    g_assert_nonnull(image);
+    g_assert_cmpuint(cd_image_get_size(image), ==, (uint64_t)clusters * cluster_size);
+
+    for (uint32_t i = 0; i < clusters; i++) {
+        g_assert_cmpuint(image_read(image, (uint64_t)i * cluster_size, buf, cluster_size), ==,
+                         cluster_size);
+        if (i == 2) {
+            for (uint32_t j = 0; j < cluster_size; j++) {
+                g_assert_cmpuint(buf[j], ==, 0);
+            }
+        } else {
+            check_sectors(buf, i * cluster_sectors, cluster_sectors);
+        }
+    }
+
+    // crossing compressed clusters, not aligned to chunks
+    cd_image_set_cache_size(image, 0);
+    g_assert_cmpuint(image_read(image, 5 * cluster_size - TEST_CD_SECTOR_SIZE, buf,
+                                2 * TEST_CD_SECTOR_SIZE), ==, 2 * TEST_CD_SECTOR_SIZE);
+    check_sectors(buf, 5 * cluster_sectors - 1, 2);
+
+    cd_image_unref(image);
+    g_free(buf);
+    g_free(file);
+    unlink(TEST_CD_QCOW2_FILE);
+}
+
+#ifdef USE_ZSTD
+#define TEST_CD_ZSTD_FILE "test-cd-image.iso.zst"
+// not a multiple of the chunk size
+#define TEST_ZSTD_FRAME_SECTORS 48
+
+static void append_le32(GByteArray *array, uint32_t v)
+{
+    v = GUINT32_TO_LE(v);
+    g_byte_array_append(array, (const guint8 *)&v, sizeof(v));
+}
+
+static void image_zstd(void)
+{
+    const uint32_t frame_size = TEST_ZSTD_FRAME_SECTORS * TEST_CD_SECTOR_SIZE;
+    const uint32_t num_frames =
+        (TEST_CD_IMAGE_SECTORS + TEST_ZSTD_FRAME_SECTORS - 1) / TEST_ZSTD_FRAME_SECTORS;
+    const uint32_t chunk_sectors = CD_IMAGE_CHUNK_SIZE / TEST_CD_SECTOR_SIZE;
+    GByteArray *file = g_byte_array_new();
+    GArray *sizes = g_array_new(FALSE, FALSE, sizeof(uint32_t) * 2);
+    uint8_t *buf = g_malloc(MAX(frame_size, CD_IMAGE_CHUNK_SIZE));
+    uint8_t *cbuf = g_malloc(ZSTD_compressBound(frame_size));
+    GError *err = NULL;
+    uint64_t offset;
+    CdImage *image;
+
+    for (uint32_t i = 0; i < num_frames; i++) {
+        uint32_t first = i * TEST_ZSTD_FRAME_SECTORS;
+        uint32_t count = MIN(TEST_ZSTD_FRAME_SECTORS, TEST_CD_IMAGE_SECTORS - first);
+        uint32_t size[2];
+        size_t ret;
+
+        fill_sectors(buf, first, count);
+        ret = ZSTD_compress(cbuf, ZSTD_compressBound(frame_size),
+                            buf, count * TEST_CD_SECTOR_SIZE, 1);
+        g_assert_false(ZSTD_isError(ret));
+        g_byte_array_append(file, cbuf, ret);
+        size[0] = ret;
+        size[1] = count * TEST_CD_SECTOR_SIZE;
+        g_array_append_val(sizes, size);
+    }
+
+    // seek table
+    append_le32(file, 0x184D2A5E);
+    append_le32(file, num_frames * 8 + 9);
+    for (uint32_t i = 0; i < num_frames; i++) {
+        const uint32_t *size = &g_array_index(sizes, uint32_t, 2 * i);
+        append_le32(file, size[0]);
+        append_le32(file, size[1]);
+    }
+    append_le32(file, num_frames);
+    g_byte_array_append(file, (const guint8 *)"", 1); // descriptor, no checksums
+    append_le32(file, 0x8F92EAB1);
+    g_assert_true(g_file_set_contents(TEST_CD_ZSTD_FILE, (char *)file->data, file->len, NULL));
+
+    image = cd_image_open(TEST_CD_ZSTD_FILE, file->len, &err);
+    g_assert_no_error(err);
+    g_assert_nonnull(image);
+    g_assert_cmpuint(cd_image_get_size(image), ==,
+                     (uint64_t)TEST_CD_IMAGE_SECTORS * TEST_CD_SECTOR_SIZE);
+
+    for (offset = 0; offset < cd_image_get_size(image); offset += CD_IMAGE_CHUNK_SIZE) {
+        g_assert_cmpuint(image_read(image, offset, buf, CD_IMAGE_CHUNK_SIZE), ==,
+                         CD_IMAGE_CHUNK_SIZE);
+        check_sectors(buf, offset / TEST_CD_SECTOR_SIZE, chunk_sectors);
+    }
+
+    // crossing frames
+    cd_image_set_cache_size(image, 0);
+    offset = (uint64_t)(TEST_ZSTD_FRAME_SECTORS - 1) * TEST_CD_SECTOR_SIZE;
+    g_assert_cmpuint(image_read(image, offset, buf, 2 * TEST_CD_SECTOR_SIZE), ==,
+                     2 * TEST_CD_SECTOR_SIZE);
+    check_sectors(buf, TEST_ZSTD_FRAME_SECTORS - 1, 2);
+
+    cd_image_unref(image);
+    g_free(cbuf);
+    g_free(buf);
+    g_array_unref(sizes);
+    g_byte_array_unref(file);
+    unlink(TEST_CD_ZSTD_FILE);
+}
+#endif
+
+static gboolean image_write_sync(CdImage *image, uint64_t offset, const uint8_t *buf,
+                                 uint32_t len, GError **err)
+{
+    GAsyncResult *result = NULL;
+    gboolean ok;
+
+    cd_image_write_async(image, offset, buf, len, NULL, image_read_done, &result);
+    while (result == NULL) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    ok = cd_image_write_finish(image, result, err);
+    g_object_unref(result);
+    return ok;
+}
+
+static void image_write_check_file(uint32_t first, uint32_t count, uint32_t value)
+{
+    gchar *contents;
+    gsize len;
+
+    g_assert_true(g_file_get_contents(TEST_CD_IMAGE_FILE, &contents, &len, NULL));
+    g_assert_cmpuint(len, ==, TEST_CD_IMAGE_SECTORS * TEST_CD_SECTOR_SIZE);
+    check_sectors((uint8_t *)contents + first * TEST_CD_SECTOR_SIZE, value, count);
+    g_free(contents);
+}
+
+static void image_write(void)
+{
+    // crossing the first two chunks
+    const uint32_t first = CD_IMAGE_CHUNK_SIZE / TEST_CD_SECTOR_SIZE - 1;
+    uint8_t *buf = g_malloc(CD_IMAGE_CHUNK_SIZE);
+    GAsyncResult *result = NULL;
+    GError *err = NULL;
+    CdImage *image;
+    FILE *f;
+
+    f = fopen(TEST_CD_IMAGE_FILE, "wb");
+    g_assert_nonnull(f);
+    for (uint32_t i = 0; i < TEST_CD_IMAGE_SECTORS; i++) {
+        fill_sectors(buf, i, 1);
+        fwrite(buf, TEST_CD_SECTOR_SIZE, 1, f);
+    }
+    fclose(f);
+
+    // read-only images are not written
+    image = cd_image_open(TEST_CD_IMAGE_FILE,
+                          TEST_CD_IMAGE_SECTORS * TEST_CD_SECTOR_SIZE, &err);
+    g_assert_no_error(err);
+    g_assert_false(cd_image_is_writable(image));
+    fill_sectors(buf, 5000, 1);
+    g_assert_false(image_write_sync(image, 0, buf, TEST_CD_SECTOR_SIZE, &err));
+    g_assert_error(err, G_IO_ERROR, G_IO_ERROR_READ_ONLY);
+    g_clear_error(&err);
+    cd_image_unref(image);
+
+    image = cd_image_open_writable(TEST_CD_IMAGE_FILE,
+                                   TEST_CD_IMAGE_SECTORS * TEST_CD_SECTOR_SIZE, &err);
+    g_assert_no_error(err);
+    g_assert_true(cd_image_is_writable(image));
+
+    // the first chunk is cached, the second one is not
+    g_assert_cmpuint(image_read(image, 0, buf, CD_IMAGE_CHUNK_SIZE), ==, CD_IMAGE_CHUNK_SIZE);
+    fill_sectors(buf, 5000, 2);
+    g_assert_true(image_write_sync(image, (uint64_t)first * TEST_CD_SECTOR_SIZE, buf,
+                                   2 * TEST_CD_SECTOR_SIZE, &err));
+    g_assert_no_error(err);
+
+    // reads see the written data before it is written back
+    memset(buf, 0, CD_IMAGE_CHUNK_SIZE);
+    g_assert_cmpuint(image_read(image, (uint64_t)first * TEST_CD_SECTOR_SIZE, buf,
+                                2 * TEST_CD_SECTOR_SIZE), ==, 2 * TEST_CD_SECTOR_SIZE);
+    check_sectors(buf, 5000, 2);
+    g_assert_cmpuint(image_read(image, (uint64_t)(first - 1) * TEST_CD_SECTOR_SIZE, buf,
+                                TEST_CD_SECTOR_SIZE), ==, TEST_CD_SECTOR_SIZE);
+    check_sectors(buf, first - 1, 1);
+
+    // unaligned and out of range writes fail
+    g_assert_false(image_write_sync(image, 1, buf, TEST_CD_SECTOR_SIZE, &err));
+    g_assert_error(err, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT);
+    g_clear_error(&err);
+    g_assert_false(image_write_sync(image, (uint64_t)TEST_CD_IMAGE_SECTORS * TEST_CD_SECTOR_SIZE,
+                                    buf, TEST_CD_SECTOR_SIZE, &err));
+    g_assert_error(err, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT);
+    g_clear_error(&err);
+
+    // the flush writes the data to the file
+    cd_image_flush_async(image, NULL, image_read_done, &result);
+    while (result == NULL) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    g_assert_true(cd_image_flush_finish(image, result, &err));
+    g_assert_no_error(err);
+    g_clear_object(&result);
+    image_write_check_file(first, 2, 5000);
+    image_write_check_file(first + 2, 1, first + 2);
+
+    // the image is kept until the last flush is done
+    fill_sectors(buf, 6000, 1);
+    g_assert_true(image_write_sync(image, 0, buf, TEST_CD_SECTOR_SIZE, &err));
+    g_assert_no_error(err);
+    cd_image_flush_async(image, NULL, image_read_done, &result);
+    cd_image_unref(image);
+    while (result == NULL) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    g_assert_true(cd_image_flush_finish(NULL, result, &err));
+    g_assert_no_error(err);
+    g_clear_object(&result);
+    image_write_check_file(0, 1, 6000);
+    image_write_check_file(first, 2, 5000);
+
+    // a disk is not probed, whatever the guest writes at its start
+    image = cd_image_open_writable(TEST_CD_IMAGE_FILE,
+                                   TEST_CD_IMAGE_SECTORS * TEST_CD_SECTOR_SIZE, &err);
+    g_assert_no_error(err);
+    memset(buf, 0, TEST_CD_SECTOR_SIZE);
+    memcpy(buf, "QFI\xfb", 4);
+    g_assert_true(image_write_sync(image, 0, buf, TEST_CD_SECTOR_SIZE, &err));
+    g_assert_no_error(err);
+    cd_image_flush_async(image, NULL, image_read_done, &result);
+    cd_image_unref(image);
+    while (result == NULL) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    g_assert_true(cd_image_flush_finish(NULL, result, &err));
+    g_assert_no_error(err);
+    g_clear_object(&result);
+
+    image = cd_image_open_writable(TEST_CD_IMAGE_FILE,
+                                   TEST_CD_IMAGE_SECTORS * TEST_CD_SECTOR_SIZE, &err);
+    g_assert_no_error(err);
+    g_assert_cmpuint(cd_image_get_size(image), ==, TEST_CD_IMAGE_SECTORS * TEST_CD_SECTOR_SIZE);
+    cd_image_unref(image);
+    image = cd_image_open_raw(TEST_CD_IMAGE_FILE,
+                              TEST_CD_IMAGE_SECTORS * TEST_CD_SECTOR_SIZE, &err);
+    g_assert_no_error(err);
+    g_assert_cmpuint(cd_image_get_size(image), ==, TEST_CD_IMAGE_SECTORS * TEST_CD_SECTOR_SIZE);
+    g_assert_cmpuint(image_read(image, 0, buf, TEST_CD_SECTOR_SIZE), ==, TEST_CD_SECTOR_SIZE);
+    g_assert_cmpmem(buf, 4, "QFI\xfb", 4);
+    cd_image_unref(image);
+
+    g_free(buf);
+    unlink(TEST_CD_IMAGE_FILE);
+}
+
 int main(int argc, char* argv[])
 {
     write_test_iso();
@@ -312,6 +745,12 @@ int main(int argc, char* argv[])
     g_test_add_data_func("/cd-emu/attach_auto", ATTACH_PARAM(1, 1), attach);
     g_test_add_data_func("/cd-emu/attach_no_auto_no_libusb", ATTACH_PARAM(0, 0), attach);
     g_test_add_data_func("/cd-emu/attach_auto_no_libusb", ATTACH_PARAM(1, 0), attach);
+    g_test_add_func("/cd-emu/image_cache", image_cache);
+    g_test_add_func("/cd-emu/image_qcow2", image_qcow2);
+#ifdef USE_ZSTD
+    g_test_add_func("/cd-emu/image_zstd", image_zstd);
+#endif
+    g_test_add_func("/cd-emu/image_write", image_write);
 
     int ret =  g_test_run();
 
@@ -9,6 +9,8 @@ typedef struct _Fixture {
     GCancellable   *cancellable;
     GMainLoop      *loop;
     GHashTable     *xfer_tasks;
+    guint8         *data;
+    gsize           data_pos;
 } Fixture;
 
 #define SINGLE_FILE     1
@@ -54,6 +56,7 @@ f_teardown(Fixture *f, gconstpointer user_data G_GNUC_UNUSED)
     g_main_loop_unref(f->loop);
     g_clear_object(&f->cancellable);
     g_clear_pointer(&f->xfer_tasks, g_hash_table_unref);
+    g_clear_pointer(&f->data, g_free);
 
     for (i = 0; i < f->num_files; i++) {
         g_file_delete(f->files[i], NULL, &err);
@@ -85,12 +88,13 @@ transfer_read_async_cb(GObject *source_object,
 {
     SpiceFileTransferTask *xfer_task;
     gssize count;
-    char *buffer;
+    GBytes *buffer = NULL;
     GError *error = NULL;
 
     xfer_task = SPICE_FILE_TRANSFER_TASK(source_object);
     count = spice_file_transfer_task_read_finish(xfer_task, res, &buffer, &error);
     g_assert_no_error(error);
+    g_clear_pointer(&buffer, g_bytes_unref);
 
     if (count == 0) {
         spice_file_transfer_task_completed(xfer_task, NULL);
@@ -197,7 +201,7 @@ transfer_cancelled_read_async_cb(GObject *source_object,
 {
     SpiceFileTransferTask *xfer_task;
     gssize count;
-    char *buffer;
+    GBytes *buffer = NULL;
     GError *error = NULL;
 
     xfer_task = SPICE_FILE_TRANSFER_TASK(source_object);
@@ -290,7 +294,7 @@ transfer_agent_cancelled_read_async_cb(GObject *source_object,
 {
     SpiceFileTransferTask *xfer_task;
     gssize count;
-    char *buffer;
+    GBytes *buffer = NULL;
     GError *error = NULL;
 
     xfer_task = SPICE_FILE_TRANSFER_TASK(source_object);
@@ -338,6 +342,87 @@ test_agent_cancel_on_read(Fixture *f, gconstpointer user_data G_GNUC_UNUSED)
     g_main_loop_run (f->loop);
 }
 
+/*******************************************************************************
+ * TEST READ AHEAD
+ ******************************************************************************/
+
+/* a few chunks, the last one partial */
+#define READ_AHEAD_SIZE (1024 * 1024 + 123)
+
+static void
+transfer_read_ahead_read_async_cb(GObject *source_object,
+                                  GAsyncResult *res,
+                                  gpointer user_data)
+{
+    Fixture *f = user_data;
+    SpiceFileTransferTask *xfer_task;
+    gssize count;
+    GBytes *buffer = NULL;
+    GError *error = NULL;
+
+    xfer_task = SPICE_FILE_TRANSFER_TASK(source_object);
+    count = spice_file_transfer_task_read_finish(xfer_task, res, &buffer, &error);
+    g_assert_no_error(error);
+
+    if (count == 0) {
+        g_assert_cmpuint(f->data_pos, ==, READ_AHEAD_SIZE);
+        spice_file_transfer_task_completed(xfer_task, NULL);
+        return;
+    }
+
+    /* chunks come in order, whatever was read ahead */
+    g_assert_cmpmem(g_bytes_get_data(buffer, NULL), g_bytes_get_size(buffer),
+                    f->data + f->data_pos, count);
+    g_bytes_unref(buffer);
+    f->data_pos += count;
+    g_assert_cmpuint(spice_file_transfer_task_get_transferred_bytes(xfer_task), ==, f->data_pos);
+
+    spice_file_transfer_task_read_async(xfer_task, transfer_read_ahead_read_async_cb, f);
+}
+
+static void
+transfer_read_ahead_init_async_cb(GObject *obj, GAsyncResult *res, gpointer data)
+{
+    GFileInfo *info;
+    SpiceFileTransferTask *xfer_task;
+    GError *error = NULL;
+
+    xfer_task = SPICE_FILE_TRANSFER_TASK(obj);
+    info = spice_file_transfer_task_init_task_finish(xfer_task, res, &error);
+    g_assert_no_error(error);
+    g_assert_nonnull(info);
+    g_object_unref(info);
+
+    spice_file_transfer_task_set_window(xfer_task, 2);
+    spice_file_transfer_task_read_async(xfer_task, transfer_read_ahead_read_async_cb, data);
+}
+
+static void
+test_read_ahead(Fixture *f, gconstpointer user_data G_GNUC_UNUSED)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    GError *err = NULL;
+    gsize i;
+
+    f->data = g_malloc(READ_AHEAD_SIZE);
+    for (i = 0; i < READ_AHEAD_SIZE; i++)
+        f->data[i] = g_test_rand_int_range(0, 256);
+    g_assert_true(g_file_replace_contents(f->files[0], (char *)f->data, READ_AHEAD_SIZE,
+                                          NULL, FALSE, G_FILE_CREATE_NONE, NULL,
+                                          f->cancellable, &err));
+    g_assert_no_error(err);
+
+    f->xfer_tasks = spice_file_transfer_task_create_tasks(f->files, NULL, G_FILE_COPY_NONE, f->cancellable);
+    g_hash_table_iter_init(&iter, f->xfer_tasks);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        SpiceFileTransferTask *xfer_task = SPICE_FILE_TRANSFER_TASK(value);
+        g_signal_connect(xfer_task, "finished", G_CALLBACK(transfer_xfer_task_on_finished), f);
+        spice_file_transfer_task_init_task_async(xfer_task, transfer_read_ahead_init_async_cb, f);
+    }
+    g_main_loop_run (f->loop);
+}
+
 /* Tests summary:
  *
  * This tests are specific to SpiceFileTransferTask in order to verify:
@@ -403,6 +488,10 @@ int main(int argc, char* argv[])
                Fixture, GUINT_TO_POINTER(SINGLE_FILE),
                f_setup, test_agent_cancel_on_read, f_teardown);
 
+    g_test_add("/spice-file-transfer-task/single/read-ahead",
+               Fixture, GUINT_TO_POINTER(SINGLE_FILE),
+               f_setup, test_read_ahead, f_teardown);
+
     g_test_add("/spice-file-transfer-task/multiple/simple-transfer",
                Fixture, GUINT_TO_POINTER(MULTIPLE_FILES),
                f_setup, test_simple_transfer, f_teardown);
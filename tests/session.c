@@ -333,6 +333,36 @@ static void test_session_uri_unix_good(void)
     test_session_uri_good(tests, G_N_ELEMENTS(tests));
 }
 
+static void test_session_timeline(void)
+{
+    SpiceSession *s = spice_session_new();
+    SpiceSessionTimelineEntry *e;
+    GArray *timeline;
+
+    timeline = spice_session_get_timeline(s);
+    g_assert_cmpuint(timeline->len, ==, 0);
+    g_array_unref(timeline);
+
+    spice_session_timeline_mark(s, NULL, SPICE_SESSION_TIMELINE_RESOLVED);
+    spice_session_timeline_mark(s, NULL, SPICE_SESSION_TIMELINE_FIRST_PAINT);
+    /* only the first occurrence is kept */
+    spice_session_timeline_mark(s, NULL, SPICE_SESSION_TIMELINE_RESOLVED);
+
+    timeline = spice_session_get_timeline(s);
+    g_assert_cmpuint(timeline->len, ==, 2);
+    e = &g_array_index(timeline, SpiceSessionTimelineEntry, 0);
+    g_assert_cmpint(e->event, ==, SPICE_SESSION_TIMELINE_RESOLVED);
+    g_assert_cmpint(e->channel_type, ==, -1);
+    g_assert_cmpint(e->channel_id, ==, -1);
+    e = &g_array_index(timeline, SpiceSessionTimelineEntry, 1);
+    g_assert_cmpint(e->event, ==, SPICE_SESSION_TIMELINE_FIRST_PAINT);
+    g_assert_cmpint(e->time, >=,
+                    g_array_index(timeline, SpiceSessionTimelineEntry, 0).time);
+    g_array_unref(timeline);
+
+    g_object_unref(s);
+}
+
 int main(int argc, char* argv[])
 {
     g_test_init(&argc, &argv, NULL);
@@ -341,6 +371,7 @@ int main(int argc, char* argv[])
     g_test_add_func("/session/good-ipv4-uri", test_session_uri_ipv4_good);
     g_test_add_func("/session/good-ipv6-uri", test_session_uri_ipv6_good);
     g_test_add_func("/session/good-unix", test_session_uri_unix_good);
+    g_test_add_func("/session/timeline", test_session_timeline);
 
     return g_test_run();
 }
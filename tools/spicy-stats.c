@@ -23,6 +23,8 @@
 
 /* config */
 static gboolean version = FALSE;
+static gint interval = 0;
+static gboolean usb = FALSE;
 
 /* state */
 static SpiceSession  *session;
@@ -62,6 +64,182 @@ static void channel_new(SpiceSession *s, SpiceChannel *channel, gpointer *data)
 
 /* ------------------------------------------------------------------ */
 
+static guint64 stats_get(GVariant *stats, const gchar *name)
+{
+    guint64 value = 0;
+
+    g_variant_lookup(stats, name, "t", &value);
+    return value;
+}
+
+static void print_channel_stats(SpiceChannel *channel, gboolean by_type)
+{
+    GVariant *stats = g_variant_ref_sink(spice_channel_get_stats(channel));
+    guint64 messages_in = stats_get(stats, "messages-in");
+    gint channel_type, channel_id;
+
+    g_object_get(channel,
+                 "channel-type", &channel_type,
+                 "channel-id", &channel_id,
+                 NULL);
+    printf("%s:%d in %" G_GUINT64_FORMAT " msgs %" G_GUINT64_FORMAT " bytes"
+           ", out %" G_GUINT64_FORMAT " msgs %" G_GUINT64_FORMAT " bytes"
+           ", parse %.1f us/msg, handler %.1f us/msg"
+           ", queue wait %" G_GUINT64_FORMAT " us"
+           ", ack latency %" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT " us (min/avg)"
+           ", tls overhead %" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT " bytes (in/out)\n",
+           spice_channel_type_to_string(channel_type), channel_id,
+           messages_in, stats_get(stats, "bytes-in"),
+           stats_get(stats, "messages-out"), stats_get(stats, "bytes-out"),
+           messages_in ? (double)stats_get(stats, "parse-time") / messages_in : 0.0,
+           messages_in ? (double)stats_get(stats, "handler-time") / messages_in : 0.0,
+           stats_get(stats, "queue-wait-time"),
+           stats_get(stats, "ack-latency-min"), stats_get(stats, "ack-latency-avg"),
+           stats_get(stats, "tls-overhead-in"), stats_get(stats, "tls-overhead-out"));
+
+    if (by_type) {
+        const gchar *dirs[] = { "messages-in-by-type", "messages-out-by-type" };
+        guint i;
+
+        for (i = 0; i < G_N_ELEMENTS(dirs); i++) {
+            GVariantIter *iter;
+            guint16 type;
+            guint64 messages, bytes;
+
+            if (!g_variant_lookup(stats, dirs[i], "a(qtt)", &iter))
+                continue;
+            while (g_variant_iter_next(iter, "(qtt)", &type, &messages, &bytes))
+                printf("    %s type %3u: %" G_GUINT64_FORMAT " msgs %" G_GUINT64_FORMAT " bytes\n",
+                       i == 0 ? "in " : "out", type, messages, bytes);
+            g_variant_iter_free(iter);
+        }
+    }
+
+    g_variant_unref(stats);
+}
+
+static void print_histogram(GVariant *stats, const gchar *name,
+                            guint64 min, const gchar *unit)
+{
+    GVariant *histogram;
+    const guint64 *buckets;
+    gsize i, n;
+
+    histogram = g_variant_lookup_value(stats, name, G_VARIANT_TYPE("at"));
+    if (!histogram)
+        return;
+    buckets = g_variant_get_fixed_array(histogram, &n, sizeof(guint64));
+    for (i = 0; i < n; i++) {
+        if (buckets[i] == 0)
+            continue;
+        if (i + 1 < n)
+            printf("    %s < %" G_GUINT64_FORMAT " %s: %" G_GUINT64_FORMAT "\n",
+                   name, min << i, unit, buckets[i]);
+        else if (i == 0)
+            /* a single bucket has no bound */
+            printf("    %s: %" G_GUINT64_FORMAT "\n", name, buckets[i]);
+        else
+            printf("    %s >= %" G_GUINT64_FORMAT " %s: %" G_GUINT64_FORMAT "\n",
+                   name, min << (i - 1), unit, buckets[i]);
+    }
+    g_variant_unref(histogram);
+}
+
+static void print_usb_device_stats(SpiceUsbDeviceManager *manager,
+                                   SpiceUsbDevice *device, gboolean histograms)
+{
+    GVariant *stats = spice_usb_device_manager_get_device_stats(manager, device);
+    GVariant *compression;
+    gchar *desc;
+    guint i;
+
+    if (!stats)
+        return;
+    g_variant_ref_sink(stats);
+
+    desc = spice_usb_device_get_description(device, NULL);
+    printf("usb %s: latency %" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT " us (avg/max)"
+           " over %" G_GUINT64_FORMAT " requests"
+           ", iso drops %" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT " (device/late)"
+           ", queue %" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT " bytes (last/max)\n",
+           desc, stats_get(stats, "latency-avg"), stats_get(stats, "latency-max"),
+           stats_get(stats, "latency-count"), stats_get(stats, "iso-drops"),
+           stats_get(stats, "iso-late-drops"),
+           stats_get(stats, "queue-size"), stats_get(stats, "queue-size-max"));
+    g_free(desc);
+
+    for (i = 0; i < 2; i++) {
+        const gchar *dir = i == 0 ? "to-device" : "from-device";
+        GVariantIter *iter;
+        const gchar *type;
+        guint64 packets, bytes;
+
+        if (!g_variant_lookup(stats, dir, "a(stt)", &iter))
+            continue;
+        while (g_variant_iter_next(iter, "(&stt)", &type, &packets, &bytes)) {
+            if (packets == 0)
+                continue;
+            printf("    %s %s: %" G_GUINT64_FORMAT " packets %" G_GUINT64_FORMAT " bytes\n",
+                   dir, type, packets, bytes);
+        }
+        g_variant_iter_free(iter);
+    }
+
+    compression = g_variant_lookup_value(stats, "compression", G_VARIANT_TYPE_VARDICT);
+    if (compression) {
+        printf("    compressed %" G_GUINT64_FORMAT " -> %" G_GUINT64_FORMAT " bytes"
+               ", skipped %" G_GUINT64_FORMAT " bytes\n",
+               stats_get(compression, "compressed-bytes-in"),
+               stats_get(compression, "compressed-bytes-out"),
+               stats_get(compression, "skipped-bytes"));
+        g_variant_unref(compression);
+    }
+
+    if (histograms) {
+        print_histogram(stats, "latency-histogram", 64, "us");
+        print_histogram(stats, "queue-histogram", 4096, "bytes");
+    }
+
+    g_variant_unref(stats);
+}
+
+static void print_usb_stats(gboolean histograms)
+{
+    SpiceUsbDeviceManager *manager = spice_usb_device_manager_get(session, NULL);
+    GPtrArray *devices;
+    guint i;
+
+    if (!manager)
+        return;
+    devices = spice_usb_device_manager_get_devices(manager);
+    if (!devices)
+        return;
+    for (i = 0; i < devices->len; i++)
+        print_usb_device_stats(manager, g_ptr_array_index(devices, i), histograms);
+    g_ptr_array_unref(devices);
+}
+
+static void print_stats(gboolean by_type)
+{
+    GList *iter, *list = spice_session_get_channels(session);
+
+    for (iter = list; iter; iter = iter->next)
+        print_channel_stats(iter->data, by_type);
+    g_list_free(list);
+
+    if (usb)
+        print_usb_stats(by_type);
+}
+
+static gboolean print_stats_timeout(gpointer data)
+{
+    print_stats(FALSE);
+    printf("\n");
+    return G_SOURCE_CONTINUE;
+}
+
+/* ------------------------------------------------------------------ */
+
 static GOptionEntry app_entries[] = {
     {
         .long_name        = "version",
@@ -69,6 +247,20 @@ static GOptionEntry app_entries[] = {
         .arg_data         = &version,
         .description      = "Display version and quit",
     },
+    {
+        .long_name        = "interval",
+        .short_name       = 'i',
+        .arg              = G_OPTION_ARG_INT,
+        .arg_data         = &interval,
+        .description      = "Print the channels statistics every <seconds>",
+        .arg_description  = "<seconds>",
+    },
+    {
+        .long_name        = "usb",
+        .arg              = G_OPTION_ARG_NONE,
+        .arg_data         = &usb,
+        .description      = "Print the statistics of the redirected USB devices",
+    },
     {
         /* end of list */
     }
@@ -115,7 +307,11 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    if (interval > 0)
+        g_timeout_add_seconds(interval, print_stats_timeout, NULL);
+
     g_main_loop_run(mainloop);
+    print_stats(TRUE);
     {
         GList *iter, *list = spice_session_get_channels(session);
         gulong total_read_bytes;
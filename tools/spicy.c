@@ -122,6 +122,7 @@ static void del_window(spice_connection *conn, SpiceWindow *win);
 /* options */
 static gboolean fullscreen = false;
 static gboolean version = false;
+static gboolean timeline = false;
 static char *spicy_title = NULL;
 /* globals */
 static GMainLoop     *mainloop = NULL;
@@ -1894,9 +1895,35 @@ static void connection_disconnect(spice_connection *conn)
     spice_session_disconnect(conn->session);
 }
 
+static void print_timeline(SpiceSession *session)
+{
+    GArray *entries = spice_session_get_timeline(session);
+    GEnumClass *klass = g_type_class_ref(SPICE_TYPE_SESSION_TIMELINE_EVENT);
+    guint i;
+
+    g_print("Startup timeline:\n");
+    for (i = 0; i < entries->len; i++) {
+        SpiceSessionTimelineEntry *e =
+            &g_array_index(entries, SpiceSessionTimelineEntry, i);
+        GEnumValue *value = g_enum_get_value(klass, e->event);
+
+        if (e->channel_type < 0)
+            g_print("%10.3f ms  %-18s\n", e->time / 1000.0, value->value_nick);
+        else
+            g_print("%10.3f ms  %-18s %s:%d\n", e->time / 1000.0, value->value_nick,
+                    spice_channel_type_to_string(e->channel_type), e->channel_id);
+    }
+
+    g_type_class_unref(klass);
+    g_array_unref(entries);
+}
+
 static void connection_destroy(SpiceSession *session,
                                spice_connection *conn)
 {
+    if (timeline)
+        print_timeline(conn->session);
+
     g_object_unref(conn->session);
     g_hash_table_unref(conn->transfers);
     g_free(conn);
@@ -1924,6 +1951,11 @@ static GOptionEntry cmd_entries[] = {
         .arg              = G_OPTION_ARG_NONE,
         .arg_data         = &version,
         .description      = "Display version and quit",
+    },{
+        .long_name        = "timeline",
+        .arg              = G_OPTION_ARG_NONE,
+        .arg_data         = &timeline,
+        .description      = "Print the connection startup timeline on exit",
     },{
         .long_name        = "title",
         .arg              = G_OPTION_ARG_STRING,